@@ -0,0 +1,551 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Priority-queue A* over the AI node graph
+//
+//=============================================================================//
+
+#include "cbase.h"
+
+#include "ai_astar.h"
+
+#include "ai_network.h"
+#include "ai_node.h"
+#include "ai_link.h"
+#include "ai_hull.h"
+#include "bitstring.h"
+#include "vstdlib/random.h"
+#include "tier0/threadtools.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+ConVar ai_pathfind_hierarchical( "ai_pathfind_hierarchical", "1", FCVAR_NONE, "Plan long node routes over the node cluster graph first" );
+
+//-----------------------------------------------------------------------------
+// CAI_AStarScratch
+//
+// Purpose: Working state for one thread's searches. Rather than clearing
+//			every array at the start of a query, each node is stamped with
+//			the query serial the first time it is touched; anything with an
+//			older stamp is treated as unvisited.
+//-----------------------------------------------------------------------------
+
+class CAI_AStarScratch
+{
+public:
+	CAI_AStarScratch()
+	 :	m_iSerial( 0 )
+	{
+	}
+
+	void BeginSearch( int nNodes )
+	{
+		if ( m_Serial.Count() < nNodes )
+		{
+			int nOld = m_Serial.Count();
+			m_Serial.AddMultipleToTail( nNodes - nOld );
+			m_G.AddMultipleToTail( nNodes - nOld );
+			m_F.AddMultipleToTail( nNodes - nOld );
+			m_Parent.AddMultipleToTail( nNodes - nOld );
+			m_HeapIndex.AddMultipleToTail( nNodes - nOld );
+			for ( int i = nOld; i < nNodes; i++ )
+				m_Serial[i] = 0;
+		}
+
+		if ( ++m_iSerial == 0 )
+		{
+			// Serial wrapped, make sure no stale stamp can match
+			for ( int i = 0; i < m_Serial.Count(); i++ )
+				m_Serial[i] = 0;
+			m_iSerial = 1;
+		}
+
+		m_Heap.RemoveAll();
+	}
+
+	bool IsVisited( int nodeID ) const
+	{
+		return ( m_Serial[nodeID] == m_iSerial );
+	}
+
+	void Visit( int nodeID )
+	{
+		m_Serial[nodeID] = m_iSerial;
+		m_G[nodeID] = FLT_MAX;
+		m_Parent[nodeID] = NO_NODE;
+		m_HeapIndex[nodeID] = -1;
+	}
+
+	//---------------------------------
+	// Open list
+	//---------------------------------
+
+	bool IsOpenEmpty() const		{ return ( m_Heap.Count() == 0 ); }
+	bool IsOpen( int nodeID ) const	{ return ( m_HeapIndex[nodeID] != -1 ); }
+
+	void PushOrUpdate( int nodeID )
+	{
+		int i = m_HeapIndex[nodeID];
+		if ( i == -1 )
+		{
+			i = m_Heap.AddToTail( nodeID );
+			m_HeapIndex[nodeID] = i;
+		}
+		// F only ever goes down when a node is updated, so it can only move up
+		SiftUp( i );
+	}
+
+	int PopSmallest()
+	{
+		int nodeID = m_Heap[0];
+		int last = m_Heap.Count() - 1;
+
+		m_HeapIndex[nodeID] = -1;
+		if ( last > 0 )
+		{
+			m_Heap[0] = m_Heap[last];
+			m_HeapIndex[m_Heap[0]] = 0;
+			m_Heap.RemoveMultipleFromTail( 1 );
+			SiftDown( 0 );
+		}
+		else
+		{
+			m_Heap.RemoveMultipleFromTail( 1 );
+		}
+
+		return nodeID;
+	}
+
+	CUtlVector<float>	m_G;			// Cost from start
+	CUtlVector<float>	m_F;			// Cost from start plus estimate to goal
+	CUtlVector<int>		m_Parent;
+
+private:
+	bool IsLess( int nodeA, int nodeB ) const
+	{
+		if ( m_F[nodeA] != m_F[nodeB] )
+			return ( m_F[nodeA] < m_F[nodeB] );
+		return ( nodeA < nodeB );
+	}
+
+	void Place( int i, int nodeID )
+	{
+		m_Heap[i] = nodeID;
+		m_HeapIndex[nodeID] = i;
+	}
+
+	void SiftUp( int i )
+	{
+		int nodeID = m_Heap[i];
+		while ( i > 0 )
+		{
+			int parent = ( i - 1 ) / 2;
+			if ( !IsLess( nodeID, m_Heap[parent] ) )
+				break;
+			Place( i, m_Heap[parent] );
+			i = parent;
+		}
+		Place( i, nodeID );
+	}
+
+	void SiftDown( int i )
+	{
+		int nodeID = m_Heap[i];
+		int count = m_Heap.Count();
+		for ( ;; )
+		{
+			int child = 2 * i + 1;
+			if ( child >= count )
+				break;
+			if ( child + 1 < count && IsLess( m_Heap[child + 1], m_Heap[child] ) )
+				child++;
+			if ( !IsLess( m_Heap[child], nodeID ) )
+				break;
+			Place( i, m_Heap[child] );
+			i = child;
+		}
+		Place( i, nodeID );
+	}
+
+	CUtlVector<unsigned>	m_Serial;
+	CUtlVector<int>			m_HeapIndex;
+	CUtlVector<int>			m_Heap;
+	unsigned				m_iSerial;
+};
+
+//-----------------------------------------------------------------------------
+
+static CThreadLocalPtr<CAI_AStarScratch> g_pAStarScratch;
+
+static CAI_AStarScratch *GetAStarScratch()
+{
+	CAI_AStarScratch *pScratch = g_pAStarScratch;
+	if ( !pScratch )
+	{
+		// Lives for the rest of the process; pathfinding threads are long lived
+		pScratch = new CAI_AStarScratch;
+		g_pAStarScratch = pScratch;
+	}
+	return pScratch;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Relaxes every link out of a node that was just taken off the
+//			open list. The open list is abstracted so the heap and the
+//			linear reference engine share the exact same update rule.
+//-----------------------------------------------------------------------------
+
+template <class OPEN_LIST>
+static void AStarExpandNode( CAI_Node **pAInode, CAI_AStarScratch *pScratch, OPEN_LIST &openList, int smallestID, IAI_AStarFilter *pFilter, AI_AStarStats_t *pStats )
+{
+	CAI_Node *pSmallestNode = pAInode[smallestID];
+
+	for ( int link = 0; link < pSmallestNode->NumLinks(); link++ )
+	{
+		CAI_Link *nodeLink = pSmallestNode->GetLinkByIndex( link );
+		int testID = nodeLink->DestNodeID( smallestID );
+
+		float dist = pFilter->LinkCost( smallestID, testID, nodeLink );
+		if ( dist == FLT_MAX )
+			continue;
+
+		float new_g = pScratch->m_G[smallestID] + dist;
+
+		bool bVisited = pScratch->IsVisited( testID );
+		if ( !bVisited || new_g < pScratch->m_G[testID] )
+		{
+			if ( !bVisited )
+				pScratch->Visit( testID );
+
+			pScratch->m_Parent[testID] = smallestID;
+			pScratch->m_G[testID] = new_g;
+			pScratch->m_F[testID] = new_g + pFilter->EstimateCost( testID );
+
+			openList.Push( testID );
+			if ( pStats )
+				pStats->nUpdated++;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+class CAI_AStarHeapOpenList
+{
+public:
+	CAI_AStarHeapOpenList( CAI_AStarScratch *pScratch ) : m_pScratch( pScratch ) {}
+
+	bool IsEmpty() const	{ return m_pScratch->IsOpenEmpty(); }
+	void Push( int nodeID )	{ m_pScratch->PushOrUpdate( nodeID ); }
+	int  Pop()				{ return m_pScratch->PopSmallest(); }
+
+private:
+	CAI_AStarScratch *m_pScratch;
+};
+
+//-----------------------------------------------------------------------------
+
+class CAI_AStarLinearOpenList
+{
+public:
+	CAI_AStarLinearOpenList( CAI_AStarScratch *pScratch, int nNodes )
+	 :	m_pScratch( pScratch ),
+		m_OpenBS( nNodes )
+	{
+	}
+
+	bool IsEmpty() const	{ return m_OpenBS.IsAllClear(); }
+	void Push( int nodeID )	{ m_OpenBS.Set( nodeID ); }
+	int  Pop()
+	{
+		int smallestID = CAI_Network::FindBSSmallest( &m_OpenBS, m_pScratch->m_F.Base(), m_OpenBS.GetNumBits() );
+		m_OpenBS.Clear( smallestID );
+		return smallestID;
+	}
+
+private:
+	CAI_AStarScratch *m_pScratch;
+	CVarBitVec m_OpenBS;
+};
+
+//-----------------------------------------------------------------------------
+
+template <class OPEN_LIST>
+static const int *AStarSearch( CAI_Network *pNetwork, CAI_AStarScratch *pScratch, OPEN_LIST &openList, int startID, int endID, IAI_AStarFilter *pFilter, AI_AStarStats_t *pStats )
+{
+	CAI_Node **pAInode = pNetwork->AccessNodes();
+
+	pScratch->Visit( startID );
+	pScratch->m_G[startID] = 0;
+	pScratch->m_F[startID] = pFilter->EstimateCost( startID );
+	openList.Push( startID );
+
+	while ( !openList.IsEmpty() )
+	{
+		int smallestID = openList.Pop();
+
+		if ( pStats )
+			pStats->nExpanded++;
+
+		if ( !pFilter->CanExpandNode( smallestID ) )
+			continue;
+
+		if ( smallestID == endID )
+			return pScratch->m_Parent.Base();
+
+		AStarExpandNode( pAInode, pScratch, openList, smallestID, pFilter, pStats );
+	}
+
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Build the parent chain for the cheapest route between two nodes
+//-----------------------------------------------------------------------------
+
+const int *CAI_AStar::FindPath( CAI_Network *pNetwork, int startID, int endID, IAI_AStarFilter *pFilter, AI_AStarStats_t *pStats )
+{
+	int nNodes = pNetwork->NumNodes();
+	if ( !nNodes )
+		return NULL;
+
+	Assert( startID >= 0 && startID < nNodes && endID >= 0 && endID < nNodes );
+
+	if ( pStats )
+		memset( pStats, 0, sizeof(*pStats) );
+
+	CAI_AStarScratch *pScratch = GetAStarScratch();
+	pScratch->BeginSearch( nNodes );
+
+	CAI_AStarHeapOpenList openList( pScratch );
+	return AStarSearch( pNetwork, pScratch, openList, startID, endID, pFilter, pStats );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Restricts a search to the nodes of a cluster corridor
+//-----------------------------------------------------------------------------
+
+class CAI_AStarCorridorFilter : public IAI_AStarFilter
+{
+public:
+	CAI_AStarCorridorFilter( IAI_AStarFilter *pInner, const CAI_NodeClusters &clusters, const CVarBitVec &corridor )
+	 :	m_pInner( pInner ),
+		m_Clusters( clusters ),
+		m_Corridor( corridor )
+	{
+	}
+
+	virtual bool CanExpandNode( int nodeID )
+	{
+		return m_pInner->CanExpandNode( nodeID );
+	}
+
+	virtual float LinkCost( int srcID, int destID, CAI_Link *pLink )
+	{
+		if ( !m_Corridor.IsBitSet( m_Clusters.GetNodeCluster( destID ) ) )
+			return FLT_MAX;
+		return m_pInner->LinkCost( srcID, destID, pLink );
+	}
+
+	virtual float EstimateCost( int nodeID )
+	{
+		return m_pInner->EstimateCost( nodeID );
+	}
+
+private:
+	IAI_AStarFilter *		m_pInner;
+	const CAI_NodeClusters &m_Clusters;
+	const CVarBitVec &		m_Corridor;
+};
+
+//-----------------------------------------------------------------------------
+
+const int *CAI_AStar::FindPathHierarchical( CAI_Network *pNetwork, int startID, int endID, Hull_t hull, int capabilities, IAI_AStarFilter *pFilter, AI_AStarStats_t *pStats )
+{
+	if ( !pNetwork->NumNodes() )
+		return NULL;
+
+	if ( !pNetwork->IsConnected( startID, endID ) )
+	{
+		if ( pStats )
+			memset( pStats, 0, sizeof(*pStats) );
+		return NULL;
+	}
+
+	const CAI_NodeClusters &clusters = pNetwork->GetClusters();
+	if ( !ai_pathfind_hierarchical.GetBool() || !clusters.IsBuilt() ||
+		 clusters.GetNodeCluster( startID ) == clusters.GetNodeCluster( endID ) )
+	{
+		return FindPath( pNetwork, startID, endID, pFilter, pStats );
+	}
+
+	CVarBitVec corridor;
+	int nClusters;
+	if ( !clusters.BuildCorridor( startID, endID, hull, capabilities, &corridor, &nClusters ) )
+	{
+		if ( pStats )
+		{
+			memset( pStats, 0, sizeof(*pStats) );
+			pStats->nClusters = nClusters;
+		}
+		return NULL;
+	}
+
+	CAI_AStarCorridorFilter corridorFilter( pFilter, clusters, corridor );
+	const int *pParents = FindPath( pNetwork, startID, endID, &corridorFilter, pStats );
+
+	if ( !pParents )
+	{
+		AI_AStarStats_t corridorStats;
+		if ( pStats )
+			corridorStats = *pStats;
+
+		pParents = FindPath( pNetwork, startID, endID, pFilter, pStats );
+
+		if ( pStats )
+		{
+			pStats->nExpanded += corridorStats.nExpanded;
+			pStats->nUpdated += corridorStats.nUpdated;
+		}
+	}
+
+	if ( pStats )
+		pStats->nClusters = nClusters;
+
+	return pParents;
+}
+
+//-----------------------------------------------------------------------------
+
+const int *CAI_AStar::FindPathLinear( CAI_Network *pNetwork, int startID, int endID, IAI_AStarFilter *pFilter, AI_AStarStats_t *pStats )
+{
+	int nNodes = pNetwork->NumNodes();
+	if ( !nNodes )
+		return NULL;
+
+	if ( pStats )
+		memset( pStats, 0, sizeof(*pStats) );
+
+	CAI_AStarScratch *pScratch = GetAStarScratch();
+	pScratch->BeginSearch( nNodes );
+
+	// FindBSSmallest reads F for every set bit, so there must be no stale
+	// values for nodes that are open
+	CAI_AStarLinearOpenList openList( pScratch, nNodes );
+	return AStarSearch( pNetwork, pScratch, openList, startID, endID, pFilter, pStats );
+}
+
+//-----------------------------------------------------------------------------
+// Benchmark
+//-----------------------------------------------------------------------------
+
+class CAI_AStarBenchmarkFilter : public IAI_AStarFilter
+{
+public:
+	CAI_AStarBenchmarkFilter( CAI_Network *pNetwork, Hull_t hull, int capabilities, int endID )
+	 :	m_pNetwork( pNetwork ),
+		m_Hull( hull ),
+		m_Capabilities( capabilities )
+	{
+		m_vecGoal = pNetwork->GetNode( endID )->GetPosition( hull );
+	}
+
+	virtual bool CanExpandNode( int nodeID )
+	{
+		return true;
+	}
+
+	virtual float LinkCost( int srcID, int destID, CAI_Link *pLink )
+	{
+		if ( pLink->m_LinkInfo & bits_LINK_OFF )
+			return FLT_MAX;
+		if ( !( pLink->m_iAcceptedMoveTypes[m_Hull] & m_Capabilities ) )
+			return FLT_MAX;
+
+		CAI_Node **pAInode = m_pNetwork->AccessNodes();
+		return ( pAInode[srcID]->GetPosition( m_Hull ) - pAInode[destID]->GetPosition( m_Hull ) ).Length();
+	}
+
+	virtual float EstimateCost( int nodeID )
+	{
+		return ( m_pNetwork->AccessNodes()[nodeID]->GetPosition( m_Hull ) - m_vecGoal ).Length();
+	}
+
+private:
+	CAI_Network *m_pNetwork;
+	Hull_t		m_Hull;
+	int			m_Capabilities;
+	Vector		m_vecGoal;
+};
+
+//-----------------------------------------------------------------------------
+
+CON_COMMAND( ai_pathfind_benchmark, "Times node graph searches between random node pairs. Arguments: [queries] [hull] [seed]" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	CAI_Network *pNetwork = g_pBigAINet;
+	if ( !pNetwork || pNetwork->NumNodes() < 2 )
+	{
+		Msg( "ai_pathfind_benchmark: no node graph loaded\n" );
+		return;
+	}
+
+	int nQueries = ( args.ArgC() > 1 ) ? MAX( 1, atoi( args[1] ) ) : 1000;
+	Hull_t hull = ( args.ArgC() > 2 ) ? (Hull_t)clamp( atoi( args[2] ), 0, NUM_HULLS - 1 ) : HULL_HUMAN;
+	int seed = ( args.ArgC() > 3 ) ? atoi( args[3] ) : 1;
+	int capabilities = bits_CAP_MOVE_GROUND | bits_CAP_MOVE_JUMP | bits_CAP_MOVE_CLIMB;
+
+	CUniformRandomStream randomStream;
+	randomStream.SetSeed( seed );
+
+	int nNodes = pNetwork->NumNodes();
+	int nFound[3] = { 0, 0, 0 };
+	int nMismatched = 0;
+	int64 nExpanded[3] = { 0, 0, 0 };
+	double flTime[3] = { 0, 0, 0 };
+
+	for ( int i = 0; i < nQueries; i++ )
+	{
+		int startID = randomStream.RandomInt( 0, nNodes - 1 );
+		int endID = randomStream.RandomInt( 0, nNodes - 1 );
+		CAI_AStarBenchmarkFilter filter( pNetwork, hull, capabilities, endID );
+		AI_AStarStats_t stats;
+
+		double flStart = Plat_FloatTime();
+		const int *pLinearParents = CAI_AStar::FindPathLinear( pNetwork, startID, endID, &filter, &stats );
+		flTime[0] += Plat_FloatTime() - flStart;
+		nExpanded[0] += stats.nExpanded;
+		nFound[0] += ( pLinearParents != NULL );
+		int linearPrev = ( pLinearParents ) ? pLinearParents[endID] : NO_NODE;
+
+		flStart = Plat_FloatTime();
+		const int *pHeapParents = CAI_AStar::FindPath( pNetwork, startID, endID, &filter, &stats );
+		flTime[1] += Plat_FloatTime() - flStart;
+		nExpanded[1] += stats.nExpanded;
+		nFound[1] += ( pHeapParents != NULL );
+		int heapPrev = ( pHeapParents ) ? pHeapParents[endID] : NO_NODE;
+
+		if ( ( pLinearParents != NULL ) != ( pHeapParents != NULL ) || linearPrev != heapPrev )
+			nMismatched++;
+
+		flStart = Plat_FloatTime();
+		const int *pClusterParents = CAI_AStar::FindPathHierarchical( pNetwork, startID, endID, hull, capabilities, &filter, &stats );
+		flTime[2] += Plat_FloatTime() - flStart;
+		nExpanded[2] += stats.nExpanded;
+		nFound[2] += ( pClusterParents != NULL );
+	}
+
+	Msg( "ai_pathfind_benchmark: %d queries, %d nodes, hull %s\n", nQueries, nNodes, NAI_Hull::Name( hull ) );
+	Msg( "  linear scan : %8.3f ms total, %7.4f ms/query, %d found, %.1f expansions/query\n",
+		flTime[0] * 1000.0, flTime[0] * 1000.0 / nQueries, nFound[0], (double)nExpanded[0] / nQueries );
+	Msg( "  binary heap : %8.3f ms total, %7.4f ms/query, %d found, %.1f expansions/query\n",
+		flTime[1] * 1000.0, flTime[1] * 1000.0 / nQueries, nFound[1], (double)nExpanded[1] / nQueries );
+	Msg( "  hierarchical: %8.3f ms total, %7.4f ms/query, %d found, %.1f expansions/query\n",
+		flTime[2] * 1000.0, flTime[2] * 1000.0 / nQueries, nFound[2], (double)nExpanded[2] / nQueries );
+	if ( flTime[1] > 0 && flTime[2] > 0 )
+		Msg( "  speedup     : %.2fx heap, %.2fx hierarchical\n", flTime[0] / flTime[1], flTime[0] / flTime[2] );
+	if ( nMismatched )
+		Msg( "  WARNING: %d queries produced different routes\n", nMismatched );
+}
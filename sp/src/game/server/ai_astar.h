@@ -0,0 +1,87 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Priority-queue A* over the AI node graph
+//
+//=============================================================================//
+
+#ifndef AI_ASTAR_H
+#define AI_ASTAR_H
+
+#if defined( _WIN32 )
+#pragma once
+#endif
+
+#include "ai_hull.h"
+
+class CAI_Network;
+class CAI_Link;
+
+//-----------------------------------------------------------------------------
+// IAI_AStarFilter
+//
+// Purpose: Supplies the per-query rules (who is searching, with what hull
+//			and capabilities) to the graph search. The search itself only
+//			knows about node IDs and links.
+//-----------------------------------------------------------------------------
+
+abstract_class IAI_AStarFilter
+{
+public:
+	// Called when a node is taken off the open list. Returning false
+	// leaves the node visited, but its links are not expanded.
+	virtual bool	CanExpandNode( int nodeID ) = 0;
+
+	// Cost of moving across pLink from srcID to destID, or FLT_MAX if
+	// the link cannot be used.
+	virtual float	LinkCost( int srcID, int destID, CAI_Link *pLink ) = 0;
+
+	// Estimated remaining cost from nodeID to the goal. Must not
+	// over estimate for the resulting route to be the shortest.
+	virtual float	EstimateCost( int nodeID ) = 0;
+};
+
+//-----------------------------------------------------------------------------
+
+struct AI_AStarStats_t
+{
+	int nExpanded;		// nodes taken off the open list
+	int nUpdated;		// nodes pushed or moved up in the open list
+	int nClusters;		// clusters expanded planning a hierarchical search
+};
+
+//-----------------------------------------------------------------------------
+// CAI_AStar
+//
+// Purpose: A* node graph search using an indexed binary heap for the open
+//			list. Working arrays are kept per thread and reused between
+//			queries, so a search does no allocations once the buffers have
+//			grown to the size of the network.
+//
+//			Ties in the open list are broken on the lowest node ID, which
+//			matches the order the old linear scan (CAI_Network::FindBSSmallest)
+//			popped nodes in, so both engines build the same routes.
+//-----------------------------------------------------------------------------
+
+class CAI_AStar
+{
+public:
+	// Returns an array of parent node IDs indexed by node ID, suitable for
+	// walking back from endID, or NULL if endID could not be reached. The
+	// array belongs to the calling thread and is valid until its next search.
+	static const int *FindPath( CAI_Network *pNetwork, int startID, int endID, IAI_AStarFilter *pFilter, AI_AStarStats_t *pStats = NULL );
+
+	// As FindPath(), but routes between different clusters are first planned
+	// over the network's cluster graph and the node search is confined to that
+	// corridor. Falls back to a full search if the corridor is blocked by
+	// something only the filter knows about (dynamic links, locked nodes).
+	// Goals in another zone are rejected without searching.
+	static const int *FindPathHierarchical( CAI_Network *pNetwork, int startID, int endID, Hull_t hull, int capabilities, IAI_AStarFilter *pFilter, AI_AStarStats_t *pStats = NULL );
+
+	// Reference implementation that selects the open node with a linear scan
+	// of the whole graph. Only used to benchmark against FindPath().
+	static const int *FindPathLinear( CAI_Network *pNetwork, int startID, int endID, IAI_AStarFilter *pFilter, AI_AStarStats_t *pStats = NULL );
+};
+
+//=============================================================================
+
+#endif // AI_ASTAR_H
@@ -258,6 +258,7 @@ CAI_Manager g_AI_Manager;
 CAI_Manager::CAI_Manager()
 {
 	m_AIs.EnsureCapacity( MAX_AIS );
+	m_nChangeCount = 0;
 }
 
 //-------------------------------------
@@ -281,6 +282,7 @@ int CAI_Manager::NumAIs()
 void CAI_Manager::AddAI( CAI_BaseNPC *pAI )
 {
 	m_AIs.AddToTail( pAI );
+	m_nChangeCount++;
 }
 
 //-------------------------------------
@@ -290,7 +292,10 @@ void CAI_Manager::RemoveAI( CAI_BaseNPC *pAI )
 	int i = m_AIs.Find( pAI );
 
 	if ( i != -1 )
+	{
 		m_AIs.FastRemove( i );
+		m_nChangeCount++;
+	}
 }
 
 
@@ -4532,6 +4537,8 @@ void CAI_BaseNPC::NPCThink( void )
 
 			SetPlayerAvoidState();
 
+			Vector vecThinkStart = GetAbsOrigin();
+
 			if ( PreThink() )
 			{
 				if ( m_flNextDecisionTime <= gpGlobals->curtime )
@@ -4557,6 +4564,8 @@ void CAI_BaseNPC::NPCThink( void )
 
 				PostMovement();
 
+				g_AI_SensingScheduler.NoteNPCMoved( this, vecThinkStart );
+
 				SetSimulationTime( gpGlobals->curtime );
 			}
 			else
@@ -13888,8 +13897,12 @@ void CAI_BaseNPC::Teleport( const Vector *newPosition, const QAngle *newAngles,
 {
 	CleanupScriptsOnTeleport( false );
 
+	Vector vecOldOrigin = GetAbsOrigin();
+
 	BaseClass::Teleport( newPosition, newAngles, newVelocity );
 
+	g_AI_SensingScheduler.NoteNPCMoved( this, vecOldOrigin );
+
 #ifdef MAPBASE // From Alien Swarm SDK
 	CheckPVSCondition();
 #endif
@@ -519,6 +519,9 @@ public:
 	void RemoveAI( CAI_BaseNPC *pAI );
 
 	bool FindAI( CAI_BaseNPC *pAI )	{ return ( m_AIs.Find( pAI ) != m_AIs.InvalidIndex() ); }
+
+	// Bumped whenever an AI is added or removed, for anything holding on to the list
+	int GetChangeCount() const		{ return m_nChangeCount; }
 	
 private:
 	enum
@@ -529,6 +532,7 @@ private:
 	typedef CUtlVector<CAI_BaseNPC *> CAIArray;
 	
 	CAIArray m_AIs;
+	int m_nChangeCount;
 
 };
 
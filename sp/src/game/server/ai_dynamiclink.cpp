@@ -647,10 +647,12 @@ void CAI_DynamicLink::SetLinkState(void)
 			if (m_nLinkState == LINK_OFF)
 			{
 				pLink->m_LinkInfo |=  bits_LINK_OFF;
+				g_pBigAINet->GetRouteCache().OnLinkBlocked( pLink->m_iSrcID, pLink->m_iDestID );
 			}
 			else
 			{
 				pLink->m_LinkInfo &= ~bits_LINK_OFF;
+				g_pBigAINet->GetRouteCache().OnLinkOpened( pLink->m_iSrcID, pLink->m_iDestID );
 			}
 		}
 		else
@@ -1110,10 +1112,12 @@ void CAI_RadialLinkController::ModifyNodeLinks( bool bMakeStale )
 							{
 								pLink->m_LinkInfo |= bits_LINK_STALE_SUGGESTED;
 								pLink->m_timeStaleExpires = FLT_MAX;
+								g_pBigAINet->GetRouteCache().OnLinkBlocked( pLink->m_iSrcID, pLink->m_iDestID );
 							}
 							else
 							{
 								pLink->m_LinkInfo &= ~bits_LINK_STALE_SUGGESTED;
+								g_pBigAINet->GetRouteCache().OnLinkOpened( pLink->m_iSrcID, pLink->m_iDestID );
 							}
 						}
 					}
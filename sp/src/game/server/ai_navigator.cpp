@@ -3544,6 +3544,7 @@ bool CAI_Navigator::MarkCurWaypointFailedLink( void )
 				CAI_Link *pLink = pDestNode->GetLinkByIndex( i );
 				pLink->m_LinkInfo |= bits_LINK_STALE_SUGGESTED;
 				pLink->m_timeStaleExpires = gpGlobals->curtime + 4.0;
+				GetNetwork()->GetRouteCache().OnLinkBlocked( pLink->m_iSrcID, pLink->m_iDestID );
 				didMark = true;
 			}
 
@@ -3557,6 +3558,7 @@ bool CAI_Navigator::MarkCurWaypointFailedLink( void )
 			{
 				pLink->m_LinkInfo |= bits_LINK_STALE_SUGGESTED;
 				pLink->m_timeStaleExpires = gpGlobals->curtime + 4.0;
+				GetNetwork()->GetRouteCache().OnLinkBlocked( pLink->m_iSrcID, pLink->m_iDestID );
 				didMark = true;
 			}
 		}
@@ -627,6 +627,10 @@ CAI_Node *CAI_Network::AddNode( const Vector &origin, float yaw )
 
 	m_iNumNodes++;
 
+	// Clusters are rebuilt along with the zones once the graph is complete
+	m_Clusters.Purge();
+	m_RouteCache.Flush();
+
 	return m_pAInode[m_iNumNodes-1];
 };
 
@@ -678,6 +682,9 @@ CAI_Link *CAI_Network::CreateLink( int srcID, int destID, CAI_DynamicLink *pDyna
 	pSrcNode->AddLink(pLink);
 	pDestNode->AddLink(pLink);
 
+	m_Clusters.Purge();
+	m_RouteCache.Flush();
+
 	return pLink;
 }
 
@@ -14,6 +14,8 @@
 
 #include "ispatialpartition.h"
 #include "utlpriorityqueue.h"
+#include "ai_nodecluster.h"
+#include "ai_routecache.h"
 
 // ------------------------------------
 
@@ -128,6 +130,11 @@ public:
 	
 	CAI_Node**		AccessNodes() const	{ return m_pAInode; }
 
+	CAI_NodeClusters &		GetClusters()		{ return m_Clusters; }
+	const CAI_NodeClusters &GetClusters() const	{ return m_Clusters; }
+
+	CAI_RouteCache &		GetRouteCache()		{ return m_RouteCache; }
+
 #ifdef MAPBASE_VSCRIPT
 	Vector		ScriptGetNodePosition( int nodeID ) { return GetNodePosition( HULL_HUMAN, nodeID ); }
 	Vector		ScriptGetNodePositionWithHull( int nodeID, int hull ) { return GetNodePosition( (Hull_t)hull, nodeID ); }
@@ -178,6 +185,9 @@ private:
 	NearNodeCache_T		m_NearestCache[NEARNODE_CACHE_SIZE];	// Cache of nearest nodes
 	int					m_iNearestCacheNext;					// Oldest record in the cache
 
+	CAI_NodeClusters	m_Clusters;								// Coarse graph for long routes
+	CAI_RouteCache		m_RouteCache;							// Recently built routes, shared by all NPCs
+
 #ifdef AI_NODE_TREE
 	ISpatialPartition * m_pNodeTree;
 	CUtlVector<int>		m_GatheredNodes;
@@ -355,6 +355,11 @@ void CAI_NetworkManager::SaveNetworkGraph( void )
 		buf.PutInt( GetEditOps()->m_pNodeIndexTable[node] );
 	}
 
+	// -------------------------------
+	// Dump node clusters
+	// -------------------------------
+	m_pNetwork->m_Clusters.Save( buf );
+
 	// -------------------------------
 	// Write the file out
 	// -------------------------------
@@ -684,6 +689,15 @@ void CAI_NetworkManager::LoadNetworkGraph( void )
 		GetEditOps()->m_pNodeIndexTable[node] = buf.GetInt();
 	}
 
+	// -------------------------------
+	// Load node clusters
+	// -------------------------------
+	if ( !m_pNetwork->m_Clusters.Restore( buf, m_pNetwork->m_iNumNodes ) )
+	{
+		// Graph was saved before clusters were stored, they're cheap to build
+		m_pNetwork->m_Clusters.Build( m_pNetwork );
+	}
+
 	
 #if 1
 	CUtlRBTree<int> usedIds;
@@ -2136,6 +2150,9 @@ void CAI_NetworkBuilder::InitZones( CAI_Network *pNetwork )
 		Assert( ppNodes[i]->GetZone() != AI_NODE_ZONE_UNKNOWN );
 	}
 #endif
+
+	// Clusters never cross zones, so they have to follow any change to them
+	pNetwork->GetClusters().Build( pNetwork );
 }
 
 
@@ -2153,6 +2170,10 @@ void CAI_NetworkBuilder::Rebuild( CAI_Network *pNetwork )
 		return;
 
 	BeginBuild();
+
+	// Zones are only patched up below, so clusters can't be trusted until the
+	// next full build
+	pNetwork->GetClusters().Purge();
 	
 	// ------------------------------------------------------------
 	//  First mark all nodes around vecPos as having to be rebuilt
@@ -0,0 +1,389 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Cluster layer over the AI node graph, used to plan long routes
+//			cluster-to-cluster before refining them node by node
+//
+//=============================================================================//
+
+#include "cbase.h"
+
+#include "ai_nodecluster.h"
+
+#include "ai_network.h"
+#include "ai_node.h"
+#include "ai_link.h"
+#include "bitvec.h"
+#include "utlbuffer.h"
+#include "utlpriorityqueue.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// Increment this to discard clusters stored in existing .ain files
+#define AI_CLUSTER_VERSION_NUMBER	1
+#define AI_CLUSTER_FILE_ID			MAKEID( 'A', 'I', 'C', 'L' )
+
+#define AI_NO_CLUSTER				0xffff
+
+//-----------------------------------------------------------------------------
+
+CAI_NodeClusters::CAI_NodeClusters()
+{
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_NodeClusters::Purge()
+{
+	m_Clusters.Purge();
+	m_Portals.Purge();
+	m_NodeCluster.Purge();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Grows clusters breadth first from the lowest unassigned node,
+//			then collects the links that cross between clusters
+//-----------------------------------------------------------------------------
+
+void CAI_NodeClusters::Build( CAI_Network *pNetwork )
+{
+	Purge();
+
+	int nNodes = pNetwork->NumNodes();
+	CAI_Node **ppNodes = pNetwork->AccessNodes();
+
+	if ( !nNodes )
+		return;
+
+	m_NodeCluster.SetCount( nNodes );
+	for ( int i = 0; i < nNodes; i++ )
+		m_NodeCluster[i] = AI_NO_CLUSTER;
+
+	CUtlVector<int> members;
+
+	for ( int seed = 0; seed < nNodes; seed++ )
+	{
+		if ( m_NodeCluster[seed] != AI_NO_CLUSTER )
+			continue;
+
+		int iCluster = m_Clusters.AddToTail();
+		const Vector &vecSeed = ppNodes[seed]->GetOrigin();
+
+		members.RemoveAll();
+		members.AddToTail( seed );
+		m_NodeCluster[seed] = iCluster;
+
+		for ( int head = 0; head < members.Count() && members.Count() < AI_CLUSTER_MAX_NODES; head++ )
+		{
+			CAI_Node *pNode = ppNodes[members[head]];
+			for ( int link = 0; link < pNode->NumLinks(); link++ )
+			{
+				int destID = pNode->GetLinkByIndex( link )->DestNodeID( members[head] );
+				if ( m_NodeCluster[destID] != AI_NO_CLUSTER )
+					continue;
+
+				if ( ppNodes[destID]->GetZone() != ppNodes[seed]->GetZone() )
+					continue;
+
+				if ( ( ppNodes[destID]->GetOrigin() - vecSeed ).LengthSqr() > AI_CLUSTER_MAX_RADIUS * AI_CLUSTER_MAX_RADIUS )
+					continue;
+
+				m_NodeCluster[destID] = iCluster;
+				members.AddToTail( destID );
+
+				if ( members.Count() == AI_CLUSTER_MAX_NODES )
+					break;
+			}
+		}
+
+		Vector vecCenter = vec3_origin;
+		for ( int i = 0; i < members.Count(); i++ )
+			vecCenter += ppNodes[members[i]]->GetOrigin();
+
+		m_Clusters[iCluster].vecCenter = vecCenter / members.Count();
+		m_Clusters[iCluster].iFirstPortal = 0;
+		m_Clusters[iCluster].nPortals = 0;
+	}
+
+	// Gather the portals per cluster, merging every node link between the same
+	// pair of clusters into one portal
+	CUtlVector< CUtlVector<Portal_t> > clusterPortals;
+	clusterPortals.SetCount( m_Clusters.Count() );
+
+	for ( int node = 0; node < nNodes; node++ )
+	{
+		CAI_Node *pNode = ppNodes[node];
+		for ( int link = 0; link < pNode->NumLinks(); link++ )
+		{
+			CAI_Link *pLink = pNode->GetLinkByIndex( link );
+			if ( pLink->m_iSrcID != node )
+				continue;
+
+			int iSrcCluster = m_NodeCluster[pLink->m_iSrcID];
+			int iDestCluster = m_NodeCluster[pLink->m_iDestID];
+			if ( iSrcCluster == iDestCluster )
+				continue;
+
+			for ( int dir = 0; dir < 2; dir++ )
+			{
+				int iFrom = ( dir == 0 ) ? iSrcCluster : iDestCluster;
+				int iTo = ( dir == 0 ) ? iDestCluster : iSrcCluster;
+				CUtlVector<Portal_t> &portals = clusterPortals[iFrom];
+
+				int i;
+				for ( i = 0; i < portals.Count(); i++ )
+				{
+					if ( portals[i].iDestCluster == iTo )
+						break;
+				}
+
+				if ( i == portals.Count() )
+				{
+					i = portals.AddToTail();
+					portals[i].iDestCluster = iTo;
+					portals[i].flCost = ( m_Clusters[iTo].vecCenter - m_Clusters[iFrom].vecCenter ).Length();
+					memset( portals[i].acceptedMoveTypes, 0, sizeof( portals[i].acceptedMoveTypes ) );
+				}
+
+				for ( int hull = 0; hull < NUM_HULLS; hull++ )
+					portals[i].acceptedMoveTypes[hull] |= pLink->m_iAcceptedMoveTypes[hull];
+			}
+		}
+	}
+
+	for ( int i = 0; i < m_Clusters.Count(); i++ )
+	{
+		m_Clusters[i].iFirstPortal = m_Portals.Count();
+		m_Clusters[i].nPortals = clusterPortals[i].Count();
+		m_Portals.AddMultipleToTail( clusterPortals[i].Count(), clusterPortals[i].Base() );
+	}
+
+	DevMsg( 2, "AI node graph: %d nodes in %d clusters, %d portals\n", nNodes, m_Clusters.Count(), m_Portals.Count() );
+}
+
+//-----------------------------------------------------------------------------
+
+bool CAI_NodeClusters::IsPortalUsable( const Portal_t &portal, Hull_t hull, int capabilities ) const
+{
+	// Jump links can be taken without the jump capability at jump override hints,
+	// so don't rule them out here
+	return ( portal.acceptedMoveTypes[hull] & ( capabilities | bits_CAP_MOVE_JUMP ) ) != 0;
+}
+
+//-----------------------------------------------------------------------------
+
+struct AI_ClusterOpen_t
+{
+	float	f;
+	int		iCluster;
+
+	static bool IsLowerPriority( const AI_ClusterOpen_t &a, const AI_ClusterOpen_t &b )
+	{
+		return ( a.f > b.f );
+	}
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: A* over the cluster graph. Stale open list entries are skipped
+//			rather than updated in place; the graph is small enough that
+//			this costs less than maintaining an index.
+//-----------------------------------------------------------------------------
+
+bool CAI_NodeClusters::BuildCorridor( int startID, int endID, Hull_t hull, int capabilities, CVarBitVec *pCorridor, int *pNumExpanded ) const
+{
+	Assert( IsBuilt() );
+
+	int nClusters = m_Clusters.Count();
+	int iStartCluster = m_NodeCluster[startID];
+	int iEndCluster = m_NodeCluster[endID];
+
+	if ( pNumExpanded )
+		*pNumExpanded = 0;
+
+	pCorridor->Resize( nClusters, true );
+
+	float *clusterG = (float *)stackalloc( nClusters * sizeof(float) );
+	int *clusterP = (int *)stackalloc( nClusters * sizeof(int) );
+	for ( int i = 0; i < nClusters; i++ )
+	{
+		clusterG[i] = FLT_MAX;
+		clusterP[i] = -1;
+	}
+
+	const Vector &vecGoal = m_Clusters[iEndCluster].vecCenter;
+
+	CUtlPriorityQueue<AI_ClusterOpen_t> openList( 0, 64, AI_ClusterOpen_t::IsLowerPriority );
+
+	AI_ClusterOpen_t start;
+	start.iCluster = iStartCluster;
+	start.f = ( m_Clusters[iStartCluster].vecCenter - vecGoal ).Length();
+	clusterG[iStartCluster] = 0;
+	openList.Insert( start );
+
+	bool bFound = false;
+	while ( openList.Count() )
+	{
+		AI_ClusterOpen_t current = openList.ElementAtHead();
+		openList.RemoveAtHead();
+
+		int iCluster = current.iCluster;
+		if ( current.f > clusterG[iCluster] + ( m_Clusters[iCluster].vecCenter - vecGoal ).Length() )
+			continue; // superseded by a cheaper entry
+
+		if ( pNumExpanded )
+			(*pNumExpanded)++;
+
+		if ( iCluster == iEndCluster )
+		{
+			bFound = true;
+			break;
+		}
+
+		const Cluster_t &cluster = m_Clusters[iCluster];
+		for ( int i = 0; i < cluster.nPortals; i++ )
+		{
+			const Portal_t &portal = m_Portals[cluster.iFirstPortal + i];
+			if ( !IsPortalUsable( portal, hull, capabilities ) )
+				continue;
+
+			float new_g = clusterG[iCluster] + portal.flCost;
+			if ( new_g < clusterG[portal.iDestCluster] )
+			{
+				clusterG[portal.iDestCluster] = new_g;
+				clusterP[portal.iDestCluster] = iCluster;
+
+				AI_ClusterOpen_t next;
+				next.iCluster = portal.iDestCluster;
+				next.f = new_g + ( m_Clusters[portal.iDestCluster].vecCenter - vecGoal ).Length();
+				openList.Insert( next );
+			}
+		}
+	}
+
+	if ( !bFound )
+		return false;
+
+	// Mark the chain and everything touching it, so the node search has some
+	// room to cut corners between cluster centers
+	for ( int iCluster = iEndCluster; iCluster != -1; iCluster = clusterP[iCluster] )
+	{
+		pCorridor->Set( iCluster );
+
+		const Cluster_t &cluster = m_Clusters[iCluster];
+		for ( int i = 0; i < cluster.nPortals; i++ )
+		{
+			const Portal_t &portal = m_Portals[cluster.iFirstPortal + i];
+			if ( IsPortalUsable( portal, hull, capabilities ) )
+				pCorridor->Set( portal.iDestCluster );
+		}
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_NodeClusters::Save( CUtlBuffer &buf ) const
+{
+	buf.PutInt( AI_CLUSTER_FILE_ID );
+	buf.PutInt( AI_CLUSTER_VERSION_NUMBER );
+	buf.PutInt( m_NodeCluster.Count() );
+	buf.PutInt( m_Clusters.Count() );
+	buf.PutInt( m_Portals.Count() );
+
+	for ( int i = 0; i < m_NodeCluster.Count(); i++ )
+	{
+		buf.PutUnsignedShort( m_NodeCluster[i] );
+	}
+
+	for ( int i = 0; i < m_Clusters.Count(); i++ )
+	{
+		const Cluster_t &cluster = m_Clusters[i];
+		buf.PutFloat( cluster.vecCenter.x );
+		buf.PutFloat( cluster.vecCenter.y );
+		buf.PutFloat( cluster.vecCenter.z );
+		buf.PutInt( cluster.iFirstPortal );
+		buf.PutInt( cluster.nPortals );
+	}
+
+	for ( int i = 0; i < m_Portals.Count(); i++ )
+	{
+		const Portal_t &portal = m_Portals[i];
+		buf.PutUnsignedShort( portal.iDestCluster );
+		buf.Put( portal.acceptedMoveTypes, sizeof( portal.acceptedMoveTypes ) );
+		buf.PutFloat( portal.flCost );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads clusters written by Save(). Returns false if the buffer
+//			holds none (graphs saved before clusters existed) or they don't
+//			belong to a graph of this size.
+//-----------------------------------------------------------------------------
+
+bool CAI_NodeClusters::Restore( CUtlBuffer &buf, int nNodes )
+{
+	Purge();
+
+	if ( buf.GetBytesRemaining() < 5 * (int)sizeof(int) )
+		return false;
+
+	if ( buf.GetInt() != AI_CLUSTER_FILE_ID || buf.GetInt() != AI_CLUSTER_VERSION_NUMBER )
+		return false;
+
+	int nStoredNodes = buf.GetInt();
+	int nClusters = buf.GetInt();
+	int nPortals = buf.GetInt();
+
+	if ( nStoredNodes != nNodes || nClusters <= 0 || nClusters > nNodes || nPortals < 0 )
+		return false;
+
+	m_NodeCluster.SetCount( nNodes );
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		m_NodeCluster[i] = buf.GetUnsignedShort();
+	}
+
+	m_Clusters.SetCount( nClusters );
+	for ( int i = 0; i < nClusters; i++ )
+	{
+		Cluster_t &cluster = m_Clusters[i];
+		cluster.vecCenter.x = buf.GetFloat();
+		cluster.vecCenter.y = buf.GetFloat();
+		cluster.vecCenter.z = buf.GetFloat();
+		cluster.iFirstPortal = buf.GetInt();
+		cluster.nPortals = buf.GetInt();
+	}
+
+	m_Portals.SetCount( nPortals );
+	for ( int i = 0; i < nPortals; i++ )
+	{
+		Portal_t &portal = m_Portals[i];
+		portal.iDestCluster = buf.GetUnsignedShort();
+		buf.Get( portal.acceptedMoveTypes, sizeof( portal.acceptedMoveTypes ) );
+		portal.flCost = buf.GetFloat();
+	}
+
+	bool bValid = buf.IsValid();
+	for ( int i = 0; bValid && i < nNodes; i++ )
+	{
+		bValid = ( m_NodeCluster[i] < nClusters );
+	}
+	for ( int i = 0; bValid && i < nClusters; i++ )
+	{
+		bValid = ( m_Clusters[i].iFirstPortal >= 0 && m_Clusters[i].nPortals >= 0 && m_Clusters[i].iFirstPortal + m_Clusters[i].nPortals <= nPortals );
+	}
+	for ( int i = 0; bValid && i < nPortals; i++ )
+	{
+		bValid = ( m_Portals[i].iDestCluster < nClusters );
+	}
+
+	if ( !bValid )
+	{
+		DevWarning( "AI node graph clusters are corrupt, rebuilding\n" );
+		Purge();
+		return false;
+	}
+
+	return true;
+}
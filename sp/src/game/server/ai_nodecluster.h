@@ -0,0 +1,86 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Cluster layer over the AI node graph, used to plan long routes
+//			cluster-to-cluster before refining them node by node
+//
+//=============================================================================//
+
+#ifndef AI_NODECLUSTER_H
+#define AI_NODECLUSTER_H
+
+#if defined( _WIN32 )
+#pragma once
+#endif
+
+#include "ai_hull.h"
+#include "utlvector.h"
+
+class CAI_Network;
+class CUtlBuffer;
+class CVarBitVec;
+
+//-----------------------------------------------------------------------------
+
+#define AI_CLUSTER_MAX_RADIUS		(64*12)		// Furthest a node may be from the node that seeded its cluster
+#define AI_CLUSTER_MAX_NODES		48
+
+//-----------------------------------------------------------------------------
+// CAI_NodeClusters
+//
+// Purpose: Groups nearby linked nodes into clusters and records which
+//			clusters are joined by node links (portals). Clusters never span
+//			zones. Portal move types are the union of every node link that
+//			crosses between the two clusters, so a route found at the
+//			cluster level is a superset of what any NPC can actually use.
+//-----------------------------------------------------------------------------
+
+class CAI_NodeClusters
+{
+public:
+	CAI_NodeClusters();
+
+	void			Build( CAI_Network *pNetwork );
+	void			Purge();
+
+	bool			IsBuilt() const					{ return ( m_NodeCluster.Count() != 0 ); }
+
+	int				NumClusters() const				{ return m_Clusters.Count(); }
+	int				GetNodeCluster( int nodeID ) const	{ return m_NodeCluster[nodeID]; }
+
+	// Finds the cheapest chain of clusters between the clusters of two nodes
+	// and marks it, plus the clusters bordering it, in pCorridor. Returns
+	// false if no chain exists for the hull and capabilities, in which case
+	// there is no node route either.
+	bool			BuildCorridor( int startID, int endID, Hull_t hull, int capabilities, CVarBitVec *pCorridor, int *pNumExpanded = NULL ) const;
+
+	//---------------------------------
+	// Stored at the end of the .ain file
+	//---------------------------------
+	void			Save( CUtlBuffer &buf ) const;
+	bool			Restore( CUtlBuffer &buf, int nNodes );
+
+private:
+	struct Cluster_t
+	{
+		Vector		vecCenter;
+		int			iFirstPortal;
+		int			nPortals;
+	};
+
+	struct Portal_t
+	{
+		unsigned short	iDestCluster;
+		byte			acceptedMoveTypes[NUM_HULLS];
+		float			flCost;
+	};
+
+	bool			IsPortalUsable( const Portal_t &portal, Hull_t hull, int capabilities ) const;
+
+	CUtlVector<Cluster_t>		m_Clusters;
+	CUtlVector<Portal_t>		m_Portals;
+	CUtlVector<unsigned short>	m_NodeCluster;
+};
+
+//=============================================================================
+
+#endif // AI_NODECLUSTER_H
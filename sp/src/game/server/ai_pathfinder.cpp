@@ -20,6 +20,7 @@
 #include "ai_moveprobe.h"
 #include "ai_dynamiclink.h"
 #include "ai_hint.h"
+#include "ai_astar.h"
 #include "bitstring.h"
 
 //@todo: bad dependency!
@@ -169,18 +170,35 @@ Navigation_t CAI_Pathfinder::ComputeWaypointType( CAI_Node **ppNodes, int parent
 // Purpose: Given an array of parentID's and endID, contruct a linked 
 //			list of waypoints through those parents
 //-----------------------------------------------------------------------------
-AI_Waypoint_t* CAI_Pathfinder::MakeRouteFromParents( int *parentArray, int endID ) 
+AI_Waypoint_t* CAI_Pathfinder::MakeRouteFromParents( const int *parentArray, int endID ) 
+{
+	CUtlVectorFixedGrowable<int, 64> nodes;
+
+	for ( int currentID = endID; currentID != NO_NODE; currentID = parentArray[currentID] )
+	{
+		nodes.AddToHead( currentID );
+	}
+
+	return MakeRouteFromNodes( nodes.Base(), nodes.Count() );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Construct a linked list of waypoints through a sequence of
+//			linked nodes, start node first
+//-----------------------------------------------------------------------------
+AI_Waypoint_t* CAI_Pathfinder::MakeRouteFromNodes( const int *pNodes, int nNodes ) 
 {
 	AI_Waypoint_t *pOldWaypoint = NULL;
 	AI_Waypoint_t *pNewWaypoint = NULL;
-	int	currentID = endID;
 
 	CAI_Node **pAInode = GetNetwork()->AccessNodes();
 
-	while (currentID != NO_NODE) 
+	for ( int i = nNodes - 1; i >= 0; i-- )
 	{
+		int currentID = pNodes[i];
+
 		// Try to link it to the previous waypoint
-		int prevID = parentArray[currentID];
+		int prevID = ( i > 0 ) ? pNodes[i - 1] : NO_NODE;
 
 		int destID; 
 		if (prevID != NO_NODE)
@@ -211,13 +229,42 @@ AI_Waypoint_t* CAI_Pathfinder::MakeRouteFromParents( int *parentArray, int endID
 		// Link it up...
 		pNewWaypoint->SetNext( pOldWaypoint );
 		pOldWaypoint = pNewWaypoint;
-
-		currentID = prevID;
 	}
 
 	return pOldWaypoint;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Checks that a route built for another NPC with the same hull and
+//			capabilities is one this NPC could have found itself
+//-----------------------------------------------------------------------------
+bool CAI_Pathfinder::IsCachedRouteUsable( const int *pNodes, int nNodes )
+{
+	CAI_Node **pAInode = GetNetwork()->AccessNodes();
+
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		CAI_Node *pNode = pAInode[pNodes[i]];
+		if ( GetOuter()->IsUnusableNode( pNodes[i], pNode->GetHint() ) )
+			return false;
+
+		if ( i == nNodes - 1 )
+			break;
+
+		CAI_Link *pLink = pNode->GetLink( pNodes[i + 1] );
+		if ( !pLink || !IsLinkUsable( pLink, pNodes[i] ) )
+			return false;
+
+		int moveType = pLink->m_iAcceptedMoveTypes[GetHullType()] & CapabilitiesGet();
+		Vector r1 = pNode->GetPosition( GetHullType() );
+		Vector r2 = pAInode[pNodes[i + 1]]->GetPosition( GetHullType() );
+		if ( GetOuter()->GetNavigator()->MovementCost( moveType, r1, r2 ) == FLT_MAX )
+			return false;
+	}
+
+	return true;
+}
+
 
 //------------------------------------------------------------------------------
 // Purpose : Test if stale link is no longer stale
@@ -249,10 +296,12 @@ bool CAI_Pathfinder::IsLinkStillStale(int moveType, CAI_Link *nodeLink)
 		GetNetwork()->GetNode(nodeLink->m_iDestID)->GetPosition(GetHullType()), moveType))
 	{
 		nodeLink->m_LinkInfo &= ~bits_LINK_STALE_SUGGESTED;
+		GetNetwork()->GetRouteCache().OnLinkOpened( nodeLink->m_iSrcID, nodeLink->m_iDestID );
 		return false;
 	}
 
 	nodeLink->m_timeStaleExpires = gpGlobals->curtime + 1.0;
+	GetNetwork()->GetRouteCache().OnLinkBlocked( nodeLink->m_iSrcID, nodeLink->m_iDestID );
 
 	return true;
 }
@@ -273,100 +322,114 @@ int CAI_Pathfinder::NearestNodeToPoint( const Vector &vecOrigin )
 }
 
 //-----------------------------------------------------------------------------
-// Purpose: Build a path between two nodes
+// Purpose: Applies an NPC's hull, capabilities and link rules to a node
+//			graph search
 //-----------------------------------------------------------------------------
 
-AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID) 
+class CAI_PathfindAStarFilter : public IAI_AStarFilter
 {
-	AI_PROFILE_SCOPE( CAI_Pathfinder_FindBestPath );
-	
-	if ( !GetNetwork()->NumNodes() )
-		return NULL;
+public:
+	CAI_PathfindAStarFilter( CAI_Pathfinder *pPathfinder, int endID )
+	 :	m_pPathfinder( pPathfinder ),
+		m_pAInode( pPathfinder->GetNetwork()->AccessNodes() ),
+		m_HullType( pPathfinder->GetHullType() ),
+		m_flEarliestStaleExpire( FLT_MAX ),
+		m_bSawNPCSpecificLink( false )
+	{
+		m_vecGoal = m_pAInode[endID]->GetPosition( m_HullType );
+	}
 
-#ifdef AI_PERF_MON
-	m_nPerfStatPB++;
+	virtual bool CanExpandNode( int nodeID )
+	{
+		return !m_pPathfinder->GetOuter()->IsUnusableNode( nodeID, m_pAInode[nodeID]->GetHint() );
+	}
+
+	virtual float LinkCost( int srcID, int destID, CAI_Link *pLink )
+	{
+		bool bUsable = m_pPathfinder->IsLinkUsable( pLink, srcID );
+
+		// Note what the result depended on, so the route cache knows how long
+		// (and whether) the route found by this search may be shared
+		if ( pLink->m_LinkInfo & bits_LINK_STALE_SUGGESTED )
+			m_flEarliestStaleExpire = MIN( m_flEarliestStaleExpire, pLink->m_timeStaleExpires );
+
+#ifdef MAPBASE
+		if ( pLink->m_pDynamicLink )
+#else
+		if ( pLink->m_pDynamicLink && ( pLink->m_LinkInfo & bits_LINK_OFF ) && pLink->m_pDynamicLink->m_strAllowUse != NULL_STRING )
 #endif
+			m_bSawNPCSpecificLink = true;
 
-	int nNodes = GetNetwork()->NumNodes();
-	CAI_Node **pAInode = GetNetwork()->AccessNodes();
+		if ( !bUsable )
+			return FLT_MAX;
 
-	CVarBitVec	openBS(nNodes);
-	CVarBitVec	closeBS(nNodes);
+		// FIXME: the cost function should take into account Node costs (danger, flanking, etc).
+		int moveType = pLink->m_iAcceptedMoveTypes[m_HullType] & m_pPathfinder->CapabilitiesGet();
 
-	// ------------- INITIALIZE ------------------------
-	float* nodeG = (float *)stackalloc( nNodes * sizeof(float) );
-	float* nodeH = (float *)stackalloc( nNodes * sizeof(float) );
-	float* nodeF = (float *)stackalloc( nNodes * sizeof(float) );
-	int*   nodeP = (int *)stackalloc( nNodes * sizeof(int) );		// Node parent 
+		Vector r1 = m_pAInode[srcID]->GetPosition( m_HullType );
+		Vector r2 = m_pAInode[destID]->GetPosition( m_HullType );
+		return m_pPathfinder->GetOuter()->GetNavigator()->MovementCost( moveType, r1, r2 ); // MovementCost takes ref parameters!!
+	}
 
-	for (int node=0;node<nNodes;node++)
+	virtual float EstimateCost( int nodeID )
 	{
-		nodeG[node] = FLT_MAX;
-		nodeP[node] = -1;
+		return ( m_pAInode[nodeID]->GetPosition( m_HullType ) - m_vecGoal ).Length();
 	}
 
-	nodeG[startID] = 0;
+	// Earliest time a stale link seen by the search may have recovered
+	float GetEarliestStaleExpire() const	{ return m_flEarliestStaleExpire; }
 
-	nodeH[startID] = 0.1*(pAInode[startID]->GetPosition(GetHullType())-pAInode[endID]->GetPosition(GetHullType())).Length(); // Don't want to over estimate
-	nodeF[startID] = nodeG[startID] + nodeH[startID];
+	// Whether a link's usability depended on which NPC was asking
+	bool SawNPCSpecificLink() const			{ return m_bSawNPCSpecificLink; }
 
-	openBS.Set(startID);
-	closeBS.Set( startID );
-
-	// --------------- FIND BEST PATH ------------------
-	while (!openBS.IsAllClear()) 
-	{
-		int smallestID = CAI_Network::FindBSSmallest(&openBS,nodeF,nNodes);
-	
-		openBS.Clear(smallestID);
+private:
+	CAI_Pathfinder *m_pPathfinder;
+	CAI_Node **		m_pAInode;
+	Hull_t			m_HullType;
+	Vector			m_vecGoal;
+	float			m_flEarliestStaleExpire;
+	bool			m_bSawNPCSpecificLink;
+};
 
-		CAI_Node *pSmallestNode = pAInode[smallestID];
-		
-		if (GetOuter()->IsUnusableNode(smallestID, pSmallestNode->GetHint()))
-			continue;
+//-----------------------------------------------------------------------------
+// Purpose: Build a path between two nodes
+//-----------------------------------------------------------------------------
 
-		if (smallestID == endID) 
-		{
-			AI_Waypoint_t* route = MakeRouteFromParents(&nodeP[0], endID);
-			return route;
-		}
+AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID) 
+{
+	AI_PROFILE_SCOPE( CAI_Pathfinder_FindBestPath );
+	
+	if ( !GetNetwork()->NumNodes() )
+		return NULL;
 
-		// Check this if the node is immediately in the path after the startNode 
-		// that it isn't blocked
-		for (int link=0; link < pSmallestNode->NumLinks();link++) 
-		{
-			CAI_Link *nodeLink = pSmallestNode->GetLinkByIndex(link);
-			
-			if (!IsLinkUsable(nodeLink,smallestID))
-				continue;
+#ifdef AI_PERF_MON
+	m_nPerfStatPB++;
+#endif
 
-			// FIXME: the cost function should take into account Node costs (danger, flanking, etc).
-			int moveType = nodeLink->m_iAcceptedMoveTypes[GetHullType()] & CapabilitiesGet();
-			int testID	 = nodeLink->DestNodeID(smallestID);
+	CAI_RouteCache &routeCache = GetNetwork()->GetRouteCache();
+	int capabilities = CapabilitiesGet() & AI_MOVE_TYPE_BITS;
 
-			Vector r1 = pSmallestNode->GetPosition(GetHullType());
-			Vector r2 = pAInode[testID]->GetPosition(GetHullType());
-			float dist   = GetOuter()->GetNavigator()->MovementCost( moveType, r1, r2 ); // MovementCost takes ref parameters!!
+	CUtlVector<int> cachedNodes;
+	if ( routeCache.Lookup( startID, endID, GetHullType(), capabilities, &cachedNodes ) )
+	{
+		if ( IsCachedRouteUsable( cachedNodes.Base(), cachedNodes.Count() ) )
+			return MakeRouteFromNodes( cachedNodes.Base(), cachedNodes.Count() );
 
-			if ( dist == FLT_MAX )
-				continue;
+		routeCache.Reject( startID, endID, GetHullType(), capabilities );
+	}
 
-			float new_g  = nodeG[smallestID] + dist;
+	CAI_PathfindAStarFilter filter( this, endID );
 
-			if ( !closeBS.IsBitSet(testID) || (new_g < nodeG[testID]) ) 
-			{
-				nodeP[testID] = smallestID;
-				nodeG[testID] = new_g;
-				nodeH[testID] = (pAInode[testID]->GetPosition(GetHullType())-pAInode[endID]->GetPosition(GetHullType())).Length();
-				nodeF[testID] = nodeG[testID] + nodeH[testID];
+	const int *pParents = CAI_AStar::FindPathHierarchical( GetNetwork(), startID, endID, GetHullType(), CapabilitiesGet(), &filter );
+	if ( !pParents )
+		return NULL;
 
-				closeBS.Set( testID );
-				openBS.Set( testID );
-			}
-		}
-	}
+	// Another NPC may not be allowed through the dynamic links this one used
+	// (or avoided), so only share routes that don't depend on who asked
+	if ( !filter.SawNPCSpecificLink() )
+		routeCache.Store( startID, endID, GetHullType(), capabilities, pParents, filter.GetEarliestStaleExpire() );
 
-	return NULL;   
+	return MakeRouteFromParents( pParents, endID );
 }
 
 //-----------------------------------------------------------------------------
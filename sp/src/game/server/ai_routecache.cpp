@@ -0,0 +1,247 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Shared cache of recent node routes, so squads asking for the
+//			same route in the same few frames don't each run a full search
+//
+//=============================================================================//
+
+#include "cbase.h"
+
+#include "ai_routecache.h"
+
+#include "ai_network.h"
+#include "ai_node.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+ConVar ai_route_cache( "ai_route_cache", "1", FCVAR_NONE, "Share recently built node routes between NPCs" );
+ConVar ai_route_cache_size( "ai_route_cache_size", "256", FCVAR_NONE, "Number of node routes kept in the shared route cache" );
+ConVar ai_route_cache_max_age( "ai_route_cache_max_age", "5", FCVAR_NONE, "Seconds a node route may be served from the shared route cache" );
+
+//-----------------------------------------------------------------------------
+
+CAI_RouteCache::CAI_RouteCache()
+ :	m_Index( KeyLessFunc )
+{
+	ResetStats();
+}
+
+//-----------------------------------------------------------------------------
+
+bool CAI_RouteCache::KeyLessFunc( const Key_t &lhs, const Key_t &rhs )
+{
+	if ( lhs.startID != rhs.startID )
+		return ( lhs.startID < rhs.startID );
+	if ( lhs.endID != rhs.endID )
+		return ( lhs.endID < rhs.endID );
+	if ( lhs.hull != rhs.hull )
+		return ( lhs.hull < rhs.hull );
+	return ( lhs.capabilities < rhs.capabilities );
+}
+
+//-----------------------------------------------------------------------------
+
+CAI_RouteCache::Key_t CAI_RouteCache::MakeKey( int startID, int endID, Hull_t hull, int capabilities )
+{
+	Key_t key;
+	key.startID = startID;
+	key.endID = endID;
+	key.hull = hull;
+	key.capabilities = capabilities;
+	return key;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CAI_RouteCache::Lookup( int startID, int endID, Hull_t hull, int capabilities, CUtlVector<int> *pNodes )
+{
+	if ( !ai_route_cache.GetBool() )
+		return false;
+
+	m_Stats.nLookups++;
+
+	unsigned short iIndex = m_Index.Find( MakeKey( startID, endID, hull, capabilities ) );
+	if ( iIndex == m_Index.InvalidIndex() )
+		return false;
+
+	unsigned short iEntry = m_Index[iIndex];
+	if ( m_Entries[iEntry].expireTime <= gpGlobals->curtime )
+	{
+		RemoveEntry( iEntry );
+		m_Stats.nExpired++;
+		return false;
+	}
+
+	m_Entries.Unlink( iEntry );
+	m_Entries.LinkToHead( iEntry );
+
+	const CUtlVector<unsigned short> &nodes = m_Entries[iEntry].nodes;
+	pNodes->SetCount( nodes.Count() );
+	for ( int i = 0; i < nodes.Count(); i++ )
+	{
+		(*pNodes)[i] = nodes[i];
+	}
+
+	m_Stats.nHits++;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Records the route found by a search. pParents is the parent
+//			array returned by CAI_AStar, walked back from endID. The entry
+//			is served until flExpireTime, or for ai_route_cache_max_age
+//			seconds if that is sooner.
+//-----------------------------------------------------------------------------
+
+void CAI_RouteCache::Store( int startID, int endID, Hull_t hull, int capabilities, const int *pParents, float flExpireTime )
+{
+	if ( !ai_route_cache.GetBool() )
+		return;
+
+	flExpireTime = MIN( flExpireTime, gpGlobals->curtime + ai_route_cache_max_age.GetFloat() );
+	if ( flExpireTime <= gpGlobals->curtime )
+		return;
+
+	Key_t key = MakeKey( startID, endID, hull, capabilities );
+
+	unsigned short iIndex = m_Index.Find( key );
+	if ( iIndex != m_Index.InvalidIndex() )
+	{
+		RemoveEntry( m_Index[iIndex] );
+	}
+
+	int nMaxEntries = MAX( ai_route_cache_size.GetInt(), 0 );
+	while ( m_Entries.Count() && m_Entries.Count() >= nMaxEntries )
+	{
+		RemoveEntry( m_Entries.Tail() );
+	}
+
+	if ( !nMaxEntries )
+		return;
+
+	unsigned short iEntry = m_Entries.AddToHead();
+	Entry_t &entry = m_Entries[iEntry];
+	entry.key = key;
+	entry.expireTime = flExpireTime;
+	entry.nodes.RemoveAll();
+
+	for ( int node = endID; node != NO_NODE; node = pParents[node] )
+	{
+		entry.nodes.AddToHead( node );
+	}
+
+	Assert( entry.nodes[0] == startID );
+
+	m_Index.Insert( key, iEntry );
+	m_Stats.nStored++;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Called when a cached route failed validation for the caller
+//-----------------------------------------------------------------------------
+
+void CAI_RouteCache::Reject( int startID, int endID, Hull_t hull, int capabilities )
+{
+	unsigned short iIndex = m_Index.Find( MakeKey( startID, endID, hull, capabilities ) );
+	if ( iIndex != m_Index.InvalidIndex() )
+	{
+		RemoveEntry( m_Index[iIndex] );
+		m_Stats.nRejected++;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_RouteCache::RemoveEntry( unsigned short iEntry )
+{
+	m_Index.Remove( m_Entries[iEntry].key );
+	m_Entries.Remove( iEntry );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Drops every route that crosses the link, in either direction
+//-----------------------------------------------------------------------------
+
+void CAI_RouteCache::OnLinkBlocked( int srcID, int destID )
+{
+	unsigned short iEntry = m_Entries.Head();
+	while ( iEntry != m_Entries.InvalidIndex() )
+	{
+		unsigned short iNext = m_Entries.Next( iEntry );
+		const CUtlVector<unsigned short> &nodes = m_Entries[iEntry].nodes;
+
+		for ( int i = 1; i < nodes.Count(); i++ )
+		{
+			if ( ( nodes[i - 1] == srcID && nodes[i] == destID ) ||
+				 ( nodes[i - 1] == destID && nodes[i] == srcID ) )
+			{
+				RemoveEntry( iEntry );
+				m_Stats.nInvalidated++;
+				break;
+			}
+		}
+
+		iEntry = iNext;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_RouteCache::OnLinkOpened( int srcID, int destID )
+{
+	Flush();
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_RouteCache::Flush()
+{
+	if ( !m_Entries.Count() )
+		return;
+
+	m_Stats.nInvalidated += m_Entries.Count();
+	m_Stats.nFlushes++;
+
+	m_Entries.RemoveAll();
+	m_Index.RemoveAll();
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_RouteCache::ResetStats()
+{
+	memset( &m_Stats, 0, sizeof( m_Stats ) );
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_RouteCache::PrintStats()
+{
+	int nUsed = m_Stats.nHits - m_Stats.nRejected;
+	float flHitRate = ( m_Stats.nLookups ) ? 100.0f * nUsed / m_Stats.nLookups : 0.0f;
+
+	Msg( "AI route cache: %d/%d routes\n", m_Entries.Count(), ai_route_cache_size.GetInt() );
+	Msg( "  lookups       %d\n", m_Stats.nLookups );
+	Msg( "  hits          %d (%d used, %.1f%% of lookups)\n", m_Stats.nHits, nUsed, flHitRate );
+	Msg( "  rejected      %d\n", m_Stats.nRejected );
+	Msg( "  expired       %d\n", m_Stats.nExpired );
+	Msg( "  stored        %d\n", m_Stats.nStored );
+	Msg( "  invalidated   %d (%d flushes)\n", m_Stats.nInvalidated, m_Stats.nFlushes );
+}
+
+//-----------------------------------------------------------------------------
+
+CON_COMMAND( ai_route_cache_stats, "Prints shared node route cache counters. Pass \"reset\" to clear them." )
+{
+	if ( !g_pBigAINet )
+		return;
+
+	CAI_RouteCache &routeCache = g_pBigAINet->GetRouteCache();
+	routeCache.PrintStats();
+
+	if ( args.ArgC() > 1 && !V_stricmp( args[1], "reset" ) )
+	{
+		routeCache.ResetStats();
+	}
+}
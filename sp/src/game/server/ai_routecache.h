@@ -0,0 +1,93 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Shared cache of recent node routes, so squads asking for the
+//			same route in the same few frames don't each run a full search
+//
+//=============================================================================//
+
+#ifndef AI_ROUTECACHE_H
+#define AI_ROUTECACHE_H
+
+#if defined( _WIN32 )
+#pragma once
+#endif
+
+#include "ai_hull.h"
+#include "utlvector.h"
+#include "utlmap.h"
+#include "utllinkedlist.h"
+
+//-----------------------------------------------------------------------------
+// CAI_RouteCache
+//
+// Purpose: Least recently used cache of node sequences keyed on start node,
+//			end node, hull and movement capabilities. Routes depend on more
+//			than the key (node locks, per-NPC link rules), so callers must
+//			re-validate a route before using it and Reject() it if it fails.
+//
+//			Entries are dropped when a link they use is blocked. Any link
+//			becoming usable again may open a shorter route for any entry, so
+//			that flushes the whole cache. Stale links recover on their own
+//			without either notification, so each entry also expires when the
+//			first stale link its search saw may have recovered, and after
+//			ai_route_cache_max_age seconds at most.
+//-----------------------------------------------------------------------------
+
+class CAI_RouteCache
+{
+public:
+	CAI_RouteCache();
+
+	// Copies the cached node sequence, start node first
+	bool			Lookup( int startID, int endID, Hull_t hull, int capabilities, CUtlVector<int> *pNodes );
+	void			Store( int startID, int endID, Hull_t hull, int capabilities, const int *pParents, float flExpireTime = FLT_MAX );
+	void			Reject( int startID, int endID, Hull_t hull, int capabilities );
+
+	void			OnLinkBlocked( int srcID, int destID );
+	void			OnLinkOpened( int srcID, int destID );
+	void			Flush();
+
+	void			PrintStats();
+	void			ResetStats();
+
+private:
+	struct Key_t
+	{
+		int			startID;
+		int			endID;
+		int			hull;
+		int			capabilities;
+	};
+
+	struct Entry_t
+	{
+		Key_t					key;
+		float					expireTime;
+		CUtlVector<unsigned short> nodes;
+	};
+
+	static bool		KeyLessFunc( const Key_t &lhs, const Key_t &rhs );
+	static Key_t	MakeKey( int startID, int endID, Hull_t hull, int capabilities );
+
+	void			RemoveEntry( unsigned short iEntry );
+
+	CUtlLinkedList<Entry_t, unsigned short>	m_Entries;		// Most recently used at the head
+	CUtlMap<Key_t, unsigned short>			m_Index;
+
+	struct Stats_t
+	{
+		int nLookups;
+		int nHits;
+		int nRejected;
+		int nExpired;
+		int nStored;
+		int nInvalidated;
+		int nFlushes;
+	};
+
+	Stats_t			m_Stats;
+};
+
+//=============================================================================
+
+#endif // AI_ROUTECACHE_H
@@ -35,9 +35,21 @@ const float AI_EFFICIENT_NPC_SEARCH_TIME = .35;
 const float AI_HIGH_PRIORITY_SEARCH_TIME = 0.15;
 const float AI_MISC_SEARCH_TIME  = 0.45;
 
+// How far an NPC might move in the rest of a tick after the sensing scheduler
+// notes where it is. Bigger moves, like teleports, are reported through
+// NoteNPCMoved() and get the NPCs sorted again.
+const float AI_SENSING_QUERY_SLOP = 128;
+
+ConVar ai_sensing_trace_budget( "ai_sensing_trace_budget", "256", FCVAR_NONE, "Line of sight traces NPC sight may run per tick before looks that can wait are put off to a later think. 0 means no limit." );
+ConVar ai_sensing_max_defer( "ai_sensing_max_defer", "0.5", FCVAR_NONE, "Longest an NPC's look can be put off by the sensing trace budget, in seconds." );
+ConVar ai_sensing_shared_query( "ai_sensing_shared_query", "1", FCVAR_NONE, "Find the NPCs near a looker through a list sorted once per tick instead of checking every NPC." );
+ConVar ai_sensing_sound_query( "ai_sensing_sound_query", "1", FCVAR_NONE, "Find the sounds an NPC might hear through the sound grid instead of checking every active sound." );
+ConVar ai_sensing_stats( "ai_sensing_stats", "0", FCVAR_NONE, "Show the traces and deferred looks of NPC sight each tick." );
+
 //-----------------------------------------------------------------------------
 
 CAI_SensedObjectsManager g_AI_SensedObjectsManager;
+CAI_SensingScheduler g_AI_SensingScheduler( "CAI_SensingScheduler" );
 
 //-----------------------------------------------------------------------------
 
@@ -118,7 +130,25 @@ void CAI_Senses::Listen( void )
 
 	int iSoundMask = GetOuter()->GetSoundInterests();
 	
-	if ( iSoundMask != SOUND_NONE && !(GetOuter()->HasSpawnFlags(SF_NPC_WAIT_TILL_SEEN)) )
+	if ( iSoundMask != SOUND_NONE && !(GetOuter()->HasSpawnFlags(SF_NPC_WAIT_TILL_SEEN)) && ai_sensing_sound_query.GetBool() )
+	{
+		// Only the sounds loud enough to reach the NPC's ears, in active list order
+		static CUtlVector<int> sounds;
+		sounds.RemoveAll();
+		CSoundEnt::GetAudibleSounds( GetOuter()->EarPosition(), GetOuter()->HearingSensitivity(), iSoundMask, &sounds );
+
+		for ( int i = 0; i < sounds.Count(); i++ )
+		{
+			CSound *pCurrentSound = CSoundEnt::SoundPointerForIndex( sounds[i] );
+
+			if ( pCurrentSound && CanHearSound( pCurrentSound ) )
+			{
+				pCurrentSound->m_iNextAudible = m_iAudibleList;
+				m_iAudibleList = sounds[i];
+			}
+		}
+	}
+	else if ( iSoundMask != SOUND_NONE && !(GetOuter()->HasSpawnFlags(SF_NPC_WAIT_TILL_SEEN)) )
 	{
 		int	iSound = CSoundEnt::ActiveList();
 		
@@ -167,7 +197,11 @@ bool CAI_Senses::ShouldSeeEntity( CBaseEntity *pSightEnt )
 
 bool CAI_Senses::CanSeeEntity( CBaseEntity *pSightEnt )
 {
-	return ( GetOuter()->FInViewCone( pSightEnt ) && GetOuter()->FVisible( pSightEnt ) );
+	if ( !GetOuter()->FInViewCone( pSightEnt ) )
+		return false;
+
+	g_AI_SensingScheduler.NoteTraces( 1 );
+	return GetOuter()->FVisible( pSightEnt );
 }
 
 #ifdef PORTAL
@@ -383,6 +417,41 @@ bool CAI_Senses::LookThroughPortal( const CProp_Portal *pPortal, CBaseEntity *pS
 }
 #endif
 
+//-----------------------------------------------------------------------------
+// Look at a batch of entities: the cheap checks first, then the line of sight
+// traces for whatever is left, if the sensing scheduler has the budget for them.
+// Returns false without touching pResult if the look has to wait.
+
+bool CAI_Senses::LookAtCandidates( CBaseEntity **ppCandidates, int nCandidates, float flOverdue, CUtlVector<EHANDLE> *pResult )
+{
+	AISensingCandidates_t toTrace;
+	for ( int i = 0; i < nCandidates; i++ )
+	{
+		CBaseEntity *pSightEnt = ppCandidates[i];
+		if ( !WaitingUntilSeen( pSightEnt ) && ShouldSeeEntity( pSightEnt ) && GetOuter()->FInViewCone( pSightEnt ) )
+		{
+			toTrace.AddToTail( pSightEnt );
+		}
+	}
+
+	if ( !g_AI_SensingScheduler.RequestTraces( GetOuter(), toTrace.Count(), flOverdue ) )
+		return false;
+
+	int nSeen = 0;
+	BeginGather();
+
+	for ( int i = 0; i < toTrace.Count(); i++ )
+	{
+		if ( GetOuter()->FVisible( toTrace[i] ) && SeeEntity( toTrace[i] ) )
+		{
+			nSeen++;
+		}
+	}
+
+	EndGather( nSeen, pResult );
+	return true;
+}
+
 //-----------------------------------------------------------------------------
 
 int CAI_Senses::LookForHighPriorityEntities( int iDistance )
@@ -450,33 +519,25 @@ int CAI_Senses::LookForNPCs( int iDistance )
 	{
 		AI_PROFILE_SENSES(CAI_Senses_LookForNPCs);
 
-		m_TimeLastLookNPCs = gpGlobals->curtime;
-
 		if ( efficiency < AIE_SUPER_EFFICIENT )
 		{
-			int i, nSeen = 0;
+			AISensingCandidates_t candidates;
+			g_AI_SensingScheduler.GetNPCsInRange( GetOuter(), origin, iDistance, &candidates );
 
-			BeginGather();
-
-			CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
-			
-			for ( i = 0; i < g_AI_Manager.NumAIs(); i++ )
+			float flOverdue = gpGlobals->curtime - m_TimeLastLookNPCs - timeNPCs;
+			if ( LookAtCandidates( candidates.Base(), candidates.Count(), flOverdue, &m_SeenNPCs ) )
 			{
-				if ( ppAIs[i] != GetOuter() && ( ppAIs[i]->ShouldNotDistanceCull() || origin.DistToSqr(ppAIs[i]->GetAbsOrigin()) < distSq ) )
-				{
-					if ( Look( ppAIs[i] ) )
-					{
-						nSeen++;
-					}
-				}
+				m_TimeLastLookNPCs = gpGlobals->curtime;
+				return m_SeenNPCs.Count();
 			}
 
-			EndGather( nSeen, &m_SeenNPCs );
-
-			return nSeen;
+			// Over the trace budget, go with what was seen last time
+		}
+		else
+		{
+			m_TimeLastLookNPCs = gpGlobals->curtime;
+			bRemoveStaleFromCache = true;
 		}
-
-		bRemoveStaleFromCache = true;
 		// Fall through
 	}
 
@@ -505,14 +566,12 @@ int CAI_Senses::LookForNPCs( int iDistance )
 int CAI_Senses::LookForObjects( int iDistance )
 {	
 	const int BOX_QUERY_MASK = FL_OBJECT;
-	int	nSeen = 0;
 
 	if ( gpGlobals->curtime - m_TimeLastLookMisc > AI_MISC_SEARCH_TIME )
 	{
 		AI_PROFILE_SENSES(CAI_Senses_LookForObjects);
-		m_TimeLastLookMisc = gpGlobals->curtime;
-		
-		BeginGather();
+
+		AISensingCandidates_t candidates;
 
 		float distSq = ( iDistance * iDistance );
 		const Vector &origin = GetAbsOrigin();
@@ -522,27 +581,31 @@ int CAI_Senses::LookForObjects( int iDistance )
 		{
 			if ( pEnt->GetFlags() & BOX_QUERY_MASK )
 			{
-				if ( origin.DistToSqr(pEnt->GetAbsOrigin()) < distSq && Look( pEnt) )
+				if ( origin.DistToSqr(pEnt->GetAbsOrigin()) < distSq )
 				{
-					nSeen++;
+					candidates.AddToTail( pEnt );
 				}
 			}
 			pEnt = g_AI_SensedObjectsManager.GetNext( &iter );
 		}
-		
-		EndGather( nSeen, &m_SeenMisc );
+
+		float flOverdue = gpGlobals->curtime - m_TimeLastLookMisc - AI_MISC_SEARCH_TIME;
+		if ( LookAtCandidates( candidates.Base(), candidates.Count(), flOverdue, &m_SeenMisc ) )
+		{
+			m_TimeLastLookMisc = gpGlobals->curtime;
+			return m_SeenMisc.Count();
+		}
+
+		// Over the trace budget, go with what was seen last time
 	}
-    else
-    {
-    	for ( int i = m_SeenMisc.Count() - 1; i >= 0; --i )
-    	{
-    		if ( m_SeenMisc[i].Get() == NULL )
-    			m_SeenMisc.FastRemove( i );    			
-    	}
-    	nSeen = m_SeenMisc.Count();
-    }
 
-	return nSeen;
+	for ( int i = m_SeenMisc.Count() - 1; i >= 0; --i )
+	{
+		if ( m_SeenMisc[i].Get() == NULL )
+			m_SeenMisc.FastRemove( i );
+	}
+
+	return m_SeenMisc.Count();
 }
 
 //-----------------------------------------------------------------------------
@@ -750,3 +813,192 @@ void CAI_SensedObjectsManager::AddEntity( CBaseEntity *pEntity )
 }
 
 //=============================================================================
+//
+// CAI_SensingScheduler
+//
+//=============================================================================
+
+CAI_SensingScheduler::CAI_SensingScheduler( char const *name ) : CAutoGameSystemPerFrame( name )
+{
+	m_nCandidatesTick = -1;
+	m_nCandidatesChangeCount = -1;
+	m_nTraces = m_nLooks = m_nDeferred = m_nForced = m_nQueries = 0;
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_SensingScheduler::LevelInitPreEntity()
+{
+	m_Candidates.Purge();
+	m_NeverCulled.Purge();
+	m_nCandidatesTick = -1;
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_SensingScheduler::FrameUpdatePreEntityThink()
+{
+	m_nTraces = m_nLooks = m_nDeferred = m_nForced = m_nQueries = 0;
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_SensingScheduler::FrameUpdatePostEntityThink()
+{
+	if ( ai_sensing_stats.GetBool() )
+	{
+		engine->Con_NPrintf( 0, "AI sensing: %d traces (budget %d) in %d looks, %d NPC queries",
+			m_nTraces, ai_sensing_trace_budget.GetInt(), m_nLooks, m_nQueries );
+		engine->Con_NPrintf( 1, "AI sensing: %d looks deferred, %d run over budget", m_nDeferred, m_nForced );
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+int __cdecl CAI_SensingScheduler::CandidateCompare( const Candidate_t *pLeft, const Candidate_t *pRight )
+{
+	if ( pLeft->x < pRight->x )
+		return -1;
+	return ( pLeft->x > pRight->x ) ? 1 : 0;
+}
+
+static int __cdecl SensingOrderCompare( const int *pLeft, const int *pRight )
+{
+	return *pLeft - *pRight;
+}
+
+//-----------------------------------------------------------------------------
+// Notes where every NPC is at the start of the first query in a tick, sorted
+// along x so a query only has to check a slice of them
+
+void CAI_SensingScheduler::BuildCandidates()
+{
+	m_Candidates.RemoveAll();
+	m_NeverCulled.RemoveAll();
+
+	CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
+	for ( int i = 0; i < g_AI_Manager.NumAIs(); i++ )
+	{
+		if ( ppAIs[i]->ShouldNotDistanceCull() )
+		{
+			m_NeverCulled.AddToTail( i );
+			continue;
+		}
+
+		Candidate_t &candidate = m_Candidates[ m_Candidates.AddToTail() ];
+		candidate.x = ppAIs[i]->GetAbsOrigin().x;
+		candidate.pNPC = ppAIs[i];
+		candidate.iOrder = i;
+	}
+	m_Candidates.Sort( CandidateCompare );
+
+	m_nCandidatesTick = gpGlobals->tickcount;
+	m_nCandidatesChangeCount = g_AI_Manager.GetChangeCount();
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_SensingScheduler::GetNPCsInRange( CAI_BaseNPC *pLooker, const Vector &vecOrigin, float flDist, AISensingCandidates_t *pResult )
+{
+	m_nQueries++;
+
+	float distSq = flDist * flDist;
+	CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
+
+	if ( !ai_sensing_shared_query.GetBool() )
+	{
+		for ( int i = 0; i < g_AI_Manager.NumAIs(); i++ )
+		{
+			if ( ppAIs[i] != pLooker && ( ppAIs[i]->ShouldNotDistanceCull() || vecOrigin.DistToSqr(ppAIs[i]->GetAbsOrigin()) < distSq ) )
+			{
+				pResult->AddToTail( ppAIs[i] );
+			}
+		}
+		return;
+	}
+
+	if ( m_nCandidatesTick != gpGlobals->tickcount || m_nCandidatesChangeCount != g_AI_Manager.GetChangeCount() )
+	{
+		BuildCandidates();
+	}
+
+	// the first candidate that could be in range
+	float flMinX = vecOrigin.x - flDist - AI_SENSING_QUERY_SLOP;
+	float flMaxX = vecOrigin.x + flDist + AI_SENSING_QUERY_SLOP;
+	int lo = 0, hi = m_Candidates.Count();
+	while ( lo < hi )
+	{
+		int mid = ( lo + hi ) / 2;
+		if ( m_Candidates[mid].x < flMinX )
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	CUtlVectorFixedGrowable<int, 64> found;
+	for ( int i = lo; i < m_Candidates.Count() && m_Candidates[i].x <= flMaxX; i++ )
+	{
+		CAI_BaseNPC *pNPC = m_Candidates[i].pNPC;
+		if ( pNPC != pLooker && vecOrigin.DistToSqr( pNPC->GetAbsOrigin() ) < distSq )
+		{
+			found.AddToTail( m_Candidates[i].iOrder );
+		}
+	}
+	for ( int i = 0; i < m_NeverCulled.Count(); i++ )
+	{
+		if ( ppAIs[ m_NeverCulled[i] ] != pLooker )
+		{
+			found.AddToTail( m_NeverCulled[i] );
+		}
+	}
+
+	// looks have always gone through the NPCs in g_AI_Manager's order
+	found.Sort( SensingOrderCompare );
+	for ( int i = 0; i < found.Count(); i++ )
+	{
+		pResult->AddToTail( ppAIs[ found[i] ] );
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_SensingScheduler::NoteNPCMoved( CAI_BaseNPC *pNPC, const Vector &vecFrom )
+{
+	// only moves since the NPCs were sorted this tick matter
+	if ( m_nCandidatesTick != gpGlobals->tickcount )
+		return;
+
+	// half the slop, so an NPC that thinks and is teleported in the same tick
+	// is still covered by the other half
+	if ( fabsf( pNPC->GetAbsOrigin().x - vecFrom.x ) > AI_SENSING_QUERY_SLOP * 0.5f )
+	{
+		m_nCandidatesTick = -1;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+bool CAI_SensingScheduler::RequestTraces( CAI_BaseNPC *pLooker, int nTraces, float flOverdue )
+{
+	int nBudget = ai_sensing_trace_budget.GetInt();
+	if ( nBudget > 0 && nTraces > 0 && m_nTraces + nTraces > nBudget )
+	{
+		// NPCs that are fighting look now regardless, so do looks that have waited long enough
+		if ( pLooker->GetState() != NPC_STATE_COMBAT && !pLooker->GetEnemy() && flOverdue < ai_sensing_max_defer.GetFloat() )
+		{
+			m_nDeferred++;
+			return false;
+		}
+		m_nForced++;
+	}
+
+	m_nTraces += nTraces;
+	m_nLooks++;
+	return true;
+}
+
+//=============================================================================
@@ -13,6 +13,7 @@
 #include "simtimer.h"
 #include "ai_component.h"
 #include "soundent.h"
+#include "igamesystem.h"
 
 #if defined( _WIN32 )
 #pragma once
@@ -20,6 +21,7 @@
 
 class CBaseEntity;
 class CSound;
+class CAI_BaseNPC;
 
 //-------------------------------------
 
@@ -118,6 +120,7 @@ private:
 	int 			LookForHighPriorityEntities( int iDistance );
 	int 			LookForNPCs( int iDistance );
 	int 			LookForObjects( int iDistance );
+	bool			LookAtCandidates( CBaseEntity **ppCandidates, int nCandidates, float flOverdue, CUtlVector<EHANDLE> *pResult );
 	
 	bool			SeeEntity( CBaseEntity *pEntity );
 	
@@ -164,6 +167,68 @@ extern CAI_SensedObjectsManager g_AI_SensedObjectsManager;
 
 //-----------------------------------------------------------------------------
 
+// Most looks have this many candidates or less
+typedef CUtlVectorFixedGrowable<CBaseEntity *, 64> AISensingCandidates_t;
+
+//-----------------------------------------------------------------------------
+// Shares the work of NPC sight across everyone looking in a tick: a spatial
+// query for nearby NPCs that's built once per tick, and a budget of line of
+// sight traces. Looks that would go over the budget are put off to the NPC's
+// next think, unless the NPC is in combat or the look has waited too long.
+//-----------------------------------------------------------------------------
+
+class CAI_SensingScheduler : public CAutoGameSystemPerFrame
+{
+public:
+	CAI_SensingScheduler( char const *name );
+
+	// NPCs other than pLooker within flDist of vecOrigin, plus any that are never
+	// distance culled, in g_AI_Manager's order
+	void			GetNPCsInRange( CAI_BaseNPC *pLooker, const Vector &vecOrigin, float flDist, AISensingCandidates_t *pResult );
+
+	// Asks to run nTraces line of sight traces for pLooker now. flOverdue is how long
+	// past due the look is. Returns false if the look should wait for a later think.
+	bool			RequestTraces( CAI_BaseNPC *pLooker, int nTraces, float flOverdue );
+
+	// Counts traces that are run regardless of the budget
+	void			NoteTraces( int nTraces )	{ m_nTraces += nTraces; }
+
+	// Called after pNPC moves or teleports from vecFrom. A move the query slop
+	// can't cover gets the NPCs sorted again before the next query.
+	void			NoteNPCMoved( CAI_BaseNPC *pNPC, const Vector &vecFrom );
+
+	virtual void	LevelInitPreEntity();
+	virtual void	FrameUpdatePreEntityThink();
+	virtual void	FrameUpdatePostEntityThink();
+
+private:
+	struct Candidate_t
+	{
+		float			x;
+		CAI_BaseNPC *	pNPC;
+		int				iOrder;			// index in g_AI_Manager
+	};
+
+	void			BuildCandidates();
+	static int __cdecl CandidateCompare( const Candidate_t *pLeft, const Candidate_t *pRight );
+
+	CUtlVector<Candidate_t>	m_Candidates;	// sorted by x
+	CUtlVector<int>			m_NeverCulled;	// g_AI_Manager indices
+	int				m_nCandidatesTick;
+	int				m_nCandidatesChangeCount;
+
+	// counters for the current tick
+	int				m_nTraces;
+	int				m_nLooks;
+	int				m_nDeferred;
+	int				m_nForced;
+	int				m_nQueries;
+};
+
+extern CAI_SensingScheduler g_AI_SensingScheduler;
+
+//-----------------------------------------------------------------------------
+
 
 
 #endif // AI_SENSES_H
@@ -549,6 +549,9 @@ void CAI_Expresser::GatherCriteria( AI_CriteriaSet * RESTRICT outputSet, const A
 	}
 #endif
 
+	// the rest is dozens of appends, so sort them in all at once
+	outputSet->BeginBulkAppend();
+
 	// include any global criteria
 	ModifyOrAppendGlobalCriteria( outputSet );
 
@@ -566,6 +569,8 @@ void CAI_Expresser::GatherCriteria( AI_CriteriaSet * RESTRICT outputSet, const A
 #ifdef MAPBASE
 	GetOuter()->ReAppendContextCriteria( *outputSet );
 #endif
+
+	outputSet->EndBulkAppend();
 }
 
 //-----------------------------------------------------------------------------
@@ -645,8 +645,23 @@ CBaseEntity *CBaseEntity::GetFollowedEntity()
 void CBaseEntity::SetClassname( const char *className )
 {
 	m_iClassname = AllocPooledString( className );
+	gEntList.ReportEntityNamesChanged( this );
 }
 
+void CBaseEntity::SetName( string_t newName )
+{
+	m_iName = newName;
+	gEntList.ReportEntityNamesChanged( this );
+}
+
+#ifdef MAPBASE_VSCRIPT
+void CBaseEntity::SetNameAsCStr( const char *newName )
+{
+	m_iName = AllocPooledString(newName);
+	gEntList.ReportEntityNamesChanged( this );
+}
+#endif
+
 void CBaseEntity::SetModelIndex( int index )
 {
 	if ( IsDynamicModelIndex( index ) && !(GetBaseAnimating() && m_bDynamicModelAllowed) )
@@ -3869,6 +3884,8 @@ int CBaseEntity::Restore( IRestore &restore )
 	// loops through the data description list, restoring each data desc block in order
 	int status = RestoreDataDescBlock( restore, GetDataDescMap() );
 
+	gEntList.ReportEntityNamesChanged( this );
+
 	// ---------------------------------------------------------------
 	// HACKHACK: We don't know the space of these vectors until now
 	// if they are worldspace, fix them up.
@@ -9091,6 +9108,10 @@ void CBaseEntity::InputChangeVariable( inputdata_t &inputdata )
 					{
 						Warning( "%s cannot set field of type %i.\n", GetDebugName(), dmap->dataDesc[i].fieldType );
 					}
+					else
+					{
+						gEntList.ReportEntityNamesChanged( this );
+					}
 				}
 			}
 		}
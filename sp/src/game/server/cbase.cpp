@@ -82,6 +82,7 @@ OUTPUTS:
 #include "entityoutput.h"
 #include "mempool.h"
 #include "tier1/strtools.h"
+#include "tier1/generichash.h"
 #include "datacache/imdlcache.h"
 #include "env_debughistory.h"
 #ifdef MAPBASE
@@ -688,8 +689,9 @@ CEventQueue g_EventQueue;
 
 CEventQueue::CEventQueue()
 {
-	m_Events.m_flFireTime = -FLT_MAX;
-	m_Events.m_pNext = NULL;
+	m_iNextSequence = 0;
+	m_pServicing = NULL;
+	m_bServicingRemoved = false;
 
 	Init();
 }
@@ -697,6 +699,8 @@ CEventQueue::CEventQueue()
 CEventQueue::~CEventQueue()
 {
 	Clear();
+	ClearResolvedTargets();
+	ResetOutputStats();
 }
 
 // Robin: Left here for backwards compatability.
@@ -798,26 +802,56 @@ ISaveRestoreBlockHandler *GetEventQueueSaveRestoreBlockHandler()
 void CEventQueue::Init( void )
 {
 	Clear();
+
+	// The names are pooled strings from the last level
+	ClearResolvedTargets();
 }
 
 void CEventQueue::Clear( void )
 {
 	// delete all the events in the queue
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
-	
-	while ( pe != NULL )
+	for ( int i = 0; i < m_Heap.Count(); i++ )
 	{
-		EventQueuePrioritizedEvent_t *next = pe->m_pNext;
-		delete pe;
-		pe = next;
+		if ( m_Heap[i] != m_pServicing )
+		{
+			delete m_Heap[i];
+		}
 	}
 
-	m_Events.m_pNext = NULL;
+	if ( m_pServicing )
+	{
+		m_bServicingRemoved = true;
+	}
+
+	m_Heap.RemoveAll();
+	m_EventsByCaller.RemoveAll();
+	m_EventsByTarget.RemoveAll();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Fills the array with the pending events in the order they will fire
+//-----------------------------------------------------------------------------
+static int __cdecl EventFireOrderCompare( EventQueuePrioritizedEvent_t * const *ppLeft, EventQueuePrioritizedEvent_t * const *ppRight )
+{
+	if ( (*ppLeft)->m_flFireTime != (*ppRight)->m_flFireTime )
+		return ( (*ppLeft)->m_flFireTime < (*ppRight)->m_flFireTime ) ? -1 : 1;
+
+	if ( (*ppLeft)->m_iSequence != (*ppRight)->m_iSequence )
+		return ( (*ppLeft)->m_iSequence < (*ppRight)->m_iSequence ) ? -1 : 1;
+
+	return 0;
+}
+
+void CEventQueue::GetEventsInOrder( CUtlVector<EventQueuePrioritizedEvent_t *> &events )
+{
+	events.CopyArray( m_Heap.Base(), m_Heap.Count() );
+	events.Sort( EventFireOrderCompare );
 }
 
 void CEventQueue::Dump( void )
 {
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
+	CUtlVector<EventQueuePrioritizedEvent_t *> events;
+	GetEventsInOrder( events );
 
 	Msg("Dumping event queue. Current time is: %.2f\n",
 #ifdef TF_DLL
@@ -827,9 +861,9 @@ void CEventQueue::Dump( void )
 #endif
 		);
 
-	while ( pe != NULL )
+	for ( int i = 0; i < events.Count(); i++ )
 	{
-		EventQueuePrioritizedEvent_t *next = pe->m_pNext;
+		EventQueuePrioritizedEvent_t *pe = events[i];
 
 		Msg("   (%.2f) Target: '%s', Input: '%s', Parameter '%s'. Activator: '%s', Caller '%s'.  \n", 
 			pe->m_flFireTime, 
@@ -838,8 +872,6 @@ void CEventQueue::Dump( void )
 			pe->m_VariantValue.String(),
 			pe->m_pActivator ? pe->m_pActivator->GetDebugName() : "None", 
 			pe->m_pCaller ? pe->m_pCaller->GetDebugName() : "None"  );
-
-		pe = next;
 	}
 
 	Msg("Finished dump.\n");
@@ -921,41 +953,162 @@ void CEventQueue::AddEvent( CBaseEntity *target, const char *action, float fireD
 
 
 //-----------------------------------------------------------------------------
-// Purpose: private function, adds an event into the list
-// Input  : *newEvent - the (already built) event to add
+// Purpose: Heap ordering. Events with the same fire time go out in the order
+//			they were added, as they did when the queue was a sorted list.
 //-----------------------------------------------------------------------------
-void CEventQueue::AddEvent( EventQueuePrioritizedEvent_t *newEvent )
+bool CEventQueue::FiresBefore( const EventQueuePrioritizedEvent_t *pLeft, const EventQueuePrioritizedEvent_t *pRight )
+{
+	if ( pLeft->m_flFireTime != pRight->m_flFireTime )
+		return ( pLeft->m_flFireTime < pRight->m_flFireTime );
+
+	return ( pLeft->m_iSequence < pRight->m_iSequence );
+}
+
+void CEventQueue::HeapSet( int i, EventQueuePrioritizedEvent_t *pe )
 {
-	// loop through the actions looking for a place to insert
-	EventQueuePrioritizedEvent_t *pe;
-	for ( pe = &m_Events; pe->m_pNext != NULL; pe = pe->m_pNext )
+	m_Heap[i] = pe;
+	pe->m_iHeapIndex = i;
+}
+
+void CEventQueue::HeapUp( int i )
+{
+	EventQueuePrioritizedEvent_t *pe = m_Heap[i];
+	while ( i > 0 )
 	{
-		if ( pe->m_pNext->m_flFireTime > newEvent->m_flFireTime )
-		{
+		int iParent = ( i - 1 ) / 2;
+		if ( !FiresBefore( pe, m_Heap[iParent] ) )
 			break;
+
+		HeapSet( i, m_Heap[iParent] );
+		i = iParent;
+	}
+	HeapSet( i, pe );
+}
+
+void CEventQueue::HeapDown( int i )
+{
+	EventQueuePrioritizedEvent_t *pe = m_Heap[i];
+	int nCount = m_Heap.Count();
+	for ( ;; )
+	{
+		int iChild = i * 2 + 1;
+		if ( iChild >= nCount )
+			break;
+
+		if ( iChild + 1 < nCount && FiresBefore( m_Heap[iChild + 1], m_Heap[iChild] ) )
+		{
+			iChild++;
 		}
+
+		if ( !FiresBefore( m_Heap[iChild], pe ) )
+			break;
+
+		HeapSet( i, m_Heap[iChild] );
+		i = iChild;
+	}
+	HeapSet( i, pe );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Per-caller and per-target chains, so cancelling only visits the
+//			events it can remove
+//-----------------------------------------------------------------------------
+void CEventQueue::LinkChain( EventChains_t &chains, unsigned int key, EventQueuePrioritizedEvent_t *pe, EventQueuePrioritizedEvent_t *EventQueuePrioritizedEvent_t::*pNext, EventQueuePrioritizedEvent_t *EventQueuePrioritizedEvent_t::*pPrev )
+{
+	pe->*pPrev = NULL;
+	pe->*pNext = NULL;
+
+	if ( key == INVALID_EHANDLE_INDEX )
+		return;
+
+	UtlHashHandle_t h = chains.Find( key );
+	if ( h == chains.InvalidHandle() )
+	{
+		chains.Insert( key, pe );
+		return;
 	}
 
-	Assert( pe );
+	EventQueuePrioritizedEvent_t *pHead = chains[h];
+	pe->*pNext = pHead;
+	pHead->*pPrev = pe;
+	chains[h] = pe;
+}
 
-	// insert
-	newEvent->m_pNext = pe->m_pNext;
-	newEvent->m_pPrev = pe;
-	pe->m_pNext = newEvent;
-	if ( newEvent->m_pNext )
+void CEventQueue::UnlinkChain( EventChains_t &chains, unsigned int key, EventQueuePrioritizedEvent_t *pe, EventQueuePrioritizedEvent_t *EventQueuePrioritizedEvent_t::*pNext, EventQueuePrioritizedEvent_t *EventQueuePrioritizedEvent_t::*pPrev )
+{
+	if ( key == INVALID_EHANDLE_INDEX )
+		return;
+
+	if ( pe->*pNext )
 	{
-		newEvent->m_pNext->m_pPrev = newEvent;
+		(pe->*pNext)->*pPrev = pe->*pPrev;
 	}
+
+	if ( pe->*pPrev )
+	{
+		(pe->*pPrev)->*pNext = pe->*pNext;
+	}
+	else if ( pe->*pNext )
+	{
+		chains[chains.Find( key )] = pe->*pNext;
+	}
+	else
+	{
+		chains.Remove( key );
+	}
+
+	pe->*pPrev = NULL;
+	pe->*pNext = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: private function, adds an event into the queue
+// Input  : *newEvent - the (already built) event to add
+//-----------------------------------------------------------------------------
+void CEventQueue::AddEvent( EventQueuePrioritizedEvent_t *newEvent )
+{
+	newEvent->m_iSequence = m_iNextSequence++;
+
+	HeapSet( m_Heap.AddToTail(), newEvent );
+	HeapUp( newEvent->m_iHeapIndex );
+
+	LinkChain( m_EventsByCaller, newEvent->m_pCaller.ToInt(), newEvent, &EventQueuePrioritizedEvent_t::m_pNextByCaller, &EventQueuePrioritizedEvent_t::m_pPrevByCaller );
+	LinkChain( m_EventsByTarget, newEvent->m_pEntTarget.ToInt(), newEvent, &EventQueuePrioritizedEvent_t::m_pNextByTarget, &EventQueuePrioritizedEvent_t::m_pPrevByTarget );
 }
 
 void CEventQueue::RemoveEvent( EventQueuePrioritizedEvent_t *pe )
 {
-	Assert( pe->m_pPrev );
-	pe->m_pPrev->m_pNext = pe->m_pNext;
-	if ( pe->m_pNext )
+	int i = pe->m_iHeapIndex;
+	Assert( m_Heap[i] == pe );
+
+	EventQueuePrioritizedEvent_t *pLast = m_Heap.Tail();
+	m_Heap.RemoveMultipleFromTail( 1 );
+	if ( pLast != pe )
+	{
+		HeapSet( i, pLast );
+		HeapUp( i );
+		HeapDown( pLast->m_iHeapIndex );
+	}
+
+	UnlinkChain( m_EventsByCaller, pe->m_pCaller.ToInt(), pe, &EventQueuePrioritizedEvent_t::m_pNextByCaller, &EventQueuePrioritizedEvent_t::m_pPrevByCaller );
+	UnlinkChain( m_EventsByTarget, pe->m_pEntTarget.ToInt(), pe, &EventQueuePrioritizedEvent_t::m_pNextByTarget, &EventQueuePrioritizedEvent_t::m_pPrevByTarget );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Takes an event out of the queue and frees it. The event being fired
+//			is freed by ServiceEvents() once it returns.
+//-----------------------------------------------------------------------------
+void CEventQueue::DeleteEvent( EventQueuePrioritizedEvent_t *pe )
+{
+	RemoveEvent( pe );
+
+	if ( pe == m_pServicing )
 	{
-		pe->m_pNext->m_pPrev = pe->m_pPrev;
+		m_bServicingRemoved = true;
+		return;
 	}
+
+	delete pe;
 }
 
 
@@ -969,7 +1122,7 @@ void CEventQueue::ServiceEvents( void )
 		return;
 	}
 
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
+	EventQueuePrioritizedEvent_t *pe = m_Heap.Count() ? m_Heap[0] : NULL;
 
 #ifdef TF_DLL
 	while ( pe != NULL && pe->m_flFireTime <= engine->GetServerTime() )
@@ -979,6 +1132,16 @@ void CEventQueue::ServiceEvents( void )
 	{
 		MDLCACHE_CRITICAL_SECTION();
 
+		// Stays in the queue while it fires, so it can still be seen as pending
+		m_pServicing = pe;
+		m_bServicingRemoved = false;
+
+		OutputStats_t *pStats = GetOutputStats( pe );
+		if ( pStats )
+		{
+			pStats->nFired++;
+		}
+
 		bool targetFound = false;
 
 		// find the targets
@@ -1001,9 +1164,45 @@ void CEventQueue::ServiceEvents( void )
 #endif
 			{
 				CBaseEntity *target = NULL;
-				while ( 1 )
+				bool bSearch = true;
+
+				const ResolvedTargets_t *pResolved = GetResolvedTargets( pe->m_iTarget, pStats );
+				if ( pResolved )
+				{
+					// Copied, since the inputs can fire other events
+					CUtlVectorFixedGrowable<EHANDLE, 16> targets;
+					targets.CopyArray( pResolved->targets.Base(), pResolved->targets.Count() );
+					unsigned int nGeneration = pResolved->nGeneration;
+
+					// An input that adds, renames or removes named entities leaves the rest
+					// of the list stale. The search carries on from the last target instead.
+					for ( int i = 0; i < targets.Count() && gEntList.GetNameGeneration() == nGeneration; i++ )
+					{
+						if ( !targets[i] )
+							continue;
+
+						target = targets[i];
+
+						// pump the action into the target
+						target->AcceptInput( STRING(pe->m_iTargetInput), pe->m_pActivator, pe->m_pCaller, pe->m_VariantValue, pe->m_iOutputID );
+						targetFound = true;
+					}
+
+					bSearch = ( gEntList.GetNameGeneration() != nGeneration );
+				}
+
+				while ( bSearch )
 				{
+					CFastTimer timer;
+					timer.Start();
 					target = gEntList.FindEntityByName( target, pe->m_iTarget, pSearchingEntity, pe->m_pActivator, pe->m_pCaller );
+					timer.End();
+
+					if ( pStats )
+					{
+						pStats->resolveTime += timer.GetDuration();
+					}
+
 					if ( !target )
 						break;
 
@@ -1061,8 +1260,12 @@ void CEventQueue::ServiceEvents( void )
 			ADD_DEBUG_HISTORY( HISTORY_ENTITY_IO, szBuffer );
 		}
 
-		// remove the event from the list (remembering that the queue may have been added to)
-		RemoveEvent( pe );
+		// remove the event from the queue (remembering that the queue may have been added to)
+		if ( !m_bServicingRemoved )
+		{
+			RemoveEvent( pe );
+		}
+		m_pServicing = NULL;
 		delete pe;
 
 		//
@@ -1076,9 +1279,162 @@ void CEventQueue::ServiceEvents( void )
 			}
 		}
 
-		// restart the list (to catch any new items have probably been added to the queue)
-		pe = m_Events.m_pNext;	
+		// restart the queue (to catch any new items have probably been added to the queue)
+		pe = m_Heap.Count() ? m_Heap[0] : NULL;
+	}
+}
+
+ConVar ent_output_cache( "ent_output_cache", "1", FCVAR_NONE, "Cache the entities found for output targets until entities are named, renamed or removed" );
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the entities an event targeting a plain name should fire
+//			at, searching for them again only if the entity names have changed
+//			since they were last found. Returns NULL for names that can't be
+//			cached (procedurals, wildcards), which need a full search.
+//-----------------------------------------------------------------------------
+const CEventQueue::ResolvedTargets_t *CEventQueue::GetResolvedTargets( string_t iszTarget, OutputStats_t *pStats )
+{
+	const char *pszTarget = STRING( iszTarget );
+	if ( !ent_output_cache.GetBool() || !CGlobalEntityList::IsPlainName( pszTarget ) )
+		return NULL;
+
+	unsigned int nHash = HashStringCaseless( pszTarget );
+	ResolvedTargets_t *pResolved;
+
+	UtlHashHandle_t h = m_ResolvedTargets.Find( nHash );
+	if ( h == m_ResolvedTargets.InvalidHandle() )
+	{
+		pResolved = new ResolvedTargets_t;
+		m_ResolvedTargets.Insert( nHash, pResolved );
+	}
+	else
+	{
+		pResolved = m_ResolvedTargets[h];
+
+		// iszTarget isn't always pooled, so compare the names
+		if ( pResolved->nGeneration == gEntList.GetNameGeneration() && pResolved->iszTarget != NULL_STRING &&
+			 ( pResolved->iszTarget == iszTarget || !V_stricmp( STRING( pResolved->iszTarget ), pszTarget ) ) )
+		{
+			return pResolved;
+		}
+	}
+
+	CFastTimer timer;
+	timer.Start();
+
+	pResolved->iszTarget = AllocPooledString( pszTarget );
+	pResolved->nGeneration = gEntList.GetNameGeneration();
+	pResolved->targets.RemoveAll();
+
+	CBaseEntity *pTarget = NULL;
+	while ( ( pTarget = gEntList.FindEntityByName( pTarget, pszTarget ) ) != NULL )
+	{
+		pResolved->targets.AddToTail( pTarget );
 	}
+
+	timer.End();
+
+	if ( pStats )
+	{
+		pStats->nResolves++;
+		pStats->resolveTime += timer.GetDuration();
+	}
+
+	return pResolved;
+}
+
+void CEventQueue::ClearResolvedTargets( void )
+{
+	FOR_EACH_HASHTABLE( m_ResolvedTargets, i )
+	{
+		delete m_ResolvedTargets[i];
+	}
+	m_ResolvedTargets.RemoveAll();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Counters for the output which queued the event, if it came from one
+//-----------------------------------------------------------------------------
+CEventQueue::OutputStats_t *CEventQueue::GetOutputStats( EventQueuePrioritizedEvent_t *pe )
+{
+	if ( !pe->m_iOutputID )
+		return NULL;
+
+	UtlHashHandle_t h = m_OutputStats.Find( pe->m_iOutputID );
+	if ( h != m_OutputStats.InvalidHandle() )
+		return m_OutputStats[h];
+
+	OutputStats_t *pStats = new OutputStats_t;
+	memset( pStats, 0, sizeof( *pStats ) );
+	pStats->resolveTime.Init();
+
+	if ( pe->m_pCaller )
+	{
+		V_snprintf( pStats->szCaller, sizeof( pStats->szCaller ), "%s", pe->m_pCaller->GetDebugName() );
+	}
+	else
+	{
+		V_strncpy( pStats->szCaller, "None", sizeof( pStats->szCaller ) );
+	}
+	V_strncpy( pStats->szTarget, STRING( pe->m_iTarget ), sizeof( pStats->szTarget ) );
+	V_strncpy( pStats->szInput, STRING( pe->m_iTargetInput ), sizeof( pStats->szInput ) );
+
+	m_OutputStats.Insert( pe->m_iOutputID, pStats );
+	return pStats;
+}
+
+void CEventQueue::ResetOutputStats( void )
+{
+	FOR_EACH_HASHTABLE( m_OutputStats, i )
+	{
+		delete m_OutputStats[i];
+	}
+	m_OutputStats.RemoveAll();
+}
+
+int __cdecl CEventQueue::OutputStatsCompare( OutputStats_t * const *ppLeft, OutputStats_t * const *ppRight )
+{
+	double flLeft = (*ppLeft)->resolveTime.GetMillisecondsF();
+	double flRight = (*ppRight)->resolveTime.GetMillisecondsF();
+	if ( flLeft != flRight )
+		return ( flLeft > flRight ) ? -1 : 1;
+
+	return (*ppRight)->nFired - (*ppLeft)->nFired;
+}
+
+void CEventQueue::PrintOutputStats( int nMaxLines )
+{
+	CUtlVector<OutputStats_t *> stats;
+	FOR_EACH_HASHTABLE( m_OutputStats, i )
+	{
+		stats.AddToTail( m_OutputStats[i] );
+	}
+	stats.Sort( OutputStatsCompare );
+
+	Msg( "Output target resolution: %d outputs fired, %d target names cached\n", stats.Count(), m_ResolvedTargets.Count() );
+	Msg( "   fired  resolves  resolve ms  caller -> target.input\n" );
+
+	for ( int i = 0; i < stats.Count() && i < nMaxLines; i++ )
+	{
+		const OutputStats_t *pStats = stats[i];
+		Msg( "  %6d  %8d  %10.3f  %s -> %s.%s\n", pStats->nFired, pStats->nResolves, pStats->resolveTime.GetMillisecondsF(),
+			pStats->szCaller, pStats->szTarget, pStats->szInput );
+	}
+}
+
+CON_COMMAND( ent_output_stats, "Prints how often each output has fired and the time spent finding its targets, most expensive first. Pass a line count, or \"reset\" to clear the counters." )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( args.ArgC() > 1 && !V_stricmp( args[1], "reset" ) )
+	{
+		g_EventQueue.ResetOutputStats();
+		return;
+	}
+
+	int nMaxLines = ( args.ArgC() > 1 ) ? atoi( args[1] ) : 20;
+	g_EventQueue.PrintOutputStats( MAX( nMaxLines, 1 ) );
 }
 
 //-----------------------------------------------------------------------------
@@ -1105,7 +1461,8 @@ void CEventQueue::CancelEvents( CBaseEntity *pCaller )
 	if (!pCaller)
 		return;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	UtlHashHandle_t h = m_EventsByCaller.Find( pCaller->GetRefEHandle().ToInt() );
+	EventQueuePrioritizedEvent_t *pCur = ( h != m_EventsByCaller.InvalidHandle() ) ? m_EventsByCaller[h] : NULL;
 
 	while (pCur != NULL)
 	{
@@ -1122,12 +1479,11 @@ void CEventQueue::CancelEvents( CBaseEntity *pCaller )
 		}
 
 		EventQueuePrioritizedEvent_t *pCurSave = pCur;
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pNextByCaller;
 
 		if (bDelete)
 		{
-			RemoveEvent( pCurSave );
-			delete pCurSave;
+			DeleteEvent( pCurSave );
 		}
 	}
 }
@@ -1143,7 +1499,8 @@ void CEventQueue::CancelEventOn( CBaseEntity *pTarget, const char *sInputName )
 	if (!pTarget)
 		return;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	UtlHashHandle_t h = m_EventsByTarget.Find( pTarget->GetRefEHandle().ToInt() );
+	EventQueuePrioritizedEvent_t *pCur = ( h != m_EventsByTarget.InvalidHandle() ) ? m_EventsByTarget[h] : NULL;
 
 	while (pCur != NULL)
 	{
@@ -1158,12 +1515,11 @@ void CEventQueue::CancelEventOn( CBaseEntity *pTarget, const char *sInputName )
 		}
 
 		EventQueuePrioritizedEvent_t *pCurSave = pCur;
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pNextByTarget;
 
 		if (bDelete)
 		{
-			RemoveEvent( pCurSave );
-			delete pCurSave;
+			DeleteEvent( pCurSave );
 		}
 	}
 }
@@ -1178,7 +1534,8 @@ bool CEventQueue::HasEventPending( CBaseEntity *pTarget, const char *sInputName
 	if (!pTarget)
 		return false;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	UtlHashHandle_t h = m_EventsByTarget.Find( pTarget->GetRefEHandle().ToInt() );
+	EventQueuePrioritizedEvent_t *pCur = ( h != m_EventsByTarget.InvalidHandle() ) ? m_EventsByTarget[h] : NULL;
 
 	while (pCur != NULL)
 	{
@@ -1191,7 +1548,7 @@ bool CEventQueue::HasEventPending( CBaseEntity *pTarget, const char *sInputName
 				return true;
 		}
 
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pNextByTarget;
 	}
 
 	return false;
@@ -1218,28 +1575,26 @@ void CEventQueue::CancelEventsByInput( CBaseEntity *pTarget, const char *szInput
 		return;
 
 	string_t iszDebugName = MAKE_STRING( pTarget->GetDebugName() );
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
 
-	while ( pCur )
+	// Events targeted by name aren't chained to the target, so this has to look at all of them.
+	// Removing reorders the heap, so gather the matches first.
+	CUtlVector<EventQueuePrioritizedEvent_t *> remove;
+	for ( int i = 0; i < m_Heap.Count(); i++ )
 	{
-		bool bRemove = false;
+		EventQueuePrioritizedEvent_t *pCur = m_Heap[i];
 
 		if ( pTarget == pCur->m_pEntTarget || pCur->m_iTarget == iszDebugName )
 		{
 			if ( !V_strncmp( STRING(pCur->m_iTargetInput), szInput, strlen(szInput) ) )
 			{
-				bRemove = true;
+				remove.AddToTail( pCur );
 			}
 		}
+	}
 
-		EventQueuePrioritizedEvent_t *pPrev = pCur;
-		pCur = pCur->m_pNext;
-
-		if ( bRemove )
-		{
-			RemoveEvent(pPrev);
-			delete pPrev;
-		}
+	for ( int i = 0; i < remove.Count(); i++ )
+	{
+		DeleteEvent( remove[i] );
 	}
 }
 
@@ -1247,32 +1602,22 @@ bool CEventQueue::RemoveEvent( int event )
 {
 	EventQueuePrioritizedEvent_t *pe = reinterpret_cast<EventQueuePrioritizedEvent_t*>(event); // INT_TO_POINTER
 
-	for ( EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext; pCur; pCur = pCur->m_pNext )
-	{
-		if ( pCur == pe )
-		{
-			RemoveEvent(pCur);
-			delete pCur;
-			return true;
-		}
-	}
+	// The handle may be stale, only trust it if it's still queued
+	if ( m_Heap.Find( pe ) == m_Heap.InvalidIndex() )
+		return false;
 
-	return false;
+	DeleteEvent( pe );
+	return true;
 }
 
 float CEventQueue::GetTimeLeft( int event )
 {
 	EventQueuePrioritizedEvent_t *pe = reinterpret_cast<EventQueuePrioritizedEvent_t*>(event); // INT_TO_POINTER
 
-	for ( EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext; pCur; pCur = pCur->m_pNext )
-	{
-		if ( pCur == pe )
-		{
-			return (pCur->m_flFireTime - gpGlobals->curtime);
-		}
-	}
+	if ( m_Heap.Find( pe ) == m_Heap.InvalidIndex() )
+		return 0.f;
 
-	return 0.f;
+	return (pe->m_flFireTime - gpGlobals->curtime);
 }
 #endif // MAPBASE_VSCRIPT
 
@@ -1297,29 +1642,28 @@ BEGIN_SIMPLE_DATADESC( EventQueuePrioritizedEvent_t )
 	DEFINE_FIELD( m_iOutputID, FIELD_INTEGER ),
 	DEFINE_CUSTOM_FIELD( m_VariantValue, variantFuncs ),
 
-//	DEFINE_FIELD( m_pNext, FIELD_??? ),
-//	DEFINE_FIELD( m_pPrev, FIELD_??? ),
+	// Queue position is rebuilt when the events are added back on restore
+//	DEFINE_FIELD( m_iSequence, FIELD_INTEGER ),
+//	DEFINE_FIELD( m_iHeapIndex, FIELD_INTEGER ),
 END_DATADESC()
 
 
 int CEventQueue::Save( ISave &save )
 {
-	// count the number of items in the queue
-	EventQueuePrioritizedEvent_t *pe;
+	// save in firing order, so events with the same fire time are restored in order
+	CUtlVector<EventQueuePrioritizedEvent_t *> events;
+	GetEventsInOrder( events );
 
-	m_iListCount = 0;
-	for ( pe = m_Events.m_pNext; pe != NULL; pe = pe->m_pNext )
-	{
-		m_iListCount++;
-	}
+	m_iListCount = events.Count();
 
 	// save that value out to disk, so we know how many to restore
 	if ( !save.WriteFields( "EventQueue", this, NULL, m_DataMap.dataDesc, m_DataMap.dataNumFields ) )
 		return 0;
 	
 	// cycle through all the events, saving them all
-	for ( pe = m_Events.m_pNext; pe != NULL; pe = pe->m_pNext )
+	for ( int i = 0; i < events.Count(); i++ )
 	{
+		EventQueuePrioritizedEvent_t *pe = events[i];
 		if ( !save.WriteFields( "PEvent", pe, NULL, pe->m_DataMap.dataDesc, pe->m_DataMap.dataNumFields ) )
 			return 0;
 	}
@@ -17,6 +17,7 @@
 #include "ai_initutils.h"
 #include "globalstate.h"
 #include "datacache/imdlcache.h"
+#include "tier1/generichash.h"
 
 #ifdef HL2_DLL
 #include "npc_playercompanion.h"
@@ -315,10 +316,356 @@ CBaseEntityClassList::~CBaseEntityClassList()
 static CUtlVector<CustomProcedural_t> g_CustomProcedurals;
 #endif
 
+ConVar ent_name_index( "ent_name_index", "1", FCVAR_NONE, "Use the hashed targetname/classname index for entity searches that don't use wildcards" );
+
+//-----------------------------------------------------------------------------
+// CEntityNameIndex
+//-----------------------------------------------------------------------------
+CEntityNameIndex::CEntityNameIndex()
+{
+	for ( int i = 0; i < NUM_ENT_ENTRIES; i++ )
+	{
+		m_Links[i].iszString = NULL_STRING;
+		m_Links[i].nHash = 0;
+		m_Links[i].iPrev = m_Links[i].iNext = INVALID_INDEX;
+	}
+}
+
+void CEntityNameIndex::Insert( int iEntity, string_t iszString, const unsigned int *pListOrder )
+{
+	Link_t &link = m_Links[iEntity];
+	Assert( link.iszString == NULL_STRING );
+
+	if ( iszString == NULL_STRING || !STRING(iszString)[0] )
+		return;
+
+	link.iszString = iszString;
+	link.nHash = HashStringCaselessConventional( STRING(iszString) );
+
+	UtlHashHandle_t hChain = m_Chains.Find( link.nHash );
+	if ( hChain == m_Chains.InvalidHandle() )
+	{
+		Chain_t chain = { INVALID_INDEX, INVALID_INDEX };
+		hChain = m_Chains.Insert( link.nHash, chain );
+	}
+
+	Chain_t &chain = m_Chains[hChain];
+
+	// New entities go on the end of the global list, so this rarely walks
+	unsigned short iAfter = chain.iTail;
+	while ( iAfter != INVALID_INDEX && pListOrder[iAfter] > pListOrder[iEntity] )
+	{
+		iAfter = m_Links[iAfter].iPrev;
+	}
+
+	link.iPrev = iAfter;
+	if ( iAfter != INVALID_INDEX )
+	{
+		link.iNext = m_Links[iAfter].iNext;
+		m_Links[iAfter].iNext = iEntity;
+	}
+	else
+	{
+		link.iNext = chain.iHead;
+		chain.iHead = iEntity;
+	}
+
+	if ( link.iNext != INVALID_INDEX )
+	{
+		m_Links[link.iNext].iPrev = iEntity;
+	}
+	else
+	{
+		chain.iTail = iEntity;
+	}
+}
+
+void CEntityNameIndex::Remove( int iEntity )
+{
+	Link_t &link = m_Links[iEntity];
+	if ( link.iszString == NULL_STRING )
+		return;
+
+	UtlHashHandle_t hChain = m_Chains.Find( link.nHash );
+	Assert( hChain != m_Chains.InvalidHandle() );
+	Chain_t &chain = m_Chains[hChain];
+
+	if ( link.iPrev != INVALID_INDEX )
+		m_Links[link.iPrev].iNext = link.iNext;
+	else
+		chain.iHead = link.iNext;
+
+	if ( link.iNext != INVALID_INDEX )
+		m_Links[link.iNext].iPrev = link.iPrev;
+	else
+		chain.iTail = link.iPrev;
+
+	if ( chain.iHead == INVALID_INDEX )
+	{
+		m_Chains.Remove( link.nHash );
+	}
+
+	link.iszString = NULL_STRING;
+	link.nHash = 0;
+	link.iPrev = link.iNext = INVALID_INDEX;
+}
+
+void CEntityNameIndex::RemoveAll()
+{
+	for ( int i = 0; i < NUM_ENT_ENTRIES; i++ )
+	{
+		m_Links[i].iszString = NULL_STRING;
+		m_Links[i].nHash = 0;
+		m_Links[i].iPrev = m_Links[i].iNext = INVALID_INDEX;
+	}
+
+	m_Chains.RemoveAll();
+}
+
+int CEntityNameIndex::FindFirst( const char *pszString, int iStartEntity, const unsigned int *pListOrder ) const
+{
+	unsigned int nHash = HashStringCaselessConventional( pszString );
+
+	// Continuing from an entity on this chain is the common case
+	if ( iStartEntity != INVALID_INDEX && m_Links[iStartEntity].iszString != NULL_STRING && m_Links[iStartEntity].nHash == nHash )
+		return m_Links[iStartEntity].iNext;
+
+	UtlHashHandle_t hChain = m_Chains.Find( nHash );
+	if ( hChain == m_Chains.InvalidHandle() )
+		return INVALID_INDEX;
+
+	int iEntity = m_Chains[hChain].iHead;
+	if ( iStartEntity != INVALID_INDEX )
+	{
+		while ( iEntity != INVALID_INDEX && pListOrder[iEntity] <= pListOrder[iStartEntity] )
+		{
+			iEntity = m_Links[iEntity].iNext;
+		}
+	}
+
+	return iEntity;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns true if a name can only match entities with that exact
+//			(case-insensitive) name
+//-----------------------------------------------------------------------------
+bool CGlobalEntityList::IsPlainName( const char *pszName )
+{
+	if ( !pszName || !pszName[0] )
+		return false;
+
+	// Procedurals and regex
+	if ( pszName[0] == '!' || pszName[0] == '@' )
+		return false;
+
+	for ( const char *p = pszName; *p; p++ )
+	{
+		if ( *p == '*' || *p == '?' )
+			return false;
+	}
+
+	return true;
+}
+
+static bool IsIndexableName( const char *pszName )
+{
+	return ent_name_index.GetBool() && CGlobalEntityList::IsPlainName( pszName );
+}
+
+ConVar ent_grid( "ent_grid", "1", FCVAR_NONE, "Use the entity grid for sphere and box entity searches" );
+
+//-----------------------------------------------------------------------------
+// CEntityGrid
+//-----------------------------------------------------------------------------
+CEntityGrid::CEntityGrid()
+{
+	for ( int i = 0; i < NUM_ENT_ENTRIES; i++ )
+	{
+		m_Entries[i].pEntity = NULL;
+		m_Entries[i].x0 = m_Entries[i].y0 = m_Entries[i].x1 = m_Entries[i].y1 = -1;
+		m_Entries[i].bOversized = false;
+		m_Entries[i].bDirty = false;
+		m_Entries[i].nQuery = 0;
+	}
+
+	m_nGeneration = 0;
+	m_nQuery = 0;
+}
+
+int CEntityGrid::CellForCoord( float flCoord )
+{
+	int iCell = (int)floor( ( flCoord - MIN_COORD_INTEGER ) * ( 1.0f / ENTITY_GRID_CELL_SIZE ) );
+	return clamp( iCell, 0, ENTITY_GRID_CELLS - 1 );
+}
+
+void CEntityGrid::Insert( int iEntity, CBaseEntity *pEntity )
+{
+	Assert( !m_Entries[iEntity].pEntity );
+	m_Entries[iEntity].pEntity = pEntity;
+
+	// Bounds aren't known yet, link it the next time the grid is used
+	MarkDirty( iEntity );
+}
+
+void CEntityGrid::Remove( int iEntity )
+{
+	Entry_t &entry = m_Entries[iEntity];
+	if ( !entry.pEntity )
+		return;
+
+	Unlink( iEntity );
+	entry.pEntity = NULL;
+	m_nGeneration++;
+}
+
+void CEntityGrid::MarkDirty( int iEntity )
+{
+	if ( m_Entries[iEntity].bDirty )
+		return;
+
+	AUTO_LOCK( m_DirtyMutex );
+	m_Entries[iEntity].bDirty = true;
+	m_Dirty.AddToTail( iEntity );
+}
+
+void CEntityGrid::Update()
+{
+	if ( !m_Dirty.Count() )
+		return;
+
+	{
+		AUTO_LOCK( m_DirtyMutex );
+		m_Updating.Swap( m_Dirty );
+	}
+
+	for ( int i = 0; i < m_Updating.Count(); i++ )
+	{
+		int iEntity = m_Updating[i];
+		Entry_t &entry = m_Entries[iEntity];
+		entry.bDirty = false;
+
+		if ( !entry.pEntity )
+			continue;
+
+		// Furthest the OBB can reach from the origin at any angle
+		CCollisionProperty *pCollision = entry.pEntity->CollisionProp();
+		const Vector &vecMins = pCollision->OBBMins();
+		const Vector &vecMaxs = pCollision->OBBMaxs();
+		Vector vecReach( MAX( fabs( vecMins.x ), fabs( vecMaxs.x ) ), MAX( fabs( vecMins.y ), fabs( vecMaxs.y ) ), MAX( fabs( vecMins.z ), fabs( vecMaxs.z ) ) );
+		float flReach = vecReach.Length();
+
+		const Vector &vecOrigin = pCollision->GetCollisionOrigin();
+		int x0 = CellForCoord( vecOrigin.x - flReach );
+		int y0 = CellForCoord( vecOrigin.y - flReach );
+		int x1 = CellForCoord( vecOrigin.x + flReach );
+		int y1 = CellForCoord( vecOrigin.y + flReach );
+
+		if ( x0 == entry.x0 && y0 == entry.y0 && x1 == entry.x1 && y1 == entry.y1 )
+			continue;
+
+		Unlink( iEntity );
+		entry.x0 = x0;
+		entry.y0 = y0;
+		entry.x1 = x1;
+		entry.y1 = y1;
+		Link( iEntity );
+
+		m_nGeneration++;
+	}
+
+	m_Updating.RemoveAll();
+}
+
+void CEntityGrid::Link( int iEntity )
+{
+	Entry_t &entry = m_Entries[iEntity];
+	Assert( entry.x0 >= 0 );
+
+	entry.bOversized = ( ( entry.x1 - entry.x0 + 1 ) * ( entry.y1 - entry.y0 + 1 ) > ENTITY_GRID_MAX_CELLS );
+	if ( entry.bOversized )
+	{
+		m_Oversized.AddToTail( iEntity );
+		return;
+	}
+
+	for ( int y = entry.y0; y <= entry.y1; y++ )
+	{
+		for ( int x = entry.x0; x <= entry.x1; x++ )
+		{
+			m_Cells[y * ENTITY_GRID_CELLS + x].AddToTail( iEntity );
+		}
+	}
+}
+
+void CEntityGrid::Unlink( int iEntity )
+{
+	Entry_t &entry = m_Entries[iEntity];
+	if ( entry.x0 < 0 )
+		return;
+
+	if ( entry.bOversized )
+	{
+		m_Oversized.FindAndFastRemove( iEntity );
+	}
+	else
+	{
+		for ( int y = entry.y0; y <= entry.y1; y++ )
+		{
+			for ( int x = entry.x0; x <= entry.x1; x++ )
+			{
+				m_Cells[y * ENTITY_GRID_CELLS + x].FindAndFastRemove( iEntity );
+			}
+		}
+	}
+
+	entry.x0 = entry.y0 = entry.x1 = entry.y1 = -1;
+	entry.bOversized = false;
+}
+
+void CEntityGrid::GatherEntities( const Vector &vecMins, const Vector &vecMaxs, CUtlVector<unsigned short> *pSlots )
+{
+	m_nQuery++;
+
+	for ( int i = 0; i < m_Oversized.Count(); i++ )
+	{
+		m_Entries[m_Oversized[i]].nQuery = m_nQuery;
+		pSlots->AddToTail( m_Oversized[i] );
+	}
+
+	int x0 = CellForCoord( vecMins.x );
+	int y0 = CellForCoord( vecMins.y );
+	int x1 = CellForCoord( vecMaxs.x );
+	int y1 = CellForCoord( vecMaxs.y );
+
+	for ( int y = y0; y <= y1; y++ )
+	{
+		for ( int x = x0; x <= x1; x++ )
+		{
+			const CUtlVector<unsigned short> &cell = m_Cells[y * ENTITY_GRID_CELLS + x];
+			for ( int i = 0; i < cell.Count(); i++ )
+			{
+				Entry_t &entry = m_Entries[cell[i]];
+				if ( entry.nQuery == m_nQuery )
+					continue;
+
+				entry.nQuery = m_nQuery;
+				pSlots->AddToTail( cell[i] );
+			}
+		}
+	}
+}
+
 CGlobalEntityList::CGlobalEntityList()
 {
 	m_iHighestEnt = m_iNumEnts = m_iNumEdicts = 0;
 	m_bClearingEntities = false;
+	m_nNextListOrder = 0;
+	m_nNameGeneration = 0;
+	memset( m_nListOrder, 0, sizeof( m_nListOrder ) );
+	m_vecGridMins.Init();
+	m_vecGridMaxs.Init();
+	m_nGridGeneration = 0;
 }
 
 
@@ -484,6 +831,113 @@ void CGlobalEntityList::ReportEntityFlagsChanged( CBaseEntity *pEntity, unsigned
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Returns the slot an entity is indexed under, or INVALID_INDEX if
+//			it isn't in the list (yet)
+//-----------------------------------------------------------------------------
+int CGlobalEntityList::GetIndexSlot( CBaseEntity *pEntity ) const
+{
+	if ( !pEntity )
+		return CEntityNameIndex::INVALID_INDEX;
+
+	const CBaseHandle &hEnt = pEntity->GetRefEHandle();
+	if ( !hEnt.IsValid() || LookupEntity( hEnt ) != pEntity )
+		return CEntityNameIndex::INVALID_INDEX;
+
+	return hEnt.GetEntryIndex();
+}
+
+void CGlobalEntityList::ReportEntityNamesChanged( CBaseEntity *pEntity )
+{
+	// Entities that aren't in the list yet are indexed by OnAddEntity()
+	int iSlot = GetIndexSlot( pEntity );
+	if ( iSlot == CEntityNameIndex::INVALID_INDEX )
+		return;
+
+	if ( m_NameIndex.GetString( iSlot ) != pEntity->GetEntityName() )
+	{
+		m_NameIndex.Remove( iSlot );
+		m_NameIndex.Insert( iSlot, pEntity->GetEntityName(), m_nListOrder );
+		m_nNameGeneration++;
+	}
+
+	if ( m_ClassnameIndex.GetString( iSlot ) != pEntity->m_iClassname )
+	{
+		m_ClassnameIndex.Remove( iSlot );
+		m_ClassnameIndex.Insert( iSlot, pEntity->m_iClassname, m_nListOrder );
+	}
+}
+
+void CGlobalEntityList::ReportEntityBoundsChanged( CBaseEntity *pEntity )
+{
+	const CBaseHandle &hEnt = pEntity->GetRefEHandle();
+	if ( !hEnt.IsValid() )
+		return;
+
+	m_EntityGrid.MarkDirty( hEnt.GetEntryIndex() );
+}
+
+static int __cdecl GridCandidateCompare( const uint64 *pLeft, const uint64 *pRight )
+{
+	if ( *pLeft < *pRight )
+		return -1;
+	return ( *pLeft > *pRight ) ? 1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the entities which could touch the box, in list order.
+//			Each candidate is its list order in the upper bits and its slot
+//			in the lower 16.
+//-----------------------------------------------------------------------------
+const CUtlVector<uint64> &CGlobalEntityList::GetGridCandidates( const Vector &vecMins, const Vector &vecMaxs )
+{
+	m_EntityGrid.Update();
+
+	// Callers iterating results ask for the same box over and over
+	if ( m_nGridGeneration == m_EntityGrid.GetGeneration() && vecMins == m_vecGridMins && vecMaxs == m_vecGridMaxs && m_GridCandidates.Count() )
+		return m_GridCandidates;
+
+	m_nGridGeneration = m_EntityGrid.GetGeneration();
+	m_vecGridMins = vecMins;
+	m_vecGridMaxs = vecMaxs;
+
+	m_GridSlots.RemoveAll();
+	m_EntityGrid.GatherEntities( vecMins, vecMaxs, &m_GridSlots );
+
+	m_GridCandidates.SetCount( m_GridSlots.Count() );
+	for ( int i = 0; i < m_GridSlots.Count(); i++ )
+	{
+		m_GridCandidates[i] = ( (uint64)m_nListOrder[m_GridSlots[i]] << 16 ) | m_GridSlots[i];
+	}
+	m_GridCandidates.Sort( GridCandidateCompare );
+
+	return m_GridCandidates;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the first candidate that comes after iStartSlot in the list
+//-----------------------------------------------------------------------------
+int CGlobalEntityList::FirstGridCandidate( const CUtlVector<uint64> &candidates, int iStartSlot ) const
+{
+	if ( iStartSlot == CEntityNameIndex::INVALID_INDEX )
+		return 0;
+
+	uint64 nStart = ( (uint64)m_nListOrder[iStartSlot] << 16 ) | 0xFFFF;
+	int nLow = 0;
+	int nHigh = candidates.Count();
+	while ( nLow < nHigh )
+	{
+		int nMid = ( nLow + nHigh ) / 2;
+		if ( candidates[nMid] <= nStart )
+			nLow = nMid + 1;
+		else
+			nHigh = nMid;
+	}
+
+	return nLow;
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Used to confirm a pointer is a pointer to an entity, useful for
 //			asserts.
@@ -514,6 +968,27 @@ CBaseEntity *CGlobalEntityList::FindEntityByClassname( CBaseEntity *pStartEntity
 CBaseEntity *CGlobalEntityList::FindEntityByClassname( CBaseEntity *pStartEntity, const char *szName )
 #endif
 {
+	int iStartSlot = GetIndexSlot( pStartEntity );
+	if ( IsIndexableName( szName ) && ( !pStartEntity || iStartSlot != CEntityNameIndex::INVALID_INDEX ) )
+	{
+		int iSlot = m_ClassnameIndex.FindFirst( szName, iStartSlot, m_nListOrder );
+		for ( ; iSlot != CEntityNameIndex::INVALID_INDEX; iSlot = m_ClassnameIndex.FindNext( iSlot ) )
+		{
+			CBaseEntity *pEntity = (CBaseEntity *)GetEntInfoPtrByIndex( iSlot )->m_pEntity;
+			if ( !pEntity->ClassMatches(szName) )
+				continue;
+
+#ifdef MAPBASE
+			if ( pFilter && !pFilter->ShouldFindEntity(pEntity) )
+				continue;
+#endif
+
+			return pEntity;
+		}
+
+		return NULL;
+	}
+
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
@@ -559,6 +1034,19 @@ CBaseEntity *CGlobalEntityList::FindEntityByClassnameFast( CBaseEntity *pStartEn
 	}
 	*/
 
+	int iStartSlot = GetIndexSlot( pStartEntity );
+	if ( ent_name_index.GetBool() && iszClassname != NULL_STRING && ( !pStartEntity || iStartSlot != CEntityNameIndex::INVALID_INDEX ) )
+	{
+		int iSlot = m_ClassnameIndex.FindFirst( STRING(iszClassname), iStartSlot, m_nListOrder );
+		for ( ; iSlot != CEntityNameIndex::INVALID_INDEX; iSlot = m_ClassnameIndex.FindNext( iSlot ) )
+		{
+			if ( m_ClassnameIndex.GetString( iSlot ) == iszClassname )
+				return (CBaseEntity *)GetEntInfoPtrByIndex( iSlot )->m_pEntity;
+		}
+
+		return NULL;
+	}
+
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
@@ -821,6 +1309,25 @@ CBaseEntity *CGlobalEntityList::FindEntityByName( CBaseEntity *pStartEntity, con
 
 		return NULL;
 	}
+
+	int iStartSlot = GetIndexSlot( pStartEntity );
+	if ( IsIndexableName( szName ) && ( !pStartEntity || iStartSlot != CEntityNameIndex::INVALID_INDEX ) )
+	{
+		int iSlot = m_NameIndex.FindFirst( szName, iStartSlot, m_nListOrder );
+		for ( ; iSlot != CEntityNameIndex::INVALID_INDEX; iSlot = m_NameIndex.FindNext( iSlot ) )
+		{
+			CBaseEntity *ent = (CBaseEntity *)GetEntInfoPtrByIndex( iSlot )->m_pEntity;
+			if ( !ent->NameMatches( szName ) )
+				continue;
+
+			if ( pFilter && !pFilter->ShouldFindEntity(ent) )
+				continue;
+
+			return ent;
+		}
+
+		return NULL;
+	}
 	
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
@@ -854,6 +1361,19 @@ CBaseEntity *CGlobalEntityList::FindEntityByNameFast( CBaseEntity *pStartEntity,
 	if ( iszName == NULL_STRING || STRING(iszName)[0] == 0 )
 		return NULL;
 
+	int iStartSlot = GetIndexSlot( pStartEntity );
+	if ( ent_name_index.GetBool() && ( !pStartEntity || iStartSlot != CEntityNameIndex::INVALID_INDEX ) )
+	{
+		int iSlot = m_NameIndex.FindFirst( STRING(iszName), iStartSlot, m_nListOrder );
+		for ( ; iSlot != CEntityNameIndex::INVALID_INDEX; iSlot = m_NameIndex.FindNext( iSlot ) )
+		{
+			if ( m_NameIndex.GetString( iSlot ) == iszName )
+				return (CBaseEntity *)GetEntInfoPtrByIndex( iSlot )->m_pEntity;
+		}
+
+		return NULL;
+	}
+
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
@@ -944,6 +1464,29 @@ CBaseEntity	*CGlobalEntityList::FindEntityByTarget( CBaseEntity *pStartEntity, c
 //-----------------------------------------------------------------------------
 CBaseEntity *CGlobalEntityList::FindEntityInSphere( CBaseEntity *pStartEntity, const Vector &vecCenter, float flRadius )
 {
+	int iStartSlot = GetIndexSlot( pStartEntity );
+	if ( ent_grid.GetBool() && ( !pStartEntity || iStartSlot != CEntityNameIndex::INVALID_INDEX ) )
+	{
+		Vector vecExtent( flRadius, flRadius, flRadius );
+		const CUtlVector<uint64> &candidates = GetGridCandidates( vecCenter - vecExtent, vecCenter + vecExtent );
+
+		for ( int i = FirstGridCandidate( candidates, iStartSlot ); i < candidates.Count(); i++ )
+		{
+			CBaseEntity *ent = (CBaseEntity *)GetEntInfoPtrByIndex( candidates[i] & 0xFFFF )->m_pEntity;
+			if ( !ent->edict() )
+				continue;
+
+			Vector vecRelativeCenter;
+			ent->CollisionProp()->WorldToCollisionSpace( vecCenter, &vecRelativeCenter );
+			if ( !IsBoxIntersectingSphere( ent->CollisionProp()->OBBMins(),	ent->CollisionProp()->OBBMaxs(), vecRelativeCenter, flRadius ) )
+				continue;
+
+			return ent;
+		}
+
+		return NULL;
+	}
+
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
@@ -1074,6 +1617,29 @@ CBaseEntity *CGlobalEntityList::FindEntityByClassnameNearest( const char *szName
 	{
 		flMaxDist2 = MAX_TRACE_LENGTH * MAX_TRACE_LENGTH;
 	}
+	else if ( ent_grid.GetBool() )
+	{
+		Vector vecExtent( flRadius, flRadius, flRadius );
+		const CUtlVector<uint64> &candidates = GetGridCandidates( vecSrc - vecExtent, vecSrc + vecExtent );
+
+		// Candidates are in list order, so ties go to the same entity as a full search
+		for ( int i = 0; i < candidates.Count(); i++ )
+		{
+			CBaseEntity *pSearch = (CBaseEntity *)GetEntInfoPtrByIndex( candidates[i] & 0xFFFF )->m_pEntity;
+			if ( !pSearch->edict() || !pSearch->ClassMatches( szName ) )
+				continue;
+
+			float flDist2 = (pSearch->GetAbsOrigin() - vecSrc).LengthSqr();
+
+			if (flMaxDist2 > flDist2)
+			{
+				pEntity = pSearch;
+				flMaxDist2 = flDist2;
+			}
+		}
+
+		return pEntity;
+	}
 
 	CBaseEntity *pSearch = NULL;
 	while ((pSearch = gEntList.FindEntityByClassname( pSearch, szName )) != NULL)
@@ -1189,6 +1755,29 @@ CBaseEntity *CGlobalEntityList::FindEntityByClassnameWithin( CBaseEntity *pStart
 		return gEntList.FindEntityByClassname( pEntity, szName );
 	}
 
+	int iStartSlot = GetIndexSlot( pStartEntity );
+	if ( ent_grid.GetBool() && ( !pStartEntity || iStartSlot != CEntityNameIndex::INVALID_INDEX ) )
+	{
+		Vector vecExtent( flRadius, flRadius, flRadius );
+		const CUtlVector<uint64> &candidates = GetGridCandidates( vecSrc - vecExtent, vecSrc + vecExtent );
+
+		for ( int i = FirstGridCandidate( candidates, iStartSlot ); i < candidates.Count(); i++ )
+		{
+			pEntity = (CBaseEntity *)GetEntInfoPtrByIndex( candidates[i] & 0xFFFF )->m_pEntity;
+			if ( !pEntity->edict() || !pEntity->ClassMatches( szName ) )
+				continue;
+
+			float flDist2 = (pEntity->GetAbsOrigin() - vecSrc).LengthSqr();
+
+			if (flMaxDist2 > flDist2)
+			{
+				return pEntity;
+			}
+		}
+
+		return NULL;
+	}
+
 	while ((pEntity = gEntList.FindEntityByClassname( pEntity, szName )) != NULL)
 	{
 		if ( !pEntity->edict() )
@@ -1221,6 +1810,31 @@ CBaseEntity *CGlobalEntityList::FindEntityByClassnameWithin( CBaseEntity *pStart
 	//
 	CBaseEntity *pEntity = pStartEntity;
 
+	int iStartSlot = GetIndexSlot( pStartEntity );
+	if ( ent_grid.GetBool() && ( !pStartEntity || iStartSlot != CEntityNameIndex::INVALID_INDEX ) )
+	{
+		const CUtlVector<uint64> &candidates = GetGridCandidates( vecMins, vecMaxs );
+
+		for ( int i = FirstGridCandidate( candidates, iStartSlot ); i < candidates.Count(); i++ )
+		{
+			pEntity = (CBaseEntity *)GetEntInfoPtrByIndex( candidates[i] & 0xFFFF )->m_pEntity;
+			if ( !pEntity->edict() && !pEntity->IsEFlagSet( EFL_SERVER_ONLY ) )
+				continue;
+
+			if ( !pEntity->ClassMatches( szName ) )
+				continue;
+
+			Vector entMins, entMaxs;
+			pEntity->CollisionProp()->WorldSpaceAABB( &entMins, &entMaxs );
+			if ( IsBoxIntersectingBox( vecMins, vecMaxs, entMins, entMaxs ) )
+			{
+				return pEntity;
+			}
+		}
+
+		return NULL;
+	}
+
 	while ((pEntity = gEntList.FindEntityByClassname( pEntity, szName )) != NULL)
 	{
 		if ( !pEntity->edict() && !pEntity->IsEFlagSet( EFL_SERVER_ONLY ) )
@@ -1444,6 +2058,16 @@ void CGlobalEntityList::OnAddEntity( IHandleEntity *pEnt, CBaseHandle handle )
 	
 	// NOTE: Must be a CBaseEntity on server
 	Assert( pBaseEnt );
+
+	// Entities are always added to the end of the list
+	m_nListOrder[i] = ++m_nNextListOrder;
+	m_NameIndex.Insert( i, pBaseEnt->GetEntityName(), m_nListOrder );
+	if ( pBaseEnt->GetEntityName() != NULL_STRING )
+	{
+		m_nNameGeneration++;
+	}
+	m_ClassnameIndex.Insert( i, pBaseEnt->m_iClassname, m_nListOrder );
+	m_EntityGrid.Insert( i, pBaseEnt );
 	//DevMsg(2,"Created %s\n", pBaseEnt->GetClassname() );
 	for ( i = m_entityListeners.Count()-1; i >= 0; i-- )
 	{
@@ -1474,6 +2098,14 @@ void CGlobalEntityList::OnRemoveEntity( IHandleEntity *pEnt, CBaseHandle handle
 	if ( pBaseEnt->edict() )
 		m_iNumEdicts--;
 
+	if ( m_NameIndex.GetString( handle.GetEntryIndex() ) != NULL_STRING )
+	{
+		m_nNameGeneration++;
+	}
+	m_NameIndex.Remove( handle.GetEntryIndex() );
+	m_ClassnameIndex.Remove( handle.GetEntryIndex() );
+	m_EntityGrid.Remove( handle.GetEntryIndex() );
+
 	m_iNumEnts--;
 }
 
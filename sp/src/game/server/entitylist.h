@@ -14,6 +14,7 @@
 #endif
 
 #include "baseentity.h"
+#include "utlhashtable.h"
 
 class IEntityListener;
 
@@ -96,6 +97,108 @@ struct CustomProcedural_t
 };
 #endif
 
+//-----------------------------------------------------------------------------
+// Purpose: Chains entities on a case-insensitive hash of one of their strings
+//			(targetname or classname), so exact lookups only visit entities
+//			which could match. Each chain is kept in global entity list order,
+//			so walking a chain finds matches in the same order as walking the
+//			whole list. Hashes can collide, so callers still test each entity.
+//-----------------------------------------------------------------------------
+class CEntityNameIndex
+{
+public:
+	enum
+	{
+		INVALID_INDEX = 0xFFFF
+	};
+
+	CEntityNameIndex();
+
+	// pListOrder maps entity slots to their position in the global list
+	void		Insert( int iEntity, string_t iszString, const unsigned int *pListOrder );
+	void		Remove( int iEntity );
+	void		RemoveAll();
+
+	string_t	GetString( int iEntity ) const	{ return m_Links[iEntity].iszString; }
+
+	// Returns the first slot which may match pszString and comes after iStartEntity
+	// (INVALID_INDEX to start at the head of the list)
+	int			FindFirst( const char *pszString, int iStartEntity, const unsigned int *pListOrder ) const;
+	int			FindNext( int iEntity ) const	{ return m_Links[iEntity].iNext; }
+
+private:
+	struct Link_t
+	{
+		string_t		iszString;
+		unsigned int	nHash;
+		unsigned short	iPrev;
+		unsigned short	iNext;
+	};
+
+	struct Chain_t
+	{
+		unsigned short	iHead;
+		unsigned short	iTail;
+	};
+
+	Link_t											m_Links[NUM_ENT_ENTRIES];
+	CUtlHashtable<unsigned int, Chain_t>			m_Chains;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Coarse 2D grid over the world which buckets entities by a box
+//			around their origin big enough to hold their collision OBB at
+//			any angle, so turning never moves them between cells. Used to
+//			find the entities which could touch a sphere or box without
+//			walking the whole list. Entities marked dirty are moved to their
+//			new cells the next time the grid is updated.
+//-----------------------------------------------------------------------------
+#define ENTITY_GRID_CELL_SIZE	512
+#define ENTITY_GRID_CELLS		( COORD_EXTENT / ENTITY_GRID_CELL_SIZE )
+#define ENTITY_GRID_MAX_CELLS	64		// Entities covering more cells than this are always returned
+
+class CEntityGrid
+{
+public:
+	CEntityGrid();
+
+	void		Insert( int iEntity, CBaseEntity *pEntity );
+	void		Remove( int iEntity );
+	void		MarkDirty( int iEntity );
+
+	// Moves dirty entities to their current cells
+	void		Update();
+
+	// Adds each slot whose cells overlap the box once
+	void		GatherEntities( const Vector &vecMins, const Vector &vecMaxs, CUtlVector<unsigned short> *pSlots );
+
+	// Changes whenever an entity is added, removed or moved to other cells
+	unsigned int GetGeneration() const	{ return m_nGeneration; }
+
+private:
+	struct Entry_t
+	{
+		CBaseEntity		*pEntity;
+		short			x0, y0, x1, y1;		// x0 is -1 when not linked
+		bool			bOversized;
+		bool			bDirty;
+		unsigned int	nQuery;
+	};
+
+	void		Link( int iEntity );
+	void		Unlink( int iEntity );
+	static int	CellForCoord( float flCoord );
+
+	Entry_t							m_Entries[NUM_ENT_ENTRIES];
+	CUtlVector<unsigned short>		m_Cells[ENTITY_GRID_CELLS * ENTITY_GRID_CELLS];
+	CUtlVector<unsigned short>		m_Oversized;
+	CUtlVector<unsigned short>		m_Dirty;
+	CUtlVector<unsigned short>		m_Updating;
+	CThreadFastMutex				m_DirtyMutex;
+	unsigned int					m_nGeneration;
+	unsigned int					m_nQuery;
+};
+
 //-----------------------------------------------------------------------------
 // Purpose: a global list of all the entities in the game.  All iteration through
 //			entities is done through this object.
@@ -111,6 +214,27 @@ private:
 	bool m_bClearingEntities;
 	CUtlVector<IEntityListener *>	m_entityListeners;
 
+	// Name and classname lookups that don't use wildcards go through these
+	unsigned int		m_nListOrder[NUM_ENT_ENTRIES];
+	unsigned int		m_nNextListOrder;
+	CEntityNameIndex	m_NameIndex;
+	CEntityNameIndex	m_ClassnameIndex;
+	unsigned int		m_nNameGeneration;
+
+	int GetIndexSlot( CBaseEntity *pEntity ) const;
+
+	// Sphere and box searches go through this. The candidates of the last
+	// search are kept, sorted by list order, for callers iterating its results.
+	CEntityGrid			m_EntityGrid;
+	CUtlVector<unsigned short>	m_GridSlots;
+	CUtlVector<uint64>	m_GridCandidates;
+	Vector				m_vecGridMins;
+	Vector				m_vecGridMaxs;
+	unsigned int		m_nGridGeneration;
+
+	const CUtlVector<uint64> &GetGridCandidates( const Vector &vecMins, const Vector &vecMaxs );
+	int FirstGridCandidate( const CUtlVector<uint64> &candidates, int iStartSlot ) const;
+
 public:
 	IServerNetworkable* GetServerNetworkable( CBaseHandle hEnt ) const;
 	CBaseNetworkable* GetBaseNetworkable( CBaseHandle hEnt ) const;
@@ -138,6 +262,20 @@ public:
 
 	void ReportEntityFlagsChanged( CBaseEntity *pEntity, unsigned int flagsOld, unsigned int flagsNow );
 
+	// Must be called whenever an entity's targetname or classname is changed
+	void ReportEntityNamesChanged( CBaseEntity *pEntity );
+
+	// Changes whenever a named entity is added, renamed or removed. Results of
+	// a name search stay valid for as long as this doesn't change.
+	unsigned int GetNameGeneration() const { return m_nNameGeneration; }
+
+	// True if FindEntityByName() results for the name only depend on which
+	// entities have that name (no wildcards or procedural names)
+	static bool IsPlainName( const char *pszName );
+
+	// Called when an entity's origin or collision bounds change
+	void ReportEntityBoundsChanged( CBaseEntity *pEntity );
+
 	// entity is about to be removed, notify the listeners
 	void NotifyCreateEntity( CBaseEntity *pEnt );
 	void NotifySpawn( CBaseEntity *pEnt );
@@ -15,6 +15,8 @@
 #endif
 
 #include "mempool.h"
+#include "utlhashtable.h"
+#include "tier0/fasttimer.h"
 
 struct EventQueuePrioritizedEvent_t
 {
@@ -28,8 +30,14 @@ struct EventQueuePrioritizedEvent_t
 
 	variant_t m_VariantValue;	// variable-type parameter
 
-	EventQueuePrioritizedEvent_t *m_pNext;
-	EventQueuePrioritizedEvent_t *m_pPrev;
+	unsigned int m_iSequence;	// keeps events with the same fire time in the order they were added
+	int m_iHeapIndex;
+
+	// Events sharing a caller, and events sharing a target entity
+	EventQueuePrioritizedEvent_t *m_pNextByCaller;
+	EventQueuePrioritizedEvent_t *m_pPrevByCaller;
+	EventQueuePrioritizedEvent_t *m_pNextByTarget;
+	EventQueuePrioritizedEvent_t *m_pPrevByTarget;
 
 	DECLARE_SIMPLE_DATADESC();
 
@@ -71,6 +79,10 @@ public:
 
 	void Dump( void );
 
+	// output target resolution counters, for ent_output_stats
+	void PrintOutputStats( int nMaxLines );
+	void ResetOutputStats( void );
+
 #ifdef MAPBASE_VSCRIPT
 	void CancelEventsByInput( CBaseEntity *pTarget, const char *szInput );
 	bool RemoveEvent( int event );
@@ -79,11 +91,60 @@ public:
 
 private:
 
+	typedef CUtlHashtable<unsigned int, EventQueuePrioritizedEvent_t *> EventChains_t;
+
 	void AddEvent( EventQueuePrioritizedEvent_t *event );
 	void RemoveEvent( EventQueuePrioritizedEvent_t *pe );
+	void DeleteEvent( EventQueuePrioritizedEvent_t *pe );
+
+	// binary heap on fire time, then sequence
+	static bool FiresBefore( const EventQueuePrioritizedEvent_t *pLeft, const EventQueuePrioritizedEvent_t *pRight );
+	void HeapSet( int i, EventQueuePrioritizedEvent_t *pe );
+	void HeapUp( int i );
+	void HeapDown( int i );
+	void GetEventsInOrder( CUtlVector<EventQueuePrioritizedEvent_t *> &events );
+
+	static void LinkChain( EventChains_t &chains, unsigned int key, EventQueuePrioritizedEvent_t *pe, EventQueuePrioritizedEvent_t *EventQueuePrioritizedEvent_t::*pNext, EventQueuePrioritizedEvent_t *EventQueuePrioritizedEvent_t::*pPrev );
+	static void UnlinkChain( EventChains_t &chains, unsigned int key, EventQueuePrioritizedEvent_t *pe, EventQueuePrioritizedEvent_t *EventQueuePrioritizedEvent_t::*pNext, EventQueuePrioritizedEvent_t *EventQueuePrioritizedEvent_t::*pPrev );
+
+	// Entities found for a plain target name, valid while the entity list's
+	// name generation hasn't changed
+	struct ResolvedTargets_t
+	{
+		string_t			iszTarget;
+		unsigned int		nGeneration;
+		CUtlVector<EHANDLE>	targets;
+	};
+
+	struct OutputStats_t
+	{
+		char				szCaller[64];
+		char				szTarget[64];
+		char				szInput[64];
+		int					nFired;
+		int					nResolves;
+		CCycleCount			resolveTime;
+	};
+
+	const ResolvedTargets_t *GetResolvedTargets( string_t iszTarget, OutputStats_t *pStats );
+	OutputStats_t *GetOutputStats( EventQueuePrioritizedEvent_t *pe );
+	static int __cdecl OutputStatsCompare( OutputStats_t * const *ppLeft, OutputStats_t * const *ppRight );
+	void ClearResolvedTargets( void );
 
 	DECLARE_SIMPLE_DATADESC();
-	EventQueuePrioritizedEvent_t m_Events;
+	CUtlVector<EventQueuePrioritizedEvent_t *> m_Heap;
+	EventChains_t m_EventsByCaller;		// keyed on the caller's handle
+	EventChains_t m_EventsByTarget;		// keyed on m_pEntTarget's handle
+	unsigned int m_iNextSequence;
+
+	// The event being fired by ServiceEvents(); if it gets cancelled while
+	// firing it's only taken out of the queue and deleted afterwards
+	EventQueuePrioritizedEvent_t *m_pServicing;
+	bool m_bServicingRemoved;
+
+	CUtlHashtable<unsigned int, ResolvedTargets_t *> m_ResolvedTargets;	// keyed on the caseless hash of the name
+	CUtlHashtable<int, OutputStats_t *> m_OutputStats;						// keyed on the output ID
+
 	int m_iListCount;
 };
 
@@ -5518,6 +5518,8 @@ bool CLogicFieldAccessor::SetKeyValue(CBaseEntity *pTarget, const char *szKeyNam
 					}
 					else if (fieldtype != FIELD_VOID)
 					{
+						gEntList.ReportEntityNamesChanged( pTarget );
+
 						variant_t var;
 						var.Set(fieldtype, data);
 						m_OutValue.Set(var, pTarget, this);
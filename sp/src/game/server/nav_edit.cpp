@@ -3939,6 +3939,7 @@ void CNavMesh::OnEditDestroyNotify( CNavArea *deadArea )
 
 	m_avoidanceObstacleAreas.FindAndRemove( deadArea );
 	m_blockedAreas.FindAndRemove( deadArea );
+	CancelPathRequests( deadArea );
 
 	FOR_EACH_VEC( TheNavAreas, it )
 	{
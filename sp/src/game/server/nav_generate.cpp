@@ -17,6 +17,7 @@
 #include "viewport_panel_names.h"
 //#include "terror/TerrorShared.h"
 #include "fmtstr.h"
+#include "vstdlib/jobthread.h"
 
 #ifdef TERROR
 #include "func_simpleladder.h"
@@ -42,6 +43,8 @@ ConVar nav_generate_fixup_jump_areas( "nav_generate_fixup_jump_areas", "1", FCVA
 ConVar nav_generate_incremental_range( "nav_generate_incremental_range", "2000", FCVAR_CHEAT );
 ConVar nav_generate_incremental_tolerance( "nav_generate_incremental_tolerance", "0", FCVAR_CHEAT, "Z tolerance for adding new nav areas." );
 ConVar nav_area_max_size( "nav_area_max_size", "50", FCVAR_CHEAT, "Max area size created in nav generation" );
+ConVar nav_generate_prefetch( "nav_generate_prefetch", "1024", FCVAR_CHEAT, "Max number of sampling steps traced ahead on the job threads during nav generation (0 = trace each step as it is taken)" );
+ConVar nav_generate_checkpoint_interval( "nav_generate_checkpoint_interval", "60", FCVAR_CHEAT, "Seconds between checkpoints while sampling for nav_generate, so it can be continued with nav_generate_resume (0 = never)" );
 
 // Common bounding box for traces
 Vector NavTraceMins( -0.45, -0.45, 0 );
@@ -3460,9 +3463,263 @@ void CNavMesh::BeginGeneration( bool incremental )
 
 	// initialize seed list index
 	m_seedIdx = 0;
+	m_sampleSteps.RemoveAll();
 
 	Msg( "Generating Navigation Mesh...\n" );
 	m_generationStartTime = Plat_FloatTime();
+	m_generationCheckpointTime = m_generationStartTime;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Start a full generation, picking up the sampling where the last checkpoint left it, if there is one
+ */
+void CNavMesh::ResumeGeneration( void )
+{
+	BeginGeneration();
+
+	if ( m_generationMode != GENERATE_FULL || m_generationState != SAMPLE_WALKABLE_SPACE )
+		return;
+
+	if ( LoadGenerationCheckpoint() )
+	{
+		Msg( "Resuming from checkpoint with %u nodes sampled.\n", CNavNode::GetListLength() );
+	}
+	else
+	{
+		Msg( "No usable nav generation checkpoint '%s', starting over.\n", GetGenerationCheckpointFilename() );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return the filename for this map's nav generation checkpoint
+ */
+const char *CNavMesh::GetGenerationCheckpointFilename( void ) const
+{
+	// persistant return value
+	static char filename[256];
+	Q_snprintf( filename, sizeof( filename ), "maps" CORRECT_PATH_SEPARATOR_S "%s.nav.checkpoint", STRING( gpGlobals->mapname ) );
+
+	return filename;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+#define NAV_CHECKPOINT_MAGIC_NUMBER 0xFEEDC0DE
+#define NAV_CHECKPOINT_VERSION 1
+
+struct NavCheckpointNodeLinks_t
+{
+	unsigned int parent;
+	unsigned int to[ NUM_DIRECTIONS ];
+};
+
+static unsigned int GetCheckpointBspSize( void )
+{
+	char bspFilename[256];
+	Q_snprintf( bspFilename, sizeof( bspFilename ), "maps" CORRECT_PATH_SEPARATOR_S "%s.bsp", STRING( gpGlobals->mapname ) );
+	return filesystem->Size( bspFilename, "GAME" );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Store the sampled nodes and where sampling is up to. Everything sampling depends on that isn't stored
+ * here (ladders, the world) is rebuilt the same way by BeginGeneration().
+ */
+void CNavMesh::SaveGenerationCheckpoint( void ) const
+{
+	// nodes are listed newest first, store them in the order they were made so IDs come back the same
+	CUtlVector< CNavNode * > nodes;
+	nodes.EnsureCapacity( CNavNode::GetListLength() );
+	for( CNavNode *node = CNavNode::GetFirst(); node; node = node->GetNext() )
+	{
+		nodes.AddToHead( node );
+	}
+
+	CUtlBuffer fileBuffer( 4096, 1024*1024 );
+	fileBuffer.PutUnsignedInt( NAV_CHECKPOINT_MAGIC_NUMBER );
+	fileBuffer.PutUnsignedInt( NAV_CHECKPOINT_VERSION );
+	fileBuffer.PutUnsignedInt( GetCheckpointBspSize() );
+	fileBuffer.PutInt( GenerationStepSize );
+
+	fileBuffer.PutInt( m_walkableSeeds.Count() );
+	FOR_EACH_VEC( m_walkableSeeds, it )
+	{
+		fileBuffer.Put( &m_walkableSeeds[ it ].pos, sizeof( Vector ) );
+		fileBuffer.Put( &m_walkableSeeds[ it ].normal, sizeof( Vector ) );
+	}
+	fileBuffer.PutInt( m_seedIdx );
+
+	fileBuffer.PutInt( nodes.Count() );
+	FOR_EACH_VEC( nodes, it )
+	{
+		const CNavNode *node = nodes[ it ];
+		fileBuffer.PutUnsignedInt( node->m_id );
+		fileBuffer.Put( &node->m_pos, sizeof( Vector ) );
+		fileBuffer.Put( &node->m_normal, sizeof( Vector ) );
+		fileBuffer.PutUnsignedInt( node->m_parent ? node->m_parent->m_id : 0 );
+		fileBuffer.PutUnsignedChar( node->m_visited );
+		fileBuffer.PutUnsignedChar( node->m_isOnDisplacement );
+		fileBuffer.PutInt( node->m_attributeFlags );
+
+		for( int d=0; d<NUM_DIRECTIONS; ++d )
+		{
+			fileBuffer.PutUnsignedInt( node->m_to[ d ] ? node->m_to[ d ]->m_id : 0 );
+			fileBuffer.PutFloat( node->m_obstacleHeight[ d ] );
+			fileBuffer.PutFloat( node->m_obstacleStartDist[ d ] );
+			fileBuffer.PutFloat( node->m_obstacleEndDist[ d ] );
+		}
+
+		for( int c=0; c<NUM_CORNERS; ++c )
+		{
+			fileBuffer.PutUnsignedChar( node->m_isBlocked[ c ] );
+			fileBuffer.PutUnsignedChar( node->m_crouch[ c ] );
+			fileBuffer.PutFloat( node->m_groundHeightAboveNode[ c ] );
+		}
+	}
+
+	fileBuffer.PutUnsignedInt( m_currentNode ? m_currentNode->m_id : 0 );
+
+	const char *filename = GetGenerationCheckpointFilename();
+	if ( !filesystem->WriteFile( filename, "MOD", fileBuffer ) )
+	{
+		Warning( "Unable to save %d bytes to %s\n", fileBuffer.Size(), filename );
+		return;
+	}
+
+	DevMsg( "Nav generation checkpoint '%s' saved with %d nodes.\n", filename, nodes.Count() );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Restore the sampled nodes from a checkpoint. Must be called right after BeginGeneration(), before any sampling.
+ */
+bool CNavMesh::LoadGenerationCheckpoint( void )
+{
+	Assert( CNavNode::GetListLength() == 0 );
+
+	CUtlBuffer fileBuffer( 4096, 1024*1024, CUtlBuffer::READ_ONLY );
+	if ( !filesystem->ReadFile( GetGenerationCheckpointFilename(), "MOD", fileBuffer ) )
+		return false;
+
+	if ( fileBuffer.GetUnsignedInt() != NAV_CHECKPOINT_MAGIC_NUMBER || fileBuffer.GetUnsignedInt() != NAV_CHECKPOINT_VERSION )
+		return false;
+
+	if ( fileBuffer.GetUnsignedInt() != GetCheckpointBspSize() )
+	{
+		Warning( "Nav generation checkpoint is older than the map.\n" );
+		return false;
+	}
+
+	if ( fileBuffer.GetInt() != GenerationStepSize )
+		return false;
+
+	CUtlVector< WalkableSeedSpot > seeds;
+	seeds.SetCount( fileBuffer.GetInt() );
+	FOR_EACH_VEC( seeds, it )
+	{
+		fileBuffer.Get( &seeds[ it ].pos, sizeof( Vector ) );
+		fileBuffer.Get( &seeds[ it ].normal, sizeof( Vector ) );
+	}
+	int seedIdx = fileBuffer.GetInt();
+
+	// first pass makes the nodes, in ID order, so the position hash chains and the node list are rebuilt as they were
+	CUtlVector< CNavNode * > nodes;
+	CUtlVector< NavCheckpointNodeLinks_t > links;
+	int nodeCount = fileBuffer.GetInt();
+	if ( !fileBuffer.IsValid() || nodeCount < 0 )
+		return false;
+
+	nodes.EnsureCapacity( nodeCount );
+	links.SetCount( nodeCount );
+	for( int i=0; i<nodeCount && fileBuffer.IsValid(); ++i )
+	{
+		unsigned int id = fileBuffer.GetUnsignedInt();
+		Vector pos, normal;
+		fileBuffer.Get( &pos, sizeof( Vector ) );
+		fileBuffer.Get( &normal, sizeof( Vector ) );
+		links[ i ].parent = fileBuffer.GetUnsignedInt();
+		unsigned char visited = fileBuffer.GetUnsignedChar();
+		bool isOnDisplacement = fileBuffer.GetUnsignedChar() != 0;
+
+		CNavNode *node = new CNavNode( pos, normal, NULL, isOnDisplacement );
+		Assert( node->m_id == id );
+		nodes.AddToTail( node );
+
+		node->m_visited = visited;
+		node->m_attributeFlags = fileBuffer.GetInt();
+
+		for( int d=0; d<NUM_DIRECTIONS; ++d )
+		{
+			links[ i ].to[ d ] = fileBuffer.GetUnsignedInt();
+			node->m_obstacleHeight[ d ] = fileBuffer.GetFloat();
+			node->m_obstacleStartDist[ d ] = fileBuffer.GetFloat();
+			node->m_obstacleEndDist[ d ] = fileBuffer.GetFloat();
+		}
+
+		for( int c=0; c<NUM_CORNERS; ++c )
+		{
+			node->m_isBlocked[ c ] = fileBuffer.GetUnsignedChar() != 0;
+			node->m_crouch[ c ] = fileBuffer.GetUnsignedChar() != 0;
+			node->m_groundHeightAboveNode[ c ] = fileBuffer.GetFloat();
+		}
+
+		if ( node->m_id != id )
+			break;
+	}
+
+	unsigned int currentID = fileBuffer.GetUnsignedInt();
+
+	// IDs start at 1, and are stored in order
+	bool isValid = fileBuffer.IsValid() && nodes.Count() == nodeCount && currentID <= (unsigned int)nodeCount;
+	for( int i=0; isValid && i<nodeCount; ++i )
+	{
+		isValid = ( nodes[ i ]->m_id == (unsigned int)( i + 1 ) && links[ i ].parent <= (unsigned int)nodeCount );
+		for( int d=0; isValid && d<NUM_DIRECTIONS; ++d )
+		{
+			isValid = ( links[ i ].to[ d ] <= (unsigned int)nodeCount );
+		}
+	}
+
+	if ( !isValid )
+	{
+		Warning( "Nav generation checkpoint '%s' is damaged.\n", GetGenerationCheckpointFilename() );
+		CNavNode::CleanupGeneration();
+		return false;
+	}
+
+	// second pass links the nodes up
+	for( int i=0; i<nodeCount; ++i )
+	{
+		CNavNode *node = nodes[ i ];
+		node->m_parent = ( links[ i ].parent ) ? nodes[ links[ i ].parent - 1 ] : NULL;
+		for( int d=0; d<NUM_DIRECTIONS; ++d )
+		{
+			node->m_to[ d ] = ( links[ i ].to[ d ] ) ? nodes[ links[ i ].to[ d ] - 1 ] : NULL;
+		}
+	}
+
+	m_walkableSeeds.Swap( seeds );
+	m_seedIdx = seedIdx;
+	m_currentNode = ( currentID ) ? nodes[ currentID - 1 ] : NULL;
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavMesh::RemoveGenerationCheckpoint( void ) const
+{
+	const char *filename = GetGenerationCheckpointFilename();
+	if ( filesystem->FileExists( filename, "MOD" ) )
+	{
+		filesystem->RemoveFile( filename, "MOD" );
+	}
 }
 
 
@@ -3635,12 +3892,26 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 			{
 				if ( Plat_FloatTime() - startTime > maxTime )
 				{
+					// store progress every so often, in case generation is interrupted
+					float checkpointInterval = nav_generate_checkpoint_interval.GetFloat();
+					if ( m_generationMode == GENERATE_FULL && checkpointInterval > 0.0f && Plat_FloatTime() - m_generationCheckpointTime > checkpointInterval )
+					{
+						SaveGenerationCheckpoint();
+						m_generationCheckpointTime = Plat_FloatTime();
+					}
+
 					return true;
 				}
 			}
 
 			// sampling is complete, now build nav areas
 			m_generationState = CREATE_AREAS_FROM_SAMPLES;
+			m_sampleSteps.RemoveAll();
+
+			if ( m_generationMode == GENERATE_FULL )
+			{
+				RemoveGenerationCheckpoint();
+			}
 
 			return true;
 		}
@@ -4331,6 +4602,349 @@ static bool IsNodeOverlapped( const Vector& pos, const Vector& offset )
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return the grid position one step from 'from' in the given direction
+ */
+Vector CNavMesh::GetSampleStepGoal( const Vector &from, NavDirType dir ) const
+{
+	// start at current node position
+	Vector pos = from;
+
+	// snap to grid
+	int cx = SnapToGrid( pos.x );
+	int cy = SnapToGrid( pos.y );
+
+	// attempt to move to adjacent node
+	switch( dir )
+	{
+		case NORTH:		cy -= GenerationStepSize; break;
+		case SOUTH:		cy += GenerationStepSize; break;
+		case EAST:		cx += GenerationStepSize; break;
+		case WEST:		cx -= GenerationStepSize; break;
+	}
+
+	pos.x = cx;
+	pos.y = cy;
+
+	return pos;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return false if sampling should not step to the given position
+ */
+bool CNavMesh::IsSampleStepInRange( const Vector &pos ) const
+{
+	// sanity check to not generate across the world for incremental generation
+	const float incrementalRange = nav_generate_incremental_range.GetFloat();
+	if ( m_generationMode == GENERATE_INCREMENTAL && incrementalRange > 0 )
+	{
+		bool inRange = false;
+		for ( int i=0; i<m_walkableSeeds.Count(); ++i )
+		{
+			const Vector &seedPos = m_walkableSeeds[i].pos;
+			if ( (seedPos - pos).IsLengthLessThan( incrementalRange ) )
+			{
+				inRange = true;
+				break;
+			}
+		}
+
+		if ( !inRange )
+		{
+			return false;
+		}
+	}
+
+	if ( m_generationMode == GENERATE_SIMPLIFY )
+	{
+		if ( !m_simplifyGenerationExtent.Contains( pos ) )
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Find where a step from step.from in step.dir lands, and what is in the way.
+ * This only traces against the world and reads the nav mesh, so many steps can be traced at once on the job threads.
+ */
+void CNavMesh::TraceSampleStep( SampleStep_t &step )
+{
+	step.canMove = false;
+
+	Vector pos = GetSampleStepGoal( step.from, step.dir );
+
+	// test if we can move to new position
+	trace_t result;
+	const Vector &from = step.from;
+	CTraceFilterWalkableEntities filter( NULL, COLLISION_GROUP_NONE, WALK_THRU_EVERYTHING );
+	Vector to, toNormal;
+	float obstacleHeight = 0, obstacleStartDist = 0, obstacleEndDist = GenerationStepSize;
+	if ( TraceAdjacentNode( 0, from, pos, &result ) )
+	{
+		to = result.endpos;
+		toNormal = result.plane.normal;
+	}
+	else
+	{
+		// test going up ClimbUpHeight
+		bool success = false;
+		for ( float height = StepHeight; height <= ClimbUpHeight; height += 1.0f )
+		{						
+			trace_t tr;
+			Vector start( from );
+			Vector end( pos );
+			start.z += height;
+			end.z += height;
+			UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
+			if ( !tr.startsolid && tr.fraction == 1.0f )
+			{
+				if ( !StayOnFloor( &tr ) )
+				{
+					break;
+				}
+
+				to = tr.endpos;
+				toNormal = tr.plane.normal;
+
+				start = end = from;
+				end.z += height;
+				UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
+				if ( tr.fraction < 1.0f )
+				{
+					break;
+				}
+
+				// keep track of far up we had to go to find a path to the next node
+				obstacleHeight = height;
+				success = true;
+				break;
+			}
+			else
+			{
+				// Could not trace from node to node at this height, something is in the way.
+				// Trace in the other direction to see if we hit something
+				Vector vecToObstacleStart = tr.endpos - start;
+				Assert( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) );
+				if ( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) )
+				{
+					UTIL_TraceHull( end, start, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
+					if ( !tr.startsolid && tr.fraction < 1.0 )
+					{
+						// We hit something going the other direction.  There is some obstacle between the two nodes.
+						Vector vecToObstacleEnd = tr.endpos - start;
+						Assert( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize ) );
+						if ( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize )  )
+						{
+							// Remember the distances to start and end of the obstacle (with respect to the "from" node).
+							// Keep track of the last distances to obstacle as we keep increasing the height we do a trace for.
+							// If we do eventually clear the obstacle, these values will be the start and end distance to the
+							// very tip of the obstacle.
+							obstacleStartDist = vecToObstacleStart.Length();
+							obstacleEndDist = vecToObstacleEnd.Length();
+							if ( obstacleEndDist == 0 )
+							{
+								obstacleEndDist = GenerationStepSize;
+							}
+						}								
+					}
+				}
+			}
+		}
+
+		if ( !success )
+		{
+			return;
+		}
+	}
+
+	// Don't generate nodes if we spill off the end of the world onto skybox
+	if ( result.surface.flags & ( SURF_SKY|SURF_SKY2D ) )
+	{
+		return;
+	}
+
+	// If we're incrementally generating, don't overlap existing nav areas.
+	Vector testPos( to );
+	bool overlapSE = IsNodeOverlapped( testPos, Vector(  1,  1, HalfHumanHeight ) );
+	bool overlapSW = IsNodeOverlapped( testPos, Vector( -1,  1, HalfHumanHeight ) );
+	bool overlapNE = IsNodeOverlapped( testPos, Vector(  1, -1, HalfHumanHeight ) );
+	bool overlapNW = IsNodeOverlapped( testPos, Vector( -1, -1, HalfHumanHeight ) );
+	if ( overlapSE && overlapSW && overlapNE && overlapNW && m_generationMode != GENERATE_SIMPLIFY )
+	{
+		return;
+	}
+
+	int nTolerance = nav_generate_incremental_tolerance.GetInt();
+	if ( nTolerance > 0 && m_generationMode == GENERATE_INCREMENTAL )
+	{
+		bool bValid = false;
+		int zPos = to.z;
+		for ( int i=0; i<m_walkableSeeds.Count(); ++i )
+		{
+			const Vector &seedPos = m_walkableSeeds[i].pos;
+			int zMin = seedPos.z - nTolerance;
+			int zMax = seedPos.z + nTolerance;
+
+			if ( zPos >= zMin && zPos <= zMax )
+			{
+				bValid = true;
+				break;
+			}
+		}
+
+		if ( !bValid )
+			return;
+	}
+
+
+	bool isOnDisplacement = result.IsDispSurface();
+
+	if ( nav_displacement_test.GetInt() > 0 )
+	{
+		// Test for nodes under displacement surfaces.
+		// This happens during development, and is a pain because the space underneath a displacement
+		// is not 'solid'.
+		Vector start = to + Vector( 0, 0, 0 );
+		Vector end = start + Vector( 0, 0, nav_displacement_test.GetInt() );
+		UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &result );
+
+		if ( result.fraction > 0 )
+		{
+			end = start;
+			start = result.endpos;
+			UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &result );
+			if ( result.fraction < 1 )
+			{
+				// if we made it down to within StepHeight, maybe we're on a static prop
+				if ( result.endpos.z > to.z + StepHeight )
+				{
+					return;
+				}
+			}
+		}
+	}
+
+	float deltaZ = to.z - from.z;
+	// If there's an obstacle in the way and it's traversable, or the obstacle is not higher than the destination node itself minus a small epsilon
+	// (meaning the obstacle was just the height change to get to the destination node, no extra obstacle between the two), clear obstacle height
+	// and distances
+	if ( ( obstacleHeight < MaxTraversableHeight ) || ( deltaZ > ( obstacleHeight - 2.0f ) ) )
+	{
+		obstacleHeight = 0;
+		obstacleStartDist = 0;
+		obstacleEndDist = GenerationStepSize;
+	}
+
+	step.canMove = true;
+	step.to = to;
+	step.toNormal = toNormal;
+	step.isOnDisplacement = isOnDisplacement;
+	step.obstacleHeight = obstacleHeight;
+	step.obstacleStartDist = obstacleStartDist;
+	step.obstacleEndDist = obstacleEndDist;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Add a step to be prefetched, unless it is out of range or already known
+ */
+void CNavMesh::QueueSampleStep( CUtlVector< SampleStep_t > *steps, const Vector &from, NavDirType dir )
+{
+	SampleStepKey_t key;
+	key.from = from;
+	key.dir = dir;
+
+	if ( m_sampleSteps.Find( key ) != m_sampleSteps.InvalidHandle() )
+		return;
+
+	if ( !IsSampleStepInRange( GetSampleStepGoal( from, dir ) ) )
+		return;
+
+	// reserve the slot so the same step isn't queued twice
+	SampleStep_t &step = steps->Element( steps->AddToTail() );
+	step.from = from;
+	step.dir = dir;
+	step.canMove = false;
+	m_sampleSteps.Insert( key, step );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Trace the given step, and the steps sampling is likely to take after it, on the job threads.
+ *
+ * Sampling is a depth-first walk where every step depends on the nodes made before it, so it still
+ * runs in order on this thread. But the traces for a step only depend on where it starts, and every
+ * unvisited direction of the current node and the nodes it will pop back to will be stepped in. Steps
+ * that succeed also tell us where the next nodes will be, so we keep guessing outwards from them in waves.
+ * SampleStep() takes the results in its usual order, so the mesh is the same as without prefetching.
+ */
+void CNavMesh::PrefetchSampleSteps( const Vector &from, NavDirType dir )
+{
+	const int budget = nav_generate_prefetch.GetInt();
+
+	CUtlVector< SampleStep_t > wave;
+	QueueSampleStep( &wave, from, dir );
+
+	for( CNavNode *node = m_currentNode; node && wave.Count() < budget; node = node->GetParent() )
+	{
+		for( int d = NORTH; d < NUM_DIRECTIONS; d++ )
+		{
+			if ( !node->HasVisited( (NavDirType)d ) )
+			{
+				QueueSampleStep( &wave, *node->GetPosition(), (NavDirType)d );
+			}
+		}
+	}
+
+	int traced = 0;
+	CUtlVector< SampleStep_t > nextWave;
+	while( wave.Count() )
+	{
+		ParallelProcess( "CNavMesh::PrefetchSampleSteps", wave.Base(), wave.Count(), this, &CNavMesh::TraceSampleStep );
+		traced += wave.Count();
+
+		nextWave.RemoveAll();
+		FOR_EACH_VEC( wave, it )
+		{
+			const SampleStep_t &step = wave[ it ];
+
+			SampleStepKey_t key;
+			key.from = step.from;
+			key.dir = step.dir;
+			m_sampleSteps[ m_sampleSteps.Find( key ) ] = step;
+
+			if ( !step.canMove || traced + nextWave.Count() >= budget )
+				continue;
+
+			// a new node will be made here, unless there is one already
+			if ( CNavNode::GetNode( step.to ) )
+				continue;
+
+			for( int d = NORTH; d < NUM_DIRECTIONS; d++ )
+			{
+				// AddNode() links small height changes back to the source node, which visits that direction
+				if ( d == OppositeDirection( step.dir ) && fabs( step.from.z - step.to.z ) < 50.0f )
+					continue;
+
+				QueueSampleStep( &nextWave, step.to, (NavDirType)d );
+			}
+		}
+
+		wave.Swap( nextWave );
+	}
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Search the world and build a map of possible movements.
@@ -4388,225 +5002,52 @@ bool CNavMesh::SampleStep( void )
 			if (!m_currentNode->HasVisited( (NavDirType)dir ))
 			{
 				// have not searched in this direction yet
-
-				// start at current node position
-				Vector pos = *m_currentNode->GetPosition();
-
-				// snap to grid
-				int cx = SnapToGrid( pos.x );
-				int cy = SnapToGrid( pos.y );
-
-				// attempt to move to adjacent node
-				switch( dir )
-				{
-					case NORTH:		cy -= GenerationStepSize; break;
-					case SOUTH:		cy += GenerationStepSize; break;
-					case EAST:		cx += GenerationStepSize; break;
-					case WEST:		cx -= GenerationStepSize; break;
-				}
-
-				pos.x = cx;
-				pos.y = cy;
-
 				m_generationDir = (NavDirType)dir;
 
 				// mark direction as visited
 				m_currentNode->MarkAsVisited( m_generationDir );
 
-				// sanity check to not generate across the world for incremental generation
-				const float incrementalRange = nav_generate_incremental_range.GetFloat();
-				if ( m_generationMode == GENERATE_INCREMENTAL && incrementalRange > 0 )
-				{
-					bool inRange = false;
-					for ( int i=0; i<m_walkableSeeds.Count(); ++i )
-					{
-						const Vector &seedPos = m_walkableSeeds[i].pos;
-						if ( (seedPos - pos).IsLengthLessThan( incrementalRange ) )
-						{
-							inRange = true;
-							break;
-						}
-					}
+				SampleStepKey_t key;
+				key.from = *m_currentNode->GetPosition();
+				key.dir = m_generationDir;
 
-					if ( !inRange )
+				UtlHashHandle_t h = m_sampleSteps.Find( key );
+				if ( h == m_sampleSteps.InvalidHandle() )
+				{
+					if ( !IsSampleStepInRange( GetSampleStepGoal( key.from, m_generationDir ) ) )
 					{
 						return true;
 					}
-				}
 
-				if ( m_generationMode == GENERATE_SIMPLIFY )
-				{
-					if ( !m_simplifyGenerationExtent.Contains( pos ) )
+					if ( nav_generate_prefetch.GetInt() > 0 )
 					{
-						return true;
+						PrefetchSampleSteps( key.from, m_generationDir );
+						h = m_sampleSteps.Find( key );
+						Assert( h != m_sampleSteps.InvalidHandle() );
 					}
 				}
 
-				// test if we can move to new position
-				trace_t result;
-				Vector from( *m_currentNode->GetPosition() );
-				CTraceFilterWalkableEntities filter( NULL, COLLISION_GROUP_NONE, WALK_THRU_EVERYTHING );
-				Vector to, toNormal;
-				float obstacleHeight = 0, obstacleStartDist = 0, obstacleEndDist = GenerationStepSize;
-				if ( TraceAdjacentNode( 0, from, pos, &result ) )
+				SampleStep_t step;
+				if ( h != m_sampleSteps.InvalidHandle() )
 				{
-					to = result.endpos;
-					toNormal = result.plane.normal;
+					step = m_sampleSteps.Element( h );
+					m_sampleSteps.Remove( key );
 				}
 				else
 				{
-					// test going up ClimbUpHeight
-					bool success = false;
-					for ( float height = StepHeight; height <= ClimbUpHeight; height += 1.0f )
-					{						
-						trace_t tr;
-						Vector start( from );
-						Vector end( pos );
-						start.z += height;
-						end.z += height;
-						UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
-						if ( !tr.startsolid && tr.fraction == 1.0f )
-						{
-							if ( !StayOnFloor( &tr ) )
-							{
-								break;
-							}
-
-							to = tr.endpos;
-							toNormal = tr.plane.normal;
-
-							start = end = from;
-							end.z += height;
-							UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
-							if ( tr.fraction < 1.0f )
-							{
-								break;
-							}
-
-							// keep track of far up we had to go to find a path to the next node
-							obstacleHeight = height;
-							success = true;
-							break;
-						}
-						else
-						{
-							// Could not trace from node to node at this height, something is in the way.
-							// Trace in the other direction to see if we hit something
-							Vector vecToObstacleStart = tr.endpos - start;
-							Assert( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) );
-							if ( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) )
-							{
-								UTIL_TraceHull( end, start, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
-								if ( !tr.startsolid && tr.fraction < 1.0 )
-								{
-									// We hit something going the other direction.  There is some obstacle between the two nodes.
-									Vector vecToObstacleEnd = tr.endpos - start;
-									Assert( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize ) );
-									if ( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize )  )
-									{
-										// Remember the distances to start and end of the obstacle (with respect to the "from" node).
-										// Keep track of the last distances to obstacle as we keep increasing the height we do a trace for.
-										// If we do eventually clear the obstacle, these values will be the start and end distance to the
-										// very tip of the obstacle.
-										obstacleStartDist = vecToObstacleStart.Length();
-										obstacleEndDist = vecToObstacleEnd.Length();
-										if ( obstacleEndDist == 0 )
-										{
-											obstacleEndDist = GenerationStepSize;
-										}
-									}								
-								}
-							}
-						}
-					}
-
-					if ( !success )
-					{
-						return true;
-					}
+					step.from = key.from;
+					step.dir = m_generationDir;
+					TraceSampleStep( step );
 				}
 
-				// Don't generate nodes if we spill off the end of the world onto skybox
-				if ( result.surface.flags & ( SURF_SKY|SURF_SKY2D ) )
+				if ( !step.canMove )
 				{
 					return true;
 				}
 
-				// If we're incrementally generating, don't overlap existing nav areas.
-				Vector testPos( to );
-				bool overlapSE = IsNodeOverlapped( testPos, Vector(  1,  1, HalfHumanHeight ) );
-				bool overlapSW = IsNodeOverlapped( testPos, Vector( -1,  1, HalfHumanHeight ) );
-				bool overlapNE = IsNodeOverlapped( testPos, Vector(  1, -1, HalfHumanHeight ) );
-				bool overlapNW = IsNodeOverlapped( testPos, Vector( -1, -1, HalfHumanHeight ) );
-				if ( overlapSE && overlapSW && overlapNE && overlapNW && m_generationMode != GENERATE_SIMPLIFY )
-				{
-					return true;
-				}
-
-				int nTolerance = nav_generate_incremental_tolerance.GetInt();
-				if ( nTolerance > 0 && m_generationMode == GENERATE_INCREMENTAL )
-				{
-					bool bValid = false;
-					int zPos = to.z;
-					for ( int i=0; i<m_walkableSeeds.Count(); ++i )
-					{
-						const Vector &seedPos = m_walkableSeeds[i].pos;
-						int zMin = seedPos.z - nTolerance;
-						int zMax = seedPos.z + nTolerance;
-
-						if ( zPos >= zMin && zPos <= zMax )
-						{
-							bValid = true;
-							break;
-						}
-					}
-
-					if ( !bValid )
-						return true;
-				}
-
-
-				bool isOnDisplacement = result.IsDispSurface();
-
-				if ( nav_displacement_test.GetInt() > 0 )
-				{
-					// Test for nodes under displacement surfaces.
-					// This happens during development, and is a pain because the space underneath a displacement
-					// is not 'solid'.
-					Vector start = to + Vector( 0, 0, 0 );
-					Vector end = start + Vector( 0, 0, nav_displacement_test.GetInt() );
-					UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &result );
-
-					if ( result.fraction > 0 )
-					{
-						end = start;
-						start = result.endpos;
-						UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &result );
-						if ( result.fraction < 1 )
-						{
-							// if we made it down to within StepHeight, maybe we're on a static prop
-							if ( result.endpos.z > to.z + StepHeight )
-							{
-								return true;
-							}
-						}
-					}
-				}
-
-				float deltaZ = to.z - m_currentNode->GetPosition()->z;
-				// If there's an obstacle in the way and it's traversable, or the obstacle is not higher than the destination node itself minus a small epsilon
-				// (meaning the obstacle was just the height change to get to the destination node, no extra obstacle between the two), clear obstacle height
-				// and distances
-				if ( ( obstacleHeight < MaxTraversableHeight ) || ( deltaZ > ( obstacleHeight - 2.0f ) ) )
-				{
-					obstacleHeight = 0;
-					obstacleStartDist = 0;
-					obstacleEndDist = GenerationStepSize;
-				}
-
 				// we can move here
 				// create a new navigation node, and update current node pointer
-				AddNode( to, toNormal, m_generationDir, m_currentNode, isOnDisplacement, obstacleHeight, obstacleStartDist, obstacleEndDist );
+				AddNode( step.to, step.toNormal, m_generationDir, m_currentNode, step.isOnDisplacement, step.obstacleHeight, step.obstacleStartDist, step.obstacleEndDist );
 
 				return true;
 			}
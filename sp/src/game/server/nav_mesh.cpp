@@ -13,6 +13,7 @@
 #include "filesystem.h"
 #include "nav_mesh.h"
 #include "nav_node.h"
+#include "nav_pathfind.h"
 #include "fmtstr.h"
 #include "utlbuffer.h"
 #include "tier0/vprof.h"
@@ -65,6 +66,8 @@ CNavMesh::CNavMesh( void )
 	m_hostThreadModeRestoreValue = 0;
 	m_placeCount = 0;
 	m_placeName = NULL;
+	m_nextPathRequestID = 0;
+	m_generationCheckpointTime = 0.0f;
 
 	LoadPlaceDatabase();
 
@@ -89,6 +92,7 @@ CNavMesh::~CNavMesh()
 		delete [] m_placeName[i];
 	}
 
+	DestroyPathRequests();
 }
 
 //--------------------------------------------------------------------------------------------------------------
@@ -160,6 +164,11 @@ void CNavMesh::DestroyNavigationMesh( bool incremental )
 	m_avoidanceObstacleAreas.RemoveAll();
 	m_transientAreas.RemoveAll();
 
+	// pending path requests may refer to areas about to be deleted; they're answered as
+	// failed once the mesh is gone
+	CUtlVector< NavPathJob_t * > droppedPathJobs;
+	droppedPathJobs.Swap( m_pathJobs );
+
 	if ( !incremental )
 	{
 		// destroy all areas
@@ -239,6 +248,8 @@ void CNavMesh::DestroyNavigationMesh( bool incremental )
 	{
 		m_isLoaded = false;
 	}
+
+	FailPathRequests( droppedPathJobs );
 }
 
 
@@ -266,6 +277,9 @@ void CNavMesh::Update( void )
 	UpdateBlockedAreas();
 	UpdateAvoidanceObstacleAreas();
 
+	// answer this frame's path requests, now blocked areas are up to date
+	SolvePathRequests();
+
 	if (nav_edit.GetBool())
 	{
 		if (m_isEditing == false)
@@ -2594,6 +2608,17 @@ void CommandNavGenerate( void )
 static ConCommand nav_generate( "nav_generate", CommandNavGenerate, "Generate a Navigation Mesh for the current map and save it to disk.", FCVAR_GAMEDLL | FCVAR_CHEAT );
 
 
+//--------------------------------------------------------------------------------------------------------------
+void CommandNavGenerateResume( void )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	TheNavMesh->ResumeGeneration();
+}
+static ConCommand nav_generate_resume( "nav_generate_resume", CommandNavGenerateResume, "Continue an interrupted nav_generate from its last checkpoint (see nav_generate_checkpoint_interval).", FCVAR_GAMEDLL | FCVAR_CHEAT );
+
+
 //--------------------------------------------------------------------------------------------------------------
 void CommandNavGenerateIncremental( void )
 {
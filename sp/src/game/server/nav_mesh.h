@@ -20,6 +20,8 @@
 #define _NAV_MESH_H_
 
 #include "utlbuffer.h"
+#include "utlhashtable.h"
+#include "tier1/generichash.h"
 #include "filesystem.h"
 #include "GameEventListener.h"
 
@@ -31,6 +33,9 @@
 class CNavArea;
 class CBaseEntity; 
 class CBreakable;
+struct NavPathRequest_t;
+struct NavPathJob_t;
+class INavPathRequester;
 
 extern ConVar nav_edit;
 extern ConVar nav_quicksave;
@@ -348,6 +353,7 @@ public:
 	//
 	#define INCREMENTAL_GENERATION true
 	void BeginGeneration( bool incremental = false );					// initiate the generation process
+	void ResumeGeneration( void );										// continue an interrupted generation from its checkpoint file, or start over if there is none
 	void BeginAnalysis( bool quitWhenFinished = false );						// re-analyze an existing Mesh.  Determine Hiding Spots, Encounter Spots, etc.
 
 	bool IsGenerating( void ) const		{ return m_generationMode != GENERATE_NONE; }	// return true while a Navigation Mesh is being generated
@@ -1051,6 +1057,11 @@ public:
 	void PostProcessCliffAreas();
 	void SimplifySelectedAreas( void );	// Simplifies the selected set by reducing to 1x1 areas and re-merging them up with loosened tolerances
 
+	// Batched pathfinding. Requests are solved together on the job threads at the end of Update(), and answered there.
+	int QueuePathRequest( const NavPathRequest_t &request, INavPathRequester *requester );	// returns the ID passed back with the result
+	void CancelPathRequests( INavPathRequester *requester );			// drop unanswered requests made by the given requester, without answering them. Only for the requester itself, e.g. before it's destroyed
+	void SolvePathRequests( void );										// solve and answer all queued requests now
+
 protected:
 	virtual void PostCustomAnalysis( void ) { }					// invoked when custom analysis step is complete
 	bool FindActiveNavArea( void );								// Finds the area or ladder the local player is currently pointing at.  Returns true if a surface was hit by the traceline.
@@ -1163,6 +1174,42 @@ private:
 	void DestroyLadders( void );
 
 	bool SampleStep( void );									// sample the walkable areas of the map
+
+	struct SampleStep_t
+	{
+		Vector from;											// position of the node stepped from
+		NavDirType dir;
+		bool canMove;											// if false, no node is added in this direction
+		Vector to;
+		Vector toNormal;
+		bool isOnDisplacement;
+		float obstacleHeight;
+		float obstacleStartDist;
+		float obstacleEndDist;
+	};
+	struct SampleStepKey_t
+	{
+		Vector from;
+		int dir;
+	};
+	class CSampleStepKeyFuncs
+	{
+	public:
+		unsigned int operator()( const SampleStepKey_t &key ) const					{ return HashItem( key ); }
+		bool operator()( const SampleStepKey_t &lhs, const SampleStepKey_t &rhs ) const	{ return V_memcmp( &lhs, &rhs, sizeof( SampleStepKey_t ) ) == 0; }
+	};
+	Vector GetSampleStepGoal( const Vector &from, NavDirType dir ) const;
+	bool IsSampleStepInRange( const Vector &pos ) const;		// incremental and simplify generation only sample near their seeds
+	void TraceSampleStep( SampleStep_t &step );					// find where a step from step.from in step.dir lands. Only traces, so safe on the job threads
+	void PrefetchSampleSteps( const Vector &from, NavDirType dir );	// trace the given step and the steps sampling is likely to take after it, in parallel
+	void QueueSampleStep( CUtlVector< SampleStep_t > *steps, const Vector &from, NavDirType dir );
+	CUtlHashtable< SampleStepKey_t, SampleStep_t, CSampleStepKeyFuncs, CSampleStepKeyFuncs > m_sampleSteps;	// prefetched steps, not yet taken
+
+	void SaveGenerationCheckpoint( void ) const;				// store the sampled nodes so an interrupted generation can be resumed
+	bool LoadGenerationCheckpoint( void );
+	void RemoveGenerationCheckpoint( void ) const;
+	const char *GetGenerationCheckpointFilename( void ) const;
+	float m_generationCheckpointTime;							// when the last checkpoint was stored
 	void CreateNavAreasFromNodes( void );						// cover all of the sampled nodes with nav areas
 
 	bool TestArea( CNavNode *node, int width, int height );		// check if an area of size (width, height) can fit, starting from node as upper left corner
@@ -1251,6 +1298,13 @@ private:
 
 	void TestAllAreasForBlockedStatus( void );					// Used to update blocked areas after a round restart. Need to delay so the map logic has all fired.
 	CountdownTimer m_updateBlockedAreasTimer;			
+
+	void CancelPathRequests( CNavArea *area );					// answer requests that start or end at the given area as failed
+	void FailPathRequests( CUtlVector< NavPathJob_t * > &jobs );	// answer the given requests as failed and free them
+	void DestroyPathRequests( void );
+	CUtlVector< NavPathJob_t * > m_pathJobs;					// requests waiting to be solved
+	CUtlVector< NavPathJob_t * > m_freePathJobs;				// jobs kept for reuse, along with their search storage
+	int m_nextPathRequestID;
 };
 
 // the global singleton interface
@@ -0,0 +1,612 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Reentrant nav mesh path search, and batched path requests
+//
+//=============================================================================//
+
+#include "cbase.h"
+#include "vstdlib/jobthread.h"
+
+#include "nav_mesh.h"
+#include "nav_pathfind.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+ConVar nav_path_requests_parallel( "nav_path_requests_parallel", "1", FCVAR_CHEAT, "Solve queued nav path requests on the job threads" );
+
+
+//--------------------------------------------------------------------------------------------------------------
+float CNavShortestPathCost::StepCost( CNavArea *area, CNavArea *fromArea, const CNavLadder *ladder, const CFuncElevator *elevator, float length ) const
+{
+	if ( fromArea == NULL )
+	{
+		// first area in path, no cost
+		return 0.0f;
+	}
+
+	// compute distance traveled along path so far
+	float dist;
+
+	if ( ladder )
+	{
+		dist = ladder->m_length;
+	}
+	else if ( length > 0.0 )
+	{
+		dist = length;
+	}
+	else
+	{
+		dist = ( area->GetCenter() - fromArea->GetCenter() ).Length();
+	}
+
+	float cost = dist;
+
+	// if this is a "crouch" area, add penalty
+	if ( area->GetAttributes() & NAV_MESH_CROUCH )
+	{
+		const float crouchPenalty = 20.0f;		// 10
+		cost += crouchPenalty * dist;
+	}
+
+	// if this is a "jump" area, add penalty
+	if ( area->GetAttributes() & NAV_MESH_JUMP )
+	{
+		const float jumpPenalty = 5.0f;
+		cost += jumpPenalty * dist;
+	}
+
+	return cost;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavPathSearch::CNavPathSearch( void )
+{
+	m_openOrder = 0;
+	m_closestArea = NULL;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+int CNavPathSearch::FindNode( CNavArea *area ) const
+{
+	UtlHashHandle_t h = m_nodeIndex.Find( area );
+	return ( h == m_nodeIndex.InvalidHandle() ) ? -1 : m_nodeIndex[ h ];
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+int CNavPathSearch::AddNode( CNavArea *area )
+{
+	int node = m_nodes.AddToTail();
+	SearchNode &searchNode = m_nodes[ node ];
+	searchNode.area = area;
+	searchNode.parent = -1;
+	searchNode.parentHow = NUM_TRAVERSE_TYPES;
+	searchNode.costSoFar = 0.0f;
+	searchNode.totalCost = 0.0f;
+	searchNode.pathLengthSoFar = 0.0f;
+	searchNode.heapIndex = -1;
+	searchNode.openOrder = 0;
+	searchNode.isClosed = false;
+
+	m_nodeIndex.Insert( area, node );
+	return node;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+bool CNavPathSearch::IsCheaper( int node, int other ) const
+{
+	const SearchNode &a = m_nodes[ node ];
+	const SearchNode &b = m_nodes[ other ];
+	if ( a.totalCost != b.totalCost )
+		return a.totalCost < b.totalCost;
+
+	return a.openOrder < b.openOrder;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::OpenHeapUp( int i )
+{
+	int node = m_openHeap[ i ];
+	while ( i > 0 )
+	{
+		int parent = ( i - 1 ) / 2;
+		if ( !IsCheaper( node, m_openHeap[ parent ] ) )
+			break;
+
+		m_openHeap[ i ] = m_openHeap[ parent ];
+		m_nodes[ m_openHeap[ i ] ].heapIndex = i;
+		i = parent;
+	}
+
+	m_openHeap[ i ] = node;
+	m_nodes[ node ].heapIndex = i;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::OpenHeapDown( int i )
+{
+	int node = m_openHeap[ i ];
+	int count = m_openHeap.Count();
+	while ( true )
+	{
+		int child = 2 * i + 1;
+		if ( child >= count )
+			break;
+
+		if ( child + 1 < count && IsCheaper( m_openHeap[ child + 1 ], m_openHeap[ child ] ) )
+			++child;
+
+		if ( !IsCheaper( m_openHeap[ child ], node ) )
+			break;
+
+		m_openHeap[ i ] = m_openHeap[ child ];
+		m_nodes[ m_openHeap[ i ] ].heapIndex = i;
+		i = child;
+	}
+
+	m_openHeap[ i ] = node;
+	m_nodes[ node ].heapIndex = i;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Add a node to the open heap, or move it up if its cost went down
+ */
+void CNavPathSearch::PushOpen( int node )
+{
+	SearchNode &searchNode = m_nodes[ node ];
+	searchNode.openOrder = m_openOrder++;
+
+	if ( searchNode.heapIndex < 0 )
+	{
+		searchNode.heapIndex = m_openHeap.AddToTail( node );
+	}
+
+	OpenHeapUp( searchNode.heapIndex );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+int CNavPathSearch::PopOpen( void )
+{
+	int node = m_openHeap[ 0 ];
+	int last = m_openHeap.Tail();
+	m_openHeap.RemoveMultipleFromTail( 1 );
+
+	if ( m_openHeap.Count() )
+	{
+		m_openHeap[ 0 ] = last;
+		OpenHeapDown( 0 );
+	}
+
+	m_nodes[ node ].heapIndex = -1;
+	return node;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Find path from startArea to goalArea via an A* search. Follows NavAreaBuildPath() step for step;
+ * see there for the meaning of the arguments. Returns true if a path exists.
+ */
+bool CNavPathSearch::BuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, const INavPathCost &cost, float maxPathLength, int teamID, bool ignoreNavBlockers )
+{
+	m_nodes.RemoveAll();
+	m_nodeIndex.RemoveAll();
+	m_openHeap.RemoveAll();
+	m_openOrder = 0;
+	m_closestArea = startArea;
+
+	if (startArea == NULL)
+		return false;
+
+	int startNode = AddNode( startArea );
+
+	if (goalArea != NULL && goalArea->IsBlocked( teamID, ignoreNavBlockers ))
+		goalArea = NULL;
+
+	if (goalArea == NULL && goalPos == NULL)
+		return false;
+
+	// if we are already in the goal area, build trivial path
+	if (startArea == goalArea)
+	{
+		return true;
+	}
+
+	// determine actual goal position
+	Vector actualGoalPos = (goalPos) ? *goalPos : goalArea->GetCenter();
+
+	float initCost = cost.StepCost( startArea, NULL, NULL, NULL, -1.0f );
+	if (initCost < 0.0f)
+		return false;
+
+	m_nodes[ startNode ].totalCost = (startArea->GetCenter() - actualGoalPos).Length();
+	m_nodes[ startNode ].costSoFar = initCost;
+	PushOpen( startNode );
+
+	// keep track of the area we visit that is closest to the goal
+	float closestAreaDist = m_nodes[ startNode ].totalCost;
+	bool bHaveMaxPathLength = ( maxPathLength > 0.0f );
+
+	// do A* search
+	while( m_openHeap.Count() )
+	{
+		// get next area to check
+		int node = PopOpen();
+		CNavArea *area = m_nodes[ node ].area;
+
+		// don't consider blocked areas
+		if ( area->IsBlocked( teamID, ignoreNavBlockers ) )
+			continue;
+
+		// check if we have found the goal area or position
+		if (area == goalArea || (goalArea == NULL && goalPos && area->Contains( *goalPos )))
+		{
+			m_closestArea = area;
+			return true;
+		}
+
+		CNavArea *parentArea = ( m_nodes[ node ].parent >= 0 ) ? m_nodes[ m_nodes[ node ].parent ].area : NULL;
+
+		// search adjacent areas, on the floor, then up and down ladders, then by elevator
+		for ( int pass = 0; pass < NUM_DIRECTIONS + 3; ++pass )
+		{
+			const NavConnectVector *floorList = NULL;
+			const NavLadderConnectVector *ladderList = NULL;
+			const CFuncElevator *elevator = NULL;
+			int count = 0;
+
+			if ( pass < NUM_DIRECTIONS )
+			{
+				floorList = area->GetAdjacentAreas( (NavDirType)pass );
+				count = floorList->Count();
+			}
+			else if ( pass == NUM_DIRECTIONS )
+			{
+				ladderList = area->GetLadders( CNavLadder::LADDER_UP );
+				count = ladderList->Count() * 3;		// do not use BEHIND connection, as its very hard to get to when going up a ladder
+			}
+			else if ( pass == NUM_DIRECTIONS + 1 )
+			{
+				ladderList = area->GetLadders( CNavLadder::LADDER_DOWN );
+				count = ladderList->Count();
+			}
+			else
+			{
+				elevator = area->GetElevator();
+				count = ( elevator ) ? area->GetElevatorAreas().Count() : 0;
+			}
+
+			for ( int i = 0; i < count; ++i )
+			{
+				CNavArea *newArea;
+				NavTraverseType how;
+				const CNavLadder *ladder = NULL;
+				float length = -1.0f;
+
+				if ( floorList )
+				{
+					const NavConnect &floorConnect = floorList->Element( i );
+					newArea = floorConnect.area;
+					length = floorConnect.length;
+					how = (NavTraverseType)pass;
+				}
+				else if ( pass == NUM_DIRECTIONS )
+				{
+					ladder = ladderList->Element( i / 3 ).ladder;
+					switch ( i % 3 )
+					{
+					case 0:		newArea = ladder->m_topForwardArea;	break;
+					case 1:		newArea = ladder->m_topLeftArea;	break;
+					default:	newArea = ladder->m_topRightArea;	break;
+					}
+					how = GO_LADDER_UP;
+				}
+				else if ( ladderList )
+				{
+					ladder = ladderList->Element( i ).ladder;
+					newArea = ladder->m_bottomArea;
+					how = GO_LADDER_DOWN;
+				}
+				else
+				{
+					newArea = area->GetElevatorAreas()[ i ].area;
+					how = ( newArea->GetCenter().z > area->GetCenter().z ) ? GO_ELEVATOR_UP : GO_ELEVATOR_DOWN;
+				}
+
+				if ( newArea == NULL )
+					continue;
+
+				// don't backtrack
+				if ( newArea == parentArea )
+					continue;
+				if ( newArea == area ) // self neighbor?
+					continue;
+
+				// don't consider blocked areas
+				if ( newArea->IsBlocked( teamID, ignoreNavBlockers ) )
+					continue;
+
+				float stepCost = cost.StepCost( newArea, area, ladder, elevator, length );
+
+				// check if cost functor says this area is a dead-end
+				if ( stepCost < 0.0f )
+					continue;
+
+				float costSoFar = m_nodes[ node ].costSoFar;
+				float newCostSoFar = costSoFar + stepCost;
+
+				// Make sure that any jump to a new area incurs some pathfinding cost, as NavAreaBuildPath() does
+				float minNewCostSoFar = costSoFar * 1.00001 + 0.00001;
+				newCostSoFar = Max( newCostSoFar, minNewCostSoFar );
+
+				// stop if path length limit reached
+				float newLengthSoFar = 0.0f;
+				if ( bHaveMaxPathLength )
+				{
+					// keep track of path length so far
+					float deltaLength = ( newArea->GetCenter() - area->GetCenter() ).Length();
+					newLengthSoFar = m_nodes[ node ].pathLengthSoFar + deltaLength;
+					if ( newLengthSoFar > maxPathLength )
+						continue;
+				}
+
+				int newNode = FindNode( newArea );
+				if ( newNode >= 0 && m_nodes[ newNode ].costSoFar <= newCostSoFar )
+				{
+					// this is a worse path - skip it
+					continue;
+				}
+
+				if ( newNode < 0 )
+				{
+					newNode = AddNode( newArea );
+				}
+
+				// compute estimate of distance left to go
+				float distSq = ( newArea->GetCenter() - actualGoalPos ).LengthSqr();
+				float newCostRemaining = ( distSq > 0.0 ) ? FastSqrt( distSq ) : 0.0 ;
+
+				// track closest area to goal in case path fails
+				if ( newCostRemaining < closestAreaDist )
+				{
+					m_closestArea = newArea;
+					closestAreaDist = newCostRemaining;
+				}
+
+				SearchNode &searchNode = m_nodes[ newNode ];
+				searchNode.costSoFar = newCostSoFar;
+				searchNode.totalCost = newCostSoFar + newCostRemaining;
+				searchNode.pathLengthSoFar = newLengthSoFar;
+				searchNode.parent = node;
+				searchNode.parentHow = how;
+				searchNode.isClosed = false;
+
+				PushOpen( newNode );
+			}
+		}
+
+		// we have searched this area
+		m_nodes[ node ].isClosed = true;
+	}
+
+	return false;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavArea *CNavPathSearch::GetParent( CNavArea *area ) const
+{
+	int node = FindNode( area );
+	if ( node < 0 || m_nodes[ node ].parent < 0 )
+		return NULL;
+
+	return m_nodes[ m_nodes[ node ].parent ].area;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+NavTraverseType CNavPathSearch::GetParentHow( CNavArea *area ) const
+{
+	int node = FindNode( area );
+	return ( node < 0 ) ? NUM_TRAVERSE_TYPES : m_nodes[ node ].parentHow;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+float CNavPathSearch::GetCostSoFar( CNavArea *area ) const
+{
+	int node = FindNode( area );
+	return ( node < 0 ) ? 0.0f : m_nodes[ node ].costSoFar;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::GetPath( CNavArea *endArea, CUtlVector< CNavArea * > *areas, CUtlVector< NavTraverseType > *how ) const
+{
+	areas->RemoveAll();
+	if ( how )
+	{
+		how->RemoveAll();
+	}
+
+	for ( int node = FindNode( endArea ); node >= 0; node = m_nodes[ node ].parent )
+	{
+		areas->AddToHead( m_nodes[ node ].area );
+		if ( how )
+		{
+			how->AddToHead( m_nodes[ node ].parentHow );
+		}
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Queue a path request, to be answered at the end of this frame's CNavMesh::Update().
+ * Returns an ID passed back with the result.
+ */
+int CNavMesh::QueuePathRequest( const NavPathRequest_t &request, INavPathRequester *requester )
+{
+	Assert( requester );
+
+	NavPathJob_t *job;
+	if ( m_freePathJobs.Count() )
+	{
+		job = m_freePathJobs.Tail();
+		m_freePathJobs.RemoveMultipleFromTail( 1 );
+	}
+	else
+	{
+		job = new NavPathJob_t;
+	}
+
+	job->requestID = ++m_nextPathRequestID;
+	job->request = request;
+	job->requester = requester;
+
+	m_pathJobs.AddToTail( job );
+	return job->requestID;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Drop all unanswered requests made by the given requester. They aren't answered, so this
+ * is only for the requester itself to call, e.g. when it's about to be destroyed.
+ */
+void CNavMesh::CancelPathRequests( INavPathRequester *requester )
+{
+	FOR_EACH_VEC_BACK( m_pathJobs, it )
+	{
+		if ( m_pathJobs[ it ]->requester == requester )
+		{
+			m_freePathJobs.AddToTail( m_pathJobs[ it ] );
+			m_pathJobs.Remove( it );
+		}
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Answer requests that start or end in an area about to be deleted as failed
+ */
+void CNavMesh::CancelPathRequests( CNavArea *area )
+{
+	CUtlVector< NavPathJob_t * > dropped;
+	FOR_EACH_VEC( m_pathJobs, it )
+	{
+		const NavPathRequest_t &request = m_pathJobs[ it ]->request;
+		if ( request.startArea == area || request.goalArea == area )
+		{
+			dropped.AddToTail( m_pathJobs[ it ] );
+		}
+	}
+
+	FOR_EACH_VEC( dropped, it )
+	{
+		m_pathJobs.FindAndRemove( dropped[ it ] );
+	}
+
+	FailPathRequests( dropped );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Answer the given requests, already taken out of m_pathJobs, as failed. Requesters may
+ * queue new requests from the callback.
+ */
+void CNavMesh::FailPathRequests( CUtlVector< NavPathJob_t * > &jobs )
+{
+	FOR_EACH_VEC( jobs, it )
+	{
+		NavPathJob_t *job = jobs[ it ];
+		job->result.isPathFound = false;
+		job->result.closestArea = NULL;
+		job->result.path.RemoveAll();
+		job->result.how.RemoveAll();
+
+		job->requester->OnNavPathResult( job->requestID, job->result );
+		m_freePathJobs.AddToTail( job );
+	}
+
+	jobs.RemoveAll();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+static CNavShortestPathCost s_shortestPathCost;
+
+static void SolveNavPathJob( NavPathJob_t *&job )
+{
+	const NavPathRequest_t &request = job->request;
+	NavPathResult_t &result = job->result;
+
+	const INavPathCost &cost = ( request.cost ) ? *request.cost : s_shortestPathCost;
+	result.isPathFound = job->search.BuildPath( request.startArea, request.goalArea, request.hasGoalPos ? &request.goalPos : NULL,
+		cost, request.maxPathLength, request.teamID, request.ignoreNavBlockers );
+	result.closestArea = job->search.GetClosestArea();
+
+	job->search.GetPath( result.closestArea, &result.path, &result.how );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Solve all queued path requests, then hand the results back on this thread
+ */
+void CNavMesh::SolvePathRequests( void )
+{
+	if ( m_pathJobs.Count() == 0 )
+		return;
+
+	VPROF( "CNavMesh::SolvePathRequests" );
+
+	if ( nav_path_requests_parallel.GetBool() && m_pathJobs.Count() > 1 )
+	{
+		ParallelProcess( "CNavMesh::SolvePathRequests", m_pathJobs.Base(), m_pathJobs.Count(), &SolveNavPathJob );
+	}
+	else
+	{
+		FOR_EACH_VEC( m_pathJobs, it )
+		{
+			SolveNavPathJob( m_pathJobs[ it ] );
+		}
+	}
+
+	// requesters may queue more requests from the callback, for next frame
+	CUtlVector< NavPathJob_t * > solved;
+	solved.Swap( m_pathJobs );
+
+	FOR_EACH_VEC( solved, it )
+	{
+		NavPathJob_t *job = solved[ it ];
+		job->requester->OnNavPathResult( job->requestID, job->result );
+		m_freePathJobs.AddToTail( job );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavMesh::DestroyPathRequests( void )
+{
+	CUtlVector< NavPathJob_t * > dropped;
+	dropped.Swap( m_pathJobs );
+	FailPathRequests( dropped );
+
+	// anything queued from those answers is dropped
+	m_pathJobs.PurgeAndDeleteElements();
+	m_freePathJobs.PurgeAndDeleteElements();
+}
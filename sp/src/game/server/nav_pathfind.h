@@ -15,6 +15,7 @@
 #include "tier0/vprof.h"
 #include "mathlib/ssemath.h"
 #include "nav_area.h"
+#include "utlhashtable.h"
 
 extern int g_DebugPathfindCounter;
 
@@ -447,6 +448,149 @@ float NavAreaTravelDistance( CNavArea *startArea, CNavArea *endArea, CostFunctor
 
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Step cost used by CNavPathSearch. Unlike the NavAreaBuildPath() functors, this returns only the cost of
+ * moving from 'fromArea' into 'area', since the cost so far lives in the search and not in the areas.
+ * Searches run on the job threads, so implementations must not change any state.
+ * Return -1 if 'area' is a dead end. 'fromArea' is NULL for the first area in the path.
+ */
+abstract_class INavPathCost
+{
+public:
+	virtual float StepCost( CNavArea *area, CNavArea *fromArea, const CNavLadder *ladder, const CFuncElevator *elevator, float length ) const = 0;
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * The ShortestPathCost rules as an INavPathCost
+ */
+class CNavShortestPathCost : public INavPathCost
+{
+public:
+	virtual float StepCost( CNavArea *area, CNavArea *fromArea, const CNavLadder *ladder, const CFuncElevator *elevator, float length ) const;
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * A reentrant A* search over the nav mesh. It gives the same paths as NavAreaBuildPath(), but keeps its
+ * open and closed sets and the path parents in the search object instead of in the areas, so any number
+ * of searches can run at once, on any thread. A search object can be reused; its storage is kept between
+ * searches.
+ */
+class CNavPathSearch
+{
+public:
+	CNavPathSearch( void );
+
+	bool BuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, const INavPathCost &cost, float maxPathLength = 0.0f, int teamID = TEAM_ANY, bool ignoreNavBlockers = false );
+
+	CNavArea *GetClosestArea( void ) const	{ return m_closestArea; }			// the area reached, or closest to the goal if the path failed
+
+	// valid for areas the last search reached
+	CNavArea *GetParent( CNavArea *area ) const;
+	NavTraverseType GetParentHow( CNavArea *area ) const;
+	float GetCostSoFar( CNavArea *area ) const;
+
+	// fill in the areas from the start area to 'endArea', and how each was reached from the one before
+	void GetPath( CNavArea *endArea, CUtlVector< CNavArea * > *areas, CUtlVector< NavTraverseType > *how = NULL ) const;
+
+private:
+	struct SearchNode
+	{
+		CNavArea *area;
+		int parent;									// index of the parent node, or -1
+		NavTraverseType parentHow;
+		float costSoFar;
+		float totalCost;
+		float pathLengthSoFar;
+		int heapIndex;								// position in the open heap, or -1 if not open
+		unsigned int openOrder;						// equal costs come off the open heap in the order they went on
+		bool isClosed;
+	};
+
+	int FindNode( CNavArea *area ) const;
+	int AddNode( CNavArea *area );
+
+	bool IsCheaper( int node, int other ) const;
+	void OpenHeapUp( int i );
+	void OpenHeapDown( int i );
+	void PushOpen( int node );
+	int PopOpen( void );
+
+	CUtlVector< SearchNode > m_nodes;
+	CUtlHashtable< const void *, int > m_nodeIndex;	// area to node index
+	CUtlVector< int > m_openHeap;						// node indices, cheapest total cost first
+	unsigned int m_openOrder;
+
+	CNavArea *m_closestArea;
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * A path request queued with CNavMesh::QueuePathRequest(). Requests queued during a frame are solved
+ * together, spread over the job threads, at the end of CNavMesh::Update().
+ */
+struct NavPathRequest_t
+{
+	NavPathRequest_t( void )
+	{
+		startArea = NULL;
+		goalArea = NULL;
+		goalPos = vec3_origin;
+		hasGoalPos = false;
+		cost = NULL;
+		maxPathLength = 0.0f;
+		teamID = TEAM_ANY;
+		ignoreNavBlockers = false;
+	}
+
+	CNavArea *startArea;
+	CNavArea *goalArea;							// if NULL, path to goalPos
+	Vector goalPos;
+	bool hasGoalPos;
+	const INavPathCost *cost;					// must stay valid until the request is answered or cancelled; NULL for CNavShortestPathCost
+	float maxPathLength;
+	int teamID;
+	bool ignoreNavBlockers;
+};
+
+struct NavPathResult_t
+{
+	bool isPathFound;
+	CNavArea *closestArea;						// the goal area if the path was found, else the closest area reached. NULL if the request was dropped
+	CUtlVector< CNavArea * > path;				// start area first, ending at closestArea
+	CUtlVector< NavTraverseType > how;			// how each area in 'path' is reached from the one before it
+};
+
+/**
+ * Receives answers to queued path requests, on the main thread. Every request is answered
+ * once: requests dropped because their areas or the whole mesh went away are answered as
+ * failed, with no closest area. Only CNavMesh::CancelPathRequests( requester ) drops them
+ * without an answer, so a requester must call it before it's destroyed.
+ */
+abstract_class INavPathRequester
+{
+public:
+	virtual void OnNavPathResult( int requestID, const NavPathResult_t &result ) = 0;
+};
+
+/**
+ * A queued request and the search that answers it
+ */
+struct NavPathJob_t
+{
+	int requestID;
+	NavPathRequest_t request;
+	INavPathRequester *requester;
+	CNavPathSearch search;
+	NavPathResult_t result;
+};
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Do a breadth-first search, invoking functor on each area.
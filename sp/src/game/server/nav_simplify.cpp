@@ -129,10 +129,12 @@ void CNavMesh::GenerateNodes( const Extent &bounds )
 	m_seedIdx = 0;
 
 	Assert( m_generationMode == GENERATE_SIMPLIFY );
+	m_sampleSteps.RemoveAll();
 	while ( SampleStep() )
 	{
 		// do nothing
 	}
+	m_sampleSteps.RemoveAll();
 }
 
 
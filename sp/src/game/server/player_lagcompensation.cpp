@@ -13,6 +13,8 @@
 #include "utllinkedlist.h"
 #include "BaseAnimatingOverlay.h"
 #include "tier0/vprof.h"
+#include "mathlib/ssemath.h"
+#include "vstdlib/random.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -42,29 +44,9 @@ ConVar sv_unlag_fixstuck( "sv_unlag_fixstuck", "0", FCVAR_DEVELOPMENTONLY, "Disa
 //-----------------------------------------------------------------------------
 #define MAX_LAYER_RECORDS (CBaseAnimatingOverlay::MAX_OVERLAYS)
 
-struct LayerRecord
-{
-	int m_sequence;
-	float m_cycle;
-	float m_weight;
-	int m_order;
-
-	LayerRecord()
-	{
-		m_sequence = 0;
-		m_cycle = 0;
-		m_weight = 0;
-		m_order = 0;
-	}
-
-	LayerRecord( const LayerRecord& src )
-	{
-		m_sequence = src.m_sequence;
-		m_cycle = src.m_cycle;
-		m_weight = src.m_weight;
-		m_order = src.m_order;
-	}
-};
+// Layer fields are stored as arrays padded to a multiple of four, so they
+// can be interpolated a fltx4 at a time
+#define LAYER_RECORD_SLOTS ( ( MAX_LAYER_RECORDS + 3 ) & ~3 )
 
 struct LagRecord
 {
@@ -77,30 +59,19 @@ public:
 		m_vecMinsPreScaled.Init();
 		m_vecMaxsPreScaled.Init();
 		m_flSimulationTime = -1;
+		memset( m_layerSequence, 0, sizeof( m_layerSequence ) );
+		memset( m_layerCycle, 0, sizeof( m_layerCycle ) );
+		memset( m_layerWeight, 0, sizeof( m_layerWeight ) );
+		memset( m_layerOrder, 0, sizeof( m_layerOrder ) );
 		m_masterSequence = 0;
 		m_masterCycle = 0;
 	}
 
-	LagRecord( const LagRecord& src )
-	{
-		m_fFlags = src.m_fFlags;
-		m_vecOrigin = src.m_vecOrigin;
-		m_vecAngles = src.m_vecAngles;
-		m_vecMinsPreScaled = src.m_vecMinsPreScaled;
-		m_vecMaxsPreScaled = src.m_vecMaxsPreScaled;
-		m_flSimulationTime = src.m_flSimulationTime;
-		for( int layerIndex = 0; layerIndex < MAX_LAYER_RECORDS; ++layerIndex )
-		{
-			m_layerRecords[layerIndex] = src.m_layerRecords[layerIndex];
-		}
-		m_masterSequence = src.m_masterSequence;
-		m_masterCycle = src.m_masterCycle;
-	}
-
 	// Did player die this frame
 	int						m_fFlags;
 
-	// Player position, orientation and bbox
+	// Player position, orientation and bbox. These are interpolated as one
+	// block of 12 floats and must stay together, in this order.
 	Vector					m_vecOrigin;
 	QAngle					m_vecAngles;
 	Vector					m_vecMinsPreScaled;
@@ -109,11 +80,206 @@ public:
 	float					m_flSimulationTime;	
 	
 	// Player animation details, so we can get the legs in the right spot.
-	LayerRecord				m_layerRecords[MAX_LAYER_RECORDS];
+	int						m_layerSequence[LAYER_RECORD_SLOTS];
+	float					m_layerCycle[LAYER_RECORD_SLOTS];
+	float					m_layerWeight[LAYER_RECORD_SLOTS];
+	int						m_layerOrder[LAYER_RECORD_SLOTS];
 	int						m_masterSequence;
 	float					m_masterCycle;
 };
 
+//-----------------------------------------------------------------------------
+// Purpose: A player's lag records in a fixed size ring, newest first. Records
+//			are only added for newer simulation times, so they can be found
+//			by binary search.
+//
+//			The backtrack walk gives up on records past a death or a teleport.
+//			Those are flagged as records are added, so a lookup doesn't have to
+//			walk the records to check them.
+//-----------------------------------------------------------------------------
+#define LAG_RECORD_HISTORY		128		// Must be a power of two; covers sv_maxunlag at up to 128 ticks a second
+
+class CLagRecordTrack
+{
+public:
+	CLagRecordTrack()
+	{
+		m_pRecords = NULL;
+		m_iHead = 0;
+		m_nCount = 0;
+		m_nAdded = 0;
+		m_nBreakEnd = 0;
+	}
+
+	~CLagRecordTrack()
+	{
+		Purge();
+	}
+
+	int Count() const					{ return m_nCount; }
+
+	// 0 is the newest record
+	LagRecord &Element( int nAge )					{ Assert( nAge >= 0 && nAge < m_nCount ); return m_pRecords[ ( m_iHead - nAge ) & ( LAG_RECORD_HISTORY - 1 ) ]; }
+	const LagRecord &Element( int nAge ) const		{ Assert( nAge >= 0 && nAge < m_nCount ); return m_pRecords[ ( m_iHead - nAge ) & ( LAG_RECORD_HISTORY - 1 ) ]; }
+
+	// The new record is reset; call CommitHead() once it's filled in
+	LagRecord &AddToHead()
+	{
+		if ( !m_pRecords )
+		{
+			m_pRecords = new LagRecord[ LAG_RECORD_HISTORY ];
+		}
+
+		m_iHead = ( m_iHead + 1 ) & ( LAG_RECORD_HISTORY - 1 );
+		m_nCount = MIN( m_nCount + 1, LAG_RECORD_HISTORY );
+		m_nAdded++;
+
+		LagRecord &record = m_pRecords[ m_iHead ];
+		record = LagRecord();
+		return record;
+	}
+
+	void CommitHead( float flTeleportDistanceSqr )
+	{
+		const LagRecord &head = Element( 0 );
+		if ( !( head.m_fFlags & LC_ALIVE ) )
+		{
+			m_nBreakEnd = m_nAdded;
+		}
+		else if ( m_nCount > 1 && ( head.m_vecOrigin - Element( 1 ).m_vecOrigin ).Length2DSqr() > flTeleportDistanceSqr )
+		{
+			// The walk stops at the older record
+			m_nBreakEnd = MAX( m_nBreakEnd, m_nAdded - 1 );
+		}
+	}
+
+	void RemoveTail()					{ Assert( m_nCount > 0 ); m_nCount--; }
+	void RemoveAll()					{ m_nCount = 0; }
+
+	void Purge()
+	{
+		delete [] m_pRecords;
+		m_pRecords = NULL;
+		m_nCount = 0;
+	}
+
+	// Age of the newest record at or before the time, or the oldest record
+	// if they are all newer
+	int FindRecord( float flTime ) const
+	{
+		int nLow = 0;
+		int nHigh = m_nCount - 1;
+		while ( nLow < nHigh )
+		{
+			int nMid = ( nLow + nHigh ) / 2;
+			if ( Element( nMid ).m_flSimulationTime <= flTime )
+			{
+				nHigh = nMid;
+			}
+			else
+			{
+				nLow = nMid + 1;
+			}
+		}
+		return nLow;
+	}
+
+	// True if no record from the newest back to this one is dead or was
+	// teleported away from
+	bool IsContinuous( int nAge ) const
+	{
+		unsigned int nSerial = m_nAdded - nAge;	// one past the record's own
+		return ( m_nBreakEnd < nSerial );
+	}
+
+private:
+	LagRecord		*m_pRecords;
+	int				m_iHead;
+	int				m_nCount;
+	unsigned int	m_nAdded;		// records ever added, so a record's serial is m_nAdded - age
+	unsigned int	m_nBreakEnd;	// one past the serial of the newest dead or teleported record
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Interpolates between two records. from is the older record, at or
+//			before the target time, and to the newer one. Position and bounds
+//			are lerped with SIMD, as are all the layers at once; angles are
+//			slerped as before.
+//-----------------------------------------------------------------------------
+COMPILE_TIME_ASSERT( offsetof( LagRecord, m_vecAngles ) == offsetof( LagRecord, m_vecOrigin ) + 3 * sizeof( float ) );
+COMPILE_TIME_ASSERT( offsetof( LagRecord, m_vecMinsPreScaled ) == offsetof( LagRecord, m_vecOrigin ) + 6 * sizeof( float ) );
+COMPILE_TIME_ASSERT( offsetof( LagRecord, m_vecMaxsPreScaled ) == offsetof( LagRecord, m_vecOrigin ) + 9 * sizeof( float ) );
+
+static void LerpLagRecords( float frac, const LagRecord &from, const LagRecord &to, LagRecord &out )
+{
+	fltx4 fl4Frac = ReplicateX4( frac );
+
+	const float *pFrom = from.m_vecOrigin.Base();
+	const float *pTo = to.m_vecOrigin.Base();
+	float *pOut = out.m_vecOrigin.Base();
+	for ( int i = 0; i < 12; i += 4 )
+	{
+		fltx4 fl4From = LoadUnalignedSIMD( pFrom + i );
+		fltx4 fl4To = LoadUnalignedSIMD( pTo + i );
+		StoreUnalignedSIMD( pOut + i, MaddSIMD( SubSIMD( fl4To, fl4From ), fl4Frac, fl4From ) );
+	}
+
+	out.m_vecAngles = Lerp( frac, from.m_vecAngles, to.m_vecAngles );
+
+	// If the master state changes, all layers will be invalid too, so don't interp (ya know, interp barely ever happens anyway)
+	if ( from.m_masterSequence != to.m_masterSequence )
+	{
+		out.m_masterSequence = from.m_masterSequence;
+		out.m_masterCycle = from.m_masterCycle;
+		memcpy( out.m_layerSequence, from.m_layerSequence, sizeof( out.m_layerSequence ) );
+		memcpy( out.m_layerCycle, from.m_layerCycle, sizeof( out.m_layerCycle ) );
+		memcpy( out.m_layerWeight, from.m_layerWeight, sizeof( out.m_layerWeight ) );
+		memcpy( out.m_layerOrder, from.m_layerOrder, sizeof( out.m_layerOrder ) );
+		return;
+	}
+
+	out.m_masterSequence = from.m_masterSequence;
+	if( from.m_masterCycle > to.m_masterCycle )
+	{
+		// the older record is higher in frame than the newer, it must have wrapped around from 1 back to 0
+		// add one to the newer so it is lerping from .9 to 1.1 instead of .9 to .1, for example.
+		float newCycle = Lerp( frac, from.m_masterCycle, to.m_masterCycle + 1 );
+		out.m_masterCycle = newCycle < 1 ? newCycle : newCycle - 1;// and make sure .9 to 1.2 does not end up 1.05
+	}
+	else
+	{
+		out.m_masterCycle = Lerp( frac, from.m_masterCycle, to.m_masterCycle );
+	}
+
+	// Layers can't be interpolated across a sequence or order change, so those keep the older record
+	memcpy( out.m_layerSequence, from.m_layerSequence, sizeof( out.m_layerSequence ) );
+	memcpy( out.m_layerOrder, from.m_layerOrder, sizeof( out.m_layerOrder ) );
+
+	for ( int i = 0; i < LAYER_RECORD_SLOTS; i += 4 )
+	{
+		fltx4 fl4SameSequence = CmpEqSIMD( SignedIntConvertToFltSIMD( LoadUnalignedIntSIMD( &from.m_layerSequence[i] ) ),
+											SignedIntConvertToFltSIMD( LoadUnalignedIntSIMD( &to.m_layerSequence[i] ) ) );
+		fltx4 fl4SameOrder = CmpEqSIMD( SignedIntConvertToFltSIMD( LoadUnalignedIntSIMD( &from.m_layerOrder[i] ) ),
+										 SignedIntConvertToFltSIMD( LoadUnalignedIntSIMD( &to.m_layerOrder[i] ) ) );
+		fltx4 fl4CanLerp = AndSIMD( fl4SameSequence, fl4SameOrder );
+
+		fltx4 fl4CycleFrom = LoadUnalignedSIMD( &from.m_layerCycle[i] );
+		fltx4 fl4CycleTo = LoadUnalignedSIMD( &to.m_layerCycle[i] );
+
+		// Same wrap around as the master cycle
+		fltx4 fl4Wrapped = CmpGtSIMD( fl4CycleFrom, fl4CycleTo );
+		fl4CycleTo = AddSIMD( fl4CycleTo, AndSIMD( fl4Wrapped, Four_Ones ) );
+		fltx4 fl4Cycle = MaddSIMD( SubSIMD( fl4CycleTo, fl4CycleFrom ), fl4Frac, fl4CycleFrom );
+		fl4Cycle = MaskedAssign( AndSIMD( fl4Wrapped, CmpGeSIMD( fl4Cycle, Four_Ones ) ), SubSIMD( fl4Cycle, Four_Ones ), fl4Cycle );
+
+		fltx4 fl4WeightFrom = LoadUnalignedSIMD( &from.m_layerWeight[i] );
+		fltx4 fl4WeightTo = LoadUnalignedSIMD( &to.m_layerWeight[i] );
+		fltx4 fl4Weight = MaddSIMD( SubSIMD( fl4WeightTo, fl4WeightFrom ), fl4Frac, fl4WeightFrom );
+
+		StoreUnalignedSIMD( &out.m_layerCycle[i], MaskedAssign( fl4CanLerp, fl4Cycle, fl4CycleFrom ) );
+		StoreUnalignedSIMD( &out.m_layerWeight[i], MaskedAssign( fl4CanLerp, fl4Weight, fl4WeightFrom ) );
+	}
+}
 
 //
 // Try to take the player from his current origin to vWantedPos.
@@ -203,8 +369,8 @@ private:
 			m_PlayerTrack[i].Purge();
 	}
 
-	// keep a list of lag records for each player
-	CUtlFixedLinkedList< LagRecord >	m_PlayerTrack[ MAX_PLAYERS ];
+	// keep a history of lag records for each player
+	CLagRecordTrack			m_PlayerTrack[ MAX_PLAYERS ];
 
 	// Scratchpad for determining what needs to be restored
 	CBitVec<MAX_PLAYERS>	m_RestorePlayer;
@@ -245,7 +411,7 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 	{
 		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
 
-		CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[i-1];
+		CLagRecordTrack *track = &m_PlayerTrack[i-1];
 
 		if ( !pPlayer )
 		{
@@ -257,27 +423,23 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 			continue;
 		}
 
-		Assert( track->Count() < 1000 ); // insanity check
-
 		// remove tail records that are too old
-		int tailIndex = track->Tail();
-		while ( track->IsValidIndex( tailIndex ) )
+		while ( track->Count() > 0 )
 		{
-			LagRecord &tail = track->Element( tailIndex );
+			LagRecord &tail = track->Element( track->Count() - 1 );
 
 			// if tail is within limits, stop
 			if ( tail.m_flSimulationTime >= flDeadtime )
 				break;
 			
-			// remove tail, get new tail
-			track->Remove( tailIndex );
-			tailIndex = track->Tail();
+			// remove tail
+			track->RemoveTail();
 		}
 
 		// check if head has same simulation time
 		if ( track->Count() > 0 )
 		{
-			LagRecord &head = track->Element( track->Head() );
+			LagRecord &head = track->Element( 0 );
 
 			// check if player changed simulation time since last time updated
 			if ( head.m_flSimulationTime >= pPlayer->GetSimulationTime() )
@@ -285,7 +447,7 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 		}
 
 		// add new record to player track
-		LagRecord &record = track->Element( track->AddToHead() );
+		LagRecord &record = track->AddToHead();
 
 		record.m_fFlags = 0;
 		if ( pPlayer->IsAlive() )
@@ -305,14 +467,16 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 			CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
 			if( currentLayer )
 			{
-				record.m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
-				record.m_layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
-				record.m_layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
-				record.m_layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
+				record.m_layerCycle[layerIndex] = currentLayer->m_flCycle;
+				record.m_layerOrder[layerIndex] = currentLayer->m_nOrder;
+				record.m_layerSequence[layerIndex] = currentLayer->m_nSequence;
+				record.m_layerWeight[layerIndex] = currentLayer->m_flWeight;
 			}
 		}
 		record.m_masterSequence = pPlayer->GetSequence();
 		record.m_masterCycle = pPlayer->GetCycle();
+
+		track->CommitHead( m_flTeleportDistanceSqr );
 	}
 
 	//Clear the current player.
@@ -411,75 +575,35 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 	}
 }
 
-void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTargetTime )
+//-----------------------------------------------------------------------------
+// Purpose: Works out where a player was at the target time from their track.
+//			Returns false if the history can't be used (empty, or the player
+//			died or teleported since then).
+//-----------------------------------------------------------------------------
+static bool FindBacktrackTarget( const CLagRecordTrack &track, const Vector &vecCurrentOrigin, float flTargetTime, float flTeleportDistanceSqr, LagRecord &target )
 {
-	Vector org;
-	Vector minsPreScaled;
-	Vector maxsPreScaled;
-	QAngle ang;
-
-	VPROF_BUDGET( "BacktrackPlayer", "CLagCompensationManager" );
-	int pl_index = pPlayer->entindex() - 1;
-
-	// get track history of this player
-	CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[ pl_index ];
-
 	// check if we have at leat one entry
-	if ( track->Count() <= 0 )
-		return;
+	if ( track.Count() <= 0 )
+		return false;
 
-	int curr = track->Head();
-
-	LagRecord *prevRecord = NULL;
-	LagRecord *record = NULL;
+	// find the first record at or before the target time, walking back from the newest
+	int nAge = track.FindRecord( flTargetTime );
 
-	Vector prevOrg = pPlayer->GetLocalOrigin();
-	
-	// Walk context looking for any invalidating event
-	while( track->IsValidIndex(curr) )
+	if ( !track.IsContinuous( nAge ) )
 	{
-		// remember last record
-		prevRecord = record;
-
-		// get next record
-		record = &track->Element( curr );
-
-		if ( !(record->m_fFlags & LC_ALIVE) )
-		{
-			// player most be alive, lost track
-			return;
-		}
-
-		Vector delta = record->m_vecOrigin - prevOrg;
-		if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
-		{
-			// lost track, too much difference
-			return; 
-		}
-
-		// did we find a context smaller than target time ?
-		if ( record->m_flSimulationTime <= flTargetTime )
-			break; // hurra, stop
-
-		prevOrg = record->m_vecOrigin;
-
-		// go one step back
-		curr = track->Next( curr );
+		// player most be alive, or we lost track because of too much difference
+		return false;
 	}
 
-	Assert( record );
-
-	if ( !record )
+	if ( ( track.Element( 0 ).m_vecOrigin - vecCurrentOrigin ).Length2DSqr() > flTeleportDistanceSqr )
 	{
-		if ( sv_unlag_debug.GetBool() )
-		{
-			DevMsg( "No valid positions in history for BacktrackPlayer client ( %s )\n", pPlayer->GetPlayerName() );
-		}
-
-		return; // that should never happen
+		// lost track, too much difference
+		return false;
 	}
 
-	float frac = 0.0f;
+	const LagRecord *record = &track.Element( nAge );
+	const LagRecord *prevRecord = ( nAge > 0 ) ? &track.Element( nAge - 1 ) : NULL;
+
 	if ( prevRecord && 
 		 (record->m_flSimulationTime < flTargetTime) &&
 		 (record->m_flSimulationTime < prevRecord->m_flSimulationTime) )
@@ -491,26 +615,38 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 		Assert( flTargetTime < prevRecord->m_flSimulationTime );
 
 		// calc fraction between both records
-		frac = ( flTargetTime - record->m_flSimulationTime ) / 
+		float frac = ( flTargetTime - record->m_flSimulationTime ) / 
 			( prevRecord->m_flSimulationTime - record->m_flSimulationTime );
 
 		Assert( frac > 0 && frac < 1 ); // should never extrapolate
 
-		ang				= Lerp( frac, record->m_vecAngles, prevRecord->m_vecAngles );
-		org				= Lerp( frac, record->m_vecOrigin, prevRecord->m_vecOrigin );
-		minsPreScaled	= Lerp( frac, record->m_vecMinsPreScaled, prevRecord->m_vecMinsPreScaled );
-		maxsPreScaled	= Lerp( frac, record->m_vecMaxsPreScaled, prevRecord->m_vecMaxsPreScaled );
+		LerpLagRecords( frac, *record, *prevRecord, target );
 	}
 	else
 	{
 		// we found the exact record or no other record to interpolate with
 		// just copy these values since they are the best we have
-		org				= record->m_vecOrigin;
-		ang				= record->m_vecAngles;
-		minsPreScaled	= record->m_vecMinsPreScaled;
-		maxsPreScaled	= record->m_vecMaxsPreScaled;
+		target = *record;
 	}
 
+	return true;
+}
+
+void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTargetTime )
+{
+	VPROF_BUDGET( "BacktrackPlayer", "CLagCompensationManager" );
+	int pl_index = pPlayer->entindex() - 1;
+
+	// the interpolated (or copied) position and animation we're moving the player to
+	LagRecord target;
+	if ( !FindBacktrackTarget( m_PlayerTrack[ pl_index ], pPlayer->GetLocalOrigin(), flTargetTime, m_flTeleportDistanceSqr, target ) )
+		return;
+
+	Vector org = target.m_vecOrigin;
+	const Vector &minsPreScaled = target.m_vecMinsPreScaled;
+	const Vector &maxsPreScaled = target.m_vecMaxsPreScaled;
+	const QAngle &ang = target.m_vecAngles;
+
 	// See if this is still a valid position for us to teleport to
 	if ( sv_unlag_fixstuck.GetBool() )
 	{
@@ -619,39 +755,8 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	restore->m_masterSequence = pPlayer->GetSequence();
 	restore->m_masterCycle = pPlayer->GetCycle();
 
-	bool interpolationAllowed = false;
-	if( prevRecord && (record->m_masterSequence == prevRecord->m_masterSequence) )
-	{
-		// If the master state changes, all layers will be invalid too, so don't interp (ya know, interp barely ever happens anyway)
-		interpolationAllowed = true;
-	}
-	
-	////////////////////////
-	// First do the master settings
-	bool interpolatedMasters = false;
-	if( frac > 0.0f && interpolationAllowed )
-	{
-		interpolatedMasters = true;
-		pPlayer->SetSequence( Lerp( frac, record->m_masterSequence, prevRecord->m_masterSequence ) );
-		pPlayer->SetCycle( Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle ) );
-
-		if( record->m_masterCycle > prevRecord->m_masterCycle )
-		{
-			// the older record is higher in frame than the newer, it must have wrapped around from 1 back to 0
-			// add one to the newer so it is lerping from .9 to 1.1 instead of .9 to .1, for example.
-			float newCycle = Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle + 1 );
-			pPlayer->SetCycle(newCycle < 1 ? newCycle : newCycle - 1 );// and make sure .9 to 1.2 does not end up 1.05
-		}
-		else
-		{
-			pPlayer->SetCycle( Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle ) );
-		}
-	}
-	if( !interpolatedMasters )
-	{
-		pPlayer->SetSequence(record->m_masterSequence);
-		pPlayer->SetCycle(record->m_masterCycle);
-	}
+	pPlayer->SetSequence( target.m_masterSequence );
+	pPlayer->SetCycle( target.m_masterCycle );
 
 	////////////////////////
 	// Now do all the layers
@@ -661,46 +766,15 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 		CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
 		if( currentLayer )
 		{
-			restore->m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
-			restore->m_layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
-			restore->m_layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
-			restore->m_layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
-
-			bool interpolated = false;
-			if( (frac > 0.0f)  &&  interpolationAllowed )
-			{
-				LayerRecord &recordsLayerRecord = record->m_layerRecords[layerIndex];
-				LayerRecord &prevRecordsLayerRecord = prevRecord->m_layerRecords[layerIndex];
-				if( (recordsLayerRecord.m_order == prevRecordsLayerRecord.m_order)
-					&& (recordsLayerRecord.m_sequence == prevRecordsLayerRecord.m_sequence)
-					)
-				{
-					// We can't interpolate across a sequence or order change
-					interpolated = true;
-					if( recordsLayerRecord.m_cycle > prevRecordsLayerRecord.m_cycle )
-					{
-						// the older record is higher in frame than the newer, it must have wrapped around from 1 back to 0
-						// add one to the newer so it is lerping from .9 to 1.1 instead of .9 to .1, for example.
-						float newCycle = Lerp( frac, recordsLayerRecord.m_cycle, prevRecordsLayerRecord.m_cycle + 1 );
-						currentLayer->m_flCycle = newCycle < 1 ? newCycle : newCycle - 1;// and make sure .9 to 1.2 does not end up 1.05
-					}
-					else
-					{
-						currentLayer->m_flCycle = Lerp( frac, recordsLayerRecord.m_cycle, prevRecordsLayerRecord.m_cycle  );
-					}
-					currentLayer->m_nOrder = recordsLayerRecord.m_order;
-					currentLayer->m_nSequence = recordsLayerRecord.m_sequence;
-					currentLayer->m_flWeight = Lerp( frac, recordsLayerRecord.m_weight, prevRecordsLayerRecord.m_weight  );
-				}
-			}
-			if( !interpolated )
-			{
-				//Either no interp, or interp failed.  Just use record.
-				currentLayer->m_flCycle = record->m_layerRecords[layerIndex].m_cycle;
-				currentLayer->m_nOrder = record->m_layerRecords[layerIndex].m_order;
-				currentLayer->m_nSequence = record->m_layerRecords[layerIndex].m_sequence;
-				currentLayer->m_flWeight = record->m_layerRecords[layerIndex].m_weight;
-			}
+			restore->m_layerCycle[layerIndex] = currentLayer->m_flCycle;
+			restore->m_layerOrder[layerIndex] = currentLayer->m_nOrder;
+			restore->m_layerSequence[layerIndex] = currentLayer->m_nSequence;
+			restore->m_layerWeight[layerIndex] = currentLayer->m_flWeight;
+
+			currentLayer->m_flCycle = target.m_layerCycle[layerIndex];
+			currentLayer->m_nOrder = target.m_layerOrder[layerIndex];
+			currentLayer->m_nSequence = target.m_layerSequence[layerIndex];
+			currentLayer->m_flWeight = target.m_layerWeight[layerIndex];
 		}
 	}
 	
@@ -815,10 +889,10 @@ void CLagCompensationManager::FinishLagCompensation( CBasePlayer *player )
 				CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
 				if( currentLayer )
 				{
-					currentLayer->m_flCycle = restore->m_layerRecords[layerIndex].m_cycle;
-					currentLayer->m_nOrder = restore->m_layerRecords[layerIndex].m_order;
-					currentLayer->m_nSequence = restore->m_layerRecords[layerIndex].m_sequence;
-					currentLayer->m_flWeight = restore->m_layerRecords[layerIndex].m_weight;
+					currentLayer->m_flCycle = restore->m_layerCycle[layerIndex];
+					currentLayer->m_nOrder = restore->m_layerOrder[layerIndex];
+					currentLayer->m_nSequence = restore->m_layerSequence[layerIndex];
+					currentLayer->m_flWeight = restore->m_layerWeight[layerIndex];
 				}
 			}
 		}
@@ -831,3 +905,236 @@ void CLagCompensationManager::FinishLagCompensation( CBasePlayer *player )
 }
 
 
+
+//-----------------------------------------------------------------------------
+// Benchmark
+//-----------------------------------------------------------------------------
+
+// The linked list walk and per field interpolation BacktrackPlayer did before
+// the ring buffer, kept to time against
+static bool FindBacktrackTargetLinear( CUtlFixedLinkedList< LagRecord > &track, const Vector &vecCurrentOrigin, float flTargetTime, float flTeleportDistanceSqr, LagRecord &target )
+{
+	if ( track.Count() <= 0 )
+		return false;
+
+	int curr = track.Head();
+
+	LagRecord *prevRecord = NULL;
+	LagRecord *record = NULL;
+
+	Vector prevOrg = vecCurrentOrigin;
+	
+	while( track.IsValidIndex(curr) )
+	{
+		prevRecord = record;
+		record = &track.Element( curr );
+
+		if ( !(record->m_fFlags & LC_ALIVE) )
+			return false;
+
+		Vector delta = record->m_vecOrigin - prevOrg;
+		if ( delta.Length2DSqr() > flTeleportDistanceSqr )
+			return false; 
+
+		if ( record->m_flSimulationTime <= flTargetTime )
+			break;
+
+		prevOrg = record->m_vecOrigin;
+		curr = track.Next( curr );
+	}
+
+	float frac = 0.0f;
+	if ( prevRecord && 
+		 (record->m_flSimulationTime < flTargetTime) &&
+		 (record->m_flSimulationTime < prevRecord->m_flSimulationTime) )
+	{
+		frac = ( flTargetTime - record->m_flSimulationTime ) / 
+			( prevRecord->m_flSimulationTime - record->m_flSimulationTime );
+
+		target.m_vecAngles			= Lerp( frac, record->m_vecAngles, prevRecord->m_vecAngles );
+		target.m_vecOrigin			= Lerp( frac, record->m_vecOrigin, prevRecord->m_vecOrigin );
+		target.m_vecMinsPreScaled	= Lerp( frac, record->m_vecMinsPreScaled, prevRecord->m_vecMinsPreScaled );
+		target.m_vecMaxsPreScaled	= Lerp( frac, record->m_vecMaxsPreScaled, prevRecord->m_vecMaxsPreScaled );
+	}
+	else
+	{
+		target.m_vecOrigin			= record->m_vecOrigin;
+		target.m_vecAngles			= record->m_vecAngles;
+		target.m_vecMinsPreScaled	= record->m_vecMinsPreScaled;
+		target.m_vecMaxsPreScaled	= record->m_vecMaxsPreScaled;
+	}
+
+	bool interpolationAllowed = ( prevRecord && (record->m_masterSequence == prevRecord->m_masterSequence) );
+
+	target.m_masterSequence = record->m_masterSequence;
+	target.m_masterCycle = record->m_masterCycle;
+	if( frac > 0.0f && interpolationAllowed )
+	{
+		if( record->m_masterCycle > prevRecord->m_masterCycle )
+		{
+			float newCycle = Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle + 1 );
+			target.m_masterCycle = newCycle < 1 ? newCycle : newCycle - 1;
+		}
+		else
+		{
+			target.m_masterCycle = Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle );
+		}
+	}
+
+	for( int layerIndex = 0; layerIndex < MAX_LAYER_RECORDS; ++layerIndex )
+	{
+		target.m_layerOrder[layerIndex] = record->m_layerOrder[layerIndex];
+		target.m_layerSequence[layerIndex] = record->m_layerSequence[layerIndex];
+		target.m_layerCycle[layerIndex] = record->m_layerCycle[layerIndex];
+		target.m_layerWeight[layerIndex] = record->m_layerWeight[layerIndex];
+
+		if( (frac > 0.0f) && interpolationAllowed &&
+			(record->m_layerOrder[layerIndex] == prevRecord->m_layerOrder[layerIndex]) &&
+			(record->m_layerSequence[layerIndex] == prevRecord->m_layerSequence[layerIndex]) )
+		{
+			if( record->m_layerCycle[layerIndex] > prevRecord->m_layerCycle[layerIndex] )
+			{
+				float newCycle = Lerp( frac, record->m_layerCycle[layerIndex], prevRecord->m_layerCycle[layerIndex] + 1 );
+				target.m_layerCycle[layerIndex] = newCycle < 1 ? newCycle : newCycle - 1;
+			}
+			else
+			{
+				target.m_layerCycle[layerIndex] = Lerp( frac, record->m_layerCycle[layerIndex], prevRecord->m_layerCycle[layerIndex] );
+			}
+			target.m_layerWeight[layerIndex] = Lerp( frac, record->m_layerWeight[layerIndex], prevRecord->m_layerWeight[layerIndex] );
+		}
+	}
+
+	return true;
+}
+
+static bool LagRecordsMatch( const LagRecord &a, const LagRecord &b )
+{
+	const float flTolerance = 0.001f;
+
+	if ( !VectorsAreEqual( a.m_vecOrigin, b.m_vecOrigin, flTolerance ) ||
+		 !QAnglesAreEqual( a.m_vecAngles, b.m_vecAngles, flTolerance ) ||
+		 !VectorsAreEqual( a.m_vecMinsPreScaled, b.m_vecMinsPreScaled, flTolerance ) ||
+		 !VectorsAreEqual( a.m_vecMaxsPreScaled, b.m_vecMaxsPreScaled, flTolerance ) ||
+		 a.m_masterSequence != b.m_masterSequence ||
+		 fabs( a.m_masterCycle - b.m_masterCycle ) > flTolerance )
+		return false;
+
+	for ( int i = 0; i < MAX_LAYER_RECORDS; i++ )
+	{
+		if ( a.m_layerSequence[i] != b.m_layerSequence[i] || a.m_layerOrder[i] != b.m_layerOrder[i] ||
+			 fabs( a.m_layerCycle[i] - b.m_layerCycle[i] ) > flTolerance ||
+			 fabs( a.m_layerWeight[i] - b.m_layerWeight[i] ) > flTolerance )
+			return false;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+CON_COMMAND( sv_unlag_benchmark, "Times lag compensation lookups against synthetic player histories. Arguments: [players] [backtracks per tick] [ticks] [seed]" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int nPlayers = ( args.ArgC() > 1 ) ? clamp( atoi( args[1] ), 1, MAX_PLAYERS ) : MAX_PLAYERS;
+	int nBacktracks = ( args.ArgC() > 2 ) ? MAX( 1, atoi( args[2] ) ) : nPlayers;
+	int nTicks = ( args.ArgC() > 3 ) ? MAX( 1, atoi( args[3] ) ) : 1000;
+	int seed = ( args.ArgC() > 4 ) ? atoi( args[4] ) : 1;
+
+	// Enough history to cover sv_maxunlag, one record per tick
+	int nRecords = clamp( TIME_TO_TICKS( sv_maxunlag.GetFloat() ), 2, LAG_RECORD_HISTORY );
+	float flTeleportDistanceSqr = sv_lagcompensation_teleport_dist.GetFloat() * sv_lagcompensation_teleport_dist.GetFloat();
+
+	CUniformRandomStream randomStream;
+	randomStream.SetSeed( seed );
+
+	CLagRecordTrack *pTracks = new CLagRecordTrack[ nPlayers ];
+	CUtlFixedLinkedList< LagRecord > *pLists = new CUtlFixedLinkedList< LagRecord >[ nPlayers ];
+	CUtlVector<Vector> currentOrigins;
+	currentOrigins.SetCount( nPlayers );
+
+	for ( int p = 0; p < nPlayers; p++ )
+	{
+		Vector org( randomStream.RandomFloat( -4096, 4096 ), randomStream.RandomFloat( -4096, 4096 ), 0 );
+		float yaw = randomStream.RandomFloat( -180, 180 );
+
+		for ( int r = 0; r < nRecords; r++ )
+		{
+			org += Vector( randomStream.RandomFloat( -8, 8 ), randomStream.RandomFloat( -8, 8 ), 0 );
+			yaw = AngleNormalize( yaw + randomStream.RandomFloat( -10, 10 ) );
+
+			LagRecord &record = pTracks[p].AddToHead();
+			record.m_fFlags = LC_ALIVE;
+			record.m_flSimulationTime = TICKS_TO_TIME( r );
+			record.m_vecOrigin = org;
+			record.m_vecAngles.Init( randomStream.RandomFloat( -30, 30 ), yaw, 0 );
+			record.m_vecMinsPreScaled.Init( -16, -16, 0 );
+			record.m_vecMaxsPreScaled.Init( 16, 16, ( r & 32 ) ? 36 : 72 );
+			record.m_masterSequence = r / 24;
+			record.m_masterCycle = fmodf( r * 0.05f, 1.0f );
+
+			for ( int i = 0; i < MAX_LAYER_RECORDS; i++ )
+			{
+				record.m_layerSequence[i] = i + r / ( 8 + i );
+				record.m_layerOrder[i] = i;
+				record.m_layerCycle[i] = fmodf( r * 0.07f + i * 0.1f, 1.0f );
+				record.m_layerWeight[i] = randomStream.RandomFloat( 0, 1 );
+			}
+
+			pTracks[p].CommitHead( flTeleportDistanceSqr );
+			pLists[p].Element( pLists[p].AddToHead() ) = record;
+		}
+
+		currentOrigins[p] = org;
+	}
+
+	// The same target times for both
+	CUtlVector<float> targetTimes;
+	targetTimes.SetCount( nPlayers * nBacktracks );
+
+	int nMismatched = 0;
+	double flTime[2] = { 0, 0 };
+	LagRecord target[2];
+
+	for ( int t = 0; t < nTicks; t++ )
+	{
+		for ( int i = 0; i < targetTimes.Count(); i++ )
+		{
+			targetTimes[i] = randomStream.RandomFloat( 0, TICKS_TO_TIME( nRecords - 1 ) );
+		}
+
+		double flStart = Plat_FloatTime();
+		for ( int i = 0; i < targetTimes.Count(); i++ )
+		{
+			int p = i / nBacktracks;
+			FindBacktrackTargetLinear( pLists[p], currentOrigins[p], targetTimes[i], flTeleportDistanceSqr, target[0] );
+		}
+		flTime[0] += Plat_FloatTime() - flStart;
+
+		flStart = Plat_FloatTime();
+		for ( int i = 0; i < targetTimes.Count(); i++ )
+		{
+			int p = i / nBacktracks;
+			FindBacktrackTarget( pTracks[p], currentOrigins[p], targetTimes[i], flTeleportDistanceSqr, target[1] );
+		}
+		flTime[1] += Plat_FloatTime() - flStart;
+
+		// Check the last of each tick gave the same answer
+		if ( !LagRecordsMatch( target[0], target[1] ) )
+			nMismatched++;
+	}
+
+	delete [] pTracks;
+	delete [] pLists;
+
+	int nQueries = nPlayers * nBacktracks * nTicks;
+	Msg( "sv_unlag_benchmark: %d players, %d backtracks each per tick, %d ticks, %d records per player\n", nPlayers, nBacktracks, nTicks, nRecords );
+	Msg( "  linked list : %8.3f ms total, %7.3f us/backtrack\n", flTime[0] * 1000.0, flTime[0] * 1000000.0 / nQueries );
+	Msg( "  ring buffer : %8.3f ms total, %7.3f us/backtrack\n", flTime[1] * 1000.0, flTime[1] * 1000000.0 / nQueries );
+	if ( flTime[1] > 0 )
+		Msg( "  speedup     : %.2fx\n", flTime[0] / flTime[1] );
+	if ( nMismatched )
+		Msg( "  WARNING: %d ticks produced different results\n", nMismatched );
+}
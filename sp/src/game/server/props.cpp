@@ -3136,6 +3136,7 @@ void CPhysicsProp::Spawn( )
 	{
 #ifdef MAPBASE
 		m_iClassname = gm_isz_class_PropPhysics;
+		gEntList.ReportEntityNamesChanged( this );
 #else
 		SetClassname( "prop_physics" );
 #endif
@@ -3151,6 +3152,7 @@ void CPhysicsProp::Spawn( )
 	if ( EntIsClass( this, gm_isz_class_PropPhysicsOverride ) )
 	{
 		m_iClassname = gm_isz_class_PropPhysics;
+		gEntList.ReportEntityNamesChanged( this );
 	}
 #else
 	if ( FClassnameIs( this, "prop_physics_override") )
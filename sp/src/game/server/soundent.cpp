@@ -21,6 +21,26 @@
 #define SOUNDLISTTYPE_FREE		1
 #define SOUNDLISTTYPE_ACTIVE	2
 
+// The sound grid has a level for each range of volumes. A sound is linked into the cell
+// under it on the first level whose cells are at least as wide as its volume, so a
+// listener only has to look at the cells within a cell's width (times its hearing
+// sensitivity) of it on each level. Cells are hashed into SOUND_GRID_BUCKETS buckets.
+#define SOUND_GRID_LEVELS		3
+#define SOUND_GRID_UNBOUNDED	SOUND_GRID_BUCKETS	// louder sounds, and the clients' sounds, which are changed in place
+#define SOUND_GRID_MAX_REACH	4	// in cells; queries reaching further walk the active list instead
+
+static const int g_SoundGridCellSize[ SOUND_GRID_LEVELS ] = { 512, 2048, 8192 };
+
+static inline int SoundGridCoord( int iLevel, float flCoord )
+{
+	return Floor2Int( flCoord / g_SoundGridCellSize[ iLevel ] );
+}
+
+static inline int SoundGridBucket( int iLevel, int x, int y )
+{
+	return ( ( (unsigned int)x * 73856093 ) ^ ( (unsigned int)y * 19349663 ) ^ ( (unsigned int)iLevel * 83492791 ) ) & ( SOUND_GRID_BUCKETS - 1 );
+}
+
 
 
 LINK_ENTITY_TO_CLASS( soundent, CSoundEnt );
@@ -84,6 +104,14 @@ void CSound::Clear ( void )
 	m_bNoExpirationTime = false;
 	m_iNext				= SOUNDLIST_EMPTY;
 	m_iNextAudible		= 0;
+	m_hOwner			= NULL;
+	m_hTarget			= NULL;
+	m_bHasOwner			= false;
+	m_ownerChannelIndex	= SOUNDENT_CHANNEL_UNSPECIFIED;
+	m_nActiveSerial		= 0;
+	m_iGridBucket		= SOUNDLIST_EMPTY;
+	m_iGridPrev			= SOUNDLIST_EMPTY;
+	m_iGridNext			= SOUNDLIST_EMPTY;
 }
 
 //=========================================================
@@ -96,6 +124,25 @@ void CSound::Reset ( void )
 	m_iType			= 0;
 	m_iVolume		= 0;
 	m_iNext			= SOUNDLIST_EMPTY;
+
+	if ( g_pSoundEnt )
+	{
+		g_pSoundEnt->RelinkSound( this );
+	}
+}
+
+//=========================================================
+// SetSoundOrigin - moves the sound, and moves it in the
+// sound grid to match.
+//=========================================================
+void CSound::SetSoundOrigin( const Vector &vecOrigin )
+{
+	m_vecOrigin = vecOrigin;
+
+	if ( g_pSoundEnt )
+	{
+		g_pSoundEnt->RelinkSound( this );
+	}
 }
 
 //=========================================================
@@ -249,10 +296,20 @@ void CSoundEnt::ShutdownSoundEnt()
 //-----------------------------------------------------------------------------
 CSoundEnt::CSoundEnt()
 {
+	m_nSoundPoolSize = MAX_WORLD_SOUNDS_SP;
+	m_nNextActiveSerial = 1;
+	m_nSoundGridQuery = 0;
+
+	for ( int i = 0; i <= SOUND_GRID_BUCKETS; i++ )
+	{
+		m_SoundGrid[ i ] = SOUNDLIST_EMPTY;
+		m_SoundGridVisited[ i ] = 0;
+	}
 }
 
 CSoundEnt::~CSoundEnt()
 {
+	FreeSoundBlocks();
 }
 
 
@@ -267,10 +324,90 @@ void CSoundEnt::Spawn( void )
 	SetNextThink( gpGlobals->curtime + 1 );
 }
 
+//-----------------------------------------------------------------------------
+// Only the first block of the sound pool is saved. If the pool has grown past it,
+// the sounds in the other blocks are left out of both lists while saving; they're
+// short lived enough not to be missed.
+//-----------------------------------------------------------------------------
+int CSoundEnt::Save( ISave &save )
+{
+	if ( m_nSoundPoolSize <= MAX_WORLD_SOUNDS_SP )
+		return BaseClass::Save( save );
+
+	short iSavedNext[ MAX_WORLD_SOUNDS_SP ];
+	for ( int i = 0; i < MAX_WORLD_SOUNDS_SP; i++ )
+	{
+		iSavedNext[ i ] = m_SoundPool[ i ].m_iNext;
+	}
+
+	int iSavedFreeSound = m_iFreeSound;
+	int iSavedActiveSound = m_iActiveSound;
+	m_iFreeSound = UnlinkUnsavedSounds( m_iFreeSound );
+	m_iActiveSound = UnlinkUnsavedSounds( m_iActiveSound );
+
+	int result = BaseClass::Save( save );
+
+	m_iFreeSound = iSavedFreeSound;
+	m_iActiveSound = iSavedActiveSound;
+	for ( int i = 0; i < MAX_WORLD_SOUNDS_SP; i++ )
+	{
+		m_SoundPool[ i ].m_iNext = iSavedNext[ i ];
+	}
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// Relinks the list starting at iSound without the sounds past the first block,
+// returning its new head.
+//-----------------------------------------------------------------------------
+int CSoundEnt::UnlinkUnsavedSounds( int iSound )
+{
+	int iHead = SOUNDLIST_EMPTY;
+	CSound *pPrevious = NULL;
+
+	while ( iSound != SOUNDLIST_EMPTY )
+	{
+		int iNext = Sound( iSound ).m_iNext;
+
+		if ( iSound < MAX_WORLD_SOUNDS_SP )
+		{
+			if ( pPrevious )
+			{
+				pPrevious->m_iNext = iSound;
+			}
+			else
+			{
+				iHead = iSound;
+			}
+			pPrevious = &m_SoundPool[ iSound ];
+		}
+
+		iSound = iNext;
+	}
+
+	if ( pPrevious )
+	{
+		pPrevious->m_iNext = SOUNDLIST_EMPTY;
+	}
+
+	return iHead;
+}
+
 void CSoundEnt::OnRestore()
 {
 	BaseClass::OnRestore();
 
+	// Neither the order sounds went active in nor the grid is saved
+	int nActiveSounds = ISoundsInList( SOUNDLISTTYPE_ACTIVE );
+	m_nNextActiveSerial = nActiveSounds + 1;
+	for ( int iSound = m_iActiveSound; iSound != SOUNDLIST_EMPTY; iSound = Sound( iSound ).m_iNext )
+	{
+		Sound( iSound ).m_nActiveSerial = nActiveSounds--;
+	}
+
+	RebuildSoundGrid();
+
 	// Make sure the singleton points to the restored version of this.
 	if ( g_pSoundEnt )
 	{
@@ -298,17 +435,17 @@ void CSoundEnt::Think ( void )
 
 	while ( iSound != SOUNDLIST_EMPTY )
 	{
-		if ( (m_SoundPool[ iSound ].m_flExpireTime <= gpGlobals->curtime && (!m_SoundPool[ iSound ].m_bNoExpirationTime)) || !m_SoundPool[iSound].ValidateOwner() )
+		if ( (Sound( iSound ).m_flExpireTime <= gpGlobals->curtime && (!Sound( iSound ).m_bNoExpirationTime)) || !Sound( iSound ).ValidateOwner() )
 		{
-			int iNext = m_SoundPool[ iSound ].m_iNext;
+			int iNext = Sound( iSound ).m_iNext;
 
 			if( displaysoundlist.GetInt() == 1 )
 			{
-				Msg("  Removed Sound: %d (Time:%f)\n", m_SoundPool[ iSound ].SoundType(), gpGlobals->curtime );
+				Msg("  Removed Sound: %d (Time:%f)\n", Sound( iSound ).SoundType(), gpGlobals->curtime );
 			}
-			if( displaysoundlist.GetInt() == 2 && m_SoundPool[ iSound ].IsSoundType( SOUND_DANGER ) )
+			if( displaysoundlist.GetInt() == 2 && Sound( iSound ).IsSoundType( SOUND_DANGER ) )
 			{
-				Msg("  Removed Danger Sound: %d (time:%f)\n", m_SoundPool[ iSound ].SoundType(), gpGlobals->curtime );
+				Msg("  Removed Danger Sound: %d (time:%f)\n", Sound( iSound ).SoundType(), gpGlobals->curtime );
 			}
 
 			// move this sound back into the free list
@@ -329,7 +466,7 @@ void CSoundEnt::Think ( void )
 				g = 255;
 				b = 0;
 
-				CSound *pSound = &m_SoundPool[ iSound ];
+				CSound *pSound = &Sound( iSound );
 
 				if( pSound->IsSoundType( SOUND_DANGER ) )
 				{
@@ -369,7 +506,7 @@ void CSoundEnt::Think ( void )
 			}
 
 			iPreviousSound = iSound;
-			iSound = m_SoundPool[ iSound ].m_iNext;
+			iSound = Sound( iSound ).m_iNext;
 		}
 	}
 
@@ -399,16 +536,18 @@ void CSoundEnt::FreeSound ( int iSound, int iPrevious )
 	{
 		// iSound is not the head of the active list, so
 		// must fix the index for the Previous sound
-		g_pSoundEnt->m_SoundPool[ iPrevious ].m_iNext = g_pSoundEnt->m_SoundPool[ iSound ].m_iNext;
+		g_pSoundEnt->Sound( iPrevious ).m_iNext = g_pSoundEnt->Sound( iSound ).m_iNext;
 	}
 	else 
 	{
 		// the sound we're freeing IS the head of the active list.
-		g_pSoundEnt->m_iActiveSound = g_pSoundEnt->m_SoundPool [ iSound ].m_iNext;
+		g_pSoundEnt->m_iActiveSound = g_pSoundEnt->Sound( iSound ).m_iNext;
 	}
 
+	g_pSoundEnt->UnlinkSoundFromGrid( iSound );
+
 	// make iSound the head of the Free list.
-	g_pSoundEnt->m_SoundPool[ iSound ].m_iNext = g_pSoundEnt->m_iFreeSound;
+	g_pSoundEnt->Sound( iSound ).m_iNext = g_pSoundEnt->m_iFreeSound;
 	g_pSoundEnt->m_iFreeSound = iSound;
 }
 
@@ -420,7 +559,7 @@ int CSoundEnt::IAllocSound( void )
 {
 	int iNewSound;
 
-	if ( m_iFreeSound == SOUNDLIST_EMPTY )
+	if ( m_iFreeSound == SOUNDLIST_EMPTY && !GrowSoundPool() )
 	{
 		// no free sound!
 		if ( developer.GetInt() >= 2 )
@@ -434,15 +573,13 @@ int CSoundEnt::IAllocSound( void )
 	
 	iNewSound = m_iFreeSound;// copy the index of the next free sound
 
-	m_iFreeSound = m_SoundPool[ m_iFreeSound ].m_iNext;// move the index down into the free list. 
+	m_iFreeSound = Sound( m_iFreeSound ).m_iNext;// move the index down into the free list. 
 
-	m_SoundPool[ iNewSound ].m_iNext = m_iActiveSound;// point the new sound at the top of the active list.
+	Sound( iNewSound ).m_iNext = m_iActiveSound;// point the new sound at the top of the active list.
 
 	m_iActiveSound = iNewSound;// now make the new sound the top of the active list. You're done.
 
-#ifdef DEBUG
-	m_SoundPool[ iNewSound ].m_iMyIndex = iNewSound;
-#endif // DEBUG
+	Sound( iNewSound ).m_nActiveSerial = m_nNextActiveSerial++;
 
 	return iNewSound;
 }
@@ -478,9 +615,11 @@ void CSoundEnt::InsertSound ( int iType, const Vector &vecOrigin, int iVolume, f
 
 	CSound *pSound;
 
-	pSound = &g_pSoundEnt->m_SoundPool[ iThisSound ];
+	pSound = &g_pSoundEnt->Sound( iThisSound );
+
+	g_pSoundEnt->UnlinkSoundFromGrid( iThisSound );
 
-	pSound->SetSoundOrigin( vecOrigin );
+	pSound->m_vecOrigin = vecOrigin;
 	pSound->m_iType = iType;
 	pSound->m_iVolume = iVolume;
 	pSound->m_flOcclusionScale = 0.5;
@@ -502,6 +641,8 @@ void CSoundEnt::InsertSound ( int iType, const Vector &vecOrigin, int iVolume, f
 		pSound->m_bHasOwner = false;
 	}
 
+	g_pSoundEnt->LinkSoundToGrid( iThisSound );
+
 	if( displaysoundlist.GetInt() == 1 )
 	{
 		Msg("  Added Sound! Type:%d  Duration:%f (Time:%f)\n", pSound->SoundType(), flDuration, gpGlobals->curtime );
@@ -520,7 +661,7 @@ int CSoundEnt::FindOrAllocateSound( CBaseEntity *pOwner, int soundChannelIndex )
 
 	while ( iSound != SOUNDLIST_EMPTY )
 	{
-		CSound &sound = m_SoundPool[iSound];
+		CSound &sound = Sound( iSound );
 		
 		if ( sound.m_ownerChannelIndex == soundChannelIndex && sound.m_hOwner == pOwner )
 		{
@@ -546,27 +687,33 @@ void CSoundEnt::Initialize ( void )
 	m_iFreeSound = 0;
 	m_iActiveSound = SOUNDLIST_EMPTY;
 
-	// In SP, we should only use the first 64 slots so save/load works right.
-	// In MP, have one for each player and 32 extras.
-	int nTotalSoundsInPool = MAX_WORLD_SOUNDS_SP;
-	if ( gpGlobals->maxClients > 1 )
-		nTotalSoundsInPool = MIN( MAX_WORLD_SOUNDS_MP, gpGlobals->maxClients + 32 );
-
-	if ( gpGlobals->maxClients+16 > nTotalSoundsInPool )
-	{
-		Warning( "CSoundEnt pool is low on sounds due to high number of clients.\n" );
-	}
+	FreeSoundBlocks();
 
-	for ( i = 0 ; i < nTotalSoundsInPool ; i++ )
+	for ( i = 0 ; i < MAX_WORLD_SOUNDS_SP ; i++ )
 	{
 		// clear all sounds, and link them into the free sound list.
 		m_SoundPool[ i ].Clear();
+		m_SoundPool[ i ].m_iMyIndex = i;
 		m_SoundPool[ i ].m_iNext = i + 1;
 	}
 
 	m_SoundPool[ i - 1 ].m_iNext = SOUNDLIST_EMPTY;// terminate the list here.
 
+	for ( i = 0 ; i <= SOUND_GRID_BUCKETS ; i++ )
+	{
+		m_SoundGrid[ i ] = SOUNDLIST_EMPTY;
+	}
+
+	// In MP, start with one for each player and 32 extras. The pool grows
+	// past that as it needs to.
+	if ( gpGlobals->maxClients > 1 )
+	{
+		while ( m_nSoundPoolSize < gpGlobals->maxClients + 32 && GrowSoundPool() )
+		{
+		}
+	}
 	
+
 	// now reserve enough sounds for each client
 	for ( i = 0 ; i < gpGlobals->maxClients ; i++ )
 	{
@@ -578,7 +725,159 @@ void CSoundEnt::Initialize ( void )
 			return;
 		}
 
-		m_SoundPool[ iSound ].m_bNoExpirationTime = true;
+		Sound( iSound ).m_bNoExpirationTime = true;
+		LinkSoundToGrid( iSound );
+	}
+}
+
+//=========================================================
+// GrowSoundPool - adds a block of sounds to the pool and
+// puts them at the top of the free list.
+//=========================================================
+bool CSoundEnt::GrowSoundPool( void )
+{
+	if ( m_nSoundPoolSize + MAX_WORLD_SOUNDS_SP > MAX_WORLD_SOUNDS )
+		return false;
+
+	CSound *pBlock = new CSound[ MAX_WORLD_SOUNDS_SP ];
+	m_SoundBlocks.AddToTail( pBlock );
+
+	int iFirstSound = m_nSoundPoolSize;
+	m_nSoundPoolSize += MAX_WORLD_SOUNDS_SP;
+
+	for ( int i = 0 ; i < MAX_WORLD_SOUNDS_SP ; i++ )
+	{
+		pBlock[ i ].Clear();
+		pBlock[ i ].m_iMyIndex = iFirstSound + i;
+		pBlock[ i ].m_iNext = iFirstSound + i + 1;
+	}
+
+	pBlock[ MAX_WORLD_SOUNDS_SP - 1 ].m_iNext = m_iFreeSound;
+	m_iFreeSound = iFirstSound;
+
+	return true;
+}
+
+//=========================================================
+// FreeSoundBlocks - shrinks the pool back to its first
+// block. Nothing may be linked to the freed sounds.
+//=========================================================
+void CSoundEnt::FreeSoundBlocks( void )
+{
+	for ( int i = 0 ; i < m_SoundBlocks.Count() ; i++ )
+	{
+		delete [] m_SoundBlocks[ i ];
+	}
+
+	m_SoundBlocks.RemoveAll();
+	m_nSoundPoolSize = MAX_WORLD_SOUNDS_SP;
+}
+
+//=========================================================
+// LinkSoundToGrid - puts an active sound in the grid
+// bucket for its origin and volume.
+//=========================================================
+void CSoundEnt::LinkSoundToGrid( int iSound )
+{
+	CSound &sound = Sound( iSound );
+	Assert( sound.m_iGridBucket == SOUNDLIST_EMPTY );
+
+	int iBucket = SOUND_GRID_UNBOUNDED;
+	if ( !sound.m_bNoExpirationTime )
+	{
+		int iVolume = abs( sound.m_iVolume );
+		for ( int iLevel = 0 ; iLevel < SOUND_GRID_LEVELS ; iLevel++ )
+		{
+			if ( iVolume <= g_SoundGridCellSize[ iLevel ] )
+			{
+				iBucket = SoundGridBucket( iLevel, SoundGridCoord( iLevel, sound.m_vecOrigin.x ), SoundGridCoord( iLevel, sound.m_vecOrigin.y ) );
+				break;
+			}
+		}
+	}
+
+	sound.m_iGridBucket = iBucket;
+	sound.m_iGridPrev = SOUNDLIST_EMPTY;
+	sound.m_iGridNext = m_SoundGrid[ iBucket ];
+
+	if ( m_SoundGrid[ iBucket ] != SOUNDLIST_EMPTY )
+	{
+		Sound( m_SoundGrid[ iBucket ] ).m_iGridPrev = iSound;
+	}
+	m_SoundGrid[ iBucket ] = iSound;
+}
+
+//=========================================================
+// UnlinkSoundFromGrid
+//=========================================================
+void CSoundEnt::UnlinkSoundFromGrid( int iSound )
+{
+	CSound &sound = Sound( iSound );
+	if ( sound.m_iGridBucket == SOUNDLIST_EMPTY )
+		return;
+
+	if ( sound.m_iGridPrev != SOUNDLIST_EMPTY )
+	{
+		Sound( sound.m_iGridPrev ).m_iGridNext = sound.m_iGridNext;
+	}
+	else
+	{
+		m_SoundGrid[ sound.m_iGridBucket ] = sound.m_iGridNext;
+	}
+
+	if ( sound.m_iGridNext != SOUNDLIST_EMPTY )
+	{
+		Sound( sound.m_iGridNext ).m_iGridPrev = sound.m_iGridPrev;
+	}
+
+	sound.m_iGridBucket = SOUNDLIST_EMPTY;
+	sound.m_iGridPrev = SOUNDLIST_EMPTY;
+	sound.m_iGridNext = SOUNDLIST_EMPTY;
+}
+
+//=========================================================
+// RelinkSound - moves a sound that's been changed outside
+// of InsertSound() to the right grid bucket. Copies of
+// sounds, like an NPC's locked best sound, are left alone.
+//=========================================================
+void CSoundEnt::RelinkSound( CSound *pSound )
+{
+	int iSound = pSound->m_iMyIndex;
+	if ( iSound < 0 || iSound >= m_nSoundPoolSize || &Sound( iSound ) != pSound )
+		return;
+
+	if ( pSound->m_iGridBucket == SOUNDLIST_EMPTY || pSound->m_iGridBucket == SOUND_GRID_UNBOUNDED )
+		return;
+
+	UnlinkSoundFromGrid( iSound );
+	LinkSoundToGrid( iSound );
+}
+
+//=========================================================
+// RebuildSoundGrid - links every active sound into the
+// grid from scratch, as after a restore.
+//=========================================================
+void CSoundEnt::RebuildSoundGrid( void )
+{
+	int i;
+
+	for ( i = 0 ; i <= SOUND_GRID_BUCKETS ; i++ )
+	{
+		m_SoundGrid[ i ] = SOUNDLIST_EMPTY;
+	}
+
+	for ( i = 0 ; i < m_nSoundPoolSize ; i++ )
+	{
+		CSound &sound = Sound( i );
+		sound.m_iMyIndex = i;
+		sound.m_iGridBucket = SOUNDLIST_EMPTY;
+		sound.m_iGridPrev = SOUNDLIST_EMPTY;
+		sound.m_iGridNext = SOUNDLIST_EMPTY;
+	}
+
+	for ( i = m_iActiveSound ; i != SOUNDLIST_EMPTY ; i = Sound( i ).m_iNext )
+	{
+		LinkSoundToGrid( i );
 	}
 }
 
@@ -615,7 +914,7 @@ int CSoundEnt::ISoundsInList ( int iListType )
 	{
 		i++;
 
-		iThisSound = m_SoundPool[ iThisSound ].m_iNext;
+		iThisSound = Sound( iThisSound ).m_iNext;
 	}
 
 	return i;
@@ -658,7 +957,7 @@ CSound*	CSoundEnt::SoundPointerForIndex( int iIndex )
 		return NULL;
 	}
 
-	if ( iIndex > ( MAX_WORLD_SOUNDS_MP - 1 ) )
+	if ( iIndex >= g_pSoundEnt->m_nSoundPoolSize )
 	{
 		Msg( "SoundPointerForIndex() - Index too large!\n" );
 		return NULL;
@@ -670,7 +969,7 @@ CSound*	CSoundEnt::SoundPointerForIndex( int iIndex )
 		return NULL;
 	}
 
-	return &g_pSoundEnt->m_SoundPool[ iIndex ];
+	return &g_pSoundEnt->Sound( iIndex );
 }
 
 //=========================================================
@@ -693,6 +992,127 @@ int CSoundEnt::ClientSoundIndex ( edict_t *pClient )
 	return iReturn;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Find the active sounds within a radius, or within earshot, of a point
+//-----------------------------------------------------------------------------
+int CSoundEnt::GetSoundsInRadius( const Vector &vecOrigin, float flRadius, int iTypeMask, CUtlVector<int> *pResult )
+{
+	if ( !g_pSoundEnt )
+		return 0;
+
+	return g_pSoundEnt->GatherSounds( vecOrigin, flRadius, 0.0f, iTypeMask, pResult );
+}
+
+int CSoundEnt::GetAudibleSounds( const Vector &vecEarPosition, float flHearingSensitivity, int iTypeMask, CUtlVector<int> *pResult )
+{
+	if ( !g_pSoundEnt )
+		return 0;
+
+	return g_pSoundEnt->GatherSounds( vecEarPosition, 0.0f, flHearingSensitivity, iTypeMask, pResult );
+}
+
+//-----------------------------------------------------------------------------
+// Adds the sounds within flRadius + Volume() * flVolumeScale of vecOrigin to
+// pResult, in the same order as the active list.
+//-----------------------------------------------------------------------------
+int CSoundEnt::GatherSounds( const Vector &vecOrigin, float flRadius, float flVolumeScale, int iTypeMask, CUtlVector<int> *pResult )
+{
+	int nStart = pResult->Count();
+	flVolumeScale = fabs( flVolumeScale );
+
+	// Sounds on a level are no louder than its cells are wide, so that far out is as far
+	// as one of them can be heard from.
+	float flReach[ SOUND_GRID_LEVELS ];
+	bool bWalkActiveList = false;
+	int iLevel;
+	for ( iLevel = 0 ; iLevel < SOUND_GRID_LEVELS ; iLevel++ )
+	{
+		flReach[ iLevel ] = flRadius + g_SoundGridCellSize[ iLevel ] * flVolumeScale;
+		if ( flReach[ iLevel ] > g_SoundGridCellSize[ iLevel ] * SOUND_GRID_MAX_REACH )
+		{
+			bWalkActiveList = true;
+		}
+	}
+
+	if ( bWalkActiveList )
+	{
+		for ( int iSound = m_iActiveSound ; iSound != SOUNDLIST_EMPTY ; iSound = Sound( iSound ).m_iNext )
+		{
+			CSound &sound = Sound( iSound );
+			float flSoundReach = flRadius + sound.Volume() * flVolumeScale;
+			if ( ( sound.m_iType & iTypeMask ) && sound.m_vecOrigin.DistToSqr( vecOrigin ) <= flSoundReach * flSoundReach )
+			{
+				pResult->AddToTail( iSound );
+			}
+		}
+
+		return pResult->Count() - nStart;
+	}
+
+	// Several cells can hash to the same bucket, so each is only walked once per query
+
+	if ( ++m_nSoundGridQuery == 0 )
+	{
+		memset( m_SoundGridVisited, 0, sizeof( m_SoundGridVisited ) );
+		m_nSoundGridQuery = 1;
+	}
+
+	GatherSoundsInBucket( SOUND_GRID_UNBOUNDED, vecOrigin, flRadius, flVolumeScale, iTypeMask, pResult );
+
+	for ( iLevel = 0 ; iLevel < SOUND_GRID_LEVELS ; iLevel++ )
+	{
+		int xMin = SoundGridCoord( iLevel, vecOrigin.x - flReach[ iLevel ] );
+		int xMax = SoundGridCoord( iLevel, vecOrigin.x + flReach[ iLevel ] );
+		int yMin = SoundGridCoord( iLevel, vecOrigin.y - flReach[ iLevel ] );
+		int yMax = SoundGridCoord( iLevel, vecOrigin.y + flReach[ iLevel ] );
+
+		for ( int y = yMin ; y <= yMax ; y++ )
+		{
+			for ( int x = xMin ; x <= xMax ; x++ )
+			{
+				GatherSoundsInBucket( SoundGridBucket( iLevel, x, y ), vecOrigin, flRadius, flVolumeScale, iTypeMask, pResult );
+			}
+		}
+	}
+
+	// Put the sounds found back in active list order, newest first. The buckets are
+	// mostly in that order already.
+	int *pSounds = pResult->Base() + nStart;
+	int nSounds = pResult->Count() - nStart;
+	for ( int i = 1 ; i < nSounds ; i++ )
+	{
+		int iSound = pSounds[ i ];
+		unsigned int nSerial = Sound( iSound ).m_nActiveSerial;
+
+		int j = i;
+		for ( ; j > 0 && Sound( pSounds[ j - 1 ] ).m_nActiveSerial < nSerial ; j-- )
+		{
+			pSounds[ j ] = pSounds[ j - 1 ];
+		}
+		pSounds[ j ] = iSound;
+	}
+
+	return nSounds;
+}
+
+void CSoundEnt::GatherSoundsInBucket( int iBucket, const Vector &vecOrigin, float flRadius, float flVolumeScale, int iTypeMask, CUtlVector<int> *pResult )
+{
+	if ( m_SoundGridVisited[ iBucket ] == m_nSoundGridQuery )
+		return;
+
+	m_SoundGridVisited[ iBucket ] = m_nSoundGridQuery;
+
+	for ( int iSound = m_SoundGrid[ iBucket ] ; iSound != SOUNDLIST_EMPTY ; iSound = Sound( iSound ).m_iGridNext )
+	{
+		CSound &sound = Sound( iSound );
+		float flSoundReach = flRadius + sound.Volume() * flVolumeScale;
+		if ( ( sound.m_iType & iTypeMask ) && sound.m_vecOrigin.DistToSqr( vecOrigin ) <= flSoundReach * flSoundReach )
+		{
+			pResult->AddToTail( iSound );
+		}
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Return the loudest sound of the specified type at "earposition"
 //-----------------------------------------------------------------------------
@@ -21,7 +21,12 @@ enum
 	MAX_WORLD_SOUNDS_SP	= 64,	// Maximum number of sounds handled by the world at one time in single player.
 	// This is also the number of entries saved in a savegame file (for b/w compatibility).
 
-	MAX_WORLD_SOUNDS_MP	= 128	// The sound array size is set this large but we'll only use gpGlobals->maxPlayers+32 entries in mp.
+	MAX_WORLD_SOUNDS	= 4096	// The sound pool grows in blocks of MAX_WORLD_SOUNDS_SP up to this many sounds.
+};
+
+enum
+{
+	SOUND_GRID_BUCKETS	= 512,	// Hash buckets of the grid that NPCs find nearby sounds through.
 };
 
 enum
@@ -120,7 +125,7 @@ class CSound
 public:
 	bool	DoesSoundExpire() const;
 	float	SoundExpirationTime() const;
-	void	SetSoundOrigin( const Vector &vecOrigin ) { m_vecOrigin = vecOrigin; }
+	void	SetSoundOrigin( const Vector &vecOrigin );
 	const	Vector& GetSoundOrigin( void ) { return m_vecOrigin; }
 	const	Vector& GetSoundReactOrigin( void );
 	bool	FIsSound( void );
@@ -161,9 +166,11 @@ private:
 
 	bool	m_bHasOwner;	// Lets us know if this sound was created with an owner. In case the owner goes null.
 
-#ifdef DEBUG
-	int		m_iMyIndex;		// debugging
-#endif
+	int		m_iMyIndex;		// index of this sound in the sound pool
+	unsigned int m_nActiveSerial;	// order the sound was put in the active list, newest highest
+	short	m_iGridBucket;	// grid bucket the sound is linked into, or SOUNDLIST_EMPTY
+	short	m_iGridPrev;	// neighbors in that bucket
+	short	m_iGridNext;
 
 	friend class CSoundEnt;
 };
@@ -240,6 +247,7 @@ public:
 	CSoundEnt();
 	virtual ~CSoundEnt();
 
+	virtual int Save( ISave &save );
 	virtual void OnRestore();
 	void Precache ( void );
 	void Spawn( void );
@@ -255,16 +263,49 @@ public:
 	static CSound*	GetLoudestSoundOfType( int iType, const Vector &vecEarPosition );
 	static int		ClientSoundIndex ( edict_t *pClient );
 
+	// Adds the active sounds matching iTypeMask within flRadius of vecOrigin to pResult,
+	// in active list order. Returns how many were added.
+	static int		GetSoundsInRadius( const Vector &vecOrigin, float flRadius, int iTypeMask, CUtlVector<int> *pResult );
+
+	// Same, but for the sounds loud enough to reach a listener at vecEarPosition, i.e.
+	// the ones within Volume() * flHearingSensitivity of it.
+	static int		GetAudibleSounds( const Vector &vecEarPosition, float flHearingSensitivity, int iTypeMask, CUtlVector<int> *pResult );
+
 	bool	IsEmpty( void );
 	int		ISoundsInList ( int iListType );
 	int		IAllocSound ( void );
 	int		FindOrAllocateSound( CBaseEntity *pOwner, int soundChannelIndex );
 	
 private:
+	CSound	&Sound( int iSound );
+	bool	GrowSoundPool( void );
+	void	FreeSoundBlocks( void );
+	int		UnlinkUnsavedSounds( int iSound );
+
+	void	LinkSoundToGrid( int iSound );
+	void	UnlinkSoundFromGrid( int iSound );
+	void	RebuildSoundGrid( void );
+	void	RelinkSound( CSound *pSound );
+	int		GatherSounds( const Vector &vecOrigin, float flRadius, float flVolumeScale, int iTypeMask, CUtlVector<int> *pResult );
+	void	GatherSoundsInBucket( int iBucket, const Vector &vecOrigin, float flRadius, float flVolumeScale, int iTypeMask, CUtlVector<int> *pResult );
+
+	friend class CSound;
+
 	int		m_iFreeSound;	// index of the first sound in the free sound list
 	int		m_iActiveSound; // indes of the first sound in the active sound list
 	int		m_cLastActiveSounds; // keeps track of the number of active sounds at the last update. (for diagnostic work)
-	CSound	m_SoundPool[ MAX_WORLD_SOUNDS_MP ];
+
+	// The first block of the pool is the only part that's saved, so it stays where the
+	// fixed size pool used to be. Further blocks are allocated as the free list runs out.
+	CSound	m_SoundPool[ MAX_WORLD_SOUNDS_SP ];
+	CUtlVector<CSound *> m_SoundBlocks;
+	int		m_nSoundPoolSize;
+	unsigned int m_nNextActiveSerial;
+
+	// Heads of the grid buckets, plus one for the sounds that are tested by every query
+	short	m_SoundGrid[ SOUND_GRID_BUCKETS + 1 ];
+	unsigned int m_SoundGridVisited[ SOUND_GRID_BUCKETS + 1 ];	// query each bucket was last walked by
+	unsigned int m_nSoundGridQuery;
 };
 
 
@@ -276,5 +317,13 @@ inline bool CSoundEnt::IsEmpty( void )
 	return m_iActiveSound == SOUNDLIST_EMPTY; 
 }
 
+inline CSound &CSoundEnt::Sound( int iSound )
+{
+	if ( iSound < MAX_WORLD_SOUNDS_SP )
+		return m_SoundPool[ iSound ];
+
+	return m_SoundBlocks[ iSound / MAX_WORLD_SOUNDS_SP - 1 ][ iSound % MAX_WORLD_SOUNDS_SP ];
+}
+
 
 #endif //SOUNDENT_H
@@ -400,6 +400,7 @@ void NWCEdit::CreateAILink( CBasePlayer* pPlayer )
 		{
 			// Don't actually destroy the dynamic link while editing.  Just mark the link
 			pAILink->m_LinkInfo &= ~bits_LINK_OFF;
+			g_pBigAINet->GetRouteCache().OnLinkOpened( pAILink->m_iSrcID, pAILink->m_iDestID );
 
 			CAI_DynamicLink* pDynamicLink = CAI_DynamicLink::GetDynamicLink(pAILink->m_iSrcID, pAILink->m_iDestID);
 			UTIL_Remove(pDynamicLink);
@@ -442,6 +443,7 @@ void NWCEdit::DestroyAILink( CBasePlayer *pPlayer )
 			pNewLink->m_nDestID			= pAILink->m_iDestID;
 			pNewLink->m_nLinkState		= LINK_OFF;
 			pAILink->m_LinkInfo |= bits_LINK_OFF;
+			g_pBigAINet->GetRouteCache().OnLinkBlocked( pAILink->m_iSrcID, pAILink->m_iDestID );
 		}
 	}
 }
@@ -772,6 +772,56 @@ static void CC_RR_DumpHashInfo( const CCommand &args )
 static ConCommand rr_dumphashinfo( "rr_dumphashinfo", CC_RR_DumpHashInfo, "Statistics on primary hash bucketing of response rule partitions");
 #endif
 
+#ifdef MAPBASE
+//-----------------------------------------------------------------------------
+// Purpose: Checks that the rule index follows a criterion redefined by a talker
+//			file loaded later, the way manifests and LoadTalkerFile do it.
+//			Returns true if the rule matched the new value, and only that value.
+//-----------------------------------------------------------------------------
+static bool RR_TestRuleIndexMatches( CResponseSystem *pSystem, const char *pszMap, bool bExpectMatch )
+{
+	AI_CriteriaSet set;
+	set.AppendCriteria( "concept", "TLK_RULEINDEXTEST" );
+	set.AppendCriteria( "map", pszMap );
+
+	float flScore = 0.0f;
+	ResponseRulePartition::tIndex idx = pSystem->FindBestMatchingRule( set, false, flScore );
+	bool bMatched = pSystem->m_RulePartitions.IsValid( idx ) && !V_strcmp( pSystem->m_RulePartitions.GetElementName( idx ), "RuleIndexTest" );
+
+	Msg( "  map %s: %s\n", pszMap, bMatched ? "matched" : "not matched" );
+	return bMatched == bExpectMatch;
+}
+
+static void CC_RR_TestRuleIndex( const CCommand &args )
+{
+	// The two filler rules share the concept key, so the tested rule is keyed on its map criterion
+	static const char s_szRules[] =
+		"criterion \"RuleIndexTestConcept\" \"concept\" \"TLK_RULEINDEXTEST\" required\n"
+		"criterion \"RuleIndexTestMap\" \"map\" \"rr_ruleindex_a\" required\n"
+		"rule RuleIndexTest\n{\n\tcriteria RuleIndexTestConcept RuleIndexTestMap\n}\n"
+		"rule RuleIndexTestFillerA\n{\n\tcriteria RuleIndexTestConcept\n}\n"
+		"rule RuleIndexTestFillerB\n{\n\tcriteria RuleIndexTestConcept\n}\n";
+
+	static const char s_szRedefine[] =
+		"criterion \"RuleIndexTestMap\" \"map\" \"rr_ruleindex_b\" required\n";
+
+	CInstancedResponseSystem *pSystem = new CInstancedResponseSystem( "rr_test_ruleindex" );
+
+	bool bPassed = true;
+	pSystem->LoadFromBuffer( "rr_test_ruleindex_rules", s_szRules );
+	bPassed &= RR_TestRuleIndexMatches( pSystem, "rr_ruleindex_a", true );
+
+	pSystem->LoadFromBuffer( "rr_test_ruleindex_redefine", s_szRedefine );
+	bPassed &= RR_TestRuleIndexMatches( pSystem, "rr_ruleindex_b", true );
+	bPassed &= RR_TestRuleIndexMatches( pSystem, "rr_ruleindex_a", false );
+
+	pSystem->Release();
+
+	Msg( "rr_test_ruleindex: %s\n", bPassed ? "PASSED" : "FAILED" );
+}
+static ConCommand rr_test_ruleindex( "rr_test_ruleindex", CC_RR_TestRuleIndex, "Checks that response rules still match after a talker file redefines one of their criteria.", FCVAR_CHEAT );
+#endif
+
 #ifdef MAPBASE
 // Designed for extern magic, this gives the <, >, etc. of response system criteria to the outside world.
 // Mostly just used for Matcher_Match in matchers.h.
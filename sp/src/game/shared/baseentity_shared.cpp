@@ -462,6 +462,14 @@ bool CBaseEntity::KeyValue( const char *szKeyName, const char *szValue )
 	if ( FStrEq( szKeyName, "targetname" ) )
 	{
 		m_iName = AllocPooledString( szValue );
+		gEntList.ReportEntityNamesChanged( this );
+		return true;
+	}
+
+	if ( FStrEq( szKeyName, "classname" ) )
+	{
+		m_iClassname = AllocPooledString( szValue );
+		gEntList.ReportEntityNamesChanged( this );
 		return true;
 	}
 
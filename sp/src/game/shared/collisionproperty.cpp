@@ -1356,6 +1356,10 @@ void CCollisionProperty::UpdateServerPartitionMask( )
 //-----------------------------------------------------------------------------
 void CCollisionProperty::MarkPartitionHandleDirty()
 {
+#ifndef CLIENT_DLL
+	gEntList.ReportEntityBoundsChanged( m_pOuter );
+#endif
+
 	// don't bother with the world
 	if ( m_pOuter->entindex() == 0 )
 		return;
@@ -220,6 +220,9 @@ public:
 #define RTE_FLAGS_FAST_TREE_GENERATION 1
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS 2				// saves memory if not needed
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS 4
+#define RTE_FLAGS_SERIAL_TREE_GENERATION 8					// build the kd-tree with RefineNode on
+															// one thread instead of the parallel
+															// binned builder
 
 enum RayTraceLightingMode_t {
 	DIRECT_LIGHTING,										// just dot product lighting
@@ -294,8 +297,9 @@ public:
 										const Vector &color);
 
 
-	// SetupAccelerationStructure to prepare for tracing
-	void SetupAccelerationStructure(void);
+	// SetupAccelerationStructure to prepare for tracing. nThreads is how many threads build
+	// the tree, 0 for one per logical processor.
+	void SetupAccelerationStructure( int nThreads = 0 );
 
 
 	// lowest level intersection routine - fire 4 rays through the scene. all 4 rays must pass the
@@ -310,6 +314,16 @@ public:
 					RayTracingResult *rslt_out,
 					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
 
+	// trace nGroups bundles of 4 rays as 8 or 16 ray packets when the cpu can (AVX2), else 4 at
+	// a time with Trace4Rays. the rays don't need matching direction signs. Transparent triangle
+	// callbacks only work 4 rays at a time, so passing one always uses Trace4Rays.
+	void TraceRayPacket(const FourRays *pRays, int nGroups, const fltx4 *pTMin, const fltx4 *pTMax,
+						RayTracingResult *pResults,
+						int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
+
+	// widest packet TraceRayPacket will trace, in rays. 4 when there's no wide packet support
+	static int PacketWidth(void);
+
 	// compute virtual light sources to model inter-reflection
 	void ComputeVirtualLightSources(void);
 
@@ -12,6 +12,7 @@
 #endif
 
 #include "tier1/utlrbtree.h"
+#include "tier1/utlvector.h"
 #include "tier1/utlsymbol.h"
 #include "tier1/interval.h"
 #include "mathlib/compressed_vector.h"
@@ -179,6 +180,7 @@ namespace ResponseRules
 	public:
 		CriteriaSet();
 		CriteriaSet( const CriteriaSet& src );
+		CriteriaSet& operator=( const CriteriaSet& src );
 		CriteriaSet( const char *criteria, const char *value ) ;  // construct initialized with a key/value pair (convenience)
 		~CriteriaSet();
 
@@ -217,6 +219,13 @@ namespace ResponseRules
 		/// set false to prevent such overrides.
 		inline void	OverrideOnAppend( bool bOverride ) { m_bOverrideOnAppend = bOverride; }
 
+		/// For callers that append a lot of criteria in one go, like ModifyOrAppendCriteria.
+		/// Between these, new criteria are added to the end of the set unsorted and are
+		/// sorted into place all at once by EndBulkAppend. Lookups still work in between,
+		/// but the order of iteration doesn't mean anything until EndBulkAppend.
+		void		BeginBulkAppend();
+		void		EndBulkAppend();
+
 		// For iteration from beginning to end (also should not be necessary except in
 		// save/load)
 		inline int  Head() const;
@@ -240,6 +249,8 @@ namespace ResponseRules
 
 	private:
 		void		RemoveCriteria( int idx, bool bTestForPrefix );
+		int			FindCriterionIndex( CritSymbol_t criteria, int *pInsertBefore ) const;
+		void		CopyFrom( const CriteriaSet &src );
 
 		struct CritEntry_t
 		{
@@ -270,11 +281,6 @@ namespace ResponseRules
 				return *this;
 			}
 
-			static bool LessFunc( const CritEntry_t& lhs, const CritEntry_t& rhs )
-			{
-				return lhs.criterianame < rhs.criterianame;
-			}
-
 			void SetValue( char const *str )
 			{
 				if ( !str )
@@ -292,16 +298,30 @@ namespace ResponseRules
 			float		weight;
 		};
 
+		// Where an entry lives in m_Entries. m_Keys is kept sorted by symbol, and the
+		// criteria's index is its position there, so a lookup only touches the keys.
+		struct CritKey_t
+		{
+			CritSymbol_t	criterianame;
+			unsigned short	entry;
+		};
+
+		// Enough for a typical speech query without going to the heap
+		enum { NUM_INLINE_CRITERIA = 64 };
+
 		static CUtlSymbolTable sm_CriteriaSymbols;
-		typedef CUtlRBTree< CritEntry_t, short > Dict_t;
-		Dict_t m_Lookup;
+		CUtlVectorFixedGrowable< CritKey_t, NUM_INLINE_CRITERIA * 2 > m_Keys;
+		CUtlVectorFixedGrowable< CritEntry_t, NUM_INLINE_CRITERIA > m_Entries;
 		int m_nNumPrefixedContexts; // number of contexts prefixed with kAPPLYTOWORLDPREFIX
+		int m_nBulkAppendStart; // -1, or where the unsorted keys start during a bulk append
+		unsigned int m_BulkAppendFilter[8]; // bit per symbol mod 256 of the unsorted keys, so most appends skip scanning them
 		bool m_bOverrideOnAppend;
 	};
 
 	inline void CriteriaSet::EnsureCapacity( int num )
 	{
-		m_Lookup.EnsureCapacity(num);
+		m_Keys.EnsureCapacity(num);
+		m_Entries.EnsureCapacity(num);
 	}
 
 	//-----------------------------------------------------------------------------
@@ -454,17 +474,17 @@ namespace ResponseRules
 
 	inline bool CriteriaSet::IsValidIndex( int index ) const
 	{
-		return ( index >= 0 && index < ((int)(m_Lookup.Count())) );
+		return ( index >= 0 && index < m_Keys.Count() );
 	}
 
 	inline int CriteriaSet::Head() const
 	{
-		return m_Lookup.FirstInorder();
+		return 0;
 	}
 
 	inline int CriteriaSet::Next( int i ) const
 	{
-		return m_Lookup.NextInorder(i);
+		return i + 1;
 	}
 
 	inline const char *CriteriaSet::SymbolToStr( const CritSymbol_t &symbol )
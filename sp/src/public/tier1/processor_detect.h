@@ -9,4 +9,5 @@ bool CheckMMXTechnology(void);
 bool CheckSSETechnology(void);
 bool CheckSSE2Technology(void);
 bool Check3DNowTechnology(void);
+bool CheckAVX2Technology(void);
 
@@ -5,6 +5,7 @@
 #include <filesystem_tools.h>
 #include <cmdlib.h>
 #include <stdio.h>
+#include "tier0/threadtools.h"
 
 static bool SameSign(float a, float b)
 {
@@ -285,6 +286,11 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 	int msk=rays.CalculateDirectionSignMask();
 	if (msk!=-1)
 		Trace4Rays(rays,TMin,TMax,msk,rslt_out,skip_id, pCallback);
+	else if (!pCallback && PacketWidth()>4)
+	{
+		// the wide packet tracer handles mixed direction signs per ray
+		TraceRayPacket(&rays,1,&TMin,&TMax,rslt_out,skip_id);
+	}
 	else
 	{
 		// sucky case - can't trace 4 rays at once. in the worst case, need to trace all 4
@@ -876,7 +882,369 @@ void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int
 }
 
 
-void RayTracingEnvironment::SetupAccelerationStructure(void)
+// The parallel builder uses binned SAH: split candidates are the boundaries of KDBUILD_BINS
+// equal bins along each axis, plus the tight bounds of the triangles on that axis so empty
+// space can still be cut away. Costs are estimated from per-bin triangle counts instead of
+// classifying every triangle against every candidate, then the chosen split is classified
+// exactly.
+//
+// Nodes with few enough triangles become tasks. Each task builds its subtree into its own
+// node list on whichever thread picks it up, and the finished lists are copied into
+// OptimizedKDTree depth first afterwards, in the same layout RefineNode produces, so the
+// tree is the same no matter how the threads were scheduled.
+
+#define KDBUILD_BINS 32
+#define KDBUILD_MIN_TASK_TRIS 2048							// smaller subtrees aren't worth a task
+#define KDBUILD_TASKS_PER_THREAD 8
+#define KDBUILD_NODE_TASK -1								// node is the root of a task's subtree
+
+struct KDBuildTriBounds_t
+{
+	Vector mins;
+	Vector maxs;
+};
+
+struct KDBuildNode_t
+{
+	int m_nType;											// KDNODE_STATE_xxx or KDBUILD_NODE_TASK
+	float m_flSplit;
+	int m_nIndex;											// left child (right follows it), first
+															// triangle of a leaf, or task index
+	int m_nTris;
+};
+
+struct KDBuildContext_t
+{
+	CUtlVector<KDBuildNode_t> m_Nodes;
+	CUtlVector<int32> m_Tris;								// leaf triangle lists
+};
+
+struct KDBuildTask_t
+{
+	CUtlVector<int32> m_TriList;
+	Vector m_MinBound;
+	Vector m_MaxBound;
+	int m_nDepth;
+	KDBuildContext_t m_Context;
+};
+
+class CKDTreeBuilder
+{
+public:
+	CKDTreeBuilder( RayTracingEnvironment *pEnv ) : m_pEnv( pEnv ) {}
+	~CKDTreeBuilder()
+	{
+		m_Tasks.PurgeAndDeleteElements();
+	}
+
+	void Build( int32 const *tri_list, int ntris, Vector const &MinBound, Vector const &MaxBound, int nThreads );
+
+private:
+	void BuildNode( KDBuildContext_t &ctx, int node, int32 const *tri_list, int ntris,
+					Vector const &MinBound, Vector const &MaxBound, int depth, bool bMakeTasks );
+	void MakeLeaf( KDBuildContext_t &ctx, int node, int32 const *tri_list, int ntris );
+	float FindSplit( int32 const *tri_list, int ntris, Vector const &MinBound, Vector const &MaxBound,
+					 int &split_plane, float &split_value );
+
+	void RunTask( KDBuildTask_t *pTask );
+	static unsigned TaskThread( void *pParam );
+
+	void Emit( KDBuildContext_t const &ctx, int node, int out_node, Vector const &MinBound, Vector const &MaxBound );
+
+	RayTracingEnvironment *m_pEnv;
+	CUtlVector<KDBuildTriBounds_t> m_TriBounds;
+	KDBuildContext_t m_Top;
+	CUtlVector<KDBuildTask_t *> m_Tasks;					// indexed by the task nodes
+	CUtlVector<KDBuildTask_t *> m_RunOrder;				// m_Tasks, biggest first
+	int m_nTaskTris;
+	CInterlockedInt m_nNextTask;
+};
+
+static int TaskSizeCompare( KDBuildTask_t * const *a, KDBuildTask_t * const *b )
+{
+	return (*b)->m_TriList.Count() - (*a)->m_TriList.Count();
+}
+
+void CKDTreeBuilder::Build( int32 const *tri_list, int ntris, Vector const &MinBound, Vector const &MaxBound, int nThreads )
+{
+	m_TriBounds.SetCount( m_pEnv->OptimizedTriangleList.Count() );
+	for( int t = 0; t < m_TriBounds.Count(); t++ )
+	{
+		CacheOptimizedTriangle const &tri = m_pEnv->OptimizedTriangleList[t];
+		KDBuildTriBounds_t &bounds = m_TriBounds[t];
+		bounds.mins = bounds.maxs = tri.Vertex( 0 );
+		for( int v = 1; v < 3; v++ )
+		{
+			VectorMin( bounds.mins, tri.Vertex( v ), bounds.mins );
+			VectorMax( bounds.maxs, tri.Vertex( v ), bounds.maxs );
+		}
+	}
+
+	if ( nThreads <= 0 )
+		nThreads = MAX( 1, GetCPUInformation()->m_nLogicalProcessors );
+	m_nTaskTris = MAX( KDBUILD_MIN_TASK_TRIS, ntris / ( nThreads * KDBUILD_TASKS_PER_THREAD ) );
+
+	// build the top of the tree here, down to the task roots
+	m_Top.m_Nodes.AddToTail();
+	BuildNode( m_Top, 0, tri_list, ntris, MinBound, MaxBound, 0, true );
+
+	// biggest tasks first so no thread is left with a big one at the end
+	m_RunOrder.CopyArray( m_Tasks.Base(), m_Tasks.Count() );
+	m_RunOrder.Sort( TaskSizeCompare );
+	m_nNextTask = 0;
+	nThreads = MIN( nThreads, m_RunOrder.Count() );
+	if ( nThreads > 1 )
+	{
+		CUtlVector<ThreadHandle_t> threads;
+		for( int i = 0; i < nThreads - 1; i++ )
+			threads.AddToTail( CreateSimpleThread( TaskThread, this ) );
+		TaskThread( this );
+		for( int i = 0; i < threads.Count(); i++ )
+		{
+			ThreadJoin( threads[i] );
+			ReleaseThreadHandle( threads[i] );
+		}
+	}
+	else
+	{
+		TaskThread( this );
+	}
+
+	Emit( m_Top, 0, 0, MinBound, MaxBound );
+}
+
+unsigned CKDTreeBuilder::TaskThread( void *pParam )
+{
+	CKDTreeBuilder *pBuilder = (CKDTreeBuilder *)pParam;
+	for(;;)
+	{
+		int i = pBuilder->m_nNextTask++;
+		if ( i >= pBuilder->m_RunOrder.Count() )
+			break;
+		pBuilder->RunTask( pBuilder->m_RunOrder[i] );
+	}
+	return 0;
+}
+
+void CKDTreeBuilder::RunTask( KDBuildTask_t *pTask )
+{
+	pTask->m_Context.m_Nodes.AddToTail();
+	BuildNode( pTask->m_Context, 0, pTask->m_TriList.Base(), pTask->m_TriList.Count(),
+			   pTask->m_MinBound, pTask->m_MaxBound, pTask->m_nDepth, false );
+	pTask->m_TriList.Purge();
+}
+
+void CKDTreeBuilder::MakeLeaf( KDBuildContext_t &ctx, int node, int32 const *tri_list, int ntris )
+{
+	KDBuildNode_t &leaf = ctx.m_Nodes[node];
+	leaf.m_nType = KDNODE_STATE_LEAF;
+	leaf.m_nIndex = ctx.m_Tris.Count();
+	leaf.m_nTris = ntris;
+	ctx.m_Tris.AddMultipleToTail( ntris, tri_list );
+}
+
+float CKDTreeBuilder::FindSplit( int32 const *tri_list, int ntris, Vector const &MinBound, Vector const &MaxBound,
+								 int &split_plane, float &split_value )
+{
+	float best_cost = 1.0e23;
+	float SA = BoxSurfaceArea( MinBound, MaxBound );
+	if ( SA <= 0 )
+		return best_cost;
+	float ISA = 1.0 / SA;
+
+	for( int axis = 0; axis < 3; axis++ )
+	{
+		float extent = MaxBound[axis] - MinBound[axis];
+		if ( extent <= 0 )
+			continue;
+
+		int nStart[KDBUILD_BINS], nEnd[KDBUILD_BINS];
+		memset( nStart, 0, sizeof( nStart ) );
+		memset( nEnd, 0, sizeof( nEnd ) );
+		float min_coord = 1.0e23, max_coord = -1.0e23;
+		float bin_scale = KDBUILD_BINS / extent;
+
+		for( int t = 0; t < ntris; t++ )
+		{
+			KDBuildTriBounds_t const &bounds = m_TriBounds[tri_list[t]];
+			min_coord = min( min_coord, bounds.mins[axis] );
+			max_coord = max( max_coord, bounds.maxs[axis] );
+			int bin_lo = (int)( ( bounds.mins[axis] - MinBound[axis] ) * bin_scale );
+			int bin_hi = (int)( ( bounds.maxs[axis] - MinBound[axis] ) * bin_scale );
+			nStart[clamp( bin_lo, 0, KDBUILD_BINS - 1 )]++;
+			nEnd[clamp( bin_hi, 0, KDBUILD_BINS - 1 )]++;
+		}
+
+		Vector LeftMaxes = MaxBound;
+		Vector RightMins = MinBound;
+
+		// between bins. triangles ending below the plane go left, ones starting above it go right
+		int nleft = 0;
+		int nright = ntris;
+		for( int b = 1; b < KDBUILD_BINS; b++ )
+		{
+			nleft += nEnd[b - 1];
+			nright -= nStart[b - 1];
+			float trial_value = MinBound[axis] + b * ( extent / KDBUILD_BINS );
+			LeftMaxes[axis] = RightMins[axis] = trial_value;
+			int nboth = ntris - nleft - nright;
+			float trial_cost = COST_OF_TRAVERSAL + COST_OF_INTERSECTION * ( nboth +
+				( BoxSurfaceArea( MinBound, LeftMaxes ) * ISA * nleft ) +
+				( BoxSurfaceArea( RightMins, MaxBound ) * ISA * nright ) );
+			if ( trial_cost < best_cost )
+			{
+				best_cost = trial_cost;
+				split_plane = axis;
+				split_value = trial_value;
+			}
+		}
+
+		// cut away empty space at either end
+		if ( max_coord < MaxBound[axis] )
+		{
+			LeftMaxes[axis] = max_coord;
+			float trial_cost = COST_OF_TRAVERSAL + COST_OF_INTERSECTION *
+				BoxSurfaceArea( MinBound, LeftMaxes ) * ISA * ntris;
+			if ( trial_cost < best_cost )
+			{
+				best_cost = trial_cost;
+				split_plane = axis;
+				split_value = max_coord;
+			}
+		}
+		if ( min_coord > MinBound[axis] )
+		{
+			RightMins[axis] = min_coord;
+			float trial_cost = COST_OF_TRAVERSAL + COST_OF_INTERSECTION *
+				BoxSurfaceArea( RightMins, MaxBound ) * ISA * ntris;
+			if ( trial_cost < best_cost )
+			{
+				best_cost = trial_cost;
+				split_plane = axis;
+				split_value = min_coord;
+			}
+		}
+	}
+	return best_cost;
+}
+
+void CKDTreeBuilder::BuildNode( KDBuildContext_t &ctx, int node, int32 const *tri_list, int ntris,
+								Vector const &MinBound, Vector const &MaxBound, int depth, bool bMakeTasks )
+{
+	if ( bMakeTasks && ( ntris <= m_nTaskTris ) )
+	{
+		KDBuildTask_t *pTask = new KDBuildTask_t;
+		pTask->m_TriList.CopyArray( tri_list, ntris );
+		pTask->m_MinBound = MinBound;
+		pTask->m_MaxBound = MaxBound;
+		pTask->m_nDepth = depth;
+		ctx.m_Nodes[node].m_nType = KDBUILD_NODE_TASK;
+		ctx.m_Nodes[node].m_nIndex = m_Tasks.AddToTail( pTask );
+		return;
+	}
+
+	if ( ntris < 3 )										// never split empty lists
+	{
+		MakeLeaf( ctx, node, tri_list, ntris );
+		return;
+	}
+
+	int split_plane = 0;
+	float split_value = 0;
+	float best_cost = FindSplit( tri_list, ntris, MinBound, MaxBound, split_plane, split_value );
+	float cost_of_no_split = COST_OF_INTERSECTION * ntris;
+	if ( ( cost_of_no_split <= best_cost ) || NEVER_SPLIT || ( depth > MAX_TREE_DEPTH ) )
+	{
+		MakeLeaf( ctx, node, tri_list, ntris );
+		return;
+	}
+
+	// classify exactly, the same way CacheOptimizedTriangle::ClassifyAgainstAxisSplit does, into
+	// left, both and right runs of the new list
+	int32 *new_triangle_list = new int32[ntris];
+	int nleft = 0, nright = 0;
+	for( int t = 0; t < ntris; t++ )
+	{
+		KDBuildTriBounds_t const &bounds = m_TriBounds[tri_list[t]];
+		float minc = bounds.mins[split_plane];
+		float maxc = bounds.maxs[split_plane];
+		if ( minc >= split_value )
+			new_triangle_list[ntris - ( ++nright )] = tri_list[t];
+		else if ( maxc <= split_value )
+			new_triangle_list[nleft++] = tri_list[t];
+	}
+	int nboth = 0;
+	for( int t = 0; t < ntris; t++ )
+	{
+		KDBuildTriBounds_t const &bounds = m_TriBounds[tri_list[t]];
+		float minc = bounds.mins[split_plane];
+		float maxc = bounds.maxs[split_plane];
+		if ( ( minc < split_value ) && ( maxc > split_value ) )
+			new_triangle_list[nleft + ( nboth++ )] = tri_list[t];
+	}
+
+	if ( nboth == ntris )
+	{
+		// the estimate was off and nothing got separated
+		delete[] new_triangle_list;
+		MakeLeaf( ctx, node, tri_list, ntris );
+		return;
+	}
+
+	int left_child = ctx.m_Nodes.AddMultipleToTail( 2 );
+	ctx.m_Nodes[node].m_nType = split_plane;
+	ctx.m_Nodes[node].m_flSplit = split_value;
+	ctx.m_Nodes[node].m_nIndex = left_child;
+
+	Vector LeftMaxes = MaxBound;
+	Vector RightMins = MinBound;
+	LeftMaxes[split_plane] = split_value;
+	RightMins[split_plane] = split_value;
+
+	if ( ( ntris < 20 ) && ( ( nleft == 0 ) || ( nright == 0 ) ) )
+		depth += 100;
+	BuildNode( ctx, left_child, new_triangle_list, nleft + nboth, MinBound, LeftMaxes, depth + 1, bMakeTasks );
+	BuildNode( ctx, left_child + 1, new_triangle_list + nleft, nright + nboth, RightMins, MaxBound, depth + 1, bMakeTasks );
+	delete[] new_triangle_list;
+}
+
+void CKDTreeBuilder::Emit( KDBuildContext_t const &ctx, int node, int out_node, Vector const &MinBound, Vector const &MaxBound )
+{
+	KDBuildNode_t const &build = ctx.m_Nodes[node];
+	if ( build.m_nType == KDBUILD_NODE_TASK )
+	{
+		Emit( m_Tasks[build.m_nIndex]->m_Context, 0, out_node, MinBound, MaxBound );
+		return;
+	}
+
+	CUtlVector<CacheOptimizedKDNode> &tree = m_pEnv->OptimizedKDTree;
+#ifdef DEBUG_RAYTRACE
+	tree[out_node].vecMins = MinBound;
+	tree[out_node].vecMaxs = MaxBound;
+#endif
+	if ( build.m_nType == KDNODE_STATE_LEAF )
+	{
+		tree[out_node].Children = KDNODE_STATE_LEAF + ( m_pEnv->TriangleIndexList.Count() << 2 );
+		tree[out_node].SetNumberOfTrianglesInLeafNode( build.m_nTris );
+		m_pEnv->TriangleIndexList.AddMultipleToTail( build.m_nTris, ctx.m_Tris.Base() + build.m_nIndex );
+		return;
+	}
+
+	int left_child = tree.Count();
+	tree[out_node].Children = build.m_nType + ( left_child << 2 );
+	tree[out_node].SplittingPlaneValue = build.m_flSplit;
+	tree.AddMultipleToTail( 2 );
+
+	Vector LeftMaxes = MaxBound;
+	Vector RightMins = MinBound;
+	LeftMaxes[build.m_nType] = build.m_flSplit;
+	RightMins[build.m_nType] = build.m_flSplit;
+	Emit( ctx, build.m_nIndex, left_child, MinBound, LeftMaxes );
+	Emit( ctx, build.m_nIndex + 1, left_child + 1, RightMins, MaxBound );
+}
+
+
+void RayTracingEnvironment::SetupAccelerationStructure( int nThreads )
 {
 	CacheOptimizedKDNode root;
 	OptimizedKDTree.AddToTail(root);
@@ -885,7 +1253,15 @@ void RayTracingEnvironment::SetupAccelerationStructure(void)
 		root_triangle_list[t]=t;
 	CalculateTriangleListBounds(root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,
 								m_MaxBound);
-	RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
+	if ( Flags & RTE_FLAGS_SERIAL_TREE_GENERATION )
+	{
+		RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
+	}
+	else
+	{
+		CKDTreeBuilder builder( this );
+		builder.Build( root_triangle_list, OptimizedTriangleList.Count(), m_MinBound, m_MaxBound, nThreads );
+	}
 	delete[] root_triangle_list;
 
 	// now, convert all triangles to "intersection format"
@@ -0,0 +1,327 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+
+// wide packet tracing. When the cpu has AVX2, TraceRayPacket traces 8 or 16 rays through the
+// kd-tree together. Unlike Trace4Rays, every ray picks its own side of each splitting plane, so
+// the direction signs in a packet don't have to match.
+
+#include "raytrace.h"
+#include "tier1/processor_detect.h"
+
+#if defined( _WIN32 ) && !defined( _X360 ) && ( _MSC_VER >= 1700 )
+#define RAYTRACE_AVX2 1
+#define RAYTRACE_AVX2_TARGET
+#elif ( defined( __i386__ ) || defined( __x86_64__ ) ) && \
+	( defined( __clang__ ) || ( __GNUC__ > 4 ) || ( __GNUC__ == 4 && __GNUC_MINOR__ >= 9 ) )
+#define RAYTRACE_AVX2 1
+// only these functions are compiled for AVX2, the rest of the library still runs anywhere
+#define RAYTRACE_AVX2_TARGET __attribute__(( target( "avx2" ) ))
+#endif
+
+#ifdef RAYTRACE_AVX2
+#include <immintrin.h>
+#endif
+
+#define MAILBOX_HASH_SIZE 256
+
+// each level of the tree pushes at most one node, and the builders stop splitting at depth 21
+#define MAX_PACKET_STACK_LEN 64
+
+static int s_nPacketWidth = 0;
+
+int RayTracingEnvironment::PacketWidth( void )
+{
+	if ( !s_nPacketWidth )
+	{
+		int nWidth = 4;
+#ifdef RAYTRACE_AVX2
+		if ( CheckAVX2Technology() )
+			nWidth = 16;
+#endif
+		s_nPacketWidth = nWidth;
+	}
+	return s_nPacketWidth;
+}
+
+#ifdef RAYTRACE_AVX2
+
+template<int N> struct PacketNodeToVisit
+{
+	CacheOptimizedKDNode const *node;
+	__m256 TMin[N];
+	__m256 TMax[N];
+};
+
+static FORCEINLINE RAYTRACE_AVX2_TARGET __m256 Combine( const fltx4 &lo, const fltx4 &hi )
+{
+	return _mm256_insertf128_ps( _mm256_castps128_ps256( lo ), hi, 1 );
+}
+
+static FORCEINLINE RAYTRACE_AVX2_TARGET fltx4 Half( const __m256 &v, int nHalf )
+{
+	return nHalf ? _mm256_extractf128_ps( v, 1 ) : _mm256_castps256_ps128( v );
+}
+
+//-----------------------------------------------------------------------------
+// Traces up to 2*N groups of 4 rays as N blocks of 8 lanes. Groups past nGroups are
+// padding and never hit anything.
+//
+// Every lane keeps its own [TMin,TMax] per node. At a split, the part of a ray before the
+// plane is on the below side if the ray heads up the axis and on the above side if it
+// heads down, so each child gets an exact per lane interval whatever the signs are. The
+// child most rays reach first is visited first, and a popped node is clipped against the
+// closest hit found so far, so visiting in the "wrong" order for some lanes only costs time.
+//-----------------------------------------------------------------------------
+template<int N>
+static RAYTRACE_AVX2_TARGET void TracePacketAVX2( RayTracingEnvironment &env, const FourRays *pRays, int nGroups,
+												   const fltx4 *pTMin, const fltx4 *pTMax,
+												   RayTracingResult *pResults, int32 skip_id )
+{
+	__m256 org[3][N], dir[3][N], invdir[3][N];
+	__m256 TMin[N], TMax[N];
+	__m256 HitDistance[N], HitIds[N], Normal[3][N];
+
+	const __m256 Zero = _mm256_setzero_ps();
+	const __m256 One = _mm256_set1_ps( 1.0f );
+	const __m256 Epsilon = _mm256_set1_ps( 1.0e-10f );
+	const __m256 NegativeEpsilon = _mm256_set1_ps( -1.0e-10f );
+	const __m256 SaturateEpsilon = _mm256_set1_ps( FLT_EPSILON );
+
+	int nActive = 0, nActiveRays = 0;
+	int nNegative[3] = { 0, 0, 0 };
+	for ( int b = 0; b < N; b++ )
+	{
+		const FourRays &lo = pRays[ ( 2 * b < nGroups ) ? 2 * b : 0 ];
+		const FourRays &hi = pRays[ ( 2 * b + 1 < nGroups ) ? 2 * b + 1 : 0 ];
+		for ( int c = 0; c < 3; c++ )
+		{
+			org[c][b] = Combine( lo.origin[c], hi.origin[c] );
+			dir[c][b] = Combine( lo.direction[c], hi.direction[c] );
+
+			// 1/0 saturates the same way MakeReciprocalSaturate does
+			__m256 safe = _mm256_or_ps( dir[c][b], _mm256_and_ps( SaturateEpsilon, _mm256_cmp_ps( dir[c][b], Zero, _CMP_EQ_OQ ) ) );
+			invdir[c][b] = _mm256_div_ps( One, safe );
+		}
+
+		// padding starts out with an empty interval
+		fltx4 PadMin = Four_Ones, PadMax = Four_Zeros;
+		TMin[b] = Combine( ( 2 * b < nGroups ) ? pTMin[2 * b] : PadMin, ( 2 * b + 1 < nGroups ) ? pTMin[2 * b + 1] : PadMin );
+		TMax[b] = Combine( ( 2 * b < nGroups ) ? pTMax[2 * b] : PadMax, ( 2 * b + 1 < nGroups ) ? pTMax[2 * b + 1] : PadMax );
+
+		// clip against the bounding box
+		for ( int c = 0; c < 3; c++ )
+		{
+			__m256 isect_min_t = _mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( env.m_MinBound[c] ), org[c][b] ), invdir[c][b] );
+			__m256 isect_max_t = _mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( env.m_MaxBound[c] ), org[c][b] ), invdir[c][b] );
+			TMin[b] = _mm256_max_ps( TMin[b], _mm256_min_ps( isect_min_t, isect_max_t ) );
+			TMax[b] = _mm256_min_ps( TMax[b], _mm256_max_ps( isect_min_t, isect_max_t ) );
+		}
+
+		int nActiveMask = _mm256_movemask_ps( _mm256_cmp_ps( TMin[b], TMax[b], _CMP_LE_OQ ) );
+		nActive |= nActiveMask;
+		for ( int c = 0; c < 3; c++ )
+		{
+			for ( int nMask = nActiveMask & _mm256_movemask_ps( invdir[c][b] ); nMask; nMask &= nMask - 1 )
+				nNegative[c]++;
+		}
+		for ( int nMask = nActiveMask; nMask; nMask &= nMask - 1 )
+			nActiveRays++;
+
+		HitDistance[b] = _mm256_set1_ps( 1.0e23f );
+		HitIds[b] = _mm256_castsi256_ps( _mm256_set1_epi32( -1 ) );
+		Normal[0][b] = Normal[1][b] = Normal[2][b] = Zero;
+	}
+
+	if ( nActive )
+	{
+		// visit the below child first on axes where most of the rays head up
+		int near_idx[3];
+		for ( int c = 0; c < 3; c++ )
+			near_idx[c] = ( nNegative[c] * 2 > nActiveRays ) ? 1 : 0;
+
+		int32 mailboxids[MAILBOX_HASH_SIZE];				// used to avoid redundant triangle tests
+		memset( mailboxids, 0xff, sizeof( mailboxids ) );
+
+		PacketNodeToVisit<N> NodeQueue[MAX_PACKET_STACK_LEN];
+		PacketNodeToVisit<N> *stack_ptr = NodeQueue;
+		CacheOptimizedKDNode const *CurNode = &( env.OptimizedKDTree[0] );
+		while ( CurNode )
+		{
+			while ( CurNode->NodeType() != KDNODE_STATE_LEAF )		// traverse until next leaf
+			{
+				int split_plane_number = CurNode->NodeType();
+				CacheOptimizedKDNode const *Children = &( env.OptimizedKDTree[CurNode->LeftChild()] );
+				__m256 split = _mm256_set1_ps( CurNode->SplittingPlaneValue );
+
+				__m256 BelowMin[N], BelowMax[N], AboveMin[N], AboveMax[N];
+				int nBelow = 0, nAbove = 0;
+				for ( int b = 0; b < N; b++ )
+				{
+					__m256 inv = invdir[split_plane_number][b];
+					__m256 dist_to_sep_plane = _mm256_mul_ps( _mm256_sub_ps( split, org[split_plane_number][b] ), inv );
+					__m256 to_plane = _mm256_min_ps( TMax[b], dist_to_sep_plane );
+					__m256 from_plane = _mm256_max_ps( TMin[b], dist_to_sep_plane );
+
+					// blendv picks the second value in lanes heading down the axis
+					BelowMin[b] = _mm256_blendv_ps( TMin[b], from_plane, inv );
+					BelowMax[b] = _mm256_blendv_ps( to_plane, TMax[b], inv );
+					AboveMin[b] = _mm256_blendv_ps( from_plane, TMin[b], inv );
+					AboveMax[b] = _mm256_blendv_ps( TMax[b], to_plane, inv );
+
+					nBelow |= _mm256_movemask_ps( _mm256_cmp_ps( BelowMin[b], BelowMax[b], _CMP_LE_OQ ) );
+					nAbove |= _mm256_movemask_ps( _mm256_cmp_ps( AboveMin[b], AboveMax[b], _CMP_LE_OQ ) );
+				}
+
+				if ( !nAbove )
+				{
+					CurNode = Children;
+					memcpy( TMin, BelowMin, sizeof( TMin ) );
+					memcpy( TMax, BelowMax, sizeof( TMax ) );
+				}
+				else if ( !nBelow )
+				{
+					CurNode = Children + 1;
+					memcpy( TMin, AboveMin, sizeof( TMin ) );
+					memcpy( TMax, AboveMax, sizeof( TMax ) );
+				}
+				else
+				{
+					// some rays reach both children. push the far one, traverse the near one
+					Assert( stack_ptr < &NodeQueue[MAX_PACKET_STACK_LEN] );
+					bool bBelowFirst = ( near_idx[split_plane_number] == 0 );
+					stack_ptr->node = Children + ( bBelowFirst ? 1 : 0 );
+					memcpy( stack_ptr->TMin, bBelowFirst ? AboveMin : BelowMin, sizeof( TMin ) );
+					memcpy( stack_ptr->TMax, bBelowFirst ? AboveMax : BelowMax, sizeof( TMax ) );
+					++stack_ptr;
+
+					CurNode = Children + ( bBelowFirst ? 0 : 1 );
+					memcpy( TMin, bBelowFirst ? BelowMin : AboveMin, sizeof( TMin ) );
+					memcpy( TMax, bBelowFirst ? BelowMax : AboveMax, sizeof( TMax ) );
+				}
+			}
+
+			// hit a leaf! must do intersection check
+			int ntris = CurNode->NumberOfTrianglesInLeaf();
+			if ( ntris )
+			{
+				int32 const *tlist = &( env.TriangleIndexList[CurNode->TriangleIndexStart()] );
+				do
+				{
+					int tnum = *( tlist++ );
+					int mbox_slot = tnum & ( MAILBOX_HASH_SIZE - 1 );
+					TriIntersectData_t const *tri = &( env.OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+					if ( ( mailboxids[mbox_slot] == tnum ) || ( tri->m_nTriangleID == skip_id ) )
+						continue;
+					mailboxids[mbox_slot] = tnum;
+
+					__m256 Nx = _mm256_set1_ps( tri->m_flNx );
+					__m256 Ny = _mm256_set1_ps( tri->m_flNy );
+					__m256 Nz = _mm256_set1_ps( tri->m_flNz );
+					__m256 D = _mm256_set1_ps( tri->m_flD );
+					int c0 = tri->m_nCoordSelect0;
+					int c1 = tri->m_nCoordSelect1;
+
+					for ( int b = 0; b < N; b++ )
+					{
+						__m256 DDotN = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( dir[0][b], Nx ), _mm256_mul_ps( dir[1][b], Ny ) ),
+													  _mm256_mul_ps( dir[2][b], Nz ) );
+						// mask off zero or near zero (ray parallel to surface)
+						__m256 did_hit = _mm256_or_ps( _mm256_cmp_ps( DDotN, Epsilon, _CMP_GT_OQ ),
+													   _mm256_cmp_ps( DDotN, NegativeEpsilon, _CMP_LT_OQ ) );
+
+						__m256 ODotN = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( org[0][b], Nx ), _mm256_mul_ps( org[1][b], Ny ) ),
+													  _mm256_mul_ps( org[2][b], Nz ) );
+						__m256 isect_t = _mm256_div_ps( _mm256_sub_ps( D, ODotN ), DDotN );
+						did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( isect_t, Epsilon, _CMP_GT_OQ ) );
+						did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( isect_t, HitDistance[b], _CMP_LT_OQ ) );
+						if ( !_mm256_movemask_ps( did_hit ) )
+							continue;
+
+						// now, check 3 edges
+						__m256 hitc1 = _mm256_add_ps( org[c0][b], _mm256_mul_ps( isect_t, dir[c0][b] ) );
+						__m256 hitc2 = _mm256_add_ps( org[c1][b], _mm256_mul_ps( isect_t, dir[c1][b] ) );
+
+						__m256 B0 = _mm256_mul_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
+						B0 = _mm256_add_ps( B0, _mm256_mul_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
+						B0 = _mm256_add_ps( B0, _mm256_set1_ps( tri->m_ProjectedEdgeEquations[2] ) );
+						did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B0, Epsilon, _CMP_GE_OQ ) );
+
+						__m256 B1 = _mm256_mul_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
+						B1 = _mm256_add_ps( B1, _mm256_mul_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[4] ), hitc2 ) );
+						B1 = _mm256_add_ps( B1, _mm256_set1_ps( tri->m_ProjectedEdgeEquations[5] ) );
+						did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B1, Epsilon, _CMP_GE_OQ ) );
+
+						did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( _mm256_add_ps( B1, B0 ), One, _CMP_LE_OQ ) );
+						if ( !_mm256_movemask_ps( did_hit ) )
+							continue;
+
+						HitIds[b] = _mm256_blendv_ps( HitIds[b], _mm256_castsi256_ps( _mm256_set1_epi32( tnum ) ), did_hit );
+						HitDistance[b] = _mm256_blendv_ps( HitDistance[b], isect_t, did_hit );
+						Normal[0][b] = _mm256_blendv_ps( Normal[0][b], Nx, did_hit );
+						Normal[1][b] = _mm256_blendv_ps( Normal[1][b], Ny, did_hit );
+						Normal[2][b] = _mm256_blendv_ps( Normal[2][b], Nz, did_hit );
+					}
+				} while ( --ntris );
+			}
+
+			// pop stack, skipping nodes that start past every ray's closest hit
+			CurNode = NULL;
+			while ( stack_ptr > NodeQueue )
+			{
+				--stack_ptr;
+				int nStillActive = 0;
+				for ( int b = 0; b < N; b++ )
+				{
+					TMin[b] = stack_ptr->TMin[b];
+					TMax[b] = _mm256_min_ps( stack_ptr->TMax[b], HitDistance[b] );
+					nStillActive |= _mm256_movemask_ps( _mm256_cmp_ps( TMin[b], TMax[b], _CMP_LE_OQ ) );
+				}
+				if ( nStillActive )
+				{
+					CurNode = stack_ptr->node;
+					break;
+				}
+			}
+		}
+	}
+
+	for ( int g = 0; g < nGroups && g < 2 * N; g++ )
+	{
+		RayTracingResult *rslt_out = &pResults[g];
+		int b = g >> 1;
+		int nHalf = g & 1;
+		StoreAlignedSIMD( (float *)rslt_out->HitIds, Half( HitIds[b], nHalf ) );
+		rslt_out->HitDistance = Half( HitDistance[b], nHalf );
+		rslt_out->surface_normal.x = Half( Normal[0][b], nHalf );
+		rslt_out->surface_normal.y = Half( Normal[1][b], nHalf );
+		rslt_out->surface_normal.z = Half( Normal[2][b], nHalf );
+	}
+
+	_mm256_zeroupper();
+}
+
+#endif // RAYTRACE_AVX2
+
+void RayTracingEnvironment::TraceRayPacket( const FourRays *pRays, int nGroups, const fltx4 *pTMin, const fltx4 *pTMax,
+											RayTracingResult *pResults, int32 skip_id, ITransparentTriangleCallback *pCallback )
+{
+	int nWidth = pCallback ? 4 : PacketWidth();
+	int i = 0;
+
+#ifdef RAYTRACE_AVX2
+	if ( nWidth >= 16 )
+	{
+		// 16 wide for anything more than 8 rays, a leftover 4 goes 8 wide with padding
+		for ( ; i + 2 < nGroups; i += 4 )
+			TracePacketAVX2<2>( *this, pRays + i, MIN( nGroups - i, 4 ), pTMin + i, pTMax + i, pResults + i, skip_id );
+	}
+	if ( nWidth >= 8 )
+	{
+		for ( ; i < nGroups; i += 2 )
+			TracePacketAVX2<1>( *this, pRays + i, MIN( nGroups - i, 2 ), pTMin + i, pTMax + i, pResults + i, skip_id );
+	}
+#endif
+
+	for ( ; i < nGroups; i++ )
+		Trace4Rays( pRays[i], pTMin[i], pTMax[i], &pResults[i], skip_id, pCallback );
+}
@@ -8,6 +8,7 @@
 #include "rrbase.h"
 
 #include "utlmap.h"
+#include "tier1/generichash.h"
 
 #include "tier1/mapbase_con_groups.h"
 
@@ -21,6 +22,57 @@ using namespace ResponseRules;
 //-----------------------------------------------------------------------------
 CUtlSymbolTable CriteriaSet::sm_CriteriaSymbols( 1024, 1024, true );
 
+//-----------------------------------------------------------------------------
+// The same few dozen criteria names are looked up for every speech query, and the
+// symbol table finds a name with a string compare at each level of its tree. This
+// remembers the symbol for each name by hash so a repeat costs one compare instead.
+//-----------------------------------------------------------------------------
+#define CRITERIA_SYMBOL_CACHE_SIZE	1024	// must be a power of 2
+
+static CUtlSymbol s_CriteriaSymbolCache[ CRITERIA_SYMBOL_CACHE_SIZE ];
+
+// Criteria that nearly every query has, interned up front
+static const char *s_pszCommonCriteria[] =
+{
+	"concept",
+	"who",
+	"subject",
+	"classname",
+	"name",
+	"health",
+	"healthfrac",
+	"map",
+	"randomnum",
+	"spawnflags",
+	"flags",
+	"playerhealth",
+	"playerhealthfrac",
+	"playerweapon",
+	"playeractivity",
+	"playerspeed",
+	"distancetoplayer",
+	"seeplayer",
+	"seenbyplayer",
+	"timesincecombat",
+	"speaking",
+	"weapon",
+	"enemy",
+	"npcstate",
+	"activity",
+};
+
+static class CCommonCriteriaSymbols
+{
+public:
+	CCommonCriteriaSymbols()
+	{
+		for ( int i = 0; i < ARRAYSIZE( s_pszCommonCriteria ); i++ )
+		{
+			CriteriaSet::ComputeCriteriaSymbol( s_pszCommonCriteria[i] );
+		}
+	}
+} s_CommonCriteriaSymbols;
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 // Input  : *raw - 
@@ -89,28 +141,50 @@ const char *SplitContext( const char *raw, char *key, int keylen, char *value, i
 //-----------------------------------------------------------------------------
 // Purpose: 
 //-----------------------------------------------------------------------------
-CriteriaSet::CriteriaSet() : m_Lookup( 0, 0, CritEntry_t::LessFunc ), m_bOverrideOnAppend(true), 
-	m_nNumPrefixedContexts(0)
+CriteriaSet::CriteriaSet() : m_nNumPrefixedContexts(0), m_nBulkAppendStart(-1), m_bOverrideOnAppend(true)
 {
 }
 
 //-----------------------------------------------------------------------------
 // Purpose: 
 //-----------------------------------------------------------------------------
-CriteriaSet::CriteriaSet( const CriteriaSet& src ) : m_Lookup( 0, 0, CritEntry_t::LessFunc ), m_nNumPrefixedContexts(src.m_nNumPrefixedContexts)
+CriteriaSet::CriteriaSet( const CriteriaSet& src ) : m_nNumPrefixedContexts(0), m_nBulkAppendStart(-1), m_bOverrideOnAppend(true)
 {
-	m_Lookup.EnsureCapacity( src.m_Lookup.Count() );
-	for ( short i = src.m_Lookup.FirstInorder(); 
-		i != src.m_Lookup.InvalidIndex(); 
-		i = src.m_Lookup.NextInorder( i ) )
+	CopyFrom( src );
+}
+
+CriteriaSet::CriteriaSet( const char *criteria, const char *value ) : m_nNumPrefixedContexts(0), m_nBulkAppendStart(-1), m_bOverrideOnAppend(true)
+{
+	AppendCriteria(criteria,value);
+}
+
+CriteriaSet& CriteriaSet::operator=( const CriteriaSet& src )
+{
+	if ( this != &src )
 	{
-		m_Lookup.Insert( src.m_Lookup[ i ] );
+		CopyFrom( src );
 	}
+	return *this;
 }
 
-CriteriaSet::CriteriaSet( const char *criteria, const char *value ) : m_Lookup( 0, 0, CritEntry_t::LessFunc ), m_bOverrideOnAppend(true)
+//-----------------------------------------------------------------------------
+// Copies the criteria of src in order, packing the entries to match the keys
+//-----------------------------------------------------------------------------
+void CriteriaSet::CopyFrom( const CriteriaSet &src )
 {
-	AppendCriteria(criteria,value);
+	Assert( src.m_nBulkAppendStart < 0 );
+
+	int count = src.GetCount();
+	m_Keys.SetCount( count );
+	m_Entries.SetCount( count );
+	for ( int i = 0; i < count; i++ )
+	{
+		m_Keys[i].criterianame = src.m_Keys[i].criterianame;
+		m_Keys[i].entry = i;
+		m_Entries[i] = src.m_Entries[ src.m_Keys[i].entry ];
+	}
+	m_nNumPrefixedContexts = src.m_nNumPrefixedContexts;
+	m_nBulkAppendStart = -1;
 }
 
 
@@ -127,7 +201,15 @@ CriteriaSet::~CriteriaSet()
 //-----------------------------------------------------------------------------
 CriteriaSet::CritSymbol_t CriteriaSet::ComputeCriteriaSymbol( const char *criteria )
 {
-	return sm_CriteriaSymbols.AddString( criteria );
+	if ( !criteria )
+		return UTL_INVAL_SYMBOL;
+
+	CUtlSymbol &cached = s_CriteriaSymbolCache[ HashStringCaselessConventional( criteria ) & ( CRITERIA_SYMBOL_CACHE_SIZE - 1 ) ];
+	if ( cached.IsValid() && !V_stricmp( sm_CriteriaSymbols.String( cached ), criteria ) )
+		return cached;
+
+	cached = sm_CriteriaSymbols.AddString( criteria );
+	return cached;
 }
 
 
@@ -136,13 +218,20 @@ CriteriaSet::CritSymbol_t CriteriaSet::ComputeCriteriaSymbol( const char *criter
 //-----------------------------------------------------------------------------
 void CriteriaSet::AppendCriteria( CriteriaSet::CritSymbol_t criteria, const char *value, float weight )
 {
-	int idx = FindCriterionIndex( criteria );
+	int nInsertBefore;
+	int idx = FindCriterionIndex( criteria, &nInsertBefore );
 	if ( idx == -1 )
 	{
-		CritEntry_t entry;
-		entry.criterianame = criteria;
 		MEM_ALLOC_CREDIT();
-		idx = m_Lookup.Insert( entry );
+		CritKey_t key;
+		key.criterianame = criteria;
+		key.entry = m_Entries.AddToTail();
+		m_Entries[ key.entry ].criterianame = criteria;
+		idx = m_Keys.InsertBefore( nInsertBefore, key );
+		if ( m_nBulkAppendStart >= 0 )
+		{
+			m_BulkAppendFilter[ ( criteria & 0xff ) >> 5 ] |= 1 << ( criteria & 31 );
+		}
 		if ( sm_CriteriaSymbols.String(criteria)[0] == kAPPLYTOWORLDPREFIX )
 		{
 			m_nNumPrefixedContexts += 1;
@@ -155,12 +244,70 @@ void CriteriaSet::AppendCriteria( CriteriaSet::CritSymbol_t criteria, const char
 			return; 
 	}
 
-	CritEntry_t *entry = &m_Lookup[ idx ];
+	CritEntry_t *entry = &m_Entries[ m_Keys[ idx ].entry ];
 	entry->SetValue( value );
 	entry->weight = weight;
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Starts appending criteria unsorted, see EndBulkAppend
+//-----------------------------------------------------------------------------
+void CriteriaSet::BeginBulkAppend()
+{
+	Assert( m_nBulkAppendStart < 0 );
+	m_nBulkAppendStart = m_Keys.Count();
+	V_memset( m_BulkAppendFilter, 0, sizeof( m_BulkAppendFilter ) );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Sorts the criteria appended since BeginBulkAppend into the set. They
+//			were checked against the rest as they went in, so there are no
+//			duplicates and this is just a merge.
+//-----------------------------------------------------------------------------
+void CriteriaSet::EndBulkAppend()
+{
+	Assert( m_nBulkAppendStart >= 0 );
+	int nSorted = m_nBulkAppendStart;
+	m_nBulkAppendStart = -1;
+
+	int count = m_Keys.Count();
+	if ( nSorted == count )
+		return;
+
+	// insertion sort the new keys, there are only ever a few dozen
+	for ( int i = nSorted + 1; i < count; i++ )
+	{
+		CritKey_t key = m_Keys[i];
+		int j = i;
+		for ( ; j > nSorted && key.criterianame < m_Keys[j - 1].criterianame; j-- )
+		{
+			m_Keys[j] = m_Keys[j - 1];
+		}
+		m_Keys[j] = key;
+	}
+	if ( nSorted == 0 || m_Keys[ nSorted - 1 ].criterianame < m_Keys[ nSorted ].criterianame )
+		return;
+
+	CUtlVectorFixedGrowable< CritKey_t, NUM_INLINE_CRITERIA * 2 > merged;
+	merged.SetCount( count );
+	int i = 0, j = nSorted;
+	for ( int k = 0; k < count; k++ )
+	{
+		if ( j >= count || ( i < nSorted && m_Keys[i].criterianame < m_Keys[j].criterianame ) )
+		{
+			merged[k] = m_Keys[i++];
+		}
+		else
+		{
+			merged[k] = m_Keys[j++];
+		}
+	}
+	V_memcpy( m_Keys.Base(), merged.Base(), count * sizeof( CritKey_t ) );
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 // Input  : *criteria - 
@@ -210,16 +357,36 @@ void CriteriaSet::RemoveCriteria( const char *criteria )
 // or if this function should do that (true).
 void CriteriaSet::RemoveCriteria( int idx, bool bTestForPrefix )
 {
-	Assert( m_Lookup.IsValidIndex(idx) );
+	Assert( IsValidIndex(idx) );
 	if ( bTestForPrefix )
 	{
-		if ( sm_CriteriaSymbols.String( m_Lookup[idx].criterianame )[0] == kAPPLYTOWORLDPREFIX )
+		if ( sm_CriteriaSymbols.String( m_Keys[idx].criterianame )[0] == kAPPLYTOWORLDPREFIX )
 		{
 			Assert( m_nNumPrefixedContexts > 0 );
 			m_nNumPrefixedContexts = isel( m_nNumPrefixedContexts - 1, m_nNumPrefixedContexts - 1, 0 );
 		}
 	}
-	m_Lookup.RemoveAt( idx );
+
+	// the last entry moves into the hole, so point its key at the new spot
+	int nEntry = m_Keys[idx].entry;
+	int nLastEntry = m_Entries.Count() - 1;
+	m_Keys.Remove( idx );
+	if ( m_nBulkAppendStart > idx )
+	{
+		m_nBulkAppendStart--;
+	}
+	if ( nEntry != nLastEntry )
+	{
+		for ( int i = 0; i < m_Keys.Count(); i++ )
+		{
+			if ( m_Keys[i].entry == nLastEntry )
+			{
+				m_Keys[i].entry = nEntry;
+				break;
+			}
+		}
+	}
+	m_Entries.FastRemove( nEntry );
 }
 
 //-----------------------------------------------------------------------------
@@ -228,7 +395,7 @@ void CriteriaSet::RemoveCriteria( int idx, bool bTestForPrefix )
 //-----------------------------------------------------------------------------
 int CriteriaSet::GetCount() const
 {
-	return m_Lookup.Count();
+	return m_Keys.Count();
 }
 
 
@@ -239,10 +406,48 @@ int CriteriaSet::GetCount() const
 //-----------------------------------------------------------------------------
 int CriteriaSet::FindCriterionIndex( CritSymbol_t criteria ) const
 {
-	CritEntry_t search;
-	search.criterianame = criteria;
-	int idx = m_Lookup.Find( search );
-	return ( idx == m_Lookup.InvalidIndex() ) ? -1 : idx;
+	int nInsertBefore;
+	return FindCriterionIndex( criteria, &nInsertBefore );
+}
+
+//-----------------------------------------------------------------------------
+// Binary searches the sorted keys, then checks any appended unsorted since
+// BeginBulkAppend. If the criteria isn't found, pInsertBefore is where a new key
+// for it belongs.
+//-----------------------------------------------------------------------------
+int CriteriaSet::FindCriterionIndex( CritSymbol_t criteria, int *pInsertBefore ) const
+{
+	int count = m_Keys.Count();
+	int nSorted = ( m_nBulkAppendStart < 0 ) ? count : m_nBulkAppendStart;
+
+	const CritKey_t *pKeys = m_Keys.Base();
+	int lo = 0, hi = nSorted;
+	while ( lo < hi )
+	{
+		int mid = ( lo + hi ) >> 1;
+		if ( pKeys[mid].criterianame < criteria )
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	if ( lo < nSorted && pKeys[lo].criterianame == criteria )
+		return lo;
+
+	if ( nSorted < count && ( m_BulkAppendFilter[ ( criteria & 0xff ) >> 5 ] & ( 1 << ( criteria & 31 ) ) ) )
+	{
+		for ( int i = nSorted; i < count; i++ )
+		{
+			if ( pKeys[i].criterianame == criteria )
+				return i;
+		}
+	}
+
+	*pInsertBefore = ( m_nBulkAppendStart < 0 ) ? lo : count;
+	return -1;
 }
 
 int CriteriaSet::FindCriterionIndex( const char *name ) const
@@ -257,11 +462,10 @@ int CriteriaSet::FindCriterionIndex( const char *name ) const
 //-----------------------------------------------------------------------------
 CriteriaSet::CritSymbol_t CriteriaSet::GetNameSymbol( int nIndex ) const
 {
-	if ( nIndex < 0 || nIndex >= (int)m_Lookup.Count() )
+	if ( !IsValidIndex( nIndex ) )
 		return UTL_INVAL_SYMBOL;
 
-	const CritEntry_t *entry = &m_Lookup[ nIndex ];
-	return entry->criterianame;
+	return m_Keys[ nIndex ].criterianame;
 }
 
 
@@ -272,11 +476,11 @@ CriteriaSet::CritSymbol_t CriteriaSet::GetNameSymbol( int nIndex ) const
 //-----------------------------------------------------------------------------
 const char *CriteriaSet::GetName( int index ) const
 {
-	if ( index < 0 || index >= (int)m_Lookup.Count() )
+	if ( !IsValidIndex( index ) )
 		return "";
 	else
 	{
-		const char *pCriteriaName = sm_CriteriaSymbols.String( m_Lookup[ index ].criterianame );
+		const char *pCriteriaName = sm_CriteriaSymbols.String( m_Keys[ index ].criterianame );
 		return pCriteriaName ? pCriteriaName : "";
 	}
 }
@@ -289,10 +493,10 @@ const char *CriteriaSet::GetName( int index ) const
 //-----------------------------------------------------------------------------
 const char *CriteriaSet::GetValue( int index ) const
 {
-	if ( index < 0 || index >= (int)m_Lookup.Count() )
+	if ( !IsValidIndex( index ) )
 		return "";
 
-	const CritEntry_t *entry = &m_Lookup[ index ];
+	const CritEntry_t *entry = &m_Entries[ m_Keys[ index ].entry ];
 	return entry->value ? entry->value : "";
 }
 
@@ -303,10 +507,10 @@ const char *CriteriaSet::GetValue( int index ) const
 //-----------------------------------------------------------------------------
 float CriteriaSet::GetWeight( int index ) const
 {
-	if ( index < 0 || index >= (int)m_Lookup.Count() )
+	if ( !IsValidIndex( index ) )
 		return 1.0f;
 
-	const CritEntry_t *entry = &m_Lookup[ index ];
+	const CritEntry_t *entry = &m_Entries[ m_Keys[ index ].entry ];
 	return entry->weight;
 }
 
@@ -323,10 +527,19 @@ void CriteriaSet::Merge( const CriteriaSet * RESTRICT otherCriteria )
 	// for now, just duplicate everything.
 	int count = otherCriteria->GetCount();
 	EnsureCapacity( count + GetCount() );
+	bool bBulk = ( m_nBulkAppendStart < 0 );
+	if ( bBulk )
+	{
+		BeginBulkAppend();
+	}
 	for ( int i = 0 ; i < count ; ++i )
 	{
 		AppendCriteria( otherCriteria->GetNameSymbol(i), otherCriteria->GetValue(i), otherCriteria->GetWeight(i) );
 	}
+	if ( bBulk )
+	{
+		EndBulkAppend();
+	}
 }
 
 void CriteriaSet::Merge( const char *modifiers ) // add criteria parsed from a text string
@@ -361,11 +574,11 @@ void CriteriaSet::Describe() const
 {
 	// build an alphabetized representation of the set for printing
 	typedef CUtlMap<const char *, const CritEntry_t *> tMap;
-	tMap m_TempMap( 0, m_Lookup.Count(), CaselessStringLessThan );
+	tMap m_TempMap( 0, m_Entries.Count(), CaselessStringLessThan );
 
-	for ( short i = m_Lookup.FirstInorder(); i != m_Lookup.InvalidIndex(); i = m_Lookup.NextInorder( i ) )
+	for ( int i = 0; i < m_Entries.Count(); i++ )
 	{
-		const CritEntry_t *entry = &m_Lookup[ i ];
+		const CritEntry_t *entry = &m_Entries[ i ];
 
 		m_TempMap.Insert( sm_CriteriaSymbols.String( entry->criterianame ), entry );
 	}
@@ -408,7 +621,10 @@ void CriteriaSet::Describe() const
 
 void CriteriaSet::Reset()
 {
-	m_Lookup.Purge();
+	m_Keys.Purge();
+	m_Entries.Purge();
+	m_nNumPrefixedContexts = 0;
+	m_nBulkAppendStart = -1;
 }
 
 void CriteriaSet::WriteToEntity( CBaseEntity *pEntity )
@@ -473,7 +689,8 @@ int CriteriaSet::InterceptWorldSetContexts( CriteriaSet * RESTRICT pFrom, Criter
 	AssertMsg2( pSetOnWorld->GetCount() == nPrefixedContexts, "Count of $ persistent RR contexts is inconsistent (%d vs %d)! Call Elan.",
 		pSetOnWorld->GetCount(), nPrefixedContexts	);
 
+	// (the inline buffers can't be swapped, so copy it back)
+	pFrom->CopyFrom( rewrite );
 	pFrom->m_nNumPrefixedContexts = 0;
-	pFrom->m_Lookup.Swap(rewrite.m_Lookup);
 	return pSetOnWorld->GetCount();
 }
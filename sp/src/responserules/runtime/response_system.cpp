@@ -88,12 +88,18 @@ ConVar rr_debugresponses( "rr_debugresponses", "0", FCVAR_NONE, "Show verbose ma
 ConVar rr_debugrule( "rr_debugrule", "", FCVAR_NONE, "If set to the name of the rule, that rule's score will be shown whenever a concept is passed into the response rules system.");
 ConVar rr_dumpresponses( "rr_dumpresponses", "0", FCVAR_NONE, "Dump all response_rules.txt and rules (requires restart)" );
 ConVar rr_debugresponseconcept( "rr_debugresponseconcept", "", FCVAR_NONE, "If set, rr_debugresponses will print only responses testing for the specified concept" );
+ConVar rr_rulecache( "rr_rulecache", "1", FCVAR_NONE, "Load the response rules from a binary cache written next to the base script, as long as none of the scripts have changed since." );
+ConVar rr_ruleindex( "rr_ruleindex", "1", FCVAR_NONE, "Only score the rules whose required criteria could match, instead of every rule for the speaker and concept." );
 #define RR_DEBUGRESPONSES_SPECIALCASE 4
 
 #ifdef MAPBASE
 ConVar rr_disableemptyrules( "rr_disableemptyrules", "0", FCVAR_NONE, "Disables rules with no remaining responses, e.g. rules which use norepeat responses." );
 #endif
 
+// Numbers the names of the criteria written inline in rules. Shared by every system, and
+// carried through the rule cache so a cached rule set doesn't reuse the numbers.
+static int s_nInstancedCriteria = 0;
+
 
 
 //-----------------------------------------------------------------------------
@@ -195,6 +201,7 @@ CResponseSystem::CResponseSystem() :
 #ifdef MAPBASE
 	m_bInProspective = false;
 #endif
+	m_bRecordCacheSources = false;
 
 	BuildDispatchTables();
 }
@@ -1259,13 +1266,37 @@ ResponseRulePartition::tIndex CResponseSystem::FindBestMatchingRule( const Crite
 
 	CUtlVectorFixed< ResponseRulePartition::tRuleDict *, 2 > buckets( 0, 2 );
 	m_RulePartitions.GetDictsForCriteria( &buckets, set );
+
+	// Rules the index leaves out would score zero, so they can't change the result. Scan
+	// everything when debugging though, since the skipped rules would print their scoring.
+	const char *pszDebugRule = rr_debugrule.GetString();
+	bool bUseIndex = rr_ruleindex.GetBool() && !verbose && !( pszDebugRule && pszDebugRule[0] );
+
+	CUtlVector< unsigned int > criteriaKeys;
+	CUtlVector< unsigned short > candidates;
+	if ( bUseIndex )
+	{
+		m_RulePartitions.EnsureCandidateIndex( this );
+		ResponseRulePartition::ComputeCriteriaKeys( &criteriaKeys, set );
+	}
+
 	for ( int b = 0 ; b < buckets.Count() ; ++b )
 	{
 		ResponseRulePartition::tRuleDict *prules = buckets[b];
-		int c = prules->Count();
-	int i;
-	for ( i = 0; i < c; i++ )
+		int c;
+		if ( bUseIndex )
+		{
+			m_RulePartitions.GetCandidateRules( &candidates, prules, criteriaKeys );
+			c = candidates.Count();
+		}
+		else
+		{
+			c = prules->Count();
+		}
+	int j;
+	for ( j = 0; j < c; j++ )
 	{
+			int i = bUseIndex ? candidates[j] : j;
 			float score = ScoreCriteriaAgainstRule( set, *prules, i, verbose );
 		// Check equals so that we keep track of all matching rules
 		if ( score >= bestscore )
@@ -1534,6 +1565,9 @@ void CResponseSystem::ParseInclude()
 	if ( !IEngineEmulator::Get()->GetFilesystem()->ReadFile( includefile, "GAME", buf ) )
 	{
 		CGMsg( 1, CON_GROUP_RESPONSE_SYSTEM, "Unable to load #included script %s\n", includefile );
+
+		// the cache is stale if this turns up later
+		AddRuleSetCacheSource( includefile, NULL );
 		return;
 	}
 
@@ -1544,6 +1578,7 @@ void CResponseSystem::LoadFromBuffer( const char *scriptfile, const char *buffer
 {
 	COM_TimestampedLog( "CResponseSystem::LoadFromBuffer [%s] - Start", scriptfile );
 	m_IncludedFiles.Allocate( scriptfile );
+	AddRuleSetCacheSource( scriptfile, buffer );
 	PushScript( scriptfile, (unsigned char * )buffer );
 
 	if( rr_dumpresponses.GetBool() )
@@ -1594,6 +1629,17 @@ void CResponseSystem::LoadFromBuffer( const char *scriptfile, const char *buffer
 void CResponseSystem::LoadRuleSet( const char *basescript )
 {
 	float flStart = Plat_FloatTime();
+
+	// The cache holds a whole rule set, so it can only stand in for a load into an empty system
+	bool bUseCache = rr_rulecache.GetBool() && !m_Criteria.Count() && !m_Responses.Count() &&
+		!m_RulePartitions.Count() && !m_Enumerations.Count();
+	if ( bUseCache && LoadRuleSetCache( basescript ) )
+	{
+		float flEnd = Plat_FloatTime();
+		COM_TimestampedLog( "CResponseSystem::LoadRuleSet (cached) took %f msec", 1000.0f * ( flEnd - flStart ) );
+		return;
+	}
+
 	int length = 0;
 	unsigned char *buffer = (unsigned char *)IEngineEmulator::Get()->LoadFileForMe( basescript, &length );
 	if ( length <= 0 || !buffer )
@@ -1603,15 +1649,534 @@ void CResponseSystem::LoadRuleSet( const char *basescript )
 	}
 
 	m_IncludedFiles.FreeAll();
+	m_CacheSources.RemoveAll();
+	m_bRecordCacheSources = bUseCache;
 	LoadFromBuffer( basescript, (const char *)buffer );
+	m_bRecordCacheSources = false;
 
 	IEngineEmulator::Get()->FreeFile( buffer );
 
 	Assert( m_ScriptStack.Count() == 0 );
+
+	if ( bUseCache )
+	{
+		SaveRuleSetCache( basescript );
+	}
+	m_CacheSources.Purge();
 	float flEnd = Plat_FloatTime();
 	COM_TimestampedLog( "CResponseSystem::LoadRuleSet took %f msec", 1000.0f * ( flEnd - flStart ) );
 }
 
+//-----------------------------------------------------------------------------
+// Rule cache: LoadRuleSet's parsed tables, written to <basescript>.rrc after a
+// text load and read back instead of the scripts as long as every script it
+// was built from still has the same CRC (and every missing #include is still
+// missing). Matchers are stored already computed.
+//-----------------------------------------------------------------------------
+#define RR_CACHE_ID			MAKEID( 'R', 'R', 'C', 'F' )
+#define RR_CACHE_VERSION	1
+
+#ifdef MAPBASE
+#define RR_CACHE_BUILD		1
+#else
+#define RR_CACHE_BUILD		0
+#endif
+
+// Matcher flags
+#define RR_CACHE_MATCHER_VALID		( 1 << 0 )
+#define RR_CACHE_MATCHER_ISNUMERIC	( 1 << 1 )
+#define RR_CACHE_MATCHER_NOTEQUAL	( 1 << 2 )
+#define RR_CACHE_MATCHER_USEMIN		( 1 << 3 )
+#define RR_CACHE_MATCHER_MINEQUALS	( 1 << 4 )
+#define RR_CACHE_MATCHER_USEMAX		( 1 << 5 )
+#define RR_CACHE_MATCHER_MAXEQUALS	( 1 << 6 )
+#define RR_CACHE_MATCHER_ISBIT		( 1 << 7 )
+
+// ResponseGroup flags
+#define RR_CACHE_GROUP_ENABLED		( 1 << 0 )
+#define RR_CACHE_GROUP_DEPLETE		( 1 << 1 )
+#define RR_CACHE_GROUP_HASFIRST		( 1 << 2 )
+#define RR_CACHE_GROUP_HASLAST		( 1 << 3 )
+#define RR_CACHE_GROUP_SEQUENTIAL	( 1 << 4 )
+#define RR_CACHE_GROUP_NOREPEAT		( 1 << 5 )
+
+static void GetRuleCacheFileName( const char *basescript, char *pOut, int nOutSize )
+{
+	Q_StripExtension( basescript, pOut, nOutSize );
+	Q_strncat( pOut, ".rrc", nOutSize, COPY_ALL_CHARACTERS );
+}
+
+// Scripts are parsed as C strings, so only what's before the first NUL counts
+static CRC32_t CRCScript( const char *pBuffer, int nMaxLen )
+{
+	const char *pEnd = (const char *)memchr( pBuffer, 0, nMaxLen );
+	return CRC32_ProcessSingleBuffer( pBuffer, pEnd ? pEnd - pBuffer : nMaxLen );
+}
+
+static void PutCacheString( CUtlBuffer &buf, const char *pString )
+{
+	buf.PutUnsignedChar( pString ? 1 : 0 );
+	if ( pString )
+	{
+		buf.PutString( pString );
+	}
+}
+
+// Returns a pointer into buf, or NULL for a NULL string. Sets bOK to false if the string runs off the end.
+static const char *GetCacheString( CUtlBuffer &buf, bool &bOK )
+{
+	if ( !buf.GetUnsignedChar() )
+		return NULL;
+
+	int nRemaining = buf.GetBytesRemaining();
+	const char *pString = (const char *)buf.PeekGet();
+	if ( nRemaining <= 0 || !pString || !memchr( pString, 0, nRemaining ) )
+	{
+		bOK = false;
+		return "";
+	}
+
+	buf.SeekGet( CUtlBuffer::SEEK_CURRENT, Q_strlen( pString ) + 1 );
+	return pString;
+}
+
+static void PutCacheInterval( CUtlBuffer &buf, const responseparams_interval_t &interval )
+{
+	buf.PutFloat( interval.start );
+	buf.PutFloat( interval.range );
+}
+
+static void GetCacheInterval( CUtlBuffer &buf, responseparams_interval_t &interval )
+{
+	interval.start = buf.GetFloat();
+	interval.range = buf.GetFloat();
+}
+
+void CResponseSystem::AddRuleSetCacheSource( const char *scriptfile, const char *buffer )
+{
+	if ( !m_bRecordCacheSources )
+		return;
+
+	CacheSource_t &source = m_CacheSources[ m_CacheSources.AddToTail() ];
+	source.m_Name = scriptfile;
+	source.m_bMissing = ( buffer == NULL );
+	source.m_CRC = buffer ? CRCScript( buffer, Q_strlen( buffer ) + 1 ) : 0;
+}
+
+void CResponseSystem::SaveRuleSetCache( const char *basescript )
+{
+	// Rules and the response/criteria tables refer to each other by index, so the
+	// tables have to be dense for a load to rebuild them with the same indices
+	if ( m_Criteria.MaxElement() != m_Criteria.Count() || m_Responses.MaxElement() != m_Responses.Count() ||
+		m_Enumerations.MaxElement() != m_Enumerations.Count() )
+	{
+		CGMsg( 1, CON_GROUP_RESPONSE_SYSTEM, "CResponseSystem:  not caching %s, its tables have holes\n", basescript );
+		return;
+	}
+
+	int i, j;
+	CUtlBuffer data;
+
+	data.PutInt( s_nInstancedCriteria );
+
+	data.PutInt( m_Enumerations.Count() );
+	for ( i = 0; i < m_Enumerations.Count(); i++ )
+	{
+		PutCacheString( data, m_Enumerations.GetElementName( i ) );
+		data.PutFloat( m_Enumerations[ i ].value );
+	}
+
+	data.PutInt( m_Criteria.Count() );
+	for ( i = 0; i < m_Criteria.Count(); i++ )
+	{
+		Criteria &c = m_Criteria[ i ];
+		PutCacheString( data, m_Criteria.GetElementName( i ) );
+		PutCacheString( data, c.nameSym.IsValid() ? CriteriaSet::SymbolToStr( c.nameSym ) : NULL );
+		PutCacheString( data, c.value );
+		data.PutFloat( c.weight.GetFloat() );
+		data.PutUnsignedChar( c.required ? 1 : 0 );
+
+		Matcher &m = c.matcher;
+		int nFlags = 0;
+		if ( m.valid )		nFlags |= RR_CACHE_MATCHER_VALID;
+		if ( m.isnumeric )	nFlags |= RR_CACHE_MATCHER_ISNUMERIC;
+		if ( m.notequal )	nFlags |= RR_CACHE_MATCHER_NOTEQUAL;
+		if ( m.usemin )		nFlags |= RR_CACHE_MATCHER_USEMIN;
+		if ( m.minequals )	nFlags |= RR_CACHE_MATCHER_MINEQUALS;
+		if ( m.usemax )		nFlags |= RR_CACHE_MATCHER_USEMAX;
+		if ( m.maxequals )	nFlags |= RR_CACHE_MATCHER_MAXEQUALS;
+#ifdef MAPBASE
+		if ( m.isbit )		nFlags |= RR_CACHE_MATCHER_ISBIT;
+#endif
+		data.PutUnsignedChar( nFlags );
+		data.PutFloat( m.minval );
+		data.PutFloat( m.maxval );
+		if ( m.valid )
+		{
+			PutCacheString( data, m.GetToken() );
+			PutCacheString( data, m.GetRaw() );
+		}
+
+		data.PutInt( c.subcriteria.Count() );
+		for ( j = 0; j < c.subcriteria.Count(); j++ )
+		{
+			data.PutUnsignedShort( c.subcriteria[ j ] );
+		}
+	}
+
+	data.PutInt( m_Responses.Count() );
+	for ( i = 0; i < m_Responses.Count(); i++ )
+	{
+		ResponseGroup &group = m_Responses[ i ];
+		PutCacheString( data, m_Responses.GetElementName( i ) );
+
+		int nFlags = 0;
+		if ( group.m_bEnabled )				nFlags |= RR_CACHE_GROUP_ENABLED;
+		if ( group.m_bDepleteBeforeRepeat )	nFlags |= RR_CACHE_GROUP_DEPLETE;
+		if ( group.m_bHasFirst )			nFlags |= RR_CACHE_GROUP_HASFIRST;
+		if ( group.m_bHasLast )				nFlags |= RR_CACHE_GROUP_HASLAST;
+		if ( group.m_bSequential )			nFlags |= RR_CACHE_GROUP_SEQUENTIAL;
+		if ( group.m_bNoRepeat )			nFlags |= RR_CACHE_GROUP_NOREPEAT;
+		data.PutUnsignedChar( nFlags );
+		data.PutUnsignedChar( group.m_nCurrentIndex );
+		data.PutUnsignedChar( group.m_nDepletionCount );
+
+		data.PutInt( group.group.Count() );
+		for ( j = 0; j < group.group.Count(); j++ )
+		{
+			ParserResponse &response = group.group[ j ];
+			PutCacheString( data, response.value );
+			data.PutFloat( response.weight.GetFloat() );
+			data.PutUnsignedChar( response.depletioncount );
+			data.PutUnsignedChar( response.type );
+			data.PutUnsignedChar( ( response.first ? 1 : 0 ) | ( response.last ? 2 : 0 ) );
+
+			ResponseParams &params = response.params;
+			PutCacheInterval( data, params.delay );
+			PutCacheInterval( data, params.respeakdelay );
+			PutCacheInterval( data, params.weapondelay );
+			data.PutShort( params.odds );
+			data.PutShort( params.flags );
+			data.PutUnsignedChar( params.soundlevel );
+			PutCacheInterval( data, params.predelay );
+
+			AI_ResponseFollowup &followup = response.m_followup;
+			PutCacheString( data, followup.followup_concept );
+			PutCacheString( data, followup.followup_contexts );
+			data.PutFloat( followup.followup_delay );
+			PutCacheString( data, followup.followup_target );
+			PutCacheString( data, followup.followup_entityiotarget );
+			PutCacheString( data, followup.followup_entityioinput );
+			data.PutFloat( followup.followup_entityiodelay );
+		}
+	}
+
+	// Bucket by bucket, in element order, so each bucket gets its rules back with the same
+	// element numbers and FindBestMatchingRule scores them in the same order
+	data.PutInt( m_RulePartitions.Count() );
+	for ( ResponseRulePartition::tIndex idx = m_RulePartitions.First() ;
+		m_RulePartitions.IsValid(idx) ;
+		idx = m_RulePartitions.Next(idx) )
+	{
+		Rule &rule = m_RulePartitions[ idx ];
+		PutCacheString( data, m_RulePartitions.GetElementName( idx ) );
+
+		data.PutInt( rule.m_Criteria.Count() );
+		for ( j = 0; j < rule.m_Criteria.Count(); j++ )
+		{
+			data.PutUnsignedShort( rule.m_Criteria[ j ] );
+		}
+
+		data.PutInt( rule.m_Responses.Count() );
+		for ( j = 0; j < rule.m_Responses.Count(); j++ )
+		{
+			data.PutUnsignedShort( rule.m_Responses[ j ] );
+		}
+
+		PutCacheString( data, rule.m_szContext );
+		data.PutUnsignedChar( rule.m_nForceWeight );
+#ifdef MAPBASE
+		data.PutUnsignedChar( rule.m_iContextFlags );
+#else
+		data.PutUnsignedChar( rule.m_bApplyContextToWorld ? 1 : 0 );
+#endif
+		data.PutUnsignedChar( ( rule.m_bMatchOnce ? 1 : 0 ) | ( rule.m_bEnabled ? 2 : 0 ) );
+	}
+
+	CUtlBuffer buf;
+	buf.PutInt( RR_CACHE_ID );
+	buf.PutInt( RR_CACHE_VERSION );
+	buf.PutInt( RR_CACHE_BUILD );
+
+	buf.PutInt( m_CacheSources.Count() );
+	for ( i = 0; i < m_CacheSources.Count(); i++ )
+	{
+		PutCacheString( buf, m_CacheSources[ i ].m_Name.Get() );
+		buf.PutUnsignedChar( m_CacheSources[ i ].m_bMissing ? 1 : 0 );
+		buf.PutUnsignedInt( m_CacheSources[ i ].m_CRC );
+	}
+
+	buf.PutUnsignedInt( CRC32_ProcessSingleBuffer( data.Base(), data.TellPut() ) );
+	buf.PutInt( data.TellPut() );
+	buf.Put( data.Base(), data.TellPut() );
+
+	char cachefile[ MAX_PATH ];
+	GetRuleCacheFileName( basescript, cachefile, sizeof( cachefile ) );
+	if ( !IEngineEmulator::Get()->GetFilesystem()->WriteFile( cachefile, "MOD", buf ) )
+	{
+		CGMsg( 1, CON_GROUP_RESPONSE_SYSTEM, "CResponseSystem:  unable to write %s\n", cachefile );
+	}
+}
+
+bool CResponseSystem::LoadRuleSetCache( const char *basescript )
+{
+	MEM_ALLOC_CREDIT();
+
+	char cachefile[ MAX_PATH ];
+	GetRuleCacheFileName( basescript, cachefile, sizeof( cachefile ) );
+
+	IFileSystem *pFileSystem = IEngineEmulator::Get()->GetFilesystem();
+
+	CUtlBuffer buf;
+	if ( !pFileSystem->ReadFile( cachefile, "MOD", buf ) )
+		return false;
+
+	if ( buf.GetInt() != RR_CACHE_ID || buf.GetInt() != RR_CACHE_VERSION || buf.GetInt() != RR_CACHE_BUILD )
+		return false;
+
+	bool bOK = true;
+	int i, j, c;
+
+	// Every script the cache was built from has to be unchanged
+	CUtlVector< const char * > sources;
+	int nSources = buf.GetInt();
+	for ( i = 0; i < nSources && bOK && buf.IsValid(); i++ )
+	{
+		const char *pszName = GetCacheString( buf, bOK );
+		bool bMissing = buf.GetUnsignedChar() != 0;
+		CRC32_t crc = buf.GetUnsignedInt();
+		if ( !bOK || !pszName )
+			return false;
+
+		CUtlBuffer script;
+		if ( !pFileSystem->ReadFile( pszName, "GAME", script ) )
+		{
+			if ( !bMissing )
+				return false;
+			continue;
+		}
+
+		if ( bMissing || CRCScript( (const char *)script.Base(), script.TellPut() ) != crc )
+		{
+			CGMsg( 1, CON_GROUP_RESPONSE_SYSTEM, "CResponseSystem:  %s has changed, reparsing %s\n", pszName, basescript );
+			return false;
+		}
+
+		sources.AddToTail( pszName );
+	}
+
+	CRC32_t dataCRC = buf.GetUnsignedInt();
+	int nDataSize = buf.GetInt();
+	if ( !bOK || !buf.IsValid() || nDataSize != buf.GetBytesRemaining() || 
+		CRC32_ProcessSingleBuffer( buf.PeekGet(), nDataSize ) != dataCRC )
+		return false;
+
+	int nInstancedCriteria = buf.GetInt();
+	s_nInstancedCriteria = MAX( s_nInstancedCriteria, nInstancedCriteria );
+
+	c = buf.GetInt();
+	for ( i = 0; i < c && bOK; i++ )
+	{
+		const char *pszName = GetCacheString( buf, bOK );
+		Enumeration newEnum;
+		newEnum.value = buf.GetFloat();
+		bOK = bOK && pszName && m_Enumerations.Insert( pszName, newEnum ) == i;
+	}
+
+	int nCriteria = buf.GetInt();
+	for ( i = 0; i < nCriteria && bOK; i++ )
+	{
+		const char *pszName = GetCacheString( buf, bOK );
+		if ( !bOK || !pszName || m_Criteria.Insert( pszName ) != i )
+		{
+			bOK = false;
+			break;
+		}
+
+		Criteria &crit = m_Criteria[ i ];
+		const char *pszSymbol = GetCacheString( buf, bOK );
+		if ( pszSymbol )
+		{
+			crit.nameSym = CriteriaSet::ComputeCriteriaSymbol( pszSymbol );
+		}
+		crit.value = ResponseCopyString( GetCacheString( buf, bOK ) );
+		crit.weight.SetFloat( buf.GetFloat() );
+		crit.required = buf.GetUnsignedChar() != 0;
+
+		Matcher &m = crit.matcher;
+		int nFlags = buf.GetUnsignedChar();
+		m.valid = ( nFlags & RR_CACHE_MATCHER_VALID ) != 0;
+		m.isnumeric = ( nFlags & RR_CACHE_MATCHER_ISNUMERIC ) != 0;
+		m.notequal = ( nFlags & RR_CACHE_MATCHER_NOTEQUAL ) != 0;
+		m.usemin = ( nFlags & RR_CACHE_MATCHER_USEMIN ) != 0;
+		m.minequals = ( nFlags & RR_CACHE_MATCHER_MINEQUALS ) != 0;
+		m.usemax = ( nFlags & RR_CACHE_MATCHER_USEMAX ) != 0;
+		m.maxequals = ( nFlags & RR_CACHE_MATCHER_MAXEQUALS ) != 0;
+#ifdef MAPBASE
+		m.isbit = ( nFlags & RR_CACHE_MATCHER_ISBIT ) != 0;
+#endif
+		m.minval = buf.GetFloat();
+		m.maxval = buf.GetFloat();
+		if ( m.valid )
+		{
+			const char *pszToken = GetCacheString( buf, bOK );
+			const char *pszRaw = GetCacheString( buf, bOK );
+			m.SetToken( pszToken ? pszToken : "" );
+			m.SetRaw( pszRaw ? pszRaw : "" );
+		}
+
+		int nSubCriteria = buf.GetInt();
+		for ( j = 0; j < nSubCriteria && buf.IsValid(); j++ )
+		{
+			crit.subcriteria.AddToTail( buf.GetUnsignedShort() );
+		}
+	}
+
+	m_RulePartitions.InvalidateCandidateIndex();
+
+	int nResponses = buf.GetInt();
+	for ( i = 0; i < nResponses && bOK; i++ )
+	{
+		const char *pszName = GetCacheString( buf, bOK );
+		if ( !bOK || !pszName || m_Responses.Insert( pszName ) != i )
+		{
+			bOK = false;
+			break;
+		}
+
+		ResponseGroup &group = m_Responses[ i ];
+		int nFlags = buf.GetUnsignedChar();
+		group.m_bEnabled = ( nFlags & RR_CACHE_GROUP_ENABLED ) != 0;
+		group.m_bDepleteBeforeRepeat = ( nFlags & RR_CACHE_GROUP_DEPLETE ) != 0;
+		group.m_bHasFirst = ( nFlags & RR_CACHE_GROUP_HASFIRST ) != 0;
+		group.m_bHasLast = ( nFlags & RR_CACHE_GROUP_HASLAST ) != 0;
+		group.m_bSequential = ( nFlags & RR_CACHE_GROUP_SEQUENTIAL ) != 0;
+		group.m_bNoRepeat = ( nFlags & RR_CACHE_GROUP_NOREPEAT ) != 0;
+		group.m_nCurrentIndex = buf.GetUnsignedChar();
+		group.m_nDepletionCount = buf.GetUnsignedChar();
+
+		c = buf.GetInt();
+		for ( j = 0; j < c && bOK && buf.IsValid(); j++ )
+		{
+			ParserResponse &response = group.group[ group.group.AddToTail() ];
+			response.value = ResponseCopyString( GetCacheString( buf, bOK ) );
+			response.weight.SetFloat( buf.GetFloat() );
+			response.depletioncount = buf.GetUnsignedChar();
+			response.type = buf.GetUnsignedChar();
+			int nFirstLast = buf.GetUnsignedChar();
+			response.first = ( nFirstLast & 1 ) != 0;
+			response.last = ( nFirstLast & 2 ) != 0;
+
+			ResponseParams &params = response.params;
+			GetCacheInterval( buf, params.delay );
+			GetCacheInterval( buf, params.respeakdelay );
+			GetCacheInterval( buf, params.weapondelay );
+			params.odds = buf.GetShort();
+			params.flags = buf.GetShort();
+			params.soundlevel = buf.GetUnsignedChar();
+			GetCacheInterval( buf, params.predelay );
+
+			AI_ResponseFollowup &followup = response.m_followup;
+			followup.followup_concept = ResponseCopyString( GetCacheString( buf, bOK ) );
+			followup.followup_contexts = ResponseCopyString( GetCacheString( buf, bOK ) );
+			followup.followup_delay = buf.GetFloat();
+			followup.followup_target = ResponseCopyString( GetCacheString( buf, bOK ) );
+			followup.followup_entityiotarget = ResponseCopyString( GetCacheString( buf, bOK ) );
+			followup.followup_entityioinput = ResponseCopyString( GetCacheString( buf, bOK ) );
+			followup.followup_entityiodelay = buf.GetFloat();
+		}
+	}
+
+	// Criteria have to be in before the rules, since they're bucketed on them
+	for ( i = 0; i < nCriteria && bOK; i++ )
+	{
+		for ( j = 0; j < m_Criteria[ i ].subcriteria.Count(); j++ )
+		{
+			bOK = bOK && m_Criteria[ i ].subcriteria[ j ] < nCriteria;
+		}
+	}
+
+	c = buf.GetInt();
+	for ( i = 0; i < c && bOK && buf.IsValid(); i++ )
+	{
+		const char *pszName = GetCacheString( buf, bOK );
+		Rule *newRule = new Rule;
+
+		int nRuleCriteria = buf.GetInt();
+		for ( j = 0; j < nRuleCriteria && buf.IsValid(); j++ )
+		{
+			unsigned short iCriteria = buf.GetUnsignedShort();
+			bOK = bOK && iCriteria < nCriteria;
+			newRule->m_Criteria.AddToTail( iCriteria );
+		}
+
+		int nRuleResponses = buf.GetInt();
+		for ( j = 0; j < nRuleResponses && buf.IsValid(); j++ )
+		{
+			unsigned short iResponse = buf.GetUnsignedShort();
+			bOK = bOK && iResponse < nResponses;
+			newRule->m_Responses.AddToTail( iResponse );
+		}
+
+		newRule->SetContext( GetCacheString( buf, bOK ) );
+		newRule->m_nForceWeight = buf.GetUnsignedChar();
+#ifdef MAPBASE
+		newRule->m_iContextFlags = buf.GetUnsignedChar();
+#else
+		newRule->m_bApplyContextToWorld = buf.GetUnsignedChar() != 0;
+#endif
+		int nRuleFlags = buf.GetUnsignedChar();
+		newRule->m_bMatchOnce = ( nRuleFlags & 1 ) != 0;
+		newRule->m_bEnabled = ( nRuleFlags & 2 ) != 0;
+
+		if ( !bOK || !pszName || !buf.IsValid() )
+		{
+			delete newRule;
+			bOK = false;
+			break;
+		}
+
+		m_RulePartitions.GetDictForRule( this, newRule ).Insert( pszName, newRule );
+	}
+
+	if ( !bOK || !buf.IsValid() || buf.GetBytesRemaining() != 0 )
+	{
+		CGMsg( 1, CON_GROUP_RESPONSE_SYSTEM, "CResponseSystem:  %s is corrupt, reparsing %s\n", cachefile, basescript );
+
+		m_Responses.RemoveAll();
+		m_Criteria.RemoveAll();
+		m_RulePartitions.RemoveAll();
+		m_Enumerations.RemoveAll();
+		return false;
+	}
+
+	m_IncludedFiles.FreeAll();
+	for ( i = 0; i < sources.Count(); i++ )
+	{
+		m_IncludedFiles.Allocate( sources[ i ] );
+	}
+
+	CGMsg( 1, CON_GROUP_RESPONSE_SYSTEM, "CResponseSystem:  %s (%i rules, %i criteria, and %i responses, from %s)\n",
+		basescript, m_RulePartitions.Count(), m_Criteria.Count(), m_Responses.Count(), cachefile );
+
+	if( rr_dumpresponses.GetBool() )
+	{
+		DumpRules();
+	}
+
+	return true;
+}
+
 inline ResponseType_t ComputeResponseType( const char *s )
 {
 	switch ( s[ 0 ] )
@@ -2126,6 +2691,9 @@ int CResponseSystem::ParseOneCriterion( const char *criterionName )
 		ComputeMatcher( pNewCriterion, pNewCriterion->matcher );
 	}
 
+	// a redefined criterion changes the keys of the rules that already use it
+	m_RulePartitions.InvalidateCandidateIndex();
+
 	return idx;
 }
 
@@ -2307,8 +2875,6 @@ void CResponseSystem::ParseRule_Criteria( Rule &newRule )
 //-----------------------------------------------------------------------------
 void CResponseSystem::ParseRule( void )
 {
-	static int instancedCriteria = 0;
-
 	char ruleName[ 128 ];
 	ParseToken();
 	Q_strncpy( ruleName, token, sizeof( ruleName ) );
@@ -2346,7 +2912,7 @@ void CResponseSystem::ParseRule( void )
 			continue;
 
 		// It's an inline criteria, generate a name and parse it in
-		Q_snprintf( sz, sizeof( sz ), "[%s%03i]", ruleName, ++instancedCriteria );
+		Q_snprintf( sz, sizeof( sz ), "[%s%03i]", ruleName, ++s_nInstancedCriteria );
 		Unget();
 		int idx = ParseOneCriterion( sz );
 		if ( idx != m_Criteria.InvalidIndex() )
@@ -2450,6 +3016,8 @@ void CResponseSystem::CopyCriteriaFrom( Rule *pSrcRule, Rule *pDstRule, CRespons
 			pDstRule->m_Criteria.AddToTail( iInsertIndex );
 		}
 	}
+
+	pCustomSystem->m_RulePartitions.InvalidateCandidateIndex();
 }
 
 //-----------------------------------------------------------------------------
@@ -13,6 +13,8 @@
 #endif
 
 #include "utldict.h"
+#include "utlstring.h"
+#include "checksum_crc.h"
 
 namespace ResponseRules
 {
@@ -76,6 +78,11 @@ namespace ResponseRules
 		virtual const char *GetScriptFile( void ) = 0;
 		void		LoadRuleSet( const char *setname );
 
+		// Binary copy of everything LoadRuleSet parsed, keyed on the CRCs of the scripts it read
+		bool		LoadRuleSetCache( const char *basescript );
+		void		SaveRuleSetCache( const char *basescript );
+		void		AddRuleSetCacheSource( const char *scriptfile, const char *buffer );
+
 		void		ResetResponseGroups();
 
 		float		LookForCriteria( const CriteriaSet &criteriaSet, int iCriteria );
@@ -314,6 +321,17 @@ public:
 		CUtlVector< ScriptEntry >		m_ScriptStack;
 		CStringPool						m_IncludedFiles;
 
+		// Scripts read (or found missing) by the LoadRuleSet in progress, for its cache
+		struct CacheSource_t
+		{
+			CUtlString	m_Name;
+			CRC32_t		m_CRC;
+			bool		m_bMissing;
+		};
+
+		CUtlVector< CacheSource_t >		m_CacheSources;
+		bool							m_bRecordCacheSources;
+
 		DispatchMap_t					m_FileDispatch;
 		ParseRuleDispatchMap_t			m_RuleDispatch;
 		ParseResponseDispatchMap_t		m_ResponseDispatch;
@@ -6,6 +6,7 @@
 //=============================================================================//
 
 #include "rrbase.h"
+#include "generichash.h"
 #ifdef MAPBASE
 #include "convar.h"
 #include "mapbase_matchers_base.h"
@@ -30,6 +31,7 @@ ResponseRulePartition::ResponseRulePartition()
 	Assert(true);
 	COMPILE_TIME_ASSERT( kIDX_ELEM_MASK < (1 << 16) );
 	COMPILE_TIME_ASSERT( (kIDX_ELEM_MASK & (kIDX_ELEM_MASK + 1)) == 0 ); /// assert is power of two minus one
+	m_bCandidateIndexDirty = true;
 }
 
 ResponseRulePartition::~ResponseRulePartition()
@@ -96,6 +98,7 @@ void ResponseRulePartition::RemoveAll( void )
 		}
 		m_RuleParts[bukkit].RemoveAll();
 	}
+	m_bCandidateIndexDirty = true;
 }
 
 #ifdef MAPBASE
@@ -108,7 +111,10 @@ void ResponseRulePartition::PurgeAndDeleteElements()
 			delete m_RuleParts[bukkit][ i ];
 		}
 		m_RuleParts[bukkit].Purge();
+		m_RuleKeys[bukkit].Purge();
+		m_UnkeyedRules[bukkit].Purge();
 	}
+	m_bCandidateIndexDirty = true;
 }
 #endif
 
@@ -141,6 +147,9 @@ ResponseRulePartition::tRuleDict &ResponseRulePartition::GetDictForRule( CRespon
 	const char *pszConcept = pRule->GetValueForRuleCriterionByName( pSystem, kCONCEPT );
 	const Criteria *pSubjCrit = pRule->GetPointerForRuleCriterionByName( pSystem, kSUBJECT );
 
+	// the caller is about to add this rule
+	m_bCandidateIndexDirty = true;
+
 	return m_RuleParts[ 
 		GetBucketForSpeakerAndConcept( pszSpeaker, pszConcept, 
 			( pSubjCrit && pSubjCrit->required && CanBucketBySubject(pSubjCrit->value) ) ? 
@@ -155,18 +164,211 @@ void ResponseRulePartition::GetDictsForCriteria( CUtlVectorFixed< ResponseRulePa
 	pResult->RemoveAll();
 	pResult->EnsureCapacity( 2 );
 
+	const static CUtlSymbol kWHO = CriteriaSet::ComputeCriteriaSymbol("Who");
+	const static CUtlSymbol kCONCEPT = CriteriaSet::ComputeCriteriaSymbol("Concept");
+	const static CUtlSymbol kSUBJECT = CriteriaSet::ComputeCriteriaSymbol("Subject");
+
 	// get the values for Who and Concept, which are what we bucket on
-	int speakerIdx = criteria.FindCriterionIndex( "Who" );
+	int speakerIdx = criteria.FindCriterionIndex( kWHO );
 	const char *pszSpeaker = speakerIdx != -1 ? criteria.GetValue( speakerIdx ) : NULL ;
 
-	int conceptIdx = criteria.FindCriterionIndex( "Concept" );
+	int conceptIdx = criteria.FindCriterionIndex( kCONCEPT );
 	const char *pszConcept = conceptIdx != -1 ? criteria.GetValue( conceptIdx ) : NULL ;
 
-	int subjectIdx = criteria.FindCriterionIndex( "Subject" );
+	int subjectIdx = criteria.FindCriterionIndex( kSUBJECT );
 	const char *pszSubject = subjectIdx != -1 ? criteria.GetValue( subjectIdx ) : NULL ;
 
 	pResult->AddToTail( &m_RuleParts[ GetBucketForSpeakerAndConcept(pszSpeaker, pszConcept, pszSubject) ] );
 	// also try the rules not specifying subject
 	pResult->AddToTail( &m_RuleParts[ GetBucketForSpeakerAndConcept(pszSpeaker, pszConcept, NULL) ] );
 
-}
\ No newline at end of file
+}
+
+
+// Criteria set values are compared to rule values ignoring case, so the keys are too.
+// Collisions just make extra rules into candidates.
+static inline unsigned int HashCriterionKey( CUtlSymbol sym, const char *pszValue )
+{
+	return HashStringCaselessConventional( pszValue ) * 31 + (UtlSymId_t)sym;
+}
+
+// can this criterion only ever match one value, and must it match for the rule to score?
+static bool IsKeyCriterion( Criteria *pCrit )
+{
+	if ( !pCrit->required || pCrit->IsSubCriteriaType() )
+		return false;
+
+	Matcher &m = pCrit->matcher;
+	if ( !m.valid || m.isnumeric || m.notequal || m.usemin || m.usemax )
+		return false;
+
+#ifdef MAPBASE
+	if ( m.isbit )
+		return false;
+#endif
+
+	// a set that doesn't have the criterion at all is compared as ""
+	const char *pszToken = m.GetToken();
+	if ( !pszToken || !pszToken[0] )
+		return false;
+
+#ifdef MAPBASE
+	// wildcards and regex
+	if ( pszToken[0] == '@' || Matcher_ContainsWildcard( pszToken ) )
+		return false;
+#endif
+
+	return true;
+}
+
+static int __cdecl RuleKeyCompare( const uint64 *pKey, const uint64 *pOther )
+{
+	if ( *pKey < *pOther )
+		return -1;
+	return ( *pKey > *pOther ) ? 1 : 0;
+}
+
+static int __cdecl CriteriaKeyCompare( const unsigned int *pKey, const unsigned int *pOther )
+{
+	if ( *pKey < *pOther )
+		return -1;
+	return ( *pKey > *pOther ) ? 1 : 0;
+}
+
+static int __cdecl RuleElemCompare( const unsigned short *pElem, const unsigned short *pOther )
+{
+	return (int)*pElem - (int)*pOther;
+}
+
+void ResponseRulePartition::EnsureCandidateIndex( CResponseSystem *pSystem )
+{
+	if ( !m_bCandidateIndexDirty )
+		return;
+
+	m_bCandidateIndexDirty = false;
+
+	CUtlVector< unsigned int > ruleKeys;
+	CUtlMap< unsigned int, int, int > keyCounts( DefLessFunc( unsigned int ) );
+
+	for ( int bukkit = 0 ; bukkit < N_RESPONSE_PARTITIONS ; ++bukkit )
+	{
+		tRuleDict &dict = m_RuleParts[bukkit];
+		m_RuleKeys[bukkit].RemoveAll();
+		m_UnkeyedRules[bukkit].RemoveAll();
+
+		int c = dict.Count();
+		if ( c <= 0 )
+			continue;
+
+		// count how many rules in this dict share each key, so each rule can be
+		// keyed on the value that the fewest other rules require.
+		keyCounts.RemoveAll();
+		for ( int i = 0; i < c; i++ )
+		{
+			Rule *pRule = dict[i];
+			ruleKeys.RemoveAll();
+			for ( int j = 0; j < pRule->m_Criteria.Count(); j++ )
+			{
+				Criteria *pCrit = &pSystem->m_Criteria[ pRule->m_Criteria[j] ];
+				if ( !IsKeyCriterion( pCrit ) )
+					continue;
+
+				unsigned int nKey = HashCriterionKey( pCrit->nameSym, pCrit->matcher.GetToken() );
+				if ( ruleKeys.Find( nKey ) != -1 )
+					continue;
+				ruleKeys.AddToTail( nKey );
+
+				int iCount = keyCounts.Find( nKey );
+				if ( iCount == keyCounts.InvalidIndex() )
+				{
+					keyCounts.Insert( nKey, 1 );
+				}
+				else
+				{
+					++keyCounts[iCount];
+				}
+			}
+		}
+
+		for ( int i = 0; i < c; i++ )
+		{
+			Rule *pRule = dict[i];
+			unsigned int nBestKey = 0;
+			int nBestCount = INT_MAX;
+			for ( int j = 0; j < pRule->m_Criteria.Count(); j++ )
+			{
+				Criteria *pCrit = &pSystem->m_Criteria[ pRule->m_Criteria[j] ];
+				if ( !IsKeyCriterion( pCrit ) )
+					continue;
+
+				unsigned int nKey = HashCriterionKey( pCrit->nameSym, pCrit->matcher.GetToken() );
+				int nCount = keyCounts[ keyCounts.Find( nKey ) ];
+				if ( nCount < nBestCount )
+				{
+					nBestKey = nKey;
+					nBestCount = nCount;
+				}
+			}
+
+			if ( nBestCount == INT_MAX )
+			{
+				m_UnkeyedRules[bukkit].AddToTail( i );
+			}
+			else
+			{
+				m_RuleKeys[bukkit].AddToTail( ( (uint64)nBestKey << 32 ) | (uint64)i );
+			}
+		}
+
+		m_RuleKeys[bukkit].Sort( RuleKeyCompare );
+	}
+}
+
+void ResponseRulePartition::ComputeCriteriaKeys( CUtlVector< unsigned int > *pResult, const CriteriaSet &criteria )
+{
+	pResult->RemoveAll();
+	pResult->EnsureCapacity( criteria.GetCount() );
+	for ( int i = criteria.Head() ; criteria.IsValidIndex(i) ; i = criteria.Next(i) )
+	{
+		const char *pszValue = criteria.GetValue( i );
+		if ( !pszValue || !pszValue[0] )
+			continue;
+
+		pResult->AddToTail( HashCriterionKey( criteria.GetNameSymbol( i ), pszValue ) );
+	}
+	pResult->Sort( CriteriaKeyCompare );
+}
+
+void ResponseRulePartition::GetCandidateRules( CUtlVector< unsigned short > *pResult, tRuleDict *pDict, const CUtlVector< unsigned int > &criteriaKeys )
+{
+	Assert( !m_bCandidateIndexDirty );
+	Assert( pDict >= m_RuleParts && pDict < m_RuleParts + N_RESPONSE_PARTITIONS );
+
+	int bukkit = pDict - m_RuleParts;
+	const CUtlVector< uint64 > &ruleKeys = m_RuleKeys[bukkit];
+
+	pResult->RemoveAll();
+	pResult->AddVectorToTail( m_UnkeyedRules[bukkit] );
+
+	// both lists are sorted, so walk them together
+	int iRuleKey = 0;
+	int nRuleKeys = ruleKeys.Count();
+	for ( int i = 0; i < criteriaKeys.Count() && iRuleKey < nRuleKeys; i++ )
+	{
+		unsigned int nKey = criteriaKeys[i];
+		while ( iRuleKey < nRuleKeys && (unsigned int)( ruleKeys[iRuleKey] >> 32 ) < nKey )
+		{
+			++iRuleKey;
+		}
+
+		// this also steps past the rules for a key that's in the set twice
+		while ( iRuleKey < nRuleKeys && (unsigned int)( ruleKeys[iRuleKey] >> 32 ) == nKey )
+		{
+			pResult->AddToTail( (unsigned short)ruleKeys[iRuleKey] );
+			++iRuleKey;
+		}
+	}
+
+	// score them in the same order as a full scan would, so ties are broken the same way
+	pResult->Sort( RuleElemCompare );
+}
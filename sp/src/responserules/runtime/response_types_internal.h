@@ -433,6 +433,24 @@ namespace ResponseRules
 	    ///  criteria are in one of two dictionaries)
 	    void GetDictsForCriteria( CUtlVectorFixed< ResponseRulePartition::tRuleDict *, 2 > *pResult, const CriteriaSet &criteria );
 
+		/// (re)build the index of rule keys used by GetCandidateRules, if any rules were
+		/// added or removed since it was last built. A rule's key is its most selective
+		/// required criterion that can only match one exact value; pSystem must be the
+		/// system these rules' criteria belong to.
+		void EnsureCandidateIndex( CResponseSystem *pSystem );
+
+		/// the rule keys are taken from the contents of the rules' criteria, so this must
+		/// be called whenever a criterion is added or redefined, not just when rules change
+		void InvalidateCandidateIndex() { m_bCandidateIndexDirty = true; }
+
+		/// hash every criterion in the set the same way rule keys are hashed
+		static void ComputeCriteriaKeys( CUtlVector< unsigned int > *pResult, const CriteriaSet &criteria );
+
+		/// get the elements of pDict, in ascending order, that aren't ruled out by a required
+		/// criterion missing from the criteria keys. Every rule that could score above zero
+		/// is among them.
+		void GetCandidateRules( CUtlVector< unsigned short > *pResult, tRuleDict *pDict, const CUtlVector< unsigned int > &criteriaKeys );
+
 		// dump everything.
 		void RemoveAll();
 #ifdef MAPBASE
@@ -472,6 +490,13 @@ namespace ResponseRules
 
 	private:
 		tRuleDict m_RuleParts[N_RESPONSE_PARTITIONS];
+
+		// each rule's key in the high 32 bits and its element in the low 16, sorted
+		CUtlVector< uint64 > m_RuleKeys[N_RESPONSE_PARTITIONS];
+		// rules with no key, which always have to be scored
+		CUtlVector< unsigned short > m_UnkeyedRules[N_RESPONSE_PARTITIONS];
+		bool m_bCandidateIndexDirty;
+
 	    unsigned int GetBucketForSpeakerAndConcept( const char *pszSpeaker, const char *pszConcept, const char *pszSubject );
 	};
 
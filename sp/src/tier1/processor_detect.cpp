@@ -12,9 +12,13 @@ bool CheckMMXTechnology(void) { return false; }
 bool CheckSSETechnology(void) { return false; }
 bool CheckSSE2Technology(void) { return false; }
 bool Check3DNowTechnology(void) { return false; }
+bool CheckAVX2Technology(void) { return false; }
 
 #elif defined( _WIN32 ) && !defined( _X360 )
 
+#include <intrin.h>
+#include <immintrin.h>
+
 #pragma optimize( "", off )
 #pragma warning( disable: 4800 ) //'int' : forcing value to bool 'true' or 'false' (performance warning)
 
@@ -269,6 +273,25 @@ bool Check3DNowTechnology(void)
     return retval;
 }
 
+bool CheckAVX2Technology(void)
+{
+	int regs[4];
+
+	__cpuid( regs, 0 );
+	if ( regs[0] < 7 )
+		return false;
+
+	// AVX, and the OS saves the ymm registers on context switches
+	__cpuid( regs, 1 );
+	if ( ( regs[2] & 0x18000000 ) != 0x18000000 )	// bit 27 is OSXSAVE, bit 28 is AVX
+		return false;
+	if ( ( _xgetbv( 0 ) & 6 ) != 6 )
+		return false;
+
+	__cpuidex( regs, 7, 0 );
+	return ( regs[1] & 0x20 ) != 0;					// bit 5 of ebx is set for AVX2
+}
+
 #pragma optimize( "", on )
 
 #endif // _WIN32
@@ -9,6 +9,10 @@
 #define cpuid(in,a,b,c,d)												\
 	asm("pushl %%ebx\n\t" "cpuid\n\t" "movl %%ebx,%%esi\n\t" "pop %%ebx": "=a" (a), "=S" (b), "=c" (c), "=d" (d) : "a" (in));
 
+// cpuid with a subleaf in ecx
+#define cpuidex(in,sub,a,b,c,d)											\
+	asm("pushl %%ebx\n\t" "cpuid\n\t" "movl %%ebx,%%esi\n\t" "pop %%ebx": "=a" (a), "=S" (b), "=c" (c), "=d" (d) : "a" (in), "c" (sub));
+
 bool CheckMMXTechnology(void)
 {
     unsigned long eax,ebx,edx,unused;
@@ -45,3 +49,24 @@ bool Check3DNowTechnology(void)
     }
     return false;
 }
+
+bool CheckAVX2Technology(void)
+{
+    unsigned long eax,ebx,ecx,edx;
+    cpuid(0,eax,ebx,ecx,edx);
+    if ( eax < 7 )
+        return false;
+
+    // AVX and OSXSAVE, then check the OS saves the ymm registers
+    cpuid(1,eax,ebx,ecx,edx);
+    if ( ( ecx & 0x18000000 ) != 0x18000000 )
+        return false;
+
+    unsigned int xcr0, xcr0hi;
+    asm volatile(".byte 0x0f, 0x01, 0xd0" : "=a" (xcr0), "=d" (xcr0hi) : "c" (0));	// xgetbv
+    if ( ( xcr0 & 6 ) != 6 )
+        return false;
+
+    cpuidex(7,0,eax,ebx,ecx,edx);
+    return ebx & 0x20;
+}
@@ -6,6 +6,15 @@
 // $NoKeywords: $
 //=============================================================================//
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#endif
 #include "cmdlib.h"
 #include "mathlib/mathlib.h"
 #include "bsplib.h"
@@ -26,6 +35,7 @@
 #include "tier0/dbg.h"
 #include "lumpfiles.h"
 #include "vtf/vtf.h"
+#include "threads.h"
 
 //=============================================================================
 
@@ -714,6 +724,30 @@ CGameLump	g_GameLumps;
 
 static IZip *s_pakFile = 0;
 
+//-----------------------------------------------------------------------------
+// The BSP file being read is mapped copy-on-write instead of being read into
+// memory. LoadBSPFile leaves the lumps it only passes through (physics, unknown
+// lumps) pointing into the mapping, so the mapping stays around until those are
+// copied out by DetachBSPFileMapping.
+//-----------------------------------------------------------------------------
+struct MappedBSPFile_t
+{
+	byte	*m_pBase;
+	int		m_nSize;
+#ifdef _WIN32
+	HANDLE	m_hFile;
+	HANDLE	m_hMapping;
+#endif
+};
+
+static MappedBSPFile_t s_MappedBSP;
+
+static bool IsInBSPMapping( const void *pData )
+{
+	return s_MappedBSP.m_pBase && (const byte *)pData >= s_MappedBSP.m_pBase &&
+		(const byte *)pData < s_MappedBSP.m_pBase + s_MappedBSP.m_nSize;
+}
+
 //-----------------------------------------------------------------------------
 // Keep the file position aligned to an arbitrary boundary.
 // Returns updated file position.
@@ -1870,6 +1904,31 @@ int CopyVariableLump( int fieldType, int lump, void **dest, int forceVersion = -
 	return CopyLumpInternal<T>( fieldType, lump, (T*)*dest, forceVersion );
 }
 
+//-----------------------------------------------------------------------------
+// Like CopyVariableLump<byte>, but points dest straight into the file mapping when
+// the lump doesn't need swapping. Free dest with FreeVariableLump.
+//-----------------------------------------------------------------------------
+static int ReferenceVariableLump( int lump, void **dest, int forceVersion = -1 )
+{
+	if ( g_bSwapOnLoad || !IsInBSPMapping( g_pBSPHeader ) )
+		return CopyVariableLump<byte>( FIELD_CHARACTER, lump, dest, forceVersion );
+
+	g_Lumps.bLumpParsed[lump] = true;
+
+	int length = g_pBSPHeader->lumps[lump].filelen;
+	ValidateLump( lump, length, 1, forceVersion );
+	*dest = length ? (byte *)g_pBSPHeader + g_pBSPHeader->lumps[lump].fileofs : NULL;
+	return length;
+}
+
+static void FreeVariableLump( void *pData )
+{
+	if ( !IsInBSPMapping( pData ) )
+	{
+		free( pData );
+	}
+}
+
 //-----------------------------------------------------------------------------
 //	Add Lumps of object types with datadescs
 //-----------------------------------------------------------------------------
@@ -1940,7 +1999,7 @@ void Lumps_Parse( void )
 	{
 		if ( !g_Lumps.bLumpParsed[i] && g_pBSPHeader->lumps[i].filelen )
 		{
-			g_Lumps.size[i] = CopyVariableLump<byte>( FIELD_CHARACTER, i, &g_Lumps.pLumps[i], -1 );
+			g_Lumps.size[i] = ReferenceVariableLump( i, &g_Lumps.pLumps[i] );
 			Msg( "Reading unknown lump #%d (%d bytes)\n", i, g_Lumps.size[i] );
 		}
 	}
@@ -1959,7 +2018,7 @@ void Lumps_Write( void )
 		}
 		if ( g_Lumps.pLumps[i] )
 		{
-			free( g_Lumps.pLumps[i] );
+			FreeVariableLump( g_Lumps.pLumps[i] );
 			g_Lumps.pLumps[i] = NULL;
 		}
 	}
@@ -2118,15 +2177,227 @@ void ValidateHeader( const char *filename, const dheader_t *pHeader )
 }
 
 //-----------------------------------------------------------------------------
-//	Low level BSP opener for external parsing. Parses headers, but nothing else.
-//	You must close the BSP, via CloseBSPFile().
+//	Maps filename copy-on-write into s_MappedBSP. Returns false if it can't be
+//	mapped, in which case it should be read with LoadFile.
 //-----------------------------------------------------------------------------
-void OpenBSPFile( const char *filename )
+static bool MapBSPFile( const char *filename )
 {
-	Lumps_Init();
+	Assert( !s_MappedBSP.m_pBase );
+
+	// VMPI workers read through base paths the OS can't open
+	int nBasePathLength;
+	if ( CmdLib_HasBasePath( filename, nBasePathLength ) )
+		return false;
 
+#ifdef _WIN32
+	HANDLE hFile = CreateFile( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( hFile == INVALID_HANDLE_VALUE )
+		return false;
+
+	LARGE_INTEGER size;
+	HANDLE hMapping = NULL;
+	void *pBase = NULL;
+	if ( GetFileSizeEx( hFile, &size ) && size.QuadPart >= (LONGLONG)sizeof( dheader_t ) && size.QuadPart <= INT_MAX )
+	{
+		hMapping = CreateFileMapping( hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL );
+		if ( hMapping )
+		{
+			pBase = MapViewOfFile( hMapping, FILE_MAP_COPY, 0, 0, 0 );
+		}
+	}
+
+	if ( !pBase )
+	{
+		if ( hMapping )
+			CloseHandle( hMapping );
+		CloseHandle( hFile );
+		return false;
+	}
+
+	s_MappedBSP.m_hFile = hFile;
+	s_MappedBSP.m_hMapping = hMapping;
+	s_MappedBSP.m_nSize = (int)size.QuadPart;
+#else
+	int fd = open( filename, O_RDONLY );
+	if ( fd < 0 )
+		return false;
+
+	struct stat st;
+	void *pBase = MAP_FAILED;
+	if ( fstat( fd, &st ) == 0 && st.st_size >= (off_t)sizeof( dheader_t ) && st.st_size <= INT_MAX )
+	{
+		pBase = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+	}
+	close( fd );
+
+	if ( pBase == MAP_FAILED )
+		return false;
+
+	s_MappedBSP.m_nSize = (int)st.st_size;
+#endif
+
+	s_MappedBSP.m_pBase = (byte *)pBase;
+	return true;
+}
+
+static void UnmapBSPFile( void )
+{
+	if ( !s_MappedBSP.m_pBase )
+		return;
+
+#ifdef _WIN32
+	UnmapViewOfFile( s_MappedBSP.m_pBase );
+	CloseHandle( s_MappedBSP.m_hMapping );
+	CloseHandle( s_MappedBSP.m_hFile );
+#else
+	munmap( s_MappedBSP.m_pBase, s_MappedBSP.m_nSize );
+#endif
+	memset( &s_MappedBSP, 0, sizeof( s_MappedBSP ) );
+}
+
+//-----------------------------------------------------------------------------
+//	Returns true if the two names are the same file, checked by its identity so
+//	links and other spellings of the path match too, or if it can't be told.
+//-----------------------------------------------------------------------------
+static bool IsSameFile( const char *pFilename1, const char *pFilename2 )
+{
+#ifdef _WIN32
+	DWORD dwShare = FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE;
+	HANDLE hFile1 = CreateFile( pFilename1, 0, dwShare, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( hFile1 == INVALID_HANDLE_VALUE )
+		return true;
+
+	HANDLE hFile2 = CreateFile( pFilename2, 0, dwShare, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( hFile2 == INVALID_HANDLE_VALUE )
+	{
+		DWORD dwError = GetLastError();
+		CloseHandle( hFile1 );
+		return ( dwError != ERROR_FILE_NOT_FOUND && dwError != ERROR_PATH_NOT_FOUND );
+	}
+
+	bool bSame = true;
+	BY_HANDLE_FILE_INFORMATION info1, info2;
+	if ( GetFileInformationByHandle( hFile1, &info1 ) && GetFileInformationByHandle( hFile2, &info2 ) )
+	{
+		bSame = ( info1.dwVolumeSerialNumber == info2.dwVolumeSerialNumber &&
+				  info1.nFileIndexHigh == info2.nFileIndexHigh &&
+				  info1.nFileIndexLow == info2.nFileIndexLow );
+	}
+
+	CloseHandle( hFile1 );
+	CloseHandle( hFile2 );
+	return bSame;
+#else
+	struct stat st1, st2;
+	if ( stat( pFilename1, &st1 ) != 0 )
+		return true;
+
+	if ( stat( pFilename2, &st2 ) != 0 )
+		return ( errno != ENOENT );
+
+	return ( st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino );
+#endif
+}
+
+// Gives a lump that points into the mapping its own copy
+static void DetachMappedLump( void **ppData, int nSize )
+{
+	if ( *ppData && IsInBSPMapping( *ppData ) )
+	{
+		void *pCopy = malloc( nSize );
+		memcpy( pCopy, *ppData, nSize );
+		*ppData = pCopy;
+	}
+}
+
+//-----------------------------------------------------------------------------
+//	Copies the lumps LoadBSPFile left in the file mapping into their own memory,
+//	and lets go of the mapping if the BSP isn't open.
+//-----------------------------------------------------------------------------
+void DetachBSPFileMapping( void )
+{
+	if ( !s_MappedBSP.m_pBase )
+		return;
+
+	DetachMappedLump( (void **)&g_pPhysCollide, g_PhysCollideSize );
+	DetachMappedLump( (void **)&g_pPhysDisp, g_PhysDispSize );
+	for ( int i = 0; i < HEADER_LUMPS; i++ )
+	{
+		DetachMappedLump( &g_Lumps.pLumps[i], g_Lumps.size[i] );
+	}
+
+	if ( !IsInBSPMapping( g_pBSPHeader ) )
+	{
+		UnmapBSPFile();
+	}
+}
+
+//-----------------------------------------------------------------------------
+//	Read-only pointer to a lump of the open BSP, straight from the file mapping
+//-----------------------------------------------------------------------------
+const void *GetMappedLump( int lump, int *pLength )
+{
+	*pLength = 0;
+	if ( g_bSwapOnLoad || !IsInBSPMapping( g_pBSPHeader ) )
+		return NULL;
+
+	const lump_t &l = g_pBSPHeader->lumps[lump];
+	if ( l.fileofs < 0 || l.filelen <= 0 || l.filelen > s_MappedBSP.m_nSize - l.fileofs )
+		return NULL;
+
+	*pLength = l.filelen;
+	return (byte *)g_pBSPHeader + l.fileofs;
+}
+
+//-----------------------------------------------------------------------------
+//	Points g_pBSPHeader at the whole file, mapped if bAllowMapping and possible
+//-----------------------------------------------------------------------------
+static void LoadBSPHeader( const char *filename, bool bAllowMapping )
+{
+	// lumps still pointing into the last file have to be copied out before it goes
+	g_pBSPHeader = NULL;
+	DetachBSPFileMapping();
+
+	if ( bAllowMapping && MapBSPFile( filename ) )
+	{
+		g_pBSPHeader = (dheader_t *)s_MappedBSP.m_pBase;
+	}
+	else
+	{
+		LoadFile( filename, (void **)&g_pBSPHeader );
+	}
+}
+
+static void FreeBSPHeader( void )
+{
+	if ( !IsInBSPMapping( g_pBSPHeader ) )
+	{
+		free( g_pBSPHeader );
+		g_pBSPHeader = NULL;
+		return;
+	}
+
+	// the mapping stays until nothing points into it
+	g_pBSPHeader = NULL;
+
+	bool bInUse = IsInBSPMapping( g_pPhysCollide ) || IsInBSPMapping( g_pPhysDisp );
+	for ( int i = 0; i < HEADER_LUMPS; i++ )
+	{
+		bInUse = bInUse || IsInBSPMapping( g_Lumps.pLumps[i] );
+	}
+
+	if ( !bInUse )
+	{
+		UnmapBSPFile();
+	}
+}
+
+static void OpenBSPFileInternal( const char *filename, bool bAllowMapping )
+{
 	// load the file header
-	LoadFile( filename, (void **)&g_pBSPHeader );
+	LoadBSPHeader( filename, bAllowMapping );
+
+	Lumps_Init();
 
 	if ( g_bSwapOnLoad )
 	{
@@ -2139,13 +2410,21 @@ void OpenBSPFile( const char *filename )
 	g_MapRevision = g_pBSPHeader->mapRevision;
 }
 
+//-----------------------------------------------------------------------------
+//	Low level BSP opener for external parsing. Parses headers, but nothing else.
+//	You must close the BSP, via CloseBSPFile().
+//-----------------------------------------------------------------------------
+void OpenBSPFile( const char *filename )
+{
+	OpenBSPFileInternal( filename, true );
+}
+
 //-----------------------------------------------------------------------------
 //	CloseBSPFile
 //-----------------------------------------------------------------------------
 void CloseBSPFile( void )
 {
-	free( g_pBSPHeader );
-	g_pBSPHeader = NULL;
+	FreeBSPHeader();
 }
 
 //-----------------------------------------------------------------------------
@@ -2201,8 +2480,8 @@ void LoadBSPFile( const char *filename )
 	numworldlightsHDR = CopyLump( LUMP_WORLDLIGHTS_HDR, dworldlightsHDR );
 	
 	numleafwaterdata = CopyLump( LUMP_LEAFWATERDATA, dleafwaterdata );
-	g_PhysCollideSize = CopyVariableLump<byte>( FIELD_CHARACTER, LUMP_PHYSCOLLIDE, (void**)&g_pPhysCollide );
-	g_PhysDispSize = CopyVariableLump<byte>( FIELD_CHARACTER, LUMP_PHYSDISP, (void**)&g_pPhysDisp );
+	g_PhysCollideSize = ReferenceVariableLump( LUMP_PHYSCOLLIDE, (void**)&g_pPhysCollide );
+	g_PhysDispSize = ReferenceVariableLump( LUMP_PHYSDISP, (void**)&g_pPhysDisp );
 
 	g_numvertnormals = CopyLump( FIELD_VECTOR, LUMP_VERTNORMALS, (float*)g_vertnormals );
 	g_numvertnormalindices = CopyLump( FIELD_SHORT, LUMP_VERTNORMALINDICES, g_vertnormalindices );
@@ -2243,7 +2522,7 @@ void LoadBSPFile( const char *filename )
 		
 	// Load PAK file lump into appropriate data structure
 	byte *pakbuffer = NULL;
-	int paksize = CopyVariableLump<byte>( FIELD_CHARACTER, LUMP_PAKFILE, ( void ** )&pakbuffer );
+	int paksize = ReferenceVariableLump( LUMP_PAKFILE, ( void ** )&pakbuffer );
 	if ( paksize > 0 )
 	{
 		GetPakFile()->ActivateByteSwapping( IsX360() );
@@ -2254,7 +2533,7 @@ void LoadBSPFile( const char *filename )
 		GetPakFile()->Reset();
 	}
 
-	free( pakbuffer );
+	FreeVariableLump( pakbuffer );
 
 	g_GameLumps.ParseGameLump( g_pBSPHeader );
 
@@ -2262,7 +2541,7 @@ void LoadBSPFile( const char *filename )
 	// parse any additional lumps
 	Lumps_Parse();
 
-	// everything has been copied out
+	// everything else has been copied out
 	CloseBSPFile();
 
 	g_Swap.ActivateByteSwapping( false );
@@ -2332,14 +2611,14 @@ void UnloadBSPFile()
 
 	if ( g_pPhysCollide )
 	{
-		free( g_pPhysCollide );
+		FreeVariableLump( g_pPhysCollide );
 		g_pPhysCollide = NULL;
 	}
 	g_PhysCollideSize = 0;
 
 	if ( g_pPhysDisp )
 	{
-		free( g_pPhysDisp );
+		FreeVariableLump( g_pPhysDisp );
 		g_pPhysDisp = NULL;
 	}
 	g_PhysDispSize = 0;
@@ -2368,11 +2647,17 @@ void UnloadBSPFile()
 	{
 		if ( g_Lumps.pLumps[i] )
 		{
-			free( g_Lumps.pLumps[i] );
+			FreeVariableLump( g_Lumps.pLumps[i] );
 			g_Lumps.pLumps[i] = NULL;
 		}
 	}
 
+	// nothing points into the last file's mapping anymore
+	if ( !IsInBSPMapping( g_pBSPHeader ) )
+	{
+		UnmapBSPFile();
+	}
+
 	ReleasePakFileLumps();
 }
 
@@ -2381,18 +2666,18 @@ void UnloadBSPFile()
 //-----------------------------------------------------------------------------
 void LoadBSPFile_FileSystemOnly( const char *filename )
 {
-	Lumps_Init();
-
 	//
 	// load the file header
 	//
-	LoadFile( filename, (void **)&g_pBSPHeader );
+	LoadBSPHeader( filename, true );
+
+	Lumps_Init();
 
 	ValidateHeader( filename, g_pBSPHeader );
 
 	// Load PAK file lump into appropriate data structure
 	byte *pakbuffer = NULL;
-	int paksize = CopyVariableLump<byte>( FIELD_CHARACTER, LUMP_PAKFILE, ( void ** )&pakbuffer, 1 );
+	int paksize = ReferenceVariableLump( LUMP_PAKFILE, ( void ** )&pakbuffer, 1 );
 	if ( paksize > 0 )
 	{
 		GetPakFile()->ParseFromBuffer( pakbuffer, paksize );
@@ -2402,43 +2687,46 @@ void LoadBSPFile_FileSystemOnly( const char *filename )
 		GetPakFile()->Reset();
 	}
 
-	free( pakbuffer );
+	FreeVariableLump( pakbuffer );
 
 	// everything has been copied out
-	free( g_pBSPHeader );
-	g_pBSPHeader = NULL;
+	FreeBSPHeader();
 }
 
 void ExtractZipFileFromBSP( char *pBSPFileName, char *pZipFileName )
 {
-	Lumps_Init();
-
 	//
 	// load the file header
 	//
-	LoadFile( pBSPFileName, (void **)&g_pBSPHeader);
+	LoadBSPHeader( pBSPFileName, true );
+
+	Lumps_Init();
 
 	ValidateHeader( pBSPFileName, g_pBSPHeader );
 
 	byte *pakbuffer = NULL;
-	int paksize = CopyVariableLump<byte>( FIELD_CHARACTER, LUMP_PAKFILE, ( void ** )&pakbuffer );
+	int paksize = ReferenceVariableLump( LUMP_PAKFILE, ( void ** )&pakbuffer );
 	if ( paksize > 0 )
 	{
 		FILE *fp;
 		fp = fopen( pZipFileName, "wb" );
-		if( !fp )
+		if( fp )
+		{
+			fwrite( pakbuffer, paksize, 1, fp );
+			fclose( fp );
+		}
+		else
 		{
 			fprintf( stderr, "can't open %s\n", pZipFileName );
-			return;
 		}
-
-		fwrite( pakbuffer, paksize, 1, fp );
-		fclose( fp );
 	}
 	else
 	{		
 		fprintf( stderr, "zip file is zero length!\n" );
 	}
+
+	FreeVariableLump( pakbuffer );
+	FreeBSPHeader();
 }
 
 /*
@@ -2572,6 +2860,10 @@ void WriteBSPFile( const char *filename, char *pUnused )
 		return;
 	}
 
+	// the file may be the one the lumps were loaded from, so nothing can still
+	// point into its mapping when it's truncated
+	DetachBSPFileMapping();
+
 	dheader_t outHeader;
 	g_pBSPHeader = &outHeader;
 	memset( g_pBSPHeader, 0, sizeof( dheader_t ) );
@@ -4400,7 +4692,89 @@ int SortLumpsByOffset( const SortedLump_t *pSortedLumpA, const SortedLump_t *pSo
 	return 0;
 }
 
-bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc )
+//-----------------------------------------------------------------------------
+// Compressing the lumps of a bsp is one job per lump (and per game lump), run on
+// the tool threads. The results are put together in file order afterwards, so the
+// output is the same as compressing them one after another.
+//-----------------------------------------------------------------------------
+struct LumpCompressJob_t
+{
+	CUtlBuffer	m_Input;
+	CUtlBuffer	m_Compressed;
+	bool		m_bCompressed;
+};
+
+static CUtlVector< LumpCompressJob_t * > s_LumpCompressJobs;
+static CompressFunc_t s_pLumpCompressFunc;
+
+static int AddLumpCompressJob( void *pData, int nSize )
+{
+	LumpCompressJob_t *pJob = new LumpCompressJob_t;
+	pJob->m_Input.SetExternalBuffer( pData, nSize, nSize );
+	pJob->m_bCompressed = false;
+	return s_LumpCompressJobs.AddToTail( pJob );
+}
+
+static int __cdecl LumpCompressJobSizeCompare( const int *pJobA, const int *pJobB )
+{
+	// biggest first, so a big lump doesn't start last and hold everything up
+	int nSizeA = s_LumpCompressJobs[*pJobA]->m_Input.TellPut();
+	int nSizeB = s_LumpCompressJobs[*pJobB]->m_Input.TellPut();
+	if ( nSizeA != nSizeB )
+		return ( nSizeA > nSizeB ) ? -1 : 1;
+	return *pJobA - *pJobB;
+}
+
+static CUtlVector< int > s_LumpCompressOrder;
+
+static void CompressLumpJob( int iThread, int iWork )
+{
+	LumpCompressJob_t *pJob = s_LumpCompressJobs[s_LumpCompressOrder[iWork]];
+	if ( !pJob->m_Input.TellPut() )
+		return;
+
+	pJob->m_bCompressed = s_pLumpCompressFunc( pJob->m_Input, pJob->m_Compressed );
+}
+
+static void RunLumpCompressJobs( CompressFunc_t pCompressFunc )
+{
+	s_pLumpCompressFunc = pCompressFunc;
+
+	s_LumpCompressOrder.SetCount( s_LumpCompressJobs.Count() );
+	for ( int i = 0; i < s_LumpCompressOrder.Count(); i++ )
+	{
+		s_LumpCompressOrder[i] = i;
+	}
+	s_LumpCompressOrder.Sort( LumpCompressJobSizeCompare );
+
+	RunThreadsOnIndividual( s_LumpCompressJobs.Count(), false, CompressLumpJob );
+}
+
+static void FreeLumpCompressJobs()
+{
+	s_LumpCompressJobs.PurgeAndDeleteElements();
+	s_LumpCompressOrder.Purge();
+}
+
+// Writes a job's output as is, or compressed if compressing it worked
+static bool PutLumpCompressJob( CUtlBuffer &outputBuffer, int iJob )
+{
+	LumpCompressJob_t *pJob = s_LumpCompressJobs[iJob];
+	if ( pJob->m_bCompressed )
+	{
+		outputBuffer.Put( pJob->m_Compressed.Base(), pJob->m_Compressed.TellPut() );
+	}
+	else
+	{
+		outputBuffer.Put( pJob->m_Input.Base(), pJob->m_Input.TellPut() );
+	}
+	pJob->m_Compressed.Purge();
+	return pJob->m_bCompressed;
+}
+
+// Swaps the game lump directory to native order and queues a job for each game lump.
+// Returns the job of the first one.
+static int AddGameLumpCompressJobs( dheader_t *pInBSPHeader )
 {
 	CByteswap	byteSwap;
 
@@ -4411,6 +4785,24 @@ bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBu
 	byteSwap.SwapFieldsToTargetEndian( pInGameLumpHeader );
 	byteSwap.SwapFieldsToTargetEndian( pInGameLump, pInGameLumpHeader->lumpCount );
 
+	int iFirstJob = s_LumpCompressJobs.Count();
+	for ( int i = 0; i < pInGameLumpHeader->lumpCount; i++ )
+	{
+		AddLumpCompressJob( ((byte *)pInBSPHeader) + pInGameLump[i].fileofs, pInGameLump[i].filelen );
+	}
+	return iFirstJob;
+}
+
+static bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBuffer &outputBuffer, int iFirstJob )
+{
+	CByteswap	byteSwap;
+
+	// already in native order, from AddGameLumpCompressJobs
+	dgamelumpheader_t* pInGameLumpHeader = (dgamelumpheader_t*)(((byte *)pInBSPHeader) + pInBSPHeader->lumps[LUMP_GAME_LUMP].fileofs);
+	dgamelump_t* pInGameLump = (dgamelump_t*)(pInGameLumpHeader + 1);
+
+	byteSwap.ActivateByteSwapping( true );
+
 	unsigned int newOffset = outputBuffer.TellPut();
 	outputBuffer.Put( pInGameLumpHeader, sizeof( dgamelumpheader_t ) );
 	outputBuffer.Put( pInGameLump, pInGameLumpHeader->lumpCount * sizeof( dgamelump_t ) );
@@ -4427,27 +4819,13 @@ bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBu
 
 	for ( int i = 0; i < pInGameLumpHeader->lumpCount; i++ )
 	{
-		CUtlBuffer inputBuffer;
-		CUtlBuffer compressedBuffer;
-
 		pOutGameLump[i].fileofs = AlignBuffer( outputBuffer, 4 );
 
 		if ( pInGameLump[i].filelen )
 		{
-			inputBuffer.SetExternalBuffer( ((byte *)pInBSPHeader) + pInGameLump[i].fileofs, pInGameLump[i].filelen, pInGameLump[i].filelen );
-
-			bool bCompressed = pCompressFunc( inputBuffer, compressedBuffer );
-			if ( bCompressed )
+			if ( PutLumpCompressJob( outputBuffer, iFirstJob + i ) )
 			{
 				pOutGameLump[i].flags |= GAMELUMPFLAG_COMPRESSED;
-
-				outputBuffer.Put( compressedBuffer.Base(), compressedBuffer.TellPut() );
-				compressedBuffer.Purge();
-			}
-			else
-			{
-				// as is
-				outputBuffer.Put( inputBuffer.Base(), inputBuffer.TellPut() );
 			}
 		}
 	}
@@ -4498,6 +4876,27 @@ bool CompressBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFun
 	}
 	sortedLumps.Sort( SortLumpsByOffset );
 
+	// compress every lump up front
+	int lumpJobs[HEADER_LUMPS];
+	for ( int i = 0; i < HEADER_LUMPS; ++i )
+	{
+		lump_t *pLump = &pInBSPHeader->lumps[i];
+		lumpJobs[i] = -1;
+		if ( !pLump->filelen || i == LUMP_PAKFILE )
+			continue;
+
+		if ( i == LUMP_GAME_LUMP )
+		{
+			// the game lump has to have each of its components individually compressed
+			lumpJobs[i] = AddGameLumpCompressJobs( pInBSPHeader );
+		}
+		else
+		{
+			lumpJobs[i] = AddLumpCompressJob( ((byte *)pInBSPHeader) + pLump->fileofs, pLump->filelen );
+		}
+	}
+	RunLumpCompressJobs( pCompressFunc );
+
 	// iterate in sorted order
 	for ( int i = 0; i < HEADER_LUMPS; ++i )
 	{
@@ -4521,43 +4920,31 @@ bool CompressBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFun
 			// only set by compressed lumps, hides the uncompressed size
 			*((unsigned int *)pOutBSPHeader->lumps[lumpNum].fourCC) = 0;
 
-			CUtlBuffer inputBuffer;
-			inputBuffer.SetExternalBuffer( ((byte *)pInBSPHeader) + pSortedLump->pLump->fileofs, pSortedLump->pLump->filelen, pSortedLump->pLump->filelen );
-
 			if ( lumpNum == LUMP_GAME_LUMP )
 			{
-				// the game lump has to have each of its components individually compressed
-				CompressGameLump( pInBSPHeader, pOutBSPHeader, outputBuffer, pCompressFunc );
+				CompressGameLump( pInBSPHeader, pOutBSPHeader, outputBuffer, lumpJobs[lumpNum] );
 			}
 			else if ( lumpNum == LUMP_PAKFILE )
 			{
 				// add as is
 				pOutBSPHeader->lumps[lumpNum].fileofs = newOffset;
-				outputBuffer.Put( inputBuffer.Base(), inputBuffer.TellPut() );
+				outputBuffer.Put( ((byte *)pInBSPHeader) + pSortedLump->pLump->fileofs, pSortedLump->pLump->filelen );
 			}
 			else
 			{
-				CUtlBuffer compressedBuffer;
-				bool bCompressed = pCompressFunc( inputBuffer, compressedBuffer );
-				if ( bCompressed )
+				pOutBSPHeader->lumps[lumpNum].fileofs = newOffset;
+				if ( PutLumpCompressJob( outputBuffer, lumpJobs[lumpNum] ) )
 				{
 					// placing the uncompressed size in the unused fourCC, will decode at runtime
-					*((unsigned int *)pOutBSPHeader->lumps[lumpNum].fourCC) = BigLong( inputBuffer.TellPut() );
-					pOutBSPHeader->lumps[lumpNum].filelen = compressedBuffer.TellPut();
-					pOutBSPHeader->lumps[lumpNum].fileofs = newOffset;
-					outputBuffer.Put( compressedBuffer.Base(), compressedBuffer.TellPut() );
-					compressedBuffer.Purge();
-				}
-				else
-				{
-					// add as is
-					pOutBSPHeader->lumps[lumpNum].fileofs = newOffset;
-					outputBuffer.Put( inputBuffer.Base(), inputBuffer.TellPut() );
+					*((unsigned int *)pOutBSPHeader->lumps[lumpNum].fourCC) = BigLong( pSortedLump->pLump->filelen );
+					pOutBSPHeader->lumps[lumpNum].filelen = outputBuffer.TellPut() - newOffset;
 				}
 			}
 		}
 	}
 
+	FreeLumpCompressJobs();
+
 	// fix the output for 360, swapping it back
 	byteSwap.SetTargetBigEndian( true );
 	byteSwap.SwapFieldsToTargetEndian( pOutBSPHeader );
@@ -4788,6 +5175,19 @@ bool SwapBSPFile( const char *pInFilename, const char *pOutFilename, bool bSwapO
 	return true;
 }
 
+//-----------------------------------------------------------------------------
+// Returns true if the BSP's header is in the other byte order
+//-----------------------------------------------------------------------------
+static bool IsBSPFileSwapped( const char *pBSPFilename )
+{
+	int ident = 0;
+	FileHandle_t f = SafeOpenRead( pBSPFilename );
+	SafeRead( f, &ident, sizeof( ident ) );
+	g_pFileSystem->Close( f );
+
+	return ( ident == BigLong( IDBSPHEADER ) );
+}
+
 //-----------------------------------------------------------------------------
 // Get the pak lump from a BSP
 //-----------------------------------------------------------------------------
@@ -4803,10 +5203,7 @@ bool GetPakFileLump( const char *pBSPFilename, void **pPakData, int *pPakSize )
 	}
 
 	// determine endian nature
-	dheader_t *pHeader;
-	LoadFile( pBSPFilename, (void **)&pHeader );
-	bool bSwap = ( pHeader->ident == BigLong( IDBSPHEADER ) );
-	free( pHeader );
+	bool bSwap = IsBSPFileSwapped( pBSPFilename );
 
 	g_bSwapOnLoad = bSwap;
 	g_bSwapOnWrite = !bSwap;
@@ -4890,15 +5287,14 @@ bool SetPakFileLump( const char *pBSPFilename, const char *pNewFilename, void *p
 	}
 
 	// determine endian nature
-	dheader_t *pHeader;
-	LoadFile( pBSPFilename, (void **)&pHeader );
-	bool bSwap = ( pHeader->ident == BigLong( IDBSPHEADER ) );
-	free( pHeader );
+	bool bSwap = IsBSPFileSwapped( pBSPFilename );
 
 	g_bSwapOnLoad = bSwap;
 	g_bSwapOnWrite = bSwap;
 
-	OpenBSPFile( pBSPFilename );
+	// the new file is truncated while the old one is still being read, so it can
+	// only be mapped if they're different files
+	OpenBSPFileInternal( pBSPFilename, !IsSameFile( pBSPFilename, pNewFilename ) );
 
 	// save a copy of the old header
 	// generating a new bsp is a destructive operation
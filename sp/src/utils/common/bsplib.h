@@ -204,6 +204,7 @@ void				RemoveFileFromPak( IZip *pak, const char *pRelativeName );
 int					GetNextFilename( IZip *pak, int id, char *pBuffer, int bufferSize, int &fileSize );
 void				ForceAlignment( IZip *pak, bool bAlign, bool bCompatibleFormat, unsigned int alignmentSize );
 
+// CompressBSP calls this from several threads at once, so it has to be thread safe
 typedef bool (*CompressFunc_t)( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer );
 typedef bool (*VTFConvertFunc_t)( const char *pDebugName, CUtlBuffer &sourceBuf, CUtlBuffer &targetBuf, CompressFunc_t pCompressFunc );
 typedef bool (*VHVFixupFunc_t)( const char *pVhvFilename, const char *pModelName, CUtlBuffer &sourceBuf, CUtlBuffer &targetBuf );
@@ -288,6 +289,38 @@ int		CompressVis (byte *vis, byte *dest);
 
 void	OpenBSPFile( const char *filename );
 void	CloseBSPFile(void);
+
+// BSP files are memory mapped while they're read, and LoadBSPFile leaves the physics
+// and unknown lumps in the mapping. This copies them out; call it before changing
+// g_pPhysCollide or g_pPhysDisp in place. WriteBSPFile calls it itself.
+void	DetachBSPFileMapping( void );
+
+// Read-only pointer to a lump of the file opened by OpenBSPFile, straight from its
+// mapping. NULL if the file isn't mapped or the lump needs byte swapping, in which
+// case the lump has to be copied out.
+const void *GetMappedLump( int lump, int *pLength );
+
+template< class T >
+class CBSPLumpView
+{
+public:
+	CBSPLumpView( int lump )
+	{
+		int length;
+		m_pData = (const T *)GetMappedLump( lump, &length );
+		m_nCount = length / sizeof( T );
+	}
+
+	bool		IsValid() const				{ return m_pData != NULL; }
+	const T		*Base() const				{ return m_pData; }
+	int			Count() const				{ return m_nCount; }
+	const T		&operator[]( int i ) const	{ Assert( i >= 0 && i < m_nCount ); return m_pData[i]; }
+
+private:
+	const T		*m_pData;
+	int			m_nCount;
+};
+
 void	LoadBSPFile( const char *filename );
 void	LoadBSPFile_FileSystemOnly( const char *filename );
 void	LoadBSPFileTexinfo( const char *filename );
@@ -0,0 +1,479 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Runs DistributeWork style jobs across worker processes forked on
+//			this machine, for when VMPI isn't available.
+//
+//=============================================================================//
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#ifdef LINUX
+#include <sched.h>
+#endif
+#endif
+#include "cmdlib.h"
+#include "pacifier.h"
+#include "local_distribute_work.h"
+#include "tier0/platform.h"
+#include "utlvector.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+
+// How many work units each worker is given at once, so it always has the next one
+// queued while its last results are on their way back.
+#define LOCALWORK_UNITS_IN_FLIGHT	4
+
+// How often the callbacks' Update() is called.
+#define LOCALWORK_UPDATE_INTERVAL	0.2
+
+static int g_nLocalWorkers = 0;
+static bool g_bPinLocalWorkers = false;
+
+
+void LocalWork_SetNumWorkers( int nWorkers )
+{
+	g_nLocalWorkers = MAX( nWorkers, 0 );
+}
+
+int LocalWork_GetNumWorkers()
+{
+	return g_nLocalWorkers;
+}
+
+void LocalWork_SetPinWorkers( bool bPin )
+{
+	g_bPinLocalWorkers = bPin;
+}
+
+
+//-----------------------------------------------------------------------------
+// Tracks which work units are done, for OnWorkUnitsCompleted and the pacifier
+//-----------------------------------------------------------------------------
+class CLocalWorkProgress
+{
+public:
+	CLocalWorkProgress( uint64 nWorkUnits, IWorkUnitDistributorCallbacks *pCallbacks )
+	{
+		m_nWorkUnits = nWorkUnits;
+		m_nDone = 0;
+		m_nConsecutive = 0;
+		m_pCallbacks = pCallbacks;
+		m_flNextUpdate = Plat_FloatTime() + LOCALWORK_UPDATE_INTERVAL;
+		m_Done.SetCount( (int)nWorkUnits );
+		if ( nWorkUnits )
+		{
+			memset( m_Done.Base(), 0, m_Done.Count() );
+		}
+	}
+
+	bool IsDone( uint64 iWorkUnit ) const	{ return m_Done[(int)iWorkUnit] != 0; }
+	bool IsFinished() const					{ return m_nDone == m_nWorkUnits; }
+
+	void MarkDone( uint64 iWorkUnit )
+	{
+		m_Done[(int)iWorkUnit] = 1;
+		++m_nDone;
+
+		uint64 nOldConsecutive = m_nConsecutive;
+		while ( m_nConsecutive < m_nWorkUnits && m_Done[(int)m_nConsecutive] )
+		{
+			++m_nConsecutive;
+		}
+		if ( m_pCallbacks && m_nConsecutive != nOldConsecutive )
+		{
+			m_pCallbacks->OnWorkUnitsCompleted( m_nConsecutive );
+		}
+
+		UpdatePacifier( (float)m_nDone / m_nWorkUnits );
+	}
+
+	// Calls Update() if it's time to. Returns true if the callbacks want to stop.
+	bool CheckStop()
+	{
+		if ( !m_pCallbacks || Plat_FloatTime() < m_flNextUpdate )
+			return false;
+
+		m_flNextUpdate = Plat_FloatTime() + LOCALWORK_UPDATE_INTERVAL;
+		return m_pCallbacks->Update();
+	}
+
+private:
+	uint64							m_nWorkUnits;
+	uint64							m_nDone;
+	uint64							m_nConsecutive;
+	IWorkUnitDistributorCallbacks	*m_pCallbacks;
+	double							m_flNextUpdate;
+	CUtlVector<byte>				m_Done;
+};
+
+
+//-----------------------------------------------------------------------------
+// Runs every work unit in this process, for when there are no workers to fork
+//-----------------------------------------------------------------------------
+static void RunWorkInProcess( uint64 nWorkUnits, ProcessWorkUnitFn processFn, ReceiveWorkUnitFn receiveFn, CLocalWorkProgress &progress )
+{
+	MessageBuffer mb;
+	for ( uint64 iWorkUnit = 0; iWorkUnit < nWorkUnits; iWorkUnit++ )
+	{
+		if ( progress.CheckStop() )
+			break;
+
+		mb.reset( 0 );
+		processFn( 0, iWorkUnit, &mb );
+		mb.setOffset( 0 );
+		receiveFn( iWorkUnit, &mb, 0 );
+		progress.MarkDone( iWorkUnit );
+	}
+}
+
+
+#ifdef _WIN32
+
+double LocalDistributeWork( uint64 nWorkUnits, ProcessWorkUnitFn processFn, ReceiveWorkUnitFn receiveFn, IWorkUnitDistributorCallbacks *pCallbacks )
+{
+	// There's no fork on Windows; use -mpi there to spread the work over processes
+	if ( g_nLocalWorkers )
+	{
+		Warning( "\nLocal worker processes aren't supported on this platform, use -mpi instead.\n" );
+		g_nLocalWorkers = 0;
+	}
+
+	double flStart = Plat_FloatTime();
+	CLocalWorkProgress progress( nWorkUnits, pCallbacks );
+	RunWorkInProcess( nWorkUnits, processFn, receiveFn, progress );
+	return Plat_FloatTime() - flStart;
+}
+
+#else
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+// Sent to a worker in place of a work unit to make it exit
+static const uint64 LOCALWORK_QUIT = (uint64)-1;
+
+// What a worker sends back before each work unit's results
+struct LocalWorkResultHeader_t
+{
+	uint64	m_iWorkUnit;
+	int		m_nBytes;
+};
+
+struct LocalWorker_t
+{
+	pid_t				m_Pid;
+	int					m_Socket;			// the master's end of the socket pair
+	CUtlVector<uint64>	m_Assigned;			// work units sent but not returned yet
+};
+
+
+static bool SendAll( int s, const void *pData, int nBytes )
+{
+	const char *pCur = (const char *)pData;
+	while ( nBytes > 0 )
+	{
+		int nSent = send( s, pCur, nBytes, MSG_NOSIGNAL );
+		if ( nSent < 0 && errno == EINTR )
+			continue;
+		if ( nSent <= 0 )
+			return false;
+
+		pCur += nSent;
+		nBytes -= nSent;
+	}
+	return true;
+}
+
+static bool RecvAll( int s, void *pData, int nBytes )
+{
+	char *pCur = (char *)pData;
+	while ( nBytes > 0 )
+	{
+		int nReceived = recv( s, pCur, nBytes, 0 );
+		if ( nReceived < 0 && errno == EINTR )
+			continue;
+		if ( nReceived <= 0 )
+			return false;
+
+		pCur += nReceived;
+		nBytes -= nReceived;
+	}
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Pins worker iWorker to one of the CPUs the process may run on
+//-----------------------------------------------------------------------------
+static void PinWorker( int iWorker )
+{
+#ifdef LINUX
+	cpu_set_t allowed;
+	CPU_ZERO( &allowed );
+	if ( sched_getaffinity( 0, sizeof( allowed ), &allowed ) != 0 )
+		return;
+
+	int nAllowed = CPU_COUNT( &allowed );
+	if ( nAllowed <= 0 )
+		return;
+
+	int iSlot = iWorker % nAllowed;
+	for ( int iCPU = 0; iCPU < CPU_SETSIZE; iCPU++ )
+	{
+		if ( CPU_ISSET( iCPU, &allowed ) && iSlot-- == 0 )
+		{
+			cpu_set_t pinned;
+			CPU_ZERO( &pinned );
+			CPU_SET( iCPU, &pinned );
+			sched_setaffinity( 0, sizeof( pinned ), &pinned );
+			return;
+		}
+	}
+#endif
+}
+
+
+//-----------------------------------------------------------------------------
+// The worker side: processes work units until told to quit or the master goes away
+//-----------------------------------------------------------------------------
+static void WorkerMain( int s, ProcessWorkUnitFn processFn )
+{
+	MessageBuffer mb;
+	uint64 iWorkUnit;
+	while ( RecvAll( s, &iWorkUnit, sizeof( iWorkUnit ) ) && iWorkUnit != LOCALWORK_QUIT )
+	{
+		mb.reset( 0 );
+		processFn( 0, iWorkUnit, &mb );
+
+		LocalWorkResultHeader_t header;
+		header.m_iWorkUnit = iWorkUnit;
+		header.m_nBytes = mb.getLen();
+		if ( !SendAll( s, &header, sizeof( header ) ) || !SendAll( s, mb.data, header.m_nBytes ) )
+			break;
+	}
+}
+
+
+static bool StartWorkers( CUtlVector<LocalWorker_t> &workers, int nWorkers, ProcessWorkUnitFn processFn )
+{
+	// anything still buffered would be written again by every worker
+	fflush( stdout );
+	fflush( stderr );
+
+	for ( int i = 0; i < nWorkers; i++ )
+	{
+		int sockets[2];
+		if ( socketpair( AF_UNIX, SOCK_STREAM, 0, sockets ) != 0 )
+		{
+			Warning( "LocalDistributeWork: socketpair failed (%s)\n", strerror( errno ) );
+			break;
+		}
+
+		pid_t pid = fork();
+		if ( pid < 0 )
+		{
+			Warning( "LocalDistributeWork: fork failed (%s)\n", strerror( errno ) );
+			close( sockets[0] );
+			close( sockets[1] );
+			break;
+		}
+
+		if ( pid == 0 )
+		{
+			// the worker doesn't need the master's ends of any socket pair
+			close( sockets[0] );
+			for ( int j = 0; j < workers.Count(); j++ )
+			{
+				close( workers[j].m_Socket );
+			}
+
+			if ( g_bPinLocalWorkers )
+			{
+				PinWorker( i );
+			}
+
+			WorkerMain( sockets[1], processFn );
+
+			// skip the atexit handlers and stdio flushes; they belong to the master
+			_exit( 0 );
+		}
+
+		close( sockets[1] );
+
+		int iWorker = workers.AddToTail();
+		workers[iWorker].m_Pid = pid;
+		workers[iWorker].m_Socket = sockets[0];
+	}
+
+	return workers.Count() != 0;
+}
+
+
+static void StopWorker( LocalWorker_t &worker, bool bKill )
+{
+	if ( worker.m_Socket == -1 )
+		return;
+
+	if ( bKill )
+	{
+		kill( worker.m_Pid, SIGKILL );
+	}
+	else
+	{
+		SendAll( worker.m_Socket, &LOCALWORK_QUIT, sizeof( LOCALWORK_QUIT ) );
+	}
+
+	close( worker.m_Socket );
+	worker.m_Socket = -1;
+
+	int status;
+	while ( waitpid( worker.m_Pid, &status, 0 ) < 0 && errno == EINTR )
+		;
+}
+
+
+double LocalDistributeWork( uint64 nWorkUnits, ProcessWorkUnitFn processFn, ReceiveWorkUnitFn receiveFn, IWorkUnitDistributorCallbacks *pCallbacks )
+{
+	double flStart = Plat_FloatTime();
+	CLocalWorkProgress progress( nWorkUnits, pCallbacks );
+
+	CUtlVector<LocalWorker_t> workers;
+	int nWorkers = (int)MIN( (uint64)g_nLocalWorkers, nWorkUnits );
+	if ( nWorkers <= 0 || !StartWorkers( workers, nWorkers, processFn ) )
+	{
+		RunWorkInProcess( nWorkUnits, processFn, receiveFn, progress );
+		return Plat_FloatTime() - flStart;
+	}
+
+	CUtlVector<uint64> retry;		// work units whose worker died
+	uint64 iNextWorkUnit = 0;
+	int nAlive = workers.Count();
+	bool bStopped = false;
+
+	CUtlVector<pollfd> fds;
+	CUtlVector<int> fdWorkers;
+	MessageBuffer mb;
+
+	while ( !progress.IsFinished() )
+	{
+		if ( progress.CheckStop() )
+		{
+			bStopped = true;
+			break;
+		}
+
+		// top up each worker's queue
+		for ( int i = 0; i < workers.Count(); i++ )
+		{
+			LocalWorker_t &worker = workers[i];
+			while ( worker.m_Socket != -1 && worker.m_Assigned.Count() < LOCALWORK_UNITS_IN_FLIGHT )
+			{
+				uint64 iWorkUnit;
+				if ( retry.Count() )
+				{
+					iWorkUnit = retry.Tail();
+					retry.RemoveMultipleFromTail( 1 );
+				}
+				else if ( iNextWorkUnit < nWorkUnits )
+				{
+					iWorkUnit = iNextWorkUnit++;
+				}
+				else
+				{
+					break;
+				}
+
+				if ( progress.IsDone( iWorkUnit ) )
+					continue;
+
+				worker.m_Assigned.AddToTail( iWorkUnit );
+
+				// if this fails the worker's gone, and reading from it below finds that out
+				if ( !SendAll( worker.m_Socket, &iWorkUnit, sizeof( iWorkUnit ) ) )
+					break;
+			}
+		}
+
+		fds.RemoveAll();
+		fdWorkers.RemoveAll();
+		for ( int i = 0; i < workers.Count(); i++ )
+		{
+			if ( workers[i].m_Socket == -1 )
+				continue;
+
+			pollfd &fd = fds[fds.AddToTail()];
+			fd.fd = workers[i].m_Socket;
+			fd.events = POLLIN;
+			fd.revents = 0;
+			fdWorkers.AddToTail( i );
+		}
+
+		int nReady = poll( fds.Base(), fds.Count(), (int)( LOCALWORK_UPDATE_INTERVAL * 1000 ) );
+		if ( nReady < 0 && errno != EINTR )
+			Error( "LocalDistributeWork: poll failed (%s)\n", strerror( errno ) );
+
+		for ( int i = 0; nReady > 0 && i < fds.Count(); i++ )
+		{
+			if ( !fds[i].revents )
+				continue;
+
+			int iWorker = fdWorkers[i];
+			LocalWorker_t &worker = workers[iWorker];
+
+			// a worker writes the whole result as soon as it has the header out, so it's
+			// fine to block here until the rest arrives
+			LocalWorkResultHeader_t header;
+			bool bValid = RecvAll( worker.m_Socket, &header, sizeof( header ) ) &&
+				header.m_nBytes >= 0 && worker.m_Assigned.HasElement( header.m_iWorkUnit );
+			if ( bValid )
+			{
+				mb.reset( header.m_nBytes );
+				mb.setLen( header.m_nBytes );
+				bValid = RecvAll( worker.m_Socket, mb.data, header.m_nBytes );
+			}
+
+			if ( !bValid )
+			{
+				Warning( "\nLocalDistributeWork: lost worker %d, handing its %d work units to the others.\n",
+					iWorker + 1, worker.m_Assigned.Count() );
+
+				retry.AddVectorToTail( worker.m_Assigned );
+				worker.m_Assigned.RemoveAll();
+				StopWorker( worker, true );
+				if ( --nAlive == 0 )
+					Error( "LocalDistributeWork: all the worker processes died.\n" );
+				continue;
+			}
+
+			worker.m_Assigned.FindAndRemove( header.m_iWorkUnit );
+			if ( !progress.IsDone( header.m_iWorkUnit ) )
+			{
+				mb.setOffset( 0 );
+				receiveFn( header.m_iWorkUnit, &mb, iWorker + 1 );
+				progress.MarkDone( header.m_iWorkUnit );
+			}
+		}
+	}
+
+	// workers that are partway through a work unit when we stop early are killed; the
+	// rest are told to quit
+	for ( int i = 0; i < workers.Count(); i++ )
+	{
+		StopWorker( workers[i], bStopped );
+	}
+
+	return Plat_FloatTime() - flStart;
+}
+
+#endif
@@ -0,0 +1,47 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Runs DistributeWork style jobs across worker processes forked on
+//			this machine, for when VMPI isn't available.
+//
+//=============================================================================//
+
+#ifndef LOCAL_DISTRIBUTE_WORK_H
+#define LOCAL_DISTRIBUTE_WORK_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+
+#include "vmpi_distribute_work.h"
+
+
+// How many worker processes LocalDistributeWork forks. 0 (the default) means the
+// tools should run their work with threads as usual.
+void LocalWork_SetNumWorkers( int nWorkers );
+int LocalWork_GetNumWorkers();
+
+// Pins each worker process to one of the CPUs the tool is allowed to run on, so the
+// pages it touches stay on that CPU's memory node.
+void LocalWork_SetPinWorkers( bool bPin );
+
+
+// Same contract as DistributeWork: processFn runs in the workers and writes each work
+// unit's results to pBuf, then receiveFn reads them back in the master. The workers are
+// forked when this is called, so they see the master's memory as it is at that point,
+// but nothing the master or the other workers change after that.
+//
+// If pCallbacks is set, Update() is called every 200ms or so and can return true to
+// stop early, and OnWorkUnitsCompleted() is called as consecutive work units finish.
+//
+// Work units given to a worker that dies are handed to another one.
+//
+// Returns the time it took to finish the work.
+double LocalDistributeWork(
+	uint64 nWorkUnits,
+	ProcessWorkUnitFn processFn,
+	ReceiveWorkUnitFn receiveFn,
+	IWorkUnitDistributorCallbacks *pCallbacks = NULL
+	);
+
+
+#endif // LOCAL_DISTRIBUTE_WORK_H
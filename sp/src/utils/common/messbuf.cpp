@@ -0,0 +1,192 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: MessageBuffer for the platforms vmpi.lib isn't built for, so the
+//			DistributeWork callbacks can be used with LocalDistributeWork.
+//
+//=============================================================================//
+
+#include <stdlib.h>
+#include <string.h>
+#include "messbuf.h"
+#include "tier0/dbg.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+
+MessageBuffer::MessageBuffer()
+{
+	size = DEFAULT_MESSAGE_BUFFER_SIZE;
+	data = (char *)malloc( size );
+	len = 0;
+	offset = 0;
+}
+
+MessageBuffer::MessageBuffer( int minsize )
+{
+	size = ( minsize > 0 ) ? minsize : DEFAULT_MESSAGE_BUFFER_SIZE;
+	data = (char *)malloc( size );
+	len = 0;
+	offset = 0;
+}
+
+MessageBuffer::~MessageBuffer()
+{
+	free( data );
+}
+
+int MessageBuffer::getSize()
+{
+	return size;
+}
+
+int MessageBuffer::getLen()
+{
+	return len;
+}
+
+int MessageBuffer::setLen( int nLength )
+{
+	if ( nLength < 0 )
+		return -1;
+
+	if ( nLength > size )
+		resize( nLength );
+
+	len = nLength;
+	if ( offset > len )
+		offset = len;
+	return len;
+}
+
+int MessageBuffer::getOffset()
+{
+	return offset;
+}
+
+int MessageBuffer::setOffset( int nOffset )
+{
+	if ( nOffset < 0 || nOffset > len )
+		return -1;
+
+	offset = nOffset;
+	return offset;
+}
+
+int MessageBuffer::write( void const *p, int bytes )
+{
+	if ( bytes < 0 )
+		return -1;
+
+	if ( len + bytes > size )
+		resize( len + bytes );
+
+	memcpy( data + len, p, bytes );
+	len += bytes;
+	return len;
+}
+
+int MessageBuffer::update( int loc, void const *p, int bytes )
+{
+	if ( loc < 0 || bytes < 0 )
+		return -1;
+
+	if ( loc + bytes > size )
+		resize( loc + bytes );
+
+	memcpy( data + loc, p, bytes );
+	if ( len < loc + bytes )
+		len = loc + bytes;
+	return len;
+}
+
+int MessageBuffer::extract( int loc, void *p, int bytes )
+{
+	if ( loc < 0 || bytes < 0 || loc + bytes > len )
+		return -1;
+
+	memcpy( p, data + loc, bytes );
+	return loc + bytes;
+}
+
+int MessageBuffer::read( void *p, int bytes )
+{
+	if ( bytes < 0 || offset + bytes > len )
+		return -1;
+
+	memcpy( p, data + offset, bytes );
+	offset += bytes;
+	return offset;
+}
+
+int MessageBuffer::WriteString( const char *pString )
+{
+	return write( pString, strlen( pString ) + 1 );
+}
+
+int MessageBuffer::ReadString( char *pOut, int bufferLength )
+{
+	const char *pEnd = (const char *)memchr( data + offset, 0, len - offset );
+	if ( !pEnd )
+		return -1;
+
+	int nChars = pEnd - ( data + offset ) + 1;
+	if ( nChars > bufferLength )
+		return -1;
+
+	memcpy( pOut, data + offset, nChars );
+	offset += nChars;
+	return offset;
+}
+
+void MessageBuffer::clear()
+{
+	memset( data, 0, size );
+	len = 0;
+	offset = 0;
+}
+
+void MessageBuffer::clear( int minsize )
+{
+	if ( minsize > size )
+		resize( minsize );
+
+	clear();
+}
+
+void MessageBuffer::reset( int minsize )
+{
+	if ( minsize > size )
+		resize( minsize );
+
+	len = 0;
+	offset = 0;
+}
+
+void MessageBuffer::print( FILE *ofile, int num )
+{
+	fprintf( ofile, "Message size %d, length %d, offset %d\n", size, len, offset );
+
+	if ( num > len )
+		num = len;
+
+	for ( int i = 0; i < num; i++ )
+	{
+		fprintf( ofile, "%02x%c", (unsigned char)data[i], ( ( i & 15 ) == 15 ) ? '\n' : ' ' );
+	}
+	fprintf( ofile, "\n" );
+}
+
+void MessageBuffer::resize( int minsize )
+{
+	int nNewSize = size * 2;
+	if ( nNewSize < minsize )
+		nNewSize = minsize;
+
+	char *pNewData = (char *)realloc( data, nNewSize );
+	if ( !pNewData )
+		Error( "MessageBuffer::resize: out of memory (%d bytes)\n", nNewSize );
+
+	data = pNewData;
+	size = nNewSize;
+}
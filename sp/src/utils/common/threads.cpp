@@ -1,6 +1,6 @@
 //========= Copyright Valve Corporation, All rights reserved. ============//
 //
-// Purpose: 
+// Purpose:
 //
 // $Workfile:     $
 // $Date:         $
@@ -13,19 +13,22 @@
 
 #define	USED
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#ifdef LINUX
+#include <sys/syscall.h>
+#endif
+#endif
 #include "cmdlib.h"
 #define NO_THREAD_NAMES
 #include "threads.h"
 #include "pacifier.h"
-
-#ifdef MAPBASE
-// This was suggested in that Source 2013 pull request that fixed Vrad.
-// I trust their judgement on this.
-#define	MAX_THREADS	32
-#else
-#define	MAX_THREADS	16
-#endif
+#include "tier0/threadtools.h"
+#include "utlvector.h"
 
 
 class CRunThreadsData
@@ -34,47 +37,158 @@ public:
 	int m_iThread;
 	void *m_pUserData;
 	RunThreadsFn m_Fn;
+	ERunThreadsPriority m_ePriority;
 };
 
-CRunThreadsData g_RunThreadsData[MAX_THREADS];
+CUtlVector<CRunThreadsData> g_RunThreadsData;
 
 
-int		dispatch;
 int		workcount;
 qboolean		pacifier;
 
 qboolean	threaded;
 bool g_bLowPriorityThreads = false;
 
-HANDLE g_ThreadHandles[MAX_THREADS];
 
+/*
+===================================================================
 
+WORK QUEUES
 
-/*
-=============
-GetThreadWork
+Work items are handed out in chunks. Chunk k goes to thread k % numthreads,
+so each thread's share is a run of "slots" (slot j is chunk iThread + j*numthreads)
+which it takes from the front while idle threads steal from the back. Both ends
+live in one 64-bit word, so taking a chunk is a single compare and swap and
+there is no lock. Dealing the chunks out round robin keeps work roughly in
+increasing order, which vvis relies on to reuse the vis of simpler portals.
 
-=============
+===================================================================
 */
-int	GetThreadWork (void)
+
+// Aim for this many chunks per thread, so stealing can even out the load
+#define WORK_CHUNKS_PER_THREAD	32
+#define MAX_WORK_CHUNK_SIZE		64
+
+struct CThreadWorkQueue
+{
+	volatile int64	m_Range;		// next slot in the low 32 bits, end slot in the high 32 bits
+	int				m_iCur;			// the rest of the chunk this thread is working through
+	int				m_iEnd;
+	char			m_Pad[64 - sizeof(int64) - 2*sizeof(int)];	// keep each queue on its own cache line
+};
+
+static CThreadWorkQueue *g_pWorkQueues;
+static int g_nWorkQueues;
+static int g_nWorkChunkSize;
+static int g_nWorkChunks;
+
+static CInterlockedInt g_nWorkDispatched;
+static CInterlockedInt g_bPacifierBusy;
+
+// Index + 1 of the tool thread running on this thread, or 0 for other threads
+static CThreadLocalInt<> g_iToolThread;
+
+
+static inline int64 MakeWorkRange( int iFirst, int iEnd )
+{
+	return (int64)(uint32)iFirst | ( (int64)iEnd << 32 );
+}
+
+
+// Deal out the chunks for workcnt items to each thread's queue.
+static void InitWorkQueues( int workcnt )
+{
+	// One extra queue for threads we didn't start, like the main thread.
+	int nQueues = numthreads + 1;
+	if ( nQueues > g_nWorkQueues )
+	{
+		delete [] g_pWorkQueues;
+		g_pWorkQueues = new CThreadWorkQueue[nQueues];
+		g_nWorkQueues = nQueues;
+	}
+
+	g_nWorkChunkSize = MAX( 1, MIN( workcnt / ( numthreads * WORK_CHUNKS_PER_THREAD ), MAX_WORK_CHUNK_SIZE ) );
+	g_nWorkChunks = ( workcnt + g_nWorkChunkSize - 1 ) / g_nWorkChunkSize;
+
+	for ( int i=0; i < g_nWorkQueues; i++ )
+	{
+		int nSlots = ( i < numthreads && i < g_nWorkChunks ) ? ( g_nWorkChunks - i + numthreads - 1 ) / numthreads : 0;
+		g_pWorkQueues[i].m_Range = MakeWorkRange( 0, nSlots );
+		g_pWorkQueues[i].m_iCur = 0;
+		g_pWorkQueues[i].m_iEnd = 0;
+	}
+
+	g_nWorkDispatched = 0;
+	g_bPacifierBusy = 0;
+}
+
+
+// Take a chunk from the front of the given queue (bSteal = false) or the back (bSteal = true).
+// Returns the chunk index or -1 if the queue is empty.
+static int TakeWorkChunk( int iQueue, bool bSteal )
+{
+	CThreadWorkQueue &queue = g_pWorkQueues[iQueue];
+
+	while ( 1 )
+	{
+		int64 range = queue.m_Range;
+		int iFirst = (int)( range & 0xFFFFFFFF );
+		int iEnd = (int)( range >> 32 );
+		if ( iFirst >= iEnd )
+			return -1;
+
+		int iSlot = bSteal ? iEnd - 1 : iFirst;
+		int64 newRange = bSteal ? MakeWorkRange( iFirst, iEnd - 1 ) : MakeWorkRange( iFirst + 1, iEnd );
+		if ( ThreadInterlockedAssignIf64( &queue.m_Range, newRange, range ) )
+			return iQueue + iSlot * numthreads;
+	}
+}
+
+
+static int GetThreadWorkForQueue( int iQueue )
 {
-	int	r;
+	CThreadWorkQueue &queue = g_pWorkQueues[iQueue];
+	if ( queue.m_iCur < queue.m_iEnd )
+		return queue.m_iCur++;
 
-	ThreadLock ();
+	int iChunk = ( iQueue < numthreads ) ? TakeWorkChunk( iQueue, false ) : -1;
 
-	if (dispatch == workcount)
+	// Out of our own work, steal from the others. Queues only ever shrink, so if they
+	// all look empty there is nothing left to do.
+	for ( int i=1; iChunk == -1 && i <= numthreads; i++ )
 	{
-		ThreadUnlock ();
+		iChunk = TakeWorkChunk( ( iQueue + i ) % numthreads, true );
+	}
+
+	if ( iChunk == -1 )
 		return -1;
+
+	queue.m_iCur = iChunk * g_nWorkChunkSize;
+	queue.m_iEnd = MIN( queue.m_iCur + g_nWorkChunkSize, workcount );
+
+	g_nWorkDispatched += queue.m_iEnd - queue.m_iCur;
+
+	// Whoever gets here first draws the pacifier, nobody waits for it
+	if ( g_bPacifierBusy.AssignIf( 0, 1 ) )
+	{
+		UpdatePacifier( (float)g_nWorkDispatched / workcount );
+		g_bPacifierBusy = 0;
 	}
 
-	UpdatePacifier( (float)dispatch / workcount );
+	return queue.m_iCur++;
+}
+
 
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock ();
+/*
+=============
+GetThreadWork
 
-	return r;
+=============
+*/
+int	GetThreadWork (void)
+{
+	int iToolThread = g_iToolThread;
+	return GetThreadWorkForQueue( iToolThread ? iToolThread - 1 : numthreads );
 }
 
 
@@ -86,10 +200,10 @@ void ThreadWorkerFunction( int iThread, void *pUserData )
 
 	while (1)
 	{
-		work = GetThreadWork ();
+		work = GetThreadWorkForQueue( iThread );
 		if (work == -1)
 			break;
-		 
+
 		workfunction( iThread, work );
 	}
 }
@@ -98,12 +212,16 @@ void RunThreadsOnIndividual (int workcnt, qboolean showpacifier, ThreadWorkerFn
 {
 	if (numthreads == -1)
 		ThreadSetDefault ();
-	
+
 	workfunction = func;
 	RunThreadsOn (workcnt, showpacifier, ThreadWorkerFunction);
 }
 
 
+int		numthreads = -1;
+static int enter;
+
+
 /*
 ===================================================================
 
@@ -112,9 +230,11 @@ WIN32
 ===================================================================
 */
 
-int		numthreads = -1;
+#ifdef _WIN32
+
 CRITICAL_SECTION		crit;
-static int enter;
+
+CUtlVector<HANDLE> g_ThreadHandles;
 
 
 class CCritInit
@@ -134,19 +254,11 @@ void SetLowPriority()
 }
 
 
-void ThreadSetDefault (void)
+static int GetProcessorCount()
 {
 	SYSTEM_INFO info;
-
-	if (numthreads == -1)	// not set manually
-	{
-		GetSystemInfo (&info);
-		numthreads = info.dwNumberOfProcessors;
-		if (numthreads < 1 || numthreads > 32)
-			numthreads = 1;
-	}
-
-	Msg ("%i threads\n", numthreads);
+	GetSystemInfo (&info);
+	return info.dwNumberOfProcessors;
 }
 
 
@@ -175,56 +287,185 @@ void ThreadUnlock (void)
 DWORD WINAPI InternalRunThreadsFn( LPVOID pParameter )
 {
 	CRunThreadsData *pData = (CRunThreadsData*)pParameter;
+	g_iToolThread = pData->m_iThread + 1;
 	pData->m_Fn( pData->m_iThread, pData->m_pUserData );
+	g_iToolThread = 0;
 	return 0;
 }
 
 
+static void CreateToolThread( CRunThreadsData *pData )
+{
+	DWORD dwDummy;
+	HANDLE hThread = CreateThread(
+	   NULL,	// LPSECURITY_ATTRIBUTES lpsa,
+	   0,		// DWORD cbStack,
+	   InternalRunThreadsFn,	// LPTHREAD_START_ROUTINE lpStartAddr,
+	   pData,	// LPVOID lpvThreadParm,
+	   0,			// DWORD fdwCreate,
+	   &dwDummy );
+
+	if ( pData->m_ePriority == k_eRunThreadsPriority_UseGlobalState )
+	{
+		if( g_bLowPriorityThreads )
+			SetThreadPriority( hThread, THREAD_PRIORITY_LOWEST );
+	}
+	else if ( pData->m_ePriority == k_eRunThreadsPriority_Idle )
+	{
+		SetThreadPriority( hThread, THREAD_PRIORITY_IDLE );
+	}
+
+	g_ThreadHandles.AddToTail( hThread );
+}
+
+
+static void JoinToolThreads()
+{
+	// WaitForMultipleObjects can only wait on MAXIMUM_WAIT_OBJECTS at once
+	for ( int i=0; i < g_ThreadHandles.Count(); i++ )
+	{
+		WaitForSingleObject( g_ThreadHandles[i], INFINITE );
+		CloseHandle( g_ThreadHandles[i] );
+	}
+	g_ThreadHandles.RemoveAll();
+}
+
+#else
+
+/*
+===================================================================
+
+PTHREADS
+
+===================================================================
+*/
+
+pthread_mutex_t		crit = PTHREAD_MUTEX_INITIALIZER;
+
+CUtlVector<pthread_t> g_ThreadHandles;
+
+
+void SetLowPriority()
+{
+	setpriority( PRIO_PROCESS, 0, 19 );
+}
+
+
+static int GetProcessorCount()
+{
+	return sysconf( _SC_NPROCESSORS_ONLN );
+}
+
+
+void ThreadLock (void)
+{
+	if (!threaded)
+		return;
+	pthread_mutex_lock (&crit);
+	if (enter)
+		Error ("Recursive ThreadLock\n");
+	enter = 1;
+}
+
+void ThreadUnlock (void)
+{
+	if (!threaded)
+		return;
+	if (!enter)
+		Error ("ThreadUnlock without lock\n");
+	enter = 0;
+	pthread_mutex_unlock (&crit);
+}
+
+
+// This runs in the thread and dispatches a RunThreadsFn call.
+static void *InternalRunThreadsFn( void *pParameter )
+{
+	CRunThreadsData *pData = (CRunThreadsData*)pParameter;
+
+#ifdef LINUX
+	// Linux keeps a nice value per thread, so this only lowers the tool thread
+	int nNice = 0;
+	if ( pData->m_ePriority == k_eRunThreadsPriority_UseGlobalState )
+		nNice = g_bLowPriorityThreads ? 10 : 0;
+	else if ( pData->m_ePriority == k_eRunThreadsPriority_Idle )
+		nNice = 19;
+
+	if ( nNice )
+		setpriority( PRIO_PROCESS, syscall( SYS_gettid ), nNice );
+#endif
+
+	g_iToolThread = pData->m_iThread + 1;
+	pData->m_Fn( pData->m_iThread, pData->m_pUserData );
+	g_iToolThread = 0;
+	return NULL;
+}
+
+
+static void CreateToolThread( CRunThreadsData *pData )
+{
+	pthread_t hThread;
+	if ( pthread_create( &hThread, NULL, InternalRunThreadsFn, pData ) != 0 )
+		Error( "pthread_create failed for tool thread %d\n", pData->m_iThread );
+
+	g_ThreadHandles.AddToTail( hThread );
+}
+
+
+static void JoinToolThreads()
+{
+	for ( int i=0; i < g_ThreadHandles.Count(); i++ )
+	{
+		pthread_join( g_ThreadHandles[i], NULL );
+	}
+	g_ThreadHandles.RemoveAll();
+}
+
+#endif
+
+
+void ThreadSetDefault (void)
+{
+	if (numthreads == -1)	// not set manually
+	{
+		numthreads = GetProcessorCount();
+		if (numthreads < 1)
+			numthreads = 1;
+	}
+
+	Msg ("%i threads\n", numthreads);
+}
+
+
 void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePriority )
 {
 	Assert( numthreads > 0 );
 	threaded = true;
 
-	if ( numthreads > MAX_TOOL_THREADS )
-		numthreads = MAX_TOOL_THREADS;
-
+	// Filled in before any thread starts, so the thread data doesn't move under them
+	g_RunThreadsData.SetCount( numthreads );
 	for ( int i=0; i < numthreads ;i++ )
 	{
 		g_RunThreadsData[i].m_iThread = i;
 		g_RunThreadsData[i].m_pUserData = pUserData;
 		g_RunThreadsData[i].m_Fn = fn;
+		g_RunThreadsData[i].m_ePriority = ePriority;
+	}
 
-		DWORD dwDummy;
-		g_ThreadHandles[i] = CreateThread(
-		   NULL,	// LPSECURITY_ATTRIBUTES lpsa,
-		   0,		// DWORD cbStack,
-		   InternalRunThreadsFn,	// LPTHREAD_START_ROUTINE lpStartAddr,
-		   &g_RunThreadsData[i],	// LPVOID lpvThreadParm,
-		   0,			// DWORD fdwCreate,
-		   &dwDummy );
-
-		if ( ePriority == k_eRunThreadsPriority_UseGlobalState )
-		{
-			if( g_bLowPriorityThreads )
-				SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_LOWEST );
-		}
-		else if ( ePriority == k_eRunThreadsPriority_Idle )
-		{
-			SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_IDLE );
-		}
+	for ( int i=0; i < numthreads ;i++ )
+	{
+		CreateToolThread( &g_RunThreadsData[i] );
 	}
 }
 
 
 void RunThreads_End()
 {
-	WaitForMultipleObjects( numthreads, g_ThreadHandles, TRUE, INFINITE );
-	for ( int i=0; i < numthreads; i++ )
-		CloseHandle( g_ThreadHandles[i] );
+	JoinToolThreads();
 
 	threaded = false;
 }
-	
+
 
 /*
 =============
@@ -235,9 +476,12 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 {
 	int		start, end;
 
+	if (numthreads == -1)
+		ThreadSetDefault ();
+
 	start = Plat_FloatTime();
-	dispatch = 0;
 	workcount = workcnt;
+	InitWorkQueues( workcnt );
 	StartPacifier("");
 	pacifier = showpacifier;
 
@@ -247,7 +491,7 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	return;
 #endif
 
-	
+
 	RunThreads_Start( fn, pUserData );
 	RunThreads_End();
 
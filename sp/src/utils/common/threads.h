@@ -16,16 +16,10 @@
 #pragma once
 
 
-#ifdef MAPBASE
-// This was suggested in that Source 2013 pull request that fixed Vrad.
-// I trust their judgement on this.
-#define MAX_TOOL_THREADS	32
-#else
-// Arrays that are indexed by thread should always be MAX_TOOL_THREADS+1
-// large so THREADINDEX_MAIN can be used from the main thread.
-#define MAX_TOOL_THREADS	16
-#endif
-#define THREADINDEX_MAIN	(MAX_TOOL_THREADS)
+// There is no limit on the number of tool threads. Arrays that are indexed by
+// thread should be numthreads+1 large, so THREADINDEX_MAIN can be used from the
+// main thread, and allocated once numthreads has been set (see ThreadSetDefault).
+#define THREADINDEX_MAIN	(numthreads)
 
 
 extern	int		numthreads;
@@ -49,6 +43,9 @@ enum ERunThreadsPriority
 void SetLowPriority();
 
 void ThreadSetDefault (void);
+
+// Returns the next work item for the calling thread, or -1 when there are none left.
+// Items are taken in chunks from per-thread queues, and idle threads steal from busy ones.
 int	GetThreadWork (void);
 
 void RunThreadsOnIndividual ( int workcnt, qboolean showpacifier, ThreadWorkerFn fn );
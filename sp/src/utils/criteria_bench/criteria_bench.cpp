@@ -0,0 +1,193 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Times building and querying ResponseRules::CriteriaSet the way a
+//			speech query does, to weigh changes to its storage.
+//
+// $NoKeywords: $
+//
+//===========================================================================//
+#include <stdlib.h>
+#include <stdio.h>
+#include "tier0/platform.h"
+#include "tier1/strtools.h"
+#include "tier1/utlvector.h"
+#include "responserules/response_types.h"
+
+using namespace ResponseRules;
+
+// Roughly what CAI_Expresser::GatherCriteria collects for an HL2 npc
+static const char *s_pszCriteriaNames[] =
+{
+	"concept", "randomnum", "map", "classname", "name", "health", "healthfrac", "spawnflags",
+	"flags", "episodic", "is_console", "is_pc", "weapon", "speed", "speaking", "npcstate",
+	"activity", "enemy", "enemyclass", "distancetoenemy", "timesincecombat", "lastseenenemy",
+	"seeplayer", "seenbyplayer", "readiness", "readinessvalue", "distancetoplayer", "playerhealth",
+	"playerhealthfrac", "playerweapon", "playeractivity", "playerspeed", "playerally", "in_vehicle",
+	"vehicle_inside", "vehicle_speed", "insquad", "squadmates", "num_enemies", "in_cover",
+	"citizentype", "medic", "ammoquartermaster", "gordon", "gender", "hurt_by_fire", "onfire",
+	"water_level", "world_chapter", "world_skill", "world_coop", "world_metastate", "speechtarget",
+	"speechtargetname", "timesinceseenplayer", "isleader", "elite", "numwarnings", "moansound",
+	"From", "From_class", "From_idx",
+};
+
+// Criteria queries ask for that usually aren't there
+static const char *s_pszMissingNames[] =
+{
+	"Who", "Subject", "Concept_previous", "playervehicle", "numgrenades", "punted_grenade",
+	"victim_was_enemy", "sniperspeak",
+};
+
+void Usage( void )
+{
+	printf( "Usage: criteria_bench [-iterations n]\n" );
+	printf( "  Times building criteria sets of %d criteria and looking criteria up in them.\n", (int)ARRAYSIZE( s_pszCriteriaNames ) );
+	printf( "  -iterations n : sets to build and query for each test (default 100000).\n" );
+	exit( -1 );
+}
+
+static void BuildSet( CriteriaSet &set, const CUtlVector<const char *> &values, bool bBulk )
+{
+	set.AppendCriteria( s_pszCriteriaNames[0], values[0] );
+	if ( bBulk )
+	{
+		set.BeginBulkAppend();
+	}
+	for ( int i = 1; i < values.Count(); i++ )
+	{
+		set.AppendCriteria( s_pszCriteriaNames[i], values[i] );
+	}
+	if ( bBulk )
+	{
+		set.EndBulkAppend();
+	}
+}
+
+static void Report( const char *pszTest, double flTime, int nIterations, int nOpsPerIteration )
+{
+	printf( "%-28s %8.3f seconds, %8.1f ns per set, %6.1f ns per op\n", pszTest, flTime,
+		flTime * 1e9 / nIterations, flTime * 1e9 / ( (double)nIterations * nOpsPerIteration ) );
+}
+
+int main( int argc, char **argv )
+{
+	int nIterations = 100000;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !Q_stricmp( argv[i], "-iterations" ) && ( i + 1 < argc ) )
+		{
+			nIterations = atoi( argv[++i] );
+			nIterations = MAX( nIterations, 1 );
+		}
+		else
+		{
+			Usage();
+		}
+	}
+
+	const int nCriteria = ARRAYSIZE( s_pszCriteriaNames );
+	const int nMissing = ARRAYSIZE( s_pszMissingNames );
+
+	// values like ModifyOrAppendCriteria's, built once so the tests only time the set
+	CUtlVector<char> valueBuf;
+	valueBuf.SetCount( nCriteria * 16 );
+	CUtlVector<const char *> values;
+	for ( int i = 0; i < nCriteria; i++ )
+	{
+		char *pszValue = valueBuf.Base() + i * 16;
+		if ( i & 1 )
+		{
+			V_snprintf( pszValue, 16, "%d", i * 37 );
+		}
+		else
+		{
+			V_snprintf( pszValue, 16, "npc_test%d", i );
+		}
+		values.AddToTail( pszValue );
+	}
+
+	CUtlVector<CriteriaSet::CritSymbol_t> symbols;
+	for ( int i = 0; i < nCriteria; i++ )
+	{
+		symbols.AddToTail( CriteriaSet::ComputeCriteriaSymbol( s_pszCriteriaNames[i] ) );
+	}
+
+	int nSink = 0;
+
+	double flStart = Plat_FloatTime();
+	for ( int iIteration = 0; iIteration < nIterations; iIteration++ )
+	{
+		CriteriaSet set;
+		BuildSet( set, values, false );
+		nSink += set.GetCount();
+	}
+	Report( "build", Plat_FloatTime() - flStart, nIterations, nCriteria );
+
+	flStart = Plat_FloatTime();
+	for ( int iIteration = 0; iIteration < nIterations; iIteration++ )
+	{
+		CriteriaSet set;
+		BuildSet( set, values, true );
+		nSink += set.GetCount();
+	}
+	Report( "build (bulk append)", Plat_FloatTime() - flStart, nIterations, nCriteria );
+
+	CriteriaSet set;
+	BuildSet( set, values, true );
+	if ( set.GetCount() != nCriteria )
+	{
+		fprintf( stderr, "Expected %d criteria, got %d\n", nCriteria, set.GetCount() );
+		return 1;
+	}
+
+	flStart = Plat_FloatTime();
+	for ( int iIteration = 0; iIteration < nIterations; iIteration++ )
+	{
+		CriteriaSet copy( set );
+		nSink += copy.GetCount();
+	}
+	Report( "copy", Plat_FloatTime() - flStart, nIterations, nCriteria );
+
+	flStart = Plat_FloatTime();
+	for ( int iIteration = 0; iIteration < nIterations; iIteration++ )
+	{
+		CriteriaSet merged;
+		merged.AppendCriteria( s_pszCriteriaNames[0], values[0] );
+		merged.Merge( &set );
+		nSink += merged.GetCount();
+	}
+	Report( "merge", Plat_FloatTime() - flStart, nIterations, nCriteria );
+
+	flStart = Plat_FloatTime();
+	for ( int iIteration = 0; iIteration < nIterations; iIteration++ )
+	{
+		for ( int i = 0; i < nCriteria; i++ )
+		{
+			nSink += set.GetValue( set.FindCriterionIndex( s_pszCriteriaNames[i] ) )[0];
+		}
+	}
+	Report( "find by name", Plat_FloatTime() - flStart, nIterations, nCriteria );
+
+	flStart = Plat_FloatTime();
+	for ( int iIteration = 0; iIteration < nIterations; iIteration++ )
+	{
+		for ( int i = 0; i < nCriteria; i++ )
+		{
+			nSink += set.GetValue( set.FindCriterionIndex( symbols[i] ) )[0];
+		}
+	}
+	Report( "find by symbol", Plat_FloatTime() - flStart, nIterations, nCriteria );
+
+	flStart = Plat_FloatTime();
+	for ( int iIteration = 0; iIteration < nIterations; iIteration++ )
+	{
+		for ( int i = 0; i < nMissing; i++ )
+		{
+			nSink += set.FindCriterionIndex( s_pszMissingNames[i] );
+		}
+	}
+	Report( "find missing by name", Plat_FloatTime() - flStart, nIterations, nMissing );
+
+	// keeps the loops from being optimized away
+	return ( nSink == 1 ) ? 2 : 0;
+}
@@ -0,0 +1,184 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Times CLZMA decompression on the LZMA streams found in files, e.g.
+//			the compressed lumps of a 360 bsp, to weigh level load time against
+//			file size.
+//
+// $NoKeywords: $
+//
+//===========================================================================//
+#include <stdlib.h>
+#include <stdio.h>
+#include "tier0/platform.h"
+#include "tier1/lzmaDecoder.h"
+#include "tier1/strtools.h"
+#include "tier1/utlvector.h"
+
+// the most a single stream may claim to decompress to before it's taken for random data
+#define MAX_PLAUSIBLE_SIZE	( 512 * 1024 * 1024 )
+
+// LZMA properties byte: lc + lp * 9 + pb * 45, with pb at most 4
+#define MAX_LZMA_PROPERTIES	( 9 * 5 * 5 )
+
+struct LZMAStream_t
+{
+	unsigned char	*m_pData;		// the lzma_header_t
+	unsigned int	m_nCompressedSize;
+	unsigned int	m_nActualSize;
+};
+
+void Usage( void )
+{
+	printf( "Usage: lzma_bench [-iterations n] file [file...]\n" );
+	printf( "  Finds the LZMA streams (CLZMA's lzma_header_t) in each file, e.g. the\n" );
+	printf( "  compressed lumps of a 360 bsp, and times decompressing them.\n" );
+	printf( "  -iterations n : times to decompress each stream (default 10).\n" );
+	exit( -1 );
+}
+
+static bool LoadFile( const char *pFileName, CUtlVector<unsigned char> &data )
+{
+	FILE *fp = fopen( pFileName, "rb" );
+	if ( !fp )
+		return false;
+
+	fseek( fp, 0, SEEK_END );
+	long nSize = ftell( fp );
+	fseek( fp, 0, SEEK_SET );
+
+	data.SetCount( nSize );
+	bool bOK = nSize > 0 && fread( data.Base(), nSize, 1, fp ) == 1;
+	fclose( fp );
+	return bOK;
+}
+
+//-----------------------------------------------------------------------------
+// Streams start 4 byte aligned wherever bsplib and the 360 converters write them,
+// so that's all this looks at. Headers whose sizes don't fit are skipped.
+//-----------------------------------------------------------------------------
+static void FindStreams( CUtlVector<unsigned char> &data, CUtlVector<LZMAStream_t> &streams )
+{
+	CLZMA lzma;
+	for ( int nOfs = 0; nOfs + (int)sizeof( lzma_header_t ) <= data.Count(); nOfs += 4 )
+	{
+		unsigned char *pData = data.Base() + nOfs;
+		if ( !lzma.IsCompressed( pData ) )
+			continue;
+
+		lzma_header_t *pHeader = (lzma_header_t *)pData;
+		unsigned int nActualSize = LittleLong( pHeader->actualSize );
+		unsigned int nLZMASize = LittleLong( pHeader->lzmaSize );
+		unsigned int nRemaining = data.Count() - nOfs - sizeof( lzma_header_t );
+		if ( !nActualSize || nActualSize > MAX_PLAUSIBLE_SIZE || nLZMASize > nRemaining ||
+			pHeader->properties[0] >= MAX_LZMA_PROPERTIES )
+			continue;
+
+		LZMAStream_t &stream = streams[streams.AddToTail()];
+		stream.m_pData = pData;
+		stream.m_nCompressedSize = nLZMASize + sizeof( lzma_header_t );
+		stream.m_nActualSize = nActualSize;
+
+		// streams don't overlap
+		nOfs += ( stream.m_nCompressedSize - 4 ) & ~3;
+	}
+}
+
+int main( int argc, char **argv )
+{
+	int nIterations = 10;
+	CUtlVector<const char *> fileNames;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !Q_stricmp( argv[i], "-iterations" ) && ( i + 1 < argc ) )
+		{
+			nIterations = atoi( argv[++i] );
+			nIterations = MAX( nIterations, 1 );
+		}
+		else if ( argv[i][0] == '-' )
+		{
+			Usage();
+		}
+		else
+		{
+			fileNames.AddToTail( argv[i] );
+		}
+	}
+	if ( !fileNames.Count() )
+	{
+		Usage();
+	}
+
+	CLZMA lzma;
+	double flTotalTime = 0;
+	double flTotalCompressed = 0, flTotalActual = 0;
+
+	for ( int iFile = 0; iFile < fileNames.Count(); iFile++ )
+	{
+		CUtlVector<unsigned char> data;
+		if ( !LoadFile( fileNames[iFile], data ) )
+		{
+			fprintf( stderr, "Unable to read %s\n", fileNames[iFile] );
+			continue;
+		}
+
+		CUtlVector<LZMAStream_t> streams;
+		FindStreams( data, streams );
+
+		// decode each once up front, which drops anything that only looked like a stream
+		unsigned int nMaxActualSize = 0;
+		for ( int i = 0; i < streams.Count(); i++ )
+		{
+			nMaxActualSize = MAX( nMaxActualSize, streams[i].m_nActualSize );
+		}
+
+		CUtlVector<unsigned char> output;
+		output.SetCount( nMaxActualSize );
+		double flCompressed = 0, flActual = 0;
+		for ( int i = streams.Count() - 1; i >= 0; i-- )
+		{
+			if ( lzma.Uncompress( streams[i].m_pData, output.Base() ) != streams[i].m_nActualSize )
+			{
+				streams.Remove( i );
+				continue;
+			}
+			flCompressed += streams[i].m_nCompressedSize;
+			flActual += streams[i].m_nActualSize;
+		}
+
+		if ( !streams.Count() )
+		{
+			printf( "%s: no LZMA streams\n", fileNames[iFile] );
+			continue;
+		}
+
+		double flStart = Plat_FloatTime();
+		for ( int iIteration = 0; iIteration < nIterations; iIteration++ )
+		{
+			for ( int i = 0; i < streams.Count(); i++ )
+			{
+				lzma.Uncompress( streams[i].m_pData, output.Base() );
+			}
+		}
+		double flTime = Plat_FloatTime() - flStart;
+
+		printf( "%s: %d streams, %.2f MB -> %.2f MB (%.1f%%), %.3f seconds per pass, %.1f MB/s decompressed\n",
+			fileNames[iFile], streams.Count(), flCompressed / ( 1024.0 * 1024.0 ), flActual / ( 1024.0 * 1024.0 ),
+			100.0 * flCompressed / flActual, flTime / nIterations,
+			( flTime > 0 ) ? flActual * nIterations / flTime / ( 1024.0 * 1024.0 ) : 0.0 );
+
+		flTotalTime += flTime;
+		flTotalCompressed += flCompressed;
+		flTotalActual += flActual;
+	}
+
+	if ( fileNames.Count() > 1 && flTotalActual > 0 )
+	{
+		printf( "total: %.2f MB -> %.2f MB (%.1f%%), %.3f seconds per pass, %.1f MB/s decompressed\n",
+			flTotalCompressed / ( 1024.0 * 1024.0 ), flTotalActual / ( 1024.0 * 1024.0 ),
+			100.0 * flTotalCompressed / flTotalActual, flTotalTime / nIterations,
+			( flTotalTime > 0 ) ? flTotalActual * nIterations / flTotalTime / ( 1024.0 * 1024.0 ) : 0.0 );
+	}
+
+	return 0;
+}
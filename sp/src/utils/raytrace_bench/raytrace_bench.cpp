@@ -0,0 +1,239 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Times kd-tree builds and ray tracing on a triangle dump written
+//			by vrad -dumptrace (trace.txt).
+//
+// $NoKeywords: $
+//
+//===========================================================================//
+#include <stdlib.h>
+#include <stdio.h>
+#include "raytrace.h"
+#include "tier0/platform.h"
+#include "tier1/utlvector.h"
+#include "mathlib/mathlib.h"
+
+void Usage( void )
+{
+	printf( "Usage: raytrace_bench [-serial] [-rays n] [-coherent] trace.txt\n" );
+	printf( "  -serial   : also time the single threaded RefineNode build, for comparison.\n" );
+	printf( "  -rays n   : number of random rays to trace (default 1000000).\n" );
+	printf( "  -coherent : trace bundles like vrad's sun samples, nearby points towards\n" );
+	printf( "              slightly jittered directions, instead of random rays.\n" );
+	exit( -1 );
+}
+
+//-----------------------------------------------------------------------------
+// Reads the windings WriteRTEnv writes: a point count, then one
+// "x y z r g b" line per point. Only triangles are kept.
+//-----------------------------------------------------------------------------
+static bool LoadTriangleDump( const char *pFileName, CUtlVector<Vector> &verts )
+{
+	FILE *fp = fopen( pFileName, "r" );
+	if ( !fp )
+		return false;
+
+	int nPoints;
+	while ( fscanf( fp, "%d", &nPoints ) == 1 )
+	{
+		for ( int i = 0; i < nPoints; i++ )
+		{
+			Vector v, color;
+			if ( fscanf( fp, "%f %f %f %f %f %f", &v.x, &v.y, &v.z, &color.x, &color.y, &color.z ) != 6 )
+			{
+				fclose( fp );
+				return false;
+			}
+			if ( nPoints == 3 )
+			{
+				verts.AddToTail( v );
+			}
+		}
+	}
+
+	fclose( fp );
+	return true;
+}
+
+static void AddTriangles( RayTracingEnvironment &env, const CUtlVector<Vector> &verts )
+{
+	Vector color( 1, 1, 1 );
+	env.MakeRoomForTriangles( verts.Count() / 3 );
+	for ( int i = 0; i + 2 < verts.Count(); i += 3 )
+	{
+		env.AddTriangle( i / 3, verts[i], verts[i + 1], verts[i + 2], color );
+	}
+}
+
+static double TimeBuild( RayTracingEnvironment &env )
+{
+	double flStart = Plat_FloatTime();
+	env.SetupAccelerationStructure();
+	return Plat_FloatTime() - flStart;
+}
+
+// Small LCG so every run traces the same rays
+static float BenchRandom( unsigned int &nSeed )
+{
+	nSeed = nSeed * 1664525 + 1013904223;
+	return ( nSeed >> 8 ) * ( 1.0f / 16777216.0f );
+}
+
+int main( int argc, char **argv )
+{
+	bool bSerial = false;
+	bool bCoherent = false;
+	int nRays = 1000000;
+	const char *pFileName = NULL;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !Q_stricmp( argv[i], "-serial" ) )
+		{
+			bSerial = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-coherent" ) )
+		{
+			bCoherent = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-rays" ) && ( i + 1 < argc ) )
+		{
+			nRays = atoi( argv[++i] );
+			nRays = MAX( nRays, 4 );
+		}
+		else if ( argv[i][0] == '-' || pFileName )
+		{
+			Usage();
+		}
+		else
+		{
+			pFileName = argv[i];
+		}
+	}
+	if ( !pFileName )
+	{
+		Usage();
+	}
+
+	MathLib_Init( 2.2f, 2.2f, 0.0f, 2.0f );
+
+	CUtlVector<Vector> verts;
+	if ( !LoadTriangleDump( pFileName, verts ) || !verts.Count() )
+	{
+		fprintf( stderr, "Unable to read triangles from %s\n", pFileName );
+		return -1;
+	}
+	printf( "%d triangles\n", verts.Count() / 3 );
+
+	RayTracingEnvironment env;
+	env.Flags |= RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS;
+	AddTriangles( env, verts );
+	double flBuild = TimeBuild( env );
+	printf( "binned build: %.3f seconds, %d nodes, %d leaf triangle refs\n",
+		flBuild, env.OptimizedKDTree.Count(), env.TriangleIndexList.Count() );
+
+	if ( bSerial )
+	{
+		RayTracingEnvironment serialEnv;
+		serialEnv.Flags |= RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS | RTE_FLAGS_SERIAL_TREE_GENERATION;
+		AddTriangles( serialEnv, verts );
+		double flSerialBuild = TimeBuild( serialEnv );
+		printf( "serial build: %.3f seconds, %d nodes, %d leaf triangle refs\n",
+			flSerialBuild, serialEnv.OptimizedKDTree.Count(), serialEnv.TriangleIndexList.Count() );
+	}
+
+	// rays from random points in the world bounds, in random directions, long enough to
+	// cross the whole world. coherent rays come in packets of 16: 4 points close together,
+	// each traced towards 4 directions jittered around a fixed "sun" direction
+	Vector vecSize = env.m_MaxBound - env.m_MinBound;
+	fltx4 TMax = ReplicateX4( vecSize.Length() );
+	unsigned int nSeed = 1;
+
+	int nGroups = nRays / 4;
+	nRays = nGroups * 4;
+	CUtlVector< FourRays, CUtlMemoryAligned< FourRays, 16 > > rays;
+	CUtlVector< RayTracingResult, CUtlMemoryAligned< RayTracingResult, 16 > > results, packetResults;
+	rays.SetCount( nGroups );
+	results.SetCount( nGroups );
+	packetResults.SetCount( nGroups );
+	Vector vecSun( 0.3f, 0.2f, 1.0f );
+	VectorNormalize( vecSun );
+	Vector vecBase;
+	for ( int i = 0; i < nGroups; i++ )
+	{
+		Vector dir;
+		if ( bCoherent )
+		{
+			if ( !( i & 3 ) )
+			{
+				vecBase.Init( env.m_MinBound.x + BenchRandom( nSeed ) * vecSize.x,
+					env.m_MinBound.y + BenchRandom( nSeed ) * vecSize.y,
+					env.m_MinBound.z + BenchRandom( nSeed ) * vecSize.z );
+			}
+			dir.Init( BenchRandom( nSeed ) - 0.5f, BenchRandom( nSeed ) - 0.5f, BenchRandom( nSeed ) - 0.5f );
+			dir = vecSun + dir * 0.1f;
+			VectorNormalize( dir );
+		}
+
+		for ( int r = 0; r < 4; r++ )
+		{
+			Vector org( BenchRandom( nSeed ), BenchRandom( nSeed ), BenchRandom( nSeed ) );
+			if ( bCoherent )
+			{
+				org = vecBase + Vector( r & 1, r >> 1, 0 ) * 16.0f;
+			}
+			else
+			{
+				dir.Init( BenchRandom( nSeed ) - 0.5f, BenchRandom( nSeed ) - 0.5f, BenchRandom( nSeed ) - 0.5f );
+				VectorNormalize( dir );
+				org = env.m_MinBound + org * vecSize;
+			}
+			rays[i].origin.X( r ) = org.x;
+			rays[i].origin.Y( r ) = org.y;
+			rays[i].origin.Z( r ) = org.z;
+			rays[i].direction.X( r ) = dir.x;
+			rays[i].direction.Y( r ) = dir.y;
+			rays[i].direction.Z( r ) = dir.z;
+		}
+	}
+
+	double flStart = Plat_FloatTime();
+	for ( int i = 0; i < nGroups; i++ )
+	{
+		env.Trace4Rays( rays[i], Four_Zeros, TMax, &results[i] );
+	}
+	double flTrace = Plat_FloatTime() - flStart;
+
+	// the same rays as wide packets, 16 at a time
+	fltx4 TMins[4] = { Four_Zeros, Four_Zeros, Four_Zeros, Four_Zeros };
+	fltx4 TMaxs[4] = { TMax, TMax, TMax, TMax };
+	flStart = Plat_FloatTime();
+	for ( int i = 0; i < nGroups; i += 4 )
+	{
+		env.TraceRayPacket( &rays[i], MIN( nGroups - i, 4 ), TMins, TMaxs, &packetResults[i] );
+	}
+	double flPacketTrace = Plat_FloatTime() - flStart;
+
+	// both should find the same closest hit inside the ray length. which of two triangles at
+	// the same distance gets reported can differ
+	int nHits = 0, nMismatches = 0;
+	for ( int i = 0; i < nGroups; i++ )
+	{
+		for ( int r = 0; r < 4; r++ )
+		{
+			bool bHit = ( results[i].HitIds[r] != -1 ) && ( SubFloat( results[i].HitDistance, r ) < SubFloat( TMax, r ) );
+			bool bPacketHit = ( packetResults[i].HitIds[r] != -1 ) && ( SubFloat( packetResults[i].HitDistance, r ) < SubFloat( TMax, r ) );
+			if ( bHit )
+				++nHits;
+			if ( bHit != bPacketHit || ( bHit && SubFloat( results[i].HitDistance, r ) != SubFloat( packetResults[i].HitDistance, r ) ) )
+				++nMismatches;
+		}
+	}
+
+	printf( "Trace4Rays: %d rays in %.3f seconds: %.2f Mrays/s, %.1f%% hit\n",
+		nRays, flTrace, ( flTrace > 0 ) ? nRays / flTrace / 1.0e6 : 0.0, 100.0 * nHits / MAX( nRays, 1 ) );
+	printf( "TraceRayPacket (%d wide): %d rays in %.3f seconds: %.2f Mrays/s, %d rays differ\n",
+		RayTracingEnvironment::PacketWidth(), nRays, flPacketTrace, ( flPacketTrace > 0 ) ? nRays / flPacketTrace / 1.0e6 : 0.0, nMismatches );
+
+	return 0;
+}
@@ -0,0 +1,724 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Keeps each face's direct lighting between compiles, so a rebuild
+//			only relights the faces whose lights or occluders changed.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "lightmap.h"
+#include "lightcache.h"
+#include "utlmap.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define LIGHTCACHE_ID				MAKEID( 'V', 'R', 'L', 'C' )
+#define LIGHTCACHE_VERSION			1
+
+// changed triangles are merged into cells this big before faces are tested against them
+#define LIGHTCACHE_CELL_SIZE		512.0f
+
+// past this many changed cells, everything is relit
+#define LIGHTCACHE_MAX_CHANGED_CELLS	4096
+
+CLightCache g_LightCache;
+bool g_bLightCache = false;
+
+//-----------------------------------------------------------------------------
+
+static int __cdecl CRCCompare( const CRC32_t *pLeft, const CRC32_t *pRight )
+{
+	return ( *pLeft < *pRight ) ? -1 : ( *pLeft > *pRight );
+}
+
+int __cdecl CLightCache::OccluderCompare( const Occluder_t *pLeft, const Occluder_t *pRight )
+{
+	return CRCCompare( &pLeft->m_Hash, &pRight->m_Hash );
+}
+
+int __cdecl CLightCache::CachedFaceCompare( const CachedFace_t *pLeft, const CachedFace_t *pRight )
+{
+	return CRCCompare( &pLeft->m_Hash, &pRight->m_Hash );
+}
+
+int __cdecl CLightCache::LightRefCompare( const LightRef_t *pLeft, const LightRef_t *pRight )
+{
+	return CRCCompare( &pLeft->m_Hash, &pRight->m_Hash );
+}
+
+static bool ReadCacheData( const CUtlVector<byte> &data, int &nPos, void *pDest, int nBytes )
+{
+	if ( nBytes < 0 || nPos + nBytes > data.Count() )
+		return false;
+
+	memcpy( pDest, data.Base() + nPos, nBytes );
+	nPos += nBytes;
+	return true;
+}
+
+static bool SkipCacheData( const CUtlVector<byte> &data, int &nPos, int64 nBytes )
+{
+	if ( nBytes < 0 || nPos + nBytes > data.Count() )
+		return false;
+
+	nPos += (int)nBytes;
+	return true;
+}
+
+static inline bool BoxesOverlap( const Vector &mins1, const Vector &maxs1, const Vector &mins2, const Vector &maxs2 )
+{
+	return ( mins1.x <= maxs2.x ) && ( maxs1.x >= mins2.x ) &&
+		   ( mins1.y <= maxs2.y ) && ( maxs1.y >= mins2.y ) &&
+		   ( mins1.z <= maxs2.z ) && ( maxs1.z >= mins2.z );
+}
+
+static CRC32_t HashLight( const directlight_t *dl )
+{
+	// the cluster, texinfo and owner are indices that shift when the map is edited
+	dworldlight_t light = dl->light;
+	light.cluster = 0;
+	light.texinfo = 0;
+	light.owner = 0;
+
+	bool bAttached = ( dl->facenum != -1 );
+
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	CRC32_ProcessBuffer( &crc, &light, sizeof( light ) );
+	CRC32_ProcessBuffer( &crc, &bAttached, sizeof( bAttached ) );
+	CRC32_ProcessBuffer( &crc, &dl->snormal, sizeof( dl->snormal ) );
+	CRC32_ProcessBuffer( &crc, &dl->tnormal, sizeof( dl->tnormal ) );
+	CRC32_ProcessBuffer( &crc, &dl->sscale, sizeof( dl->sscale ) );
+	CRC32_ProcessBuffer( &crc, &dl->tscale, sizeof( dl->tscale ) );
+	CRC32_ProcessBuffer( &crc, &dl->soffset, sizeof( dl->soffset ) );
+	CRC32_ProcessBuffer( &crc, &dl->toffset, sizeof( dl->toffset ) );
+	CRC32_ProcessBuffer( &crc, &dl->m_flStartFadeDistance, sizeof( dl->m_flStartFadeDistance ) );
+	CRC32_ProcessBuffer( &crc, &dl->m_flEndFadeDistance, sizeof( dl->m_flEndFadeDistance ) );
+	CRC32_ProcessBuffer( &crc, &dl->m_flCapDist, sizeof( dl->m_flCapDist ) );
+	CRC32_Final( &crc );
+	return crc;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Hash of the command line settings that change direct lighting.
+//			A cache written with different settings isn't used.
+//-----------------------------------------------------------------------------
+
+CRC32_t CLightCache::SettingsHash()
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	CRC32_ProcessBuffer( &crc, &g_bHDR, sizeof( g_bHDR ) );
+	CRC32_ProcessBuffer( &crc, &do_extra, sizeof( do_extra ) );
+	CRC32_ProcessBuffer( &crc, &extrapasses, sizeof( extrapasses ) );
+	CRC32_ProcessBuffer( &crc, &do_fast, sizeof( do_fast ) );
+	CRC32_ProcessBuffer( &crc, &do_centersamples, sizeof( do_centersamples ) );
+	CRC32_ProcessBuffer( &crc, &g_SunAngularExtent, sizeof( g_SunAngularExtent ) );
+	CRC32_ProcessBuffer( &crc, &g_flSkySampleScale, sizeof( g_flSkySampleScale ) );
+	CRC32_ProcessBuffer( &crc, &g_bLargeDispSampleRadius, sizeof( g_bLargeDispSampleRadius ) );
+	CRC32_ProcessBuffer( &crc, &g_flMaxDispSampleSize, sizeof( g_flMaxDispSampleSize ) );
+	CRC32_ProcessBuffer( &crc, &g_bTextureShadows, sizeof( g_bTextureShadows ) );
+	CRC32_ProcessBuffer( &crc, &g_bNoSkyRecurse, sizeof( g_bNoSkyRecurse ) );
+	CRC32_ProcessBuffer( &crc, &g_bDisablePropSelfShadowing, sizeof( g_bDisablePropSelfShadowing ) );
+	CRC32_Final( &crc );
+	return crc;
+}
+
+//-----------------------------------------------------------------------------
+
+CLightCache::CLightCache()
+{
+	m_szFileName[0] = 0;
+	m_bLoaded = false;
+	m_bAllChanged = false;
+	m_ChangedMins.Init();
+	m_ChangedMaxs.Init();
+	m_nReused = 0;
+	m_nLit = 0;
+}
+
+void CLightCache::Init( const char *pFileName )
+{
+	Q_strncpy( m_szFileName, pFileName, sizeof( m_szFileName ) );
+
+	m_bLoaded = LoadCacheFile();
+	if ( !m_bLoaded )
+	{
+		m_OldOccluders.Purge();
+		m_CachedFaces.Purge();
+		m_FileData.Purge();
+		Msg( "No usable light cache in %s, lighting every face.\n", m_szFileName );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads the whole file and indexes its faces. The lighting stays in
+//			m_FileData until RestoreFace copies it out.
+//-----------------------------------------------------------------------------
+
+bool CLightCache::LoadCacheFile()
+{
+	FILE *fp = fopen( m_szFileName, "rb" );
+	if ( !fp )
+		return false;
+
+	fseek( fp, 0, SEEK_END );
+	long nSize = ftell( fp );
+	fseek( fp, 0, SEEK_SET );
+	if ( nSize <= 0 || nSize >= INT_MAX )
+	{
+		fclose( fp );
+		return false;
+	}
+
+	m_FileData.SetCount( (int)nSize );
+	bool bRead = ( fread( m_FileData.Base(), nSize, 1, fp ) == 1 );
+	fclose( fp );
+	if ( !bRead )
+		return false;
+
+	int nPos = 0;
+	int nId, nVersion;
+	CRC32_t settings;
+	if ( !ReadCacheData( m_FileData, nPos, &nId, sizeof( nId ) ) ||
+		 !ReadCacheData( m_FileData, nPos, &nVersion, sizeof( nVersion ) ) ||
+		 !ReadCacheData( m_FileData, nPos, &settings, sizeof( settings ) ) )
+		return false;
+
+	if ( nId != LIGHTCACHE_ID || nVersion != LIGHTCACHE_VERSION )
+		return false;
+
+	if ( settings != SettingsHash() )
+	{
+		Msg( "Lighting settings changed since %s was written.\n", m_szFileName );
+		return false;
+	}
+
+	int nOccluders;
+	if ( !ReadCacheData( m_FileData, nPos, &nOccluders, sizeof( nOccluders ) ) || nOccluders < 0 )
+		return false;
+
+	if ( (int64)nOccluders * sizeof( Occluder_t ) > m_FileData.Count() - nPos )
+		return false;
+
+	m_OldOccluders.SetCount( nOccluders );
+	if ( !ReadCacheData( m_FileData, nPos, m_OldOccluders.Base(), nOccluders * sizeof( Occluder_t ) ) )
+		return false;
+	m_OldOccluders.Sort( OccluderCompare );
+
+	int nFaces;
+	if ( !ReadCacheData( m_FileData, nPos, &nFaces, sizeof( nFaces ) ) || nFaces < 0 )
+		return false;
+
+	m_CachedFaces.EnsureCapacity( nFaces );
+	for ( int i = 0; i < nFaces; i++ )
+	{
+		CachedFace_t face;
+		if ( !ReadCacheData( m_FileData, nPos, &face.m_Hash, sizeof( face.m_Hash ) ) ||
+			 !ReadCacheData( m_FileData, nPos, &face.m_Mins, sizeof( face.m_Mins ) ) ||
+			 !ReadCacheData( m_FileData, nPos, &face.m_Maxs, sizeof( face.m_Maxs ) ) ||
+			 !ReadCacheData( m_FileData, nPos, &face.m_Normal, sizeof( face.m_Normal ) ) ||
+			 !ReadCacheData( m_FileData, nPos, face.m_Styles, sizeof( face.m_Styles ) ) ||
+			 !ReadCacheData( m_FileData, nPos, &face.m_nNormalCount, sizeof( face.m_nNormalCount ) ) ||
+			 !ReadCacheData( m_FileData, nPos, &face.m_nSamples, sizeof( face.m_nSamples ) ) ||
+			 !ReadCacheData( m_FileData, nPos, &face.m_nLights, sizeof( face.m_nLights ) ) )
+			return false;
+
+		if ( face.m_nNormalCount < 1 || face.m_nNormalCount > NUM_BUMP_VECTS + 1 || face.m_nSamples < 0 )
+			return false;
+
+		int nStyles = 0;
+		while ( nStyles < MAXLIGHTMAPS && face.m_Styles[nStyles] != 255 )
+		{
+			++nStyles;
+		}
+
+		face.m_nLightsOfs = nPos;
+		if ( !SkipCacheData( m_FileData, nPos, (int64)face.m_nLights * sizeof( CRC32_t ) ) )
+			return false;
+
+		face.m_nLightingOfs = nPos;
+		if ( !SkipCacheData( m_FileData, nPos, (int64)nStyles * face.m_nNormalCount * face.m_nSamples * sizeof( LightingValue_t ) ) )
+			return false;
+
+		face.m_bStale = false;
+		m_CachedFaces.AddToTail( face );
+	}
+
+	m_CachedFaces.Sort( CachedFaceCompare );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Hashes every triangle that can block light. The low bits of static
+//			prop ids are the prop's index, which shifts as props are added, so
+//			only the id's type is hashed.
+//-----------------------------------------------------------------------------
+
+void CLightCache::HashOccluders()
+{
+	int nTriangles = g_RtEnv.OptimizedTriangleList.Count();
+	m_Occluders.SetCount( nTriangles );
+	for ( int i = 0; i < nTriangles; i++ )
+	{
+		CacheOptimizedTriangle &tri = g_RtEnv.OptimizedTriangleList[i];
+		Occluder_t &occluder = m_Occluders[i];
+
+		int32 nType = tri.m_Data.m_GeometryData.m_nTriangleID & 0xff000000;
+		uint8 nFlags = tri.m_Data.m_GeometryData.m_nFlags;
+
+		CRC32_t crc;
+		CRC32_Init( &crc );
+		CRC32_ProcessBuffer( &crc, tri.m_Data.m_GeometryData.m_VertexCoordData, sizeof( tri.m_Data.m_GeometryData.m_VertexCoordData ) );
+		CRC32_ProcessBuffer( &crc, &nType, sizeof( nType ) );
+		CRC32_ProcessBuffer( &crc, &nFlags, sizeof( nFlags ) );
+		if ( i < g_RtEnv.TriangleColors.Count() )
+		{
+			CRC32_ProcessBuffer( &crc, &g_RtEnv.TriangleColors[i], sizeof( Vector ) );
+		}
+		CRC32_Final( &crc );
+
+		occluder.m_Hash = crc;
+		ClearBounds( occluder.m_Mins, occluder.m_Maxs );
+		for ( int v = 0; v < 3; v++ )
+		{
+			AddPointToBounds( tri.Vertex( v ), occluder.m_Mins, occluder.m_Maxs );
+		}
+	}
+
+	m_Occluders.Sort( OccluderCompare );
+
+	if ( m_bLoaded )
+	{
+		FindChangedOccluders();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Finds the triangles that are only in the old or only in the new
+//			list and merges their bounds into cells.
+//-----------------------------------------------------------------------------
+
+void CLightCache::FindChangedOccluders()
+{
+	CUtlVector<const Occluder_t *> changed;
+	int i = 0, j = 0;
+	while ( i < m_OldOccluders.Count() || j < m_Occluders.Count() )
+	{
+		if ( j == m_Occluders.Count() || ( i < m_OldOccluders.Count() && m_OldOccluders[i].m_Hash < m_Occluders[j].m_Hash ) )
+		{
+			changed.AddToTail( &m_OldOccluders[i++] );
+		}
+		else if ( i == m_OldOccluders.Count() || m_Occluders[j].m_Hash < m_OldOccluders[i].m_Hash )
+		{
+			changed.AddToTail( &m_Occluders[j++] );
+		}
+		else
+		{
+			++i;
+			++j;
+		}
+	}
+
+	CUtlMap<uint64, int> cells( DefLessFunc( uint64 ) );
+	ClearBounds( m_ChangedMins, m_ChangedMaxs );
+	for ( i = 0; i < changed.Count(); i++ )
+	{
+		const Occluder_t &box = *changed[i];
+		Vector vecCenter = ( box.m_Mins + box.m_Maxs ) * 0.5f;
+		uint64 nCell = 0;
+		for ( int k = 0; k < 3; k++ )
+		{
+			int nCoord = (int)floor( vecCenter[k] / LIGHTCACHE_CELL_SIZE ) + 0x8000;
+			nCell = ( nCell << 16 ) | ( nCoord & 0xffff );
+		}
+
+		unsigned short iCell = cells.Find( nCell );
+		if ( iCell == cells.InvalidIndex() )
+		{
+			int iBox = m_ChangedBoxes.AddToTail( box );
+			cells.Insert( nCell, iBox );
+		}
+		else
+		{
+			Occluder_t &merged = m_ChangedBoxes[cells[iCell]];
+			VectorMin( merged.m_Mins, box.m_Mins, merged.m_Mins );
+			VectorMax( merged.m_Maxs, box.m_Maxs, merged.m_Maxs );
+		}
+
+		AddPointToBounds( box.m_Mins, m_ChangedMins, m_ChangedMaxs );
+		AddPointToBounds( box.m_Maxs, m_ChangedMins, m_ChangedMaxs );
+	}
+
+	m_bAllChanged = ( m_ChangedBoxes.Count() > LIGHTCACHE_MAX_CHANGED_CELLS );
+
+	Msg( "%d occluding triangles changed since the last compile%s\n", changed.Count(),
+		m_bAllChanged ? ", relighting everything" : "" );
+
+	m_OldOccluders.Purge();
+}
+
+bool CLightCache::TouchesChange( const Vector &mins, const Vector &maxs ) const
+{
+	if ( !BoxesOverlap( mins, maxs, m_ChangedMins, m_ChangedMaxs ) )
+		return false;
+
+	for ( int i = 0; i < m_ChangedBoxes.Count(); i++ )
+	{
+		if ( BoxesOverlap( mins, maxs, m_ChangedBoxes[i].m_Mins, m_ChangedBoxes[i].m_Maxs ) )
+			return true;
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Could a changed triangle be between the face and one of its lights?
+//			Tests the box around the face and each light, or around the face
+//			swept towards the sun for sky lights.
+//-----------------------------------------------------------------------------
+
+bool CLightCache::IsFaceStale( const CachedFace_t &face ) const
+{
+	if ( m_bAllChanged )
+		return true;
+
+	if ( !m_ChangedBoxes.Count() )
+		return false;
+
+	const byte *pLights = m_FileData.Base() + face.m_nLightsOfs;
+	for ( int i = 0; i < face.m_nLights; i++ )
+	{
+		CRC32_t hash;
+		memcpy( &hash, pLights + i * sizeof( CRC32_t ), sizeof( hash ) );
+
+		// binary search the sorted light list
+		int nLow = 0, nHigh = m_LightsByHash.Count() - 1;
+		int iRef = -1;
+		while ( nLow <= nHigh )
+		{
+			int nMid = ( nLow + nHigh ) / 2;
+			if ( m_LightsByHash[nMid].m_Hash < hash )
+				nLow = nMid + 1;
+			else if ( m_LightsByHash[nMid].m_Hash > hash )
+				nHigh = nMid - 1;
+			else
+			{
+				iRef = nMid;
+				break;
+			}
+		}
+
+		// the light's gone, RestoreFace won't match the face anyway
+		if ( iRef < 0 )
+			return true;
+
+		directlight_t *dl = m_Lights[m_LightsByHash[iRef].m_nLight];
+
+		Vector mins = face.m_Mins;
+		Vector maxs = face.m_Maxs;
+		if ( dl->light.type == emit_skyambient )
+		{
+			// sky ambient comes from every direction. Flat, unbumped faces only see
+			// changes in front of them, anything else could see any change. The rays
+			// also carry on into the 3d skybox, like the sun's
+			if ( face.m_Normal == vec3_origin || num_sky_cameras )
+				return true;
+
+			const Vector &n = face.m_Normal;
+			Vector vecNear( ( n.x > 0 ) ? face.m_Mins.x : face.m_Maxs.x,
+							( n.y > 0 ) ? face.m_Mins.y : face.m_Maxs.y,
+							( n.z > 0 ) ? face.m_Mins.z : face.m_Maxs.z );
+			float flNear = DotProduct( vecNear, n );
+			for ( int j = 0; j < m_ChangedBoxes.Count(); j++ )
+			{
+				const Occluder_t &box = m_ChangedBoxes[j];
+				Vector vecFar( ( n.x > 0 ) ? box.m_Maxs.x : box.m_Mins.x,
+							   ( n.y > 0 ) ? box.m_Maxs.y : box.m_Mins.y,
+							   ( n.z > 0 ) ? box.m_Maxs.z : box.m_Mins.z );
+				if ( DotProduct( vecFar, n ) >= flNear )
+					return true;
+			}
+			continue;
+		}
+		else if ( dl->light.type == emit_skylight )
+		{
+			// sun rays can carry on into the 3d skybox
+			if ( num_sky_cameras )
+				return true;
+
+			Vector vecSweep = dl->light.normal * -MAX_TRACE_LENGTH;
+			float flSpread = MAX_TRACE_LENGTH * g_SunAngularExtent;
+			AddPointToBounds( face.m_Mins + vecSweep, mins, maxs );
+			AddPointToBounds( face.m_Maxs + vecSweep, mins, maxs );
+			mins -= Vector( flSpread, flSpread, flSpread );
+			maxs += Vector( flSpread, flSpread, flSpread );
+		}
+		else
+		{
+			AddPointToBounds( dl->light.origin, mins, maxs );
+			if ( dl->facenum != -1 )
+			{
+				// light attached to a face shines from all over it
+				dface_t *pEmitter = &g_pFaces[dl->facenum];
+				for ( int e = 0; e < pEmitter->numedges; e++ )
+				{
+					int se = dsurfedges[pEmitter->firstedge + e];
+					int v = ( se < 0 ) ? dedges[-se].v[1] : dedges[se].v[0];
+					AddPointToBounds( dvertexes[v].point, mins, maxs );
+				}
+			}
+		}
+
+		if ( TouchesChange( mins, maxs ) )
+			return true;
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+
+void CLightCache::Prepare()
+{
+	m_Lights.SetCount( numdlights );
+	m_LightHashes.SetCount( numdlights );
+	memset( m_Lights.Base(), 0, m_Lights.Count() * sizeof( directlight_t * ) );
+	memset( m_LightHashes.Base(), 0, m_LightHashes.Count() * sizeof( CRC32_t ) );
+	m_LightsByHash.RemoveAll();
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		m_Lights[dl->index] = dl;
+		m_LightHashes[dl->index] = HashLight( dl );
+
+		int iRef = m_LightsByHash.AddToTail();
+		m_LightsByHash[iRef].m_Hash = m_LightHashes[dl->index];
+		m_LightsByHash[iRef].m_nLight = dl->index;
+	}
+	m_LightsByHash.Sort( LightRefCompare );
+
+	m_ThreadState.SetCount( numthreads + 1 );
+	for ( int i = 0; i < m_ThreadState.Count(); i++ )
+	{
+		m_ThreadState[i].m_Seen.SetCount( numdlights );
+		memset( m_ThreadState[i].m_Seen.Base(), 0, numdlights );
+		m_ThreadState[i].m_Lights.RemoveAll();
+	}
+
+	m_Faces.SetCount( numfaces );
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		m_Faces[i].m_bValid = false;
+		m_Faces[i].m_Lights.RemoveAll();
+	}
+
+	m_nReused = 0;
+	m_nLit = 0;
+
+	int nStale = 0;
+	for ( int i = 0; i < m_CachedFaces.Count(); i++ )
+	{
+		m_CachedFaces[i].m_bStale = IsFaceStale( m_CachedFaces[i] );
+		if ( m_CachedFaces[i].m_bStale )
+			++nStale;
+	}
+
+	if ( m_bLoaded )
+	{
+		Msg( "Light cache: %d cached faces, %d near changed occluders\n", m_CachedFaces.Count(), nStale );
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CLightCache::BeginFace( int iThread )
+{
+	ThreadState_t &state = m_ThreadState[iThread];
+	for ( int i = 0; i < state.m_Lights.Count(); i++ )
+	{
+		state.m_Seen[state.m_Lights[i]] = 0;
+	}
+	state.m_Lights.RemoveAll();
+}
+
+void CLightCache::MarkVisibleLights( int iThread, const int *pClusters, int nClusters )
+{
+	ThreadState_t &state = m_ThreadState[iThread];
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		if ( state.m_Seen[dl->index] )
+			continue;
+
+		for ( int i = 0; i < nClusters; i++ )
+		{
+			if ( PVSCheck( dl->pvs, pClusters[i] ) )
+			{
+				state.m_Seen[dl->index] = 1;
+				state.m_Lights.AddToTail( dl->index );
+				break;
+			}
+		}
+	}
+}
+
+void CLightCache::GetFaceLights( int iThread, CUtlVector<CRC32_t> &lights ) const
+{
+	const ThreadState_t &state = m_ThreadState[iThread];
+	lights.SetCount( state.m_Lights.Count() );
+	for ( int i = 0; i < state.m_Lights.Count(); i++ )
+	{
+		lights[i] = m_LightHashes[state.m_Lights[i]];
+	}
+
+	// sorted so they compare as sets
+	lights.Sort( CRCCompare );
+}
+
+const CLightCache::CachedFace_t *CLightCache::FindCachedFace( CRC32_t hash ) const
+{
+	int nLow = 0, nHigh = m_CachedFaces.Count() - 1;
+	while ( nLow <= nHigh )
+	{
+		int nMid = ( nLow + nHigh ) / 2;
+		if ( m_CachedFaces[nMid].m_Hash < hash )
+			nLow = nMid + 1;
+		else if ( m_CachedFaces[nMid].m_Hash > hash )
+			nHigh = nMid - 1;
+		else
+			return &m_CachedFaces[nMid];
+	}
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CLightCache::RestoreFace( int iThread, int facenum, CRC32_t hash, facelight_t *fl, dface_t *f, int normalCount )
+{
+	const CachedFace_t *pCached = FindCachedFace( hash );
+	if ( !pCached || pCached->m_bStale || pCached->m_nSamples != fl->numsamples || pCached->m_nNormalCount != normalCount )
+		return false;
+
+	FaceEntry_t &entry = m_Faces[facenum];
+	GetFaceLights( iThread, entry.m_Lights );
+	if ( entry.m_Lights.Count() != pCached->m_nLights ||
+		 memcmp( entry.m_Lights.Base(), m_FileData.Base() + pCached->m_nLightsOfs, pCached->m_nLights * sizeof( CRC32_t ) ) )
+		return false;
+
+	const byte *pLighting = m_FileData.Base() + pCached->m_nLightingOfs;
+	int nBytes = fl->numsamples * sizeof( LightingValue_t );
+	for ( int k = 0; k < MAXLIGHTMAPS && pCached->m_Styles[k] != 255; k++ )
+	{
+		if ( f->styles[k] == 255 )
+		{
+			AllocateLightstyleSamples( fl, k, normalCount );
+		}
+		f->styles[k] = pCached->m_Styles[k];
+
+		for ( int n = 0; n < normalCount; n++ )
+		{
+			memcpy( fl->light[k][n], pLighting, nBytes );
+			pLighting += nBytes;
+		}
+	}
+
+	entry.m_bValid = true;
+	entry.m_Hash = hash;
+	entry.m_Mins = pCached->m_Mins;
+	entry.m_Maxs = pCached->m_Maxs;
+	entry.m_Normal = pCached->m_Normal;
+	++m_nReused;
+	return true;
+}
+
+void CLightCache::StoreFace( int iThread, int facenum, CRC32_t hash, const Vector &mins, const Vector &maxs, const Vector &normal )
+{
+	FaceEntry_t &entry = m_Faces[facenum];
+	GetFaceLights( iThread, entry.m_Lights );
+	entry.m_bValid = true;
+	entry.m_Hash = hash;
+	entry.m_Mins = mins;
+	entry.m_Maxs = maxs;
+	entry.m_Normal = normal;
+	++m_nLit;
+}
+
+//-----------------------------------------------------------------------------
+
+void CLightCache::Save()
+{
+	Msg( "Light cache: reused %d faces, lit %d\n", (int)m_nReused, (int)m_nLit );
+
+	// the lighting has been copied out, the old file can go
+	m_FileData.Purge();
+	m_CachedFaces.Purge();
+
+	FILE *fp = fopen( m_szFileName, "wb" );
+	if ( !fp )
+	{
+		Warning( "Can't write light cache %s\n", m_szFileName );
+		return;
+	}
+
+	int nId = LIGHTCACHE_ID;
+	int nVersion = LIGHTCACHE_VERSION;
+	CRC32_t settings = SettingsHash();
+	int nOccluders = m_Occluders.Count();
+	fwrite( &nId, sizeof( nId ), 1, fp );
+	fwrite( &nVersion, sizeof( nVersion ), 1, fp );
+	fwrite( &settings, sizeof( settings ), 1, fp );
+	fwrite( &nOccluders, sizeof( nOccluders ), 1, fp );
+	fwrite( m_Occluders.Base(), sizeof( Occluder_t ), nOccluders, fp );
+
+	int nFaces = 0;
+	for ( int i = 0; i < m_Faces.Count(); i++ )
+	{
+		if ( m_Faces[i].m_bValid )
+			++nFaces;
+	}
+	fwrite( &nFaces, sizeof( nFaces ), 1, fp );
+
+	for ( int i = 0; i < m_Faces.Count(); i++ )
+	{
+		FaceEntry_t &entry = m_Faces[i];
+		if ( !entry.m_bValid )
+			continue;
+
+		facelight_t *fl = &facelight[i];
+		dface_t *f = &g_pFaces[i];
+
+		// the bump vectors a face was lit with
+		int nNormalCount = 0;
+		while ( nNormalCount < NUM_BUMP_VECTS + 1 && fl->light[0][nNormalCount] )
+		{
+			++nNormalCount;
+		}
+
+		int nLights = entry.m_Lights.Count();
+		fwrite( &entry.m_Hash, sizeof( entry.m_Hash ), 1, fp );
+		fwrite( &entry.m_Mins, sizeof( entry.m_Mins ), 1, fp );
+		fwrite( &entry.m_Maxs, sizeof( entry.m_Maxs ), 1, fp );
+		fwrite( &entry.m_Normal, sizeof( entry.m_Normal ), 1, fp );
+		fwrite( f->styles, sizeof( f->styles ), 1, fp );
+		fwrite( &nNormalCount, sizeof( nNormalCount ), 1, fp );
+		fwrite( &fl->numsamples, sizeof( fl->numsamples ), 1, fp );
+		fwrite( &nLights, sizeof( nLights ), 1, fp );
+		fwrite( entry.m_Lights.Base(), sizeof( CRC32_t ), nLights, fp );
+
+		for ( int k = 0; k < MAXLIGHTMAPS && f->styles[k] != 255; k++ )
+		{
+			for ( int n = 0; n < nNormalCount; n++ )
+			{
+				fwrite( fl->light[k][n], sizeof( LightingValue_t ), fl->numsamples, fp );
+			}
+		}
+
+		entry.m_Lights.Purge();
+	}
+
+	if ( ferror( fp ) )
+	{
+		Warning( "Failed writing light cache %s\n", m_szFileName );
+	}
+	fclose( fp );
+}
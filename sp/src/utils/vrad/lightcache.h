@@ -0,0 +1,161 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Keeps each face's direct lighting between compiles, so a rebuild
+//			only relights the faces whose lights or occluders changed.
+//
+//=============================================================================//
+
+#ifndef LIGHTCACHE_H
+#define LIGHTCACHE_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "utlvector.h"
+#include "checksum_crc.h"
+#include "mathlib/vector.h"
+
+struct directlight_t;
+struct facelight_t;
+struct dface_t;
+
+//-----------------------------------------------------------------------------
+// The cache file, <map>.lightcache (<map>.hdr.lightcache for hdr), holds:
+//
+//		header		version and a hash of the settings that change direct lighting
+//		occluders	hash and bounds of every ray tracing triangle
+//		faces		per lit face: the hash of its samples, its bounds, the hashes of
+//					the lights whose PVS it's in, and its direct lighting for
+//					each style and bump vector
+//
+// Faces are looked up by the hash of their samples rather than their index, so
+// edits that renumber faces don't throw the cache away. A cached face is reused
+// when its samples hash the same, the set of lights it's in the PVS of is the
+// same, and no triangle that was added, moved or removed lies between it and one
+// of those lights.
+//
+// Only direct lighting is kept; light bounces are still computed every run.
+//-----------------------------------------------------------------------------
+
+class CLightCache
+{
+public:
+	CLightCache();
+
+	// Loads the last compile's cache from pFileName, if it's there and still matches
+	// the compile settings
+	void			Init( const char *pFileName );
+
+	// Hashes the ray tracing triangles. Call before SetupAccelerationStructure
+	// changes them into intersection format.
+	void			HashOccluders();
+
+	// Hashes the direct lights and finds the cached faces that changed occluders
+	// make stale. Call once the direct lights are created.
+	void			Prepare();
+
+	// Per face, from BuildFacelights. BeginFace clears the thread's light list, then
+	// MarkVisibleLights adds the lights whose PVS holds one of the sample clusters.
+	void			BeginFace( int iThread );
+	void			MarkVisibleLights( int iThread, const int *pClusters, int nClusters );
+
+	// Sets the face's styles and direct lighting from the cache. Returns false if
+	// the face has to be lit.
+	bool			RestoreFace( int iThread, int facenum, CRC32_t hash, facelight_t *fl, dface_t *f, int normalCount );
+
+	// Remembers a face that was lit this run. normal is the face's plane normal if it's
+	// flat and not bumped, else zero; it narrows down which changes can block sky ambient.
+	void			StoreFace( int iThread, int facenum, CRC32_t hash, const Vector &mins, const Vector &maxs, const Vector &normal );
+
+	// Writes the new cache from the face lighting. Call after BuildFacelights,
+	// before anything adds bounced or ambient light to the samples.
+	void			Save();
+
+private:
+	struct Occluder_t
+	{
+		CRC32_t		m_Hash;
+		Vector		m_Mins;
+		Vector		m_Maxs;
+	};
+
+	// A face read from the cache file. The offsets are into m_FileData.
+	struct CachedFace_t
+	{
+		CRC32_t		m_Hash;
+		Vector		m_Mins;
+		Vector		m_Maxs;
+		Vector		m_Normal;			// zero unless the face is flat and not bumped
+		byte		m_Styles[MAXLIGHTMAPS];
+		int			m_nNormalCount;
+		int			m_nSamples;
+		int			m_nLights;
+		int			m_nLightsOfs;
+		int			m_nLightingOfs;
+		bool		m_bStale;
+	};
+
+	// A face as it will be written out
+	struct FaceEntry_t
+	{
+		bool		m_bValid;
+		CRC32_t		m_Hash;
+		Vector		m_Mins;
+		Vector		m_Maxs;
+		Vector		m_Normal;
+		CUtlVector<CRC32_t>	m_Lights;
+	};
+
+	struct ThreadState_t
+	{
+		CUtlVector<byte>	m_Seen;		// indexed by directlight_t::index
+		CUtlVector<int>		m_Lights;	// directlight_t::index of the marked lights
+	};
+
+	struct LightRef_t
+	{
+		CRC32_t		m_Hash;
+		int			m_nLight;			// into m_Lights
+	};
+
+	static int __cdecl	OccluderCompare( const Occluder_t *pLeft, const Occluder_t *pRight );
+	static int __cdecl	CachedFaceCompare( const CachedFace_t *pLeft, const CachedFace_t *pRight );
+	static int __cdecl	LightRefCompare( const LightRef_t *pLeft, const LightRef_t *pRight );
+
+	bool			LoadCacheFile();
+	void			GetFaceLights( int iThread, CUtlVector<CRC32_t> &lights ) const;
+	void			FindChangedOccluders();
+	bool			IsFaceStale( const CachedFace_t &face ) const;
+	bool			TouchesChange( const Vector &mins, const Vector &maxs ) const;
+	const CachedFace_t *FindCachedFace( CRC32_t hash ) const;
+	static CRC32_t	SettingsHash();
+
+	char			m_szFileName[MAX_PATH];
+	bool			m_bLoaded;
+
+	CUtlVector<byte>			m_FileData;
+	CUtlVector<Occluder_t>		m_OldOccluders;		// sorted by hash
+	CUtlVector<CachedFace_t>	m_CachedFaces;		// sorted by hash
+
+	CUtlVector<Occluder_t>		m_Occluders;		// sorted by hash
+
+	// bounds of the occluders that changed, merged into coarse cells
+	CUtlVector<Occluder_t>		m_ChangedBoxes;
+	Vector						m_ChangedMins;
+	Vector						m_ChangedMaxs;
+	bool						m_bAllChanged;
+
+	CUtlVector<directlight_t *>	m_Lights;			// indexed by directlight_t::index
+	CUtlVector<CRC32_t>			m_LightHashes;		// indexed by directlight_t::index
+	CUtlVector<LightRef_t>		m_LightsByHash;		// sorted by hash
+
+	CUtlVector<ThreadState_t>	m_ThreadState;		// [numthreads+1]
+	CUtlVector<FaceEntry_t>		m_Faces;			// indexed by face
+	CInterlockedInt				m_nReused;
+	CInterlockedInt				m_nLit;
+};
+
+extern CLightCache g_LightCache;
+extern bool g_bLightCache;
+
+#endif // LIGHTCACHE_H
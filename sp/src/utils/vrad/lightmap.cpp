@@ -22,6 +22,7 @@
 #include "mathlib/quantize.h"
 #include "bitmap/imageformat.h"
 #include "coordsize.h"
+#include "lightcache.h"
 
 enum
 {
@@ -1699,30 +1700,45 @@ void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, i
 	}
 
 	fltx4 totalFractionVisible = Four_Zeros;
-	fltx4 fractionVisible = Four_Zeros;
 
 	DirectionalSampler_t sampler;
 
-	for ( int d = 0; d < nsamples; d++ )
+	// the samples all head towards the sun from the same points, so test them a few
+	// directions at a time as one packet
+	FourVectors starts[MAX_SKY_TEST_GROUPS];
+	FourVectors stops[MAX_SKY_TEST_GROUPS];
+	fltx4 fractionsVisible[MAX_SKY_TEST_GROUPS];
+	for ( int i = 0; i < MAX_SKY_TEST_GROUPS; i++ )
 	{
-		// determine visibility of skylight
-		// serach back to see if we can hit a sky brush
-		Vector delta;
-		VectorScale( dl->light.normal, -MAX_TRACE_LENGTH, delta );
-		if ( d )
+		starts[i] = pos;
+	}
+
+	for ( int d = 0; d < nsamples; d += MAX_SKY_TEST_GROUPS )
+	{
+		int nGroups = MIN( nsamples - d, MAX_SKY_TEST_GROUPS );
+		for ( int i = 0; i < nGroups; i++ )
 		{
-			// jitter light source location
-			Vector ofs = sampler.NextValue();
-			ofs *= MAX_TRACE_LENGTH * g_SunAngularExtent;
-			delta += ofs;
+			// determine visibility of skylight
+			// serach back to see if we can hit a sky brush
+			Vector delta;
+			VectorScale( dl->light.normal, -MAX_TRACE_LENGTH, delta );
+			if ( d + i )
+			{
+				// jitter light source location
+				Vector ofs = sampler.NextValue();
+				ofs *= MAX_TRACE_LENGTH * g_SunAngularExtent;
+				delta += ofs;
+			}
+			stops[i].DuplicateVector ( delta );
+			stops[i] += pos;
 		}
-		FourVectors delta4;
-		delta4.DuplicateVector ( delta );
-		delta4 += pos;
 
-		TestLine_DoesHitSky ( pos, delta4, &fractionVisible, true, static_prop_index_to_ignore );
+		TestLines_DoesHitSky ( nGroups, starts, stops, fractionsVisible, true, static_prop_index_to_ignore );
 
-		totalFractionVisible = AddSIMD ( totalFractionVisible, fractionVisible );
+		for ( int i = 0; i < nGroups; i++ )
+		{
+			totalFractionVisible = AddSIMD ( totalFractionVisible, fractionsVisible[i] );
+		}
 	}
 
 	fltx4 seeAmount = MulSIMD ( totalFractionVisible, ReplicateX4 ( 1.0f / nsamples ) );
@@ -1769,6 +1785,12 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 	else
 		nsky_samples *= g_flSkySampleScale;
 
+	FourVectors starts[MAX_SKY_TEST_GROUPS];
+	FourVectors stops[MAX_SKY_TEST_GROUPS];
+	fltx4 fractionsVisible[MAX_SKY_TEST_GROUPS];
+	fltx4 pendingDots[MAX_SKY_TEST_GROUPS][NUM_BUMP_VECTS+1];
+	int nPending = 0;
+
 	for (int j = 0; j < nsky_samples; j++)
 	{
 		FourVectors anorm;
@@ -1801,22 +1823,48 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 		}
 
 		// search back to see if we can hit a sky brush
-		FourVectors delta = anorm;
+		FourVectors &delta = stops[nPending];
+		delta = anorm;
 		delta *= -MAX_TRACE_LENGTH;
 		delta += pos;
-		FourVectors surfacePos = pos;
+		FourVectors &surfacePos = starts[nPending];
+		surfacePos = pos;
 		FourVectors offset = anorm;
 		offset *= -flEpsilon;
 		surfacePos -= offset;
 
-		fltx4 fractionVisible = Four_Ones;
-		TestLine_DoesHitSky( surfacePos, delta, &fractionVisible, true, static_prop_index_to_ignore );
 		for ( int i = 0; i < normalCount; i++ )
 		{
-			fltx4 addedAmount = MulSIMD( fractionVisible, dots[i] );
-			ambient_intensity[i] = AddSIMD( ambient_intensity[i], addedAmount );
+			pendingDots[nPending][i] = dots[i];
 		}
 
+		// test a few directions at once so they can be traced as one packet
+		if ( ++nPending < MAX_SKY_TEST_GROUPS && j < nsky_samples - 1 )
+			continue;
+
+		TestLines_DoesHitSky( nPending, starts, stops, fractionsVisible, true, static_prop_index_to_ignore );
+		for ( int k = 0; k < nPending; k++ )
+		{
+			for ( int i = 0; i < normalCount; i++ )
+			{
+				fltx4 addedAmount = MulSIMD( fractionsVisible[k], pendingDots[k][i] );
+				ambient_intensity[i] = AddSIMD( ambient_intensity[i], addedAmount );
+			}
+		}
+		nPending = 0;
+	}
+
+	if ( nPending )
+	{
+		TestLines_DoesHitSky( nPending, starts, stops, fractionsVisible, true, static_prop_index_to_ignore );
+		for ( int k = 0; k < nPending; k++ )
+		{
+			for ( int i = 0; i < normalCount; i++ )
+			{
+				fltx4 addedAmount = MulSIMD( fractionsVisible[k], pendingDots[k][i] );
+				ambient_intensity[i] = AddSIMD( ambient_intensity[i], addedAmount );
+			}
+		}
 	}
 
 	out.m_flFalloff = Four_Ones;
@@ -2382,7 +2430,7 @@ void DumpSamples( int ndxFace, facelight_t *pFaceLight )
 //-----------------------------------------------------------------------------
 // Allocates light sample data
 //-----------------------------------------------------------------------------
-static inline void AllocateLightstyleSamples( facelight_t* fl, int styleIndex, int numnormals )
+void AllocateLightstyleSamples( facelight_t* fl, int styleIndex, int numnormals )
 {
 	for (int n = 0; n < numnormals; ++n)
 	{
@@ -3056,6 +3104,75 @@ static void InitSampleInfo( lightinfo_t const& l, int iThread, SSE_SampleInfo_t&
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Hashes what lighting the face's samples depends on, for the light
+//			cache: the points and normals GatherSampleLightAt4Points will use,
+//			and the sample layout supersampling works from. Fixes up the sample
+//			normals of smooth faces like the lighting loop does, and marks the
+//			lights the samples are in the PVS of.
+//-----------------------------------------------------------------------------
+static CRC32_t HashFaceSamples( lightinfo_t &l, SSE_SampleInfo_t &info )
+{
+	facelight_t *fl = info.m_pFaceLight;
+	int numGroups = ( fl->numsamples + 3 ) / 4;
+
+	g_LightCache.BeginFace( info.m_iThread );
+
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	CRC32_ProcessBuffer( &crc, &fl->numsamples, sizeof( fl->numsamples ) );
+	CRC32_ProcessBuffer( &crc, &info.m_NormalCount, sizeof( info.m_NormalCount ) );
+	CRC32_ProcessBuffer( &crc, &info.m_IsDispFace, sizeof( info.m_IsDispFace ) );
+	CRC32_ProcessBuffer( &crc, &info.m_pTexInfo->flags, sizeof( info.m_pTexInfo->flags ) );
+	CRC32_ProcessBuffer( &crc, &l.luxelToWorldSpace, sizeof( l.luxelToWorldSpace ) );
+
+	for ( int grp = 0; grp < numGroups; ++grp )
+	{
+		sample_t *sample = fl->sample + 4 * grp;
+		int numSamples = min ( 4, fl->numsamples - 4 * grp );
+
+		Vector v[4], n[4];
+		for ( int i = 0; i < 4; i++ )
+		{
+			v[i] = ( i < numSamples ) ? sample[i].pos : sample[numSamples - 1].pos;
+			n[i] = ( i < numSamples ) ? sample[i].normal : sample[numSamples - 1].normal;
+		}
+
+		FourVectors positions;
+		FourVectors normals;
+		positions.LoadAndSwizzle( v[0], v[1], v[2], v[3] );
+		normals.LoadAndSwizzle( n[0], n[1], n[2], n[3] );
+
+		ComputeIlluminationPointAndNormalsSSE( l, positions, normals, &info, numSamples );
+		if ( !l.isflat )
+		{
+			for ( int i = 0; i < numSamples; i++ )
+				sample[i].normal = info.m_PointNormals[0].Vec( i );
+		}
+
+		for ( int i = 0; i < numSamples; i++ )
+		{
+			Vector vecPoint = info.m_Points.Vec( i );
+			CRC32_ProcessBuffer( &crc, &vecPoint, sizeof( vecPoint ) );
+			for ( int b = 0; b < info.m_NormalCount; b++ )
+			{
+				Vector vecNormal = info.m_PointNormals[b].Vec( i );
+				CRC32_ProcessBuffer( &crc, &vecNormal, sizeof( vecNormal ) );
+			}
+
+			CRC32_ProcessBuffer( &crc, &sample[i].coord, sizeof( sample[i].coord ) );
+			CRC32_ProcessBuffer( &crc, &sample[i].mins, sizeof( sample[i].mins ) );
+			CRC32_ProcessBuffer( &crc, &sample[i].maxs, sizeof( sample[i].maxs ) );
+			CRC32_ProcessBuffer( &crc, &sample[i].area, sizeof( sample[i].area ) );
+		}
+
+		g_LightCache.MarkVisibleLights( info.m_iThread, info.m_Clusters, numSamples );
+	}
+
+	CRC32_Final( &crc );
+	return crc;
+}
+
 void BuildFacelights (int iThread, int facenum)
 {
 	int	i, j;
@@ -3113,6 +3230,18 @@ void BuildFacelights (int iThread, int facenum)
 	f->styles[0] = 0;
 	AllocateLightstyleSamples( fl, 0, sampleInfo.m_NormalCount );
 
+	// reuse the last compile's lighting if nothing the face depends on changed
+	CRC32_t faceHash = 0;
+	if ( g_bLightCache )
+	{
+		faceHash = HashFaceSamples( l, sampleInfo );
+		if ( g_LightCache.RestoreFace( iThread, facenum, faceHash, fl, f, sampleInfo.m_NormalCount ) )
+		{
+			numGroups = 0;
+		}
+	}
+	bool bLightFace = ( numGroups > 0 );
+
 	// sample the lights at each sample location
 	for ( int grp = 0; grp < numGroups; ++grp )
 	{
@@ -3161,7 +3290,7 @@ void BuildFacelights (int iThread, int facenum)
 	}
 
 	// get rid of the -extra functionality on displacement surfaces
-	if (do_extra && !sampleInfo.m_IsDispFace)
+	if (do_extra && !sampleInfo.m_IsDispFace && bLightFace)
 	{
 		// For each lightstyle, perform a supersampling pass
 		for ( i = 0; i < MAXLIGHTMAPS; ++i )
@@ -3174,6 +3303,23 @@ void BuildFacelights (int iThread, int facenum)
 		}
 	}
 
+	if ( g_bLightCache && bLightFace )
+	{
+		// pad the sample bounds out to the luxels and the offset off the surface
+		Vector mins, maxs;
+		ClearBounds( mins, maxs );
+		for ( i = 0; i < fl->numsamples; i++ )
+		{
+			AddPointToBounds( fl->sample[i].pos, mins, maxs );
+		}
+		float flPad = l.luxelToWorldSpace[0].Length() + l.luxelToWorldSpace[1].Length() + 1.0f;
+		mins -= Vector( flPad, flPad, flPad );
+		maxs += Vector( flPad, flPad, flPad );
+
+		Vector normal = ( l.isflat && sampleInfo.m_NormalCount == 1 && !sampleInfo.m_IsDispFace ) ? l.facenormal : vec3_origin;
+		g_LightCache.StoreFace( iThread, facenum, faceHash, mins, maxs, normal );
+	}
+
 	if (!g_bUseMPI) 
 	{
 		//
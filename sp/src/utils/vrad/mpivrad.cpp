@@ -29,6 +29,7 @@
 #include "mpi_stats.h"
 #include "vmpi_distribute_work.h"
 #include "vmpi_tools_shared.h"
+#include "transfers.h"
 
 
 
@@ -288,15 +289,15 @@ void MPI_ReceiveVisLeafsResults( uint64 iWorkUnit, MessageBuffer *pBuf, int iWor
 		int patchnum = 0;
 		pBuf->read(&patchnum, sizeof(patchnum));
 		
-		CPatch * patch = &g_Patches[patchnum];
-		int numtransfers;
+		int numtransfers, recordBytes;
 		pBuf->read( &numtransfers, sizeof(numtransfers) );
-		patch->numtransfers = numtransfers;
-		if (numtransfers) 
-		{
-			patch->transfers = new transfer_t[numtransfers];
-			pBuf->read(patch->transfers, numtransfers * sizeof(transfer_t));
-		}
+		pBuf->read( &recordBytes, sizeof(recordBytes) );
+
+		// the workers send their compressed transfer records as is
+		CUtlVector<byte> record;
+		record.SetCount( recordBytes );
+		pBuf->read( record.Base(), recordBytes );
+		g_TransferStore.AddRecord( THREADINDEX_MAIN, patchnum, numtransfers, record.Base(), recordBytes );
 		
 		total_transfer += numtransfers;
 		if (max_transfer < numtransfers) 
@@ -315,7 +316,7 @@ public:
 	transfer_t *m_pBuildVisLeafsTransfers;
 };
 
-CVMPIVisLeafsData g_VMPIVisLeafsData[MAX_TOOL_THREADS+1];
+CUtlVector<CVMPIVisLeafsData> g_VMPIVisLeafsData;
 
 
 
@@ -327,10 +328,14 @@ void MPI_AddPatchData( int iThread, int patchnum, CPatch *patch )
 	if ( pData->m_pVisLeafsMB )
 	{
 		// Add in results for this patch
+		int recordBytes;
+		const byte *pRecord = g_TransferStore.GetLastRecord( iThread, &recordBytes );
+
 		++pData->m_nPatchesInCluster;
 		pData->m_pVisLeafsMB->write(&patchnum, sizeof(patchnum));
 		pData->m_pVisLeafsMB->write(&patch->numtransfers, sizeof(patch->numtransfers));
-		pData->m_pVisLeafsMB->write( patch->transfers, patch->numtransfers * sizeof(transfer_t) );
+		pData->m_pVisLeafsMB->write(&recordBytes, sizeof(recordBytes));
+		pData->m_pVisLeafsMB->write( pRecord, recordBytes );
 	}
 }
 
@@ -378,7 +383,8 @@ void RunMPIBuildVisLeafs()
 		StartPacifier("");
 	}
 
-	memset( g_VMPIVisLeafsData, 0, sizeof( g_VMPIVisLeafsData ) );
+	g_VMPIVisLeafsData.SetCount( numthreads + 1 );
+	memset( g_VMPIVisLeafsData.Base(), 0, g_VMPIVisLeafsData.Count() * sizeof( CVMPIVisLeafsData ) );
 	if ( !g_bMPIMaster || VMPI_GetActiveWorkUnitDistributor() == k_eWorkUnitDistributor_SDK )
 	{
 		// Allocate space for the transfers for each thread.
@@ -81,7 +81,7 @@ float TraceLeafBrushes( int leafIndex, const Vector &start, const Vector &end, C
 	return 1.0f;
 }
 
-DispTested_t s_DispTested[MAX_TOOL_THREADS+1];
+CUtlVector<DispTested_t> s_DispTested;
 
 // this just uses the average coverage for the triangle
 class CCoverageCount : public ITransparentTriangleCallback
@@ -349,25 +349,11 @@ void DM_ClipBoxToBrush( CToolTrace *trace, const Vector& mins, const Vector& max
 	}
 }
 
-void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
-	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip, bool bDoDebug )
+//-----------------------------------------------------------------------------
+// 1 for each ray that hit something other than sky before reaching its end
+//-----------------------------------------------------------------------------
+static fltx4 SkyOcclusion( const RayTracingResult &rt_result, const fltx4 &len )
 {
-	FourRays myrays;
-	myrays.origin = start;
-	myrays.direction = stop;
-	myrays.direction -= myrays.origin;
-	fltx4 len = myrays.direction.length();
-	myrays.direction *= ReciprocalSIMD( len );
-	RayTracingResult rt_result;
-	CCoverageCountTexture coverageCallback;
-
-	g_RtEnv.Trace4Rays(myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_to_skip, g_bTextureShadows? &coverageCallback : 0);
-
-	if ( bDoDebug )
-	{
-		WriteTrace( "trace.txt", myrays, rt_result );
-	}
-
 	float aOcclusion[4];
 	for ( int i = 0; i < 4; i++ )
 	{
@@ -380,10 +366,16 @@ void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
 				aOcclusion[i] = 1.0f;
 		}
 	}
-	fltx4 occlusion = LoadUnalignedSIMD( aOcclusion );
-	if (g_bTextureShadows)
-		occlusion = MaxSIMD ( occlusion, coverageCallback.GetCoverage() );
+	return LoadUnalignedSIMD( aOcclusion );
+}
 
+//-----------------------------------------------------------------------------
+// Recurses into the 3D skyboxes for rays that weren't fully occluded, and turns
+// the occlusion into the fraction visible
+//-----------------------------------------------------------------------------
+static void FinishSkyTest( FourVectors const& start, FourVectors const& stop, fltx4 occlusion,
+	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip, bool bDoDebug )
+{
 	bool fullyOccluded = ( TestSignSIMD( CmpGeSIMD( occlusion, Four_Ones ) ) == 0xF );
 
 	// if we hit sky, and we're not in a sky camera's area, try clipping into the 3D sky boxes
@@ -428,6 +420,69 @@ void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
 	*pFractionVisible = SubSIMD( Four_Ones, occlusion );
 }
 
+void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
+	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip, bool bDoDebug )
+{
+	FourRays myrays;
+	myrays.origin = start;
+	myrays.direction = stop;
+	myrays.direction -= myrays.origin;
+	fltx4 len = myrays.direction.length();
+	myrays.direction *= ReciprocalSIMD( len );
+	RayTracingResult rt_result;
+	CCoverageCountTexture coverageCallback;
+
+	g_RtEnv.Trace4Rays(myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_to_skip, g_bTextureShadows? &coverageCallback : 0);
+
+	if ( bDoDebug )
+	{
+		WriteTrace( "trace.txt", myrays, rt_result );
+	}
+
+	fltx4 occlusion = SkyOcclusion( rt_result, len );
+	if (g_bTextureShadows)
+		occlusion = MaxSIMD ( occlusion, coverageCallback.GetCoverage() );
+
+	FinishSkyTest( start, stop, occlusion, pFractionVisible, canRecurse, static_prop_to_skip, bDoDebug );
+}
+
+void TestLines_DoesHitSky( int nGroups, FourVectors const *pStart, FourVectors const *pStop,
+	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip )
+{
+	Assert( nGroups <= MAX_SKY_TEST_GROUPS );
+
+	// texture shadows need the coverage callback, which only works 4 rays at a time
+	if ( g_bTextureShadows )
+	{
+		for ( int i = 0; i < nGroups; i++ )
+		{
+			TestLine_DoesHitSky( pStart[i], pStop[i], &pFractionVisible[i], canRecurse, static_prop_to_skip );
+		}
+		return;
+	}
+
+	FourRays myrays[MAX_SKY_TEST_GROUPS];
+	fltx4 tmin[MAX_SKY_TEST_GROUPS];
+	fltx4 len[MAX_SKY_TEST_GROUPS];
+	RayTracingResult rt_result[MAX_SKY_TEST_GROUPS];
+	for ( int i = 0; i < nGroups; i++ )
+	{
+		myrays[i].origin = pStart[i];
+		myrays[i].direction = pStop[i];
+		myrays[i].direction -= myrays[i].origin;
+		len[i] = myrays[i].direction.length();
+		myrays[i].direction *= ReciprocalSIMD( len[i] );
+		tmin[i] = Four_Zeros;
+	}
+
+	g_RtEnv.TraceRayPacket( myrays, nGroups, tmin, len, rt_result, TRACE_ID_STATICPROP | static_prop_to_skip );
+
+	for ( int i = 0; i < nGroups; i++ )
+	{
+		FinishSkyTest( pStart[i], pStop[i], SkyOcclusion( rt_result[i], len[i] ), &pFractionVisible[i], canRecurse, static_prop_to_skip, false );
+	}
+}
+
 
 
 //-----------------------------------------------------------------------------
@@ -0,0 +1,365 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compressed storage for the patch to patch transfer lists that
+//			GatherLight streams through once per bounce.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "transfers.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define TRANSFER_BLOCK_SIZE		( 1024 * 1024 )
+
+// records start 4 byte aligned so the scale and weights can be read directly
+#define TRANSFER_RECORD_ALIGN	4
+
+CTransferStore g_TransferStore;
+
+//-----------------------------------------------------------------------------
+
+static int TransferPatchCompare( const void *a, const void *b )
+{
+	return ( (const transfer_t *)a )->patch - ( (const transfer_t *)b )->patch;
+}
+
+static int DeltaBytes( unsigned int nDelta )
+{
+	int nBytes = 1;
+	while ( nDelta >= 0x80 )
+	{
+		nDelta >>= 7;
+		++nBytes;
+	}
+	return nBytes;
+}
+
+//-----------------------------------------------------------------------------
+
+CTransferStore::CTransferStore()
+{
+	m_nTotalBytes = 0;
+	m_szSpillFile[0] = 0;
+	m_pSpillFile = NULL;
+	m_nSpillSize = 0;
+	m_pMapped = NULL;
+#ifdef _WIN32
+	m_hFile = INVALID_HANDLE_VALUE;
+	m_hMapping = NULL;
+#endif
+}
+
+CTransferStore::~CTransferStore()
+{
+	Shutdown();
+}
+
+//-----------------------------------------------------------------------------
+
+void CTransferStore::Init( const char *pSpillFile )
+{
+	Shutdown();
+
+	m_OpenBlocks.SetCount( numthreads + 1 );
+	for ( int i = 0; i < m_OpenBlocks.Count(); i++ )
+	{
+		m_OpenBlocks[i].m_pBase = NULL;
+		m_OpenBlocks[i].m_nSize = 0;
+		m_OpenBlocks[i].m_nUsed = 0;
+		m_OpenBlocks[i].m_nLastRecord = -1;
+	}
+
+	if ( pSpillFile )
+	{
+		Q_strncpy( m_szSpillFile, pSpillFile, sizeof( m_szSpillFile ) );
+		m_pSpillFile = fopen( m_szSpillFile, "wb" );
+		if ( !m_pSpillFile )
+			Error( "Can't open transfer spill file %s\n", m_szSpillFile );
+	}
+}
+
+void CTransferStore::Shutdown()
+{
+	UnmapSpillFile();
+
+	if ( m_pSpillFile )
+	{
+		fclose( m_pSpillFile );
+		m_pSpillFile = NULL;
+	}
+	if ( m_szSpillFile[0] )
+	{
+		remove( m_szSpillFile );
+		m_szSpillFile[0] = 0;
+	}
+	m_nSpillSize = 0;
+
+	for ( int i = 0; i < m_Blocks.Count(); i++ )
+	{
+		if ( m_Blocks[i].m_nFileOfs < 0 )
+			free( m_Blocks[i].m_pBase );
+	}
+	for ( int i = 0; i < m_OpenBlocks.Count(); i++ )
+	{
+		free( m_OpenBlocks[i].m_pBase );
+	}
+
+	m_Blocks.Purge();
+	m_OpenBlocks.Purge();
+	m_PatchOrder.Purge();
+	m_nTotalBytes = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Finds room for a record in the thread's open block, closing it if
+//			it's full. Large records get a block to themselves.
+//-----------------------------------------------------------------------------
+
+byte *CTransferStore::AllocRecord( int iThread, int ndxPatch, int nBytes )
+{
+	OpenBlock_t &open = m_OpenBlocks[iThread];
+
+	nBytes = ALIGN_VALUE( nBytes, TRANSFER_RECORD_ALIGN );
+	if ( open.m_pBase && open.m_nUsed + nBytes > open.m_nSize )
+	{
+		CommitBlock( open );
+	}
+
+	if ( !open.m_pBase || nBytes > open.m_nSize )
+	{
+		free( open.m_pBase );
+		open.m_nSize = MAX( nBytes, TRANSFER_BLOCK_SIZE );
+		open.m_pBase = (byte *)malloc( open.m_nSize );
+		if ( !open.m_pBase )
+			Error( "Memory allocation failure" );
+		open.m_nUsed = 0;
+	}
+
+	byte *pRecord = open.m_pBase + open.m_nUsed;
+	open.m_Patches.AddToTail( ndxPatch );
+	open.m_Patches.AddToTail( open.m_nUsed );
+	open.m_nLastRecord = open.m_nUsed;
+	open.m_nUsed += nBytes;
+
+	return pRecord;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Gives the block its index and points its patches at it
+//-----------------------------------------------------------------------------
+
+void CTransferStore::CommitBlock( OpenBlock_t &open )
+{
+	if ( !open.m_pBase || !open.m_nUsed )
+		return;
+
+	ThreadLock();
+
+	int iBlock = m_Blocks.AddToTail();
+	Block_t &block = m_Blocks[iBlock];
+
+	if ( m_pSpillFile )
+	{
+		if ( fwrite( open.m_pBase, open.m_nUsed, 1, m_pSpillFile ) != 1 )
+			Error( "Failed writing transfer spill file %s\n", m_szSpillFile );
+
+		block.m_pBase = NULL;
+		block.m_nFileOfs = m_nSpillSize;
+		m_nSpillSize += open.m_nUsed;
+	}
+	else
+	{
+		// give back the unused end of the block
+		block.m_pBase = (byte *)realloc( open.m_pBase, open.m_nUsed );
+		block.m_nFileOfs = -1;
+		open.m_pBase = NULL;
+	}
+
+	for ( int i = 0; i < open.m_Patches.Count(); i += 2 )
+	{
+		int ndxPatch = open.m_Patches[i];
+		g_Patches[ndxPatch].transferofs = ( (int64)iBlock << 32 ) | open.m_Patches[i + 1];
+		m_PatchOrder.AddToTail( ndxPatch );
+	}
+
+	m_nTotalBytes += open.m_nUsed;
+
+	ThreadUnlock();
+
+	// spilled blocks are reused for the thread's next records
+	if ( !m_pSpillFile )
+	{
+		open.m_nSize = 0;
+	}
+	open.m_nUsed = 0;
+	open.m_nLastRecord = -1;
+	open.m_Patches.RemoveAll();
+}
+
+//-----------------------------------------------------------------------------
+
+void CTransferStore::AddTransfers( int iThread, int ndxPatch, transfer_t *pTransfers, int nTransfers )
+{
+	g_Patches[ndxPatch].numtransfers = nTransfers;
+	if ( !nTransfers )
+	{
+		m_OpenBlocks[iThread].m_nLastRecord = -1;
+		return;
+	}
+
+	qsort( pTransfers, nTransfers, sizeof( transfer_t ), TransferPatchCompare );
+
+	float flMax = 0.0f;
+	int nDeltaBytes = 0;
+	int nPrev = 0;
+	for ( int i = 0; i < nTransfers; i++ )
+	{
+		flMax = MAX( flMax, pTransfers[i].transfer );
+		nDeltaBytes += DeltaBytes( pTransfers[i].patch - nPrev );
+		nPrev = pTransfers[i].patch;
+	}
+
+	int nBytes = sizeof( float ) + nTransfers * sizeof( uint16 ) + nDeltaBytes;
+	byte *pRecord = AllocRecord( iThread, ndxPatch, nBytes );
+
+	float flScale = flMax / 65535.0f;
+	float flInvScale = ( flMax > 0.0f ) ? 65535.0f / flMax : 0.0f;
+	*(float *)pRecord = flScale;
+
+	uint16 *pWeights = (uint16 *)( pRecord + sizeof( float ) );
+	byte *pDeltas = (byte *)( pWeights + nTransfers );
+	nPrev = 0;
+	for ( int i = 0; i < nTransfers; i++ )
+	{
+		pWeights[i] = (uint16)MIN( pTransfers[i].transfer * flInvScale + 0.5f, 65535.0f );
+
+		unsigned int nDelta = pTransfers[i].patch - nPrev;
+		nPrev = pTransfers[i].patch;
+		while ( nDelta >= 0x80 )
+		{
+			*pDeltas++ = (byte)( nDelta | 0x80 );
+			nDelta >>= 7;
+		}
+		*pDeltas++ = (byte)nDelta;
+	}
+
+	Assert( pDeltas == pRecord + nBytes );
+}
+
+void CTransferStore::AddRecord( int iThread, int ndxPatch, int nTransfers, const byte *pRecord, int nBytes )
+{
+	g_Patches[ndxPatch].numtransfers = nTransfers;
+	if ( !nTransfers )
+	{
+		m_OpenBlocks[iThread].m_nLastRecord = -1;
+		return;
+	}
+
+	memcpy( AllocRecord( iThread, ndxPatch, nBytes ), pRecord, nBytes );
+}
+
+const byte *CTransferStore::GetLastRecord( int iThread, int *pBytes ) const
+{
+	const OpenBlock_t &open = m_OpenBlocks[iThread];
+	if ( open.m_nLastRecord < 0 )
+	{
+		*pBytes = 0;
+		return NULL;
+	}
+
+	*pBytes = open.m_nUsed - open.m_nLastRecord;
+	return open.m_pBase + open.m_nLastRecord;
+}
+
+//-----------------------------------------------------------------------------
+
+void CTransferStore::Finish()
+{
+	for ( int i = 0; i < m_OpenBlocks.Count(); i++ )
+	{
+		CommitBlock( m_OpenBlocks[i] );
+		free( m_OpenBlocks[i].m_pBase );
+		m_OpenBlocks[i].m_pBase = NULL;
+	}
+
+	if ( !m_pSpillFile )
+		return;
+
+	fclose( m_pSpillFile );
+	m_pSpillFile = NULL;
+
+	if ( !m_nSpillSize )
+		return;
+
+#ifdef _WIN32
+	m_hFile = CreateFile( m_szSpillFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if ( m_hFile != INVALID_HANDLE_VALUE )
+	{
+		m_hMapping = CreateFileMapping( m_hFile, NULL, PAGE_READONLY, 0, 0, NULL );
+		if ( m_hMapping )
+		{
+			m_pMapped = (byte *)MapViewOfFile( m_hMapping, FILE_MAP_READ, 0, 0, 0 );
+		}
+	}
+#else
+	int fd = open( m_szSpillFile, O_RDONLY );
+	if ( fd >= 0 )
+	{
+		void *pMapped = mmap( NULL, m_nSpillSize, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if ( pMapped != MAP_FAILED )
+		{
+			m_pMapped = (byte *)pMapped;
+		}
+		close( fd );
+	}
+#endif
+
+	if ( !m_pMapped )
+		Error( "Can't map transfer spill file %s (%.1f megs)\n", m_szSpillFile, m_nSpillSize / ( 1024.0 * 1024.0 ) );
+
+	for ( int i = 0; i < m_Blocks.Count(); i++ )
+	{
+		m_Blocks[i].m_pBase = m_pMapped + m_Blocks[i].m_nFileOfs;
+	}
+}
+
+void CTransferStore::UnmapSpillFile()
+{
+#ifdef _WIN32
+	if ( m_pMapped )
+	{
+		UnmapViewOfFile( m_pMapped );
+	}
+	if ( m_hMapping )
+	{
+		CloseHandle( m_hMapping );
+		m_hMapping = NULL;
+	}
+	if ( m_hFile != INVALID_HANDLE_VALUE )
+	{
+		CloseHandle( m_hFile );
+		m_hFile = INVALID_HANDLE_VALUE;
+	}
+#else
+	if ( m_pMapped )
+	{
+		munmap( m_pMapped, m_nSpillSize );
+	}
+#endif
+	m_pMapped = NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+const byte *CTransferStore::GetRecord( int64 ofs ) const
+{
+	return m_Blocks[(int)( ofs >> 32 )].m_pBase + (uint32)ofs;
+}
@@ -0,0 +1,149 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compressed storage for the patch to patch transfer lists that
+//			GatherLight streams through once per bounce.
+//
+//=============================================================================//
+
+#ifndef TRANSFERS_H
+#define TRANSFERS_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "utlvector.h"
+
+struct transfer_t;
+
+//-----------------------------------------------------------------------------
+// Each patch's transfers are one record, sorted by patch index:
+//
+//		float	scale			transfer = weight * scale
+//		uint16	weight[n]		quantized against the largest transfer
+//		byte	delta[]			patch index deltas, 7 bits per byte, high bit
+//								set if more bytes follow
+//
+// Records are appended to large blocks, one open block per thread. Vis leafs
+// are built a cluster at a time, so each block holds whole clusters and the
+// records of a cluster sit next to each other. PatchOrder() walks patches in
+// the same order the records are laid out.
+//
+// With a spill file, finished blocks are written out and the file is mapped
+// back in by Finish(), so the lists don't need to fit in memory.
+//-----------------------------------------------------------------------------
+
+class CTransferStore
+{
+public:
+	CTransferStore();
+	~CTransferStore();
+
+	// Call once numthreads is set. pSpillFile may be NULL to keep everything in memory.
+	void			Init( const char *pSpillFile );
+	void			Shutdown();
+
+	// Compresses a patch's transfers and sets its numtransfers and transferofs.
+	// pTransfers is scratch and gets sorted.
+	void			AddTransfers( int iThread, int ndxPatch, transfer_t *pTransfers, int nTransfers );
+
+	// Adds an already compressed record, as sent back by a vmpi worker
+	void			AddRecord( int iThread, int ndxPatch, int nTransfers, const byte *pRecord, int nBytes );
+
+	// The last record added by the thread, before Finish()
+	const byte		*GetLastRecord( int iThread, int *pBytes ) const;
+
+	// Closes the open blocks and maps the spill file. Records can be read after this.
+	void			Finish();
+
+	const byte		*GetRecord( int64 ofs ) const;
+	const CUtlVector<int> &PatchOrder() const	{ return m_PatchOrder; }
+
+	int64			TotalBytes() const			{ return m_nTotalBytes; }
+
+private:
+	struct Block_t
+	{
+		byte		*m_pBase;
+		int64		m_nFileOfs;		// -1 if the block is held in memory
+	};
+
+	struct OpenBlock_t
+	{
+		byte		*m_pBase;
+		int			m_nSize;
+		int			m_nUsed;
+		int			m_nLastRecord;
+		CUtlVector<int>	m_Patches;	// patch, offset pairs
+	};
+
+	byte			*AllocRecord( int iThread, int ndxPatch, int nBytes );
+	void			CommitBlock( OpenBlock_t &open );
+	void			UnmapSpillFile();
+
+	CUtlVector<Block_t>		m_Blocks;
+	CUtlVector<OpenBlock_t>	m_OpenBlocks;	// [numthreads+1]
+	CUtlVector<int>			m_PatchOrder;
+	int64					m_nTotalBytes;
+
+	char					m_szSpillFile[MAX_PATH];
+	FILE					*m_pSpillFile;
+	int64					m_nSpillSize;
+	byte					*m_pMapped;
+#ifdef _WIN32
+	HANDLE					m_hFile;
+	HANDLE					m_hMapping;
+#endif
+};
+
+//-----------------------------------------------------------------------------
+// Walks one record
+//-----------------------------------------------------------------------------
+
+class CTransferReader
+{
+public:
+	// Patches with no transfers have no record; pRecord may be NULL when nTransfers is 0,
+	// and Next() must not be called.
+	CTransferReader( const byte *pRecord, int nTransfers )
+	{
+		m_nPatch = 0;
+		if ( !pRecord || !nTransfers )
+		{
+			m_flScale = 0;
+			m_pWeights = NULL;
+			m_pDeltas = NULL;
+			return;
+		}
+
+		m_flScale = *(const float *)pRecord;
+		m_pWeights = (const uint16 *)( pRecord + sizeof( float ) );
+		m_pDeltas = (const byte *)( m_pWeights + nTransfers );
+	}
+
+	FORCEINLINE void Next( int &ndxPatch, float &flTransfer )
+	{
+		int nDelta = 0;
+		int nShift = 0;
+		byte b;
+		do
+		{
+			b = *m_pDeltas++;
+			nDelta |= ( b & 0x7f ) << nShift;
+			nShift += 7;
+		} while ( b & 0x80 );
+
+		m_nPatch += nDelta;
+		ndxPatch = m_nPatch;
+		flTransfer = *m_pWeights++ * m_flScale;
+	}
+
+private:
+	float			m_flScale;
+	const uint16	*m_pWeights;
+	const byte		*m_pDeltas;
+	int				m_nPatch;
+};
+
+extern CTransferStore g_TransferStore;
+
+#endif // TRANSFERS_H
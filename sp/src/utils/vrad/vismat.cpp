@@ -422,7 +422,7 @@ void BuildVisLeafs_Cluster(
 			transferMaker.Finish();
 			
 			// do the transfers
-			MakeScales( patchnum, transfers );
+			MakeScales( threadnum, patchnum, transfers );
 
 			// Let MPI aggregate the data if it's being used.
 			if ( PatchCB )
@@ -19,6 +19,8 @@
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
+#include "transfers.h"
+#include "lightcache.h"
 
 #define ALLOWDEBUGOPTIONS (0 || _DEBUG)
 
@@ -60,6 +62,7 @@ bool		g_bDumpRtEnv = false;
 bool		bRed2Black = true;
 bool		g_bFastAmbient = false;
 bool        g_bNoSkyRecurse = false;
+bool		g_bSpillTransfers = false;
 
 int			junk;
 
@@ -1198,11 +1201,11 @@ void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers )
 }
 
 
-void MakeScales ( int ndxPatch, transfer_t *all_transfers )
+void MakeScales ( int iThread, int ndxPatch, transfer_t *all_transfers )
 {
 	int		j;
 	float	total;
-	transfer_t	*t, *t2;
+	transfer_t	*t2;
 	total = 0;
 
 	if( ndxPatch == g_Patches.InvalidIndex() )
@@ -1218,10 +1221,6 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 		}
 
 
-		patch->transfers = ( transfer_t* )calloc (1, patch->numtransfers * sizeof(transfer_t));
-		if (!patch->transfers)
-			Error ("Memory allocation failure");
-
 		// get total transfer energy
 		t2 = all_transfers;
 
@@ -1237,17 +1236,14 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 		else	
 			total = 1.0f/M_PI;
 
-		t = patch->transfers;
 		t2 = all_transfers;
-		for (j=0 ; j<patch->numtransfers ; j++, t++, t2++)
-		{
-			t->transfer = t2->transfer*total;
-			t->patch = t2->patch;
-		}
-		if (patch->numtransfers > max_transfer)
+		for (j=0 ; j<patch->numtransfers ; j++, t2++)
 		{
-			max_transfer = patch->numtransfers;
+			t2->transfer *= total;
 		}
+
+		// compress them into the transfer store
+		g_TransferStore.AddTransfers( iThread, ndxPatch, all_transfers, patch->numtransfers );
 	}
 	else
 	{
@@ -1531,13 +1527,17 @@ void PreGetBumpNormalsForDisp( texinfo_t *pTexinfo, Vector &vecU, Vector &vecV,
 	vecV = vecTexV;
 }
 
+// Patches in the order their transfer records are stored, then the ones without any
+static CUtlVector<int> s_GatherOrder;
+
 void GatherLight (int threadnum, void *pUserData)
 {
 	int			i, j, k;
-	transfer_t	*trans;
 	int			num;
 	CPatch		*patch;
 	Vector		sum, v;
+	int			ndxPatch2;
+	float		flTransfer;
 
 	while (1)
 	{
@@ -1545,10 +1545,11 @@ void GatherLight (int threadnum, void *pUserData)
 		if (j == -1)
 			break;
 
+		j = s_GatherOrder[j];
 		patch = &g_Patches[j];
 
-		trans = patch->transfers;
 		num = patch->numtransfers;
+		CTransferReader trans( num ? g_TransferStore.GetRecord( patch->transferofs ) : NULL, num );
 		if ( patch->needsBumpmap )
 		{
 			Vector delta;
@@ -1588,9 +1589,10 @@ void GatherLight (int threadnum, void *pUserData)
 			}
 
 			float dot;
-			for (k=0 ; k<num ; k++, trans++)
+			for (k=0 ; k<num ; k++)
 			{
-				CPatch *patch2 = &g_Patches[trans->patch];
+				trans.Next( ndxPatch2, flTransfer );
+				CPatch *patch2 = &g_Patches[ndxPatch2];
 
 				// get vector to other patch
 				VectorSubtract (patch2->origin, patch->origin, delta);
@@ -1598,11 +1600,11 @@ void GatherLight (int threadnum, void *pUserData)
 				// find light emitted from other patch
 				for(i=0; i<3; i++)
 				{
-					v[i] = emitlight[trans->patch][i] * patch2->reflectivity[i];
+					v[i] = emitlight[ndxPatch2][i] * patch2->reflectivity[i];
 				}
 				// remove normal already factored into transfer steradian
 				float scale = 1.0f / DotProduct (delta, patch->normal);
-				VectorScale( v, trans->transfer * scale, v );
+				VectorScale( v, flTransfer * scale, v );
 				
 				Vector bumpTransfer;
 				for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
@@ -1625,13 +1627,14 @@ void GatherLight (int threadnum, void *pUserData)
 		else
 		{
 			VectorFill( sum, 0 );
-			for (k=0 ; k<num ; k++, trans++)
+			for (k=0 ; k<num ; k++)
 			{
+				trans.Next( ndxPatch2, flTransfer );
 				for(i=0; i<3; i++)
 				{
-					v[i] = emitlight[trans->patch][i] * g_Patches[trans->patch].reflectivity[i];
+					v[i] = emitlight[ndxPatch2][i] * g_Patches[ndxPatch2].reflectivity[i];
 				}
-				VectorScale( v, trans->transfer, v );
+				VectorScale( v, flTransfer, v );
 				VectorAdd( sum, v, sum );
 			}
 			VectorCopy( sum, addlight[j].light[0] );
@@ -1666,6 +1669,17 @@ void BounceLight (void)
 		VectorFill( g_Patches[i].totallight.light[0], 0 );
 	}
 
+	// walk the transfer records in the order they are laid out
+	s_GatherOrder.RemoveAll();
+	s_GatherOrder.EnsureCapacity( uiPatchCount );
+	s_GatherOrder.AddVectorToTail( g_TransferStore.PatchOrder() );
+	for (i=0 ; i<uiPatchCount; i++)
+	{
+		if ( !g_Patches[i].numtransfers )
+			s_GatherOrder.AddToTail( i );
+	}
+	Assert( (unsigned)s_GatherOrder.Count() == uiPatchCount );
+
 #if 0
 	FileHandle_t dFp = g_pFileSystem->Open( "lightemit.txt", "w" );
 
@@ -1723,6 +1737,9 @@ void BounceLight (void)
 			WriteWorld (name, 0);
 		}
 	}
+
+	s_GatherOrder.Purge();
+	g_TransferStore.Shutdown();
 }
 
 
@@ -1923,16 +1940,32 @@ void BuildFacesVisibleToLights( bool bAllVisible )
 
 void MakeAllScales (void)
 {
+	char	spillFile[MAX_PATH];
+
+	if ( g_bSpillTransfers )
+	{
+		Q_snprintf( spillFile, sizeof( spillFile ), "%s.transfers", source );
+		g_TransferStore.Init( spillFile );
+	}
+	else
+	{
+		g_TransferStore.Init( NULL );
+	}
+
 	// determine visibility between patches
 	BuildVisMatrix ();
 	
 	// release visibility matrix
 	FreeVisMatrix ();
 
+	g_TransferStore.Finish();
+
 	Msg("transfers %d, max %d\n", total_transfer, max_transfer );
 
-	qprintf ("transfer lists: %5.1f megs\n"
-		, (float)total_transfer * sizeof(transfer_t) / (1024*1024));
+	qprintf ("transfer lists: %5.1f megs (%5.1f uncompressed)%s\n"
+		, (float)g_TransferStore.TotalBytes() / (1024*1024)
+		, (float)total_transfer * sizeof(transfer_t) / (1024*1024)
+		, g_bSpillTransfers ? ", mapped from disk" : "" );
 }
 
 
@@ -2016,6 +2049,11 @@ bool RadWorld_Go()
 		// likely that all faces are going to be touched by at least one light so don't
 		// waste time here.
 		BuildFacesVisibleToLights( true );
+
+		if ( g_bLightCache )
+		{
+			g_LightCache.Prepare();
+		}
 	}
 
 	// build initial facelights
@@ -2033,6 +2071,12 @@ bool RadWorld_Go()
 	if( g_pIncremental && (g_iCurFace != numfaces) )
 		return false;
 
+	// Save the direct lighting before bounced light is added to it
+	if ( g_bLightCache )
+	{
+		g_LightCache.Save();
+	}
+
 	// Figure out the offset into lightmap data for each face.
 	PrecompLightmapOffsets();
 	
@@ -2124,6 +2168,10 @@ void VRAD_LoadBSP( char const *pFilename )
 {
 	ThreadSetDefault ();
 
+	// per-thread ray test state, including a slot for the main thread
+	s_DispTested.SetCount( numthreads + 1 );
+	memset( s_DispTested.Base(), 0, s_DispTested.Count() * sizeof( DispTested_t ) );
+
 	g_flStartTime = Plat_FloatTime();
 
 	if( g_bLowPriority )
@@ -2254,10 +2302,26 @@ void VRAD_LoadBSP( char const *pFilename )
 	if ( g_bDumpRtEnv )
 		WriteRTEnv("trace.txt");
 
+	if ( g_bLightCache && ( g_bUseMPI || g_pIncremental ) )
+	{
+		Warning( "-lightcache doesn't work with VMPI or incremental lighting, ignoring it.\n" );
+		g_bLightCache = false;
+	}
+
+	// The light cache compares triangles before they're changed into intersection format
+	if ( g_bLightCache )
+	{
+		char cacheFile[MAX_PATH];
+		Q_StripExtension( source, cacheFile, sizeof( cacheFile ) );
+		Q_strncat( cacheFile, g_bHDR ? ".hdr.lightcache" : ".lightcache", sizeof( cacheFile ), COPY_ALL_CHARACTERS );
+		g_LightCache.Init( cacheFile );
+		g_LightCache.HashOccluders();
+	}
+
 	// Build acceleration structure
 	printf ( "Setting up ray-trace acceleration structure... ");
 	float start = Plat_FloatTime();
-	g_RtEnv.SetupAccelerationStructure();
+	g_RtEnv.SetupAccelerationStructure( numthreads );
 	float end = Plat_FloatTime();
 	printf ( "Done (%.2f seconds)\n", end-start );
 
@@ -2422,6 +2486,14 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 				return 1;
 			}
 		}
+		else if (!Q_stricmp(argv[i],"-spilltransfers"))
+		{
+			g_bSpillTransfers = true;
+		}
+		else if (!Q_stricmp(argv[i],"-lightcache"))
+		{
+			g_bLightCache = true;
+		}
 		else if (!Q_stricmp(argv[i],"-verbose") || !Q_stricmp(argv[i],"-v"))
 		{
 			verbose = true;
@@ -2790,6 +2862,11 @@ void PrintUsage( int argc, char **argv )
 		"Other options:\n"
 		"  -novconfig      : Don't bring up graphical UI on vproject errors.\n"
 		"  -dump           : Write debugging .txt files.\n"
+		"  -spilltransfers : Keep the radiosity transfer lists in a temporary file\n"
+		"                    mapped into memory, for maps too big to hold them in RAM.\n"
+		"  -lightcache     : Keep each face's direct lighting in <map>.lightcache and\n"
+		"                    only relight the faces whose lights or occluders changed\n"
+		"                    since the last compile.\n"
 		"  -dumpnormals    : Write normals to debug files.\n"
 		"  -dumptrace      : Write ray-tracing environment to debug files.\n"
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
@@ -237,7 +237,7 @@ struct CPatch
 //	struct		patch_s		*nextclusterchild;		// next terminal child in cluster
 
 	int			numtransfers;
-	transfer_t	*transfers;
+	int64		transferofs;			// compressed transfer list in g_TransferStore
 
 	short		indices[3];				// displacement use these for subdivision
 };
@@ -386,6 +386,12 @@ void TestLine( FourVectors const& start, FourVectors const& stop, fltx4 *pFracti
 void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
                           fltx4 *pFractionVisible, bool canRecurse = true, int static_prop_to_skip=-1, bool bDoDebug = false );
 
+// TestLine_DoesHitSky for several bundles of lines at once, so they can be traced as wider
+// packets. Coherent lines (the same few directions from nearby points) trace fastest.
+#define MAX_SKY_TEST_GROUPS 4
+void TestLines_DoesHitSky( int nGroups, FourVectors const *pStart, FourVectors const *pStop,
+                           fltx4 *pFractionVisible, bool canRecurse = true, int static_prop_to_skip=-1 );
+
 // converts any marked brush entities to triangles for shadow casting
 void ExtractBrushEntityShadowCasters ( void );
 void AddBrushesForRayTrace ( void );
@@ -395,7 +401,7 @@ void CreateDirectLights (void);
 void GetPhongNormal( int facenum, Vector const& spot, Vector& phongnormal );
 int LightForString( char *pLight, Vector& intensity );
 void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers );
-void MakeScales( int ndxPatch, transfer_t *all_transfers );
+void MakeScales( int iThread, int ndxPatch, transfer_t *all_transfers );
 
 // Run startup code like initialize mathlib.
 void VRAD_Init();
@@ -600,8 +606,8 @@ public:
 	virtual void AddPolysForRayTrace() = 0;
 };
 
-//extern PropTested_t s_PropTested[MAX_TOOL_THREADS+1];
-extern DispTested_t s_DispTested[MAX_TOOL_THREADS+1];
+//extern PropTested_t s_PropTested[numthreads+1];
+extern CUtlVector<DispTested_t> s_DispTested;	// indexed by thread, numthreads+1 long
 
 IVradStaticPropMgr* StaticPropMgr();
 
@@ -7,6 +7,7 @@
 //=============================================================================//
 #include "vis.h"
 #include "vmpi.h"
+#include <emmintrin.h>
 
 int g_TraceClusterStart = -1;
 int g_TraceClusterStop = -1;
@@ -29,19 +30,88 @@ int g_TraceClusterStop = -1;
   void CalcMightSee (leaf_t *leaf, 
 */
 
+/*
+==================
+CountBits
+
+Population count a 32 bit word at a time, then the odd bits at the end
+==================
+*/
 int CountBits (byte *bits, int numbits)
 {
 	int		i;
 	int		c;
+	int		numwords;
+	unsigned int	w;
 
 	c = 0;
-	for (i=0 ; i<numbits ; i++)
+	numwords = numbits >> 5;
+	for (i=0 ; i<numwords ; i++)
+	{
+		w = ((unsigned int *)bits)[i];
+		w = w - ((w >> 1) & 0x55555555);
+		w = (w & 0x33333333) + ((w >> 2) & 0x33333333);
+		w = (w + (w >> 4)) & 0x0f0f0f0f;
+		c += (w * 0x01010101) >> 24;
+	}
+
+	for (i=numwords<<5 ; i<numbits ; i++)
 		if ( CheckBit( bits, i ) )
 			c++;
 
 	return c;
 }
 
+/*
+==================
+Portal bit strings
+
+These work on whole portalbytes long strings, 256 bits per pass as two
+SSE2 registers. portalbytes is padded to PORTALBITS_ALIGN so there is no
+tail to handle. The strings live on the stack or come from malloc, so the
+loads are unaligned.
+==================
+*/
+void PortalBitsCopy (byte *dest, const byte *src)
+{
+	memcpy (dest, src, portalbytes);
+}
+
+void PortalBitsOr (byte *dest, const byte *src)
+{
+	int		i;
+	__m128i	d0, d1;
+
+	for (i=0 ; i<portalbytes ; i+=PORTALBITS_ALIGN)
+	{
+		d0 = _mm_or_si128 (_mm_loadu_si128 ((__m128i *)(dest + i)), _mm_loadu_si128 ((__m128i *)(src + i)));
+		d1 = _mm_or_si128 (_mm_loadu_si128 ((__m128i *)(dest + i + 16)), _mm_loadu_si128 ((__m128i *)(src + i + 16)));
+		_mm_storeu_si128 ((__m128i *)(dest + i), d0);
+		_mm_storeu_si128 ((__m128i *)(dest + i + 16), d1);
+	}
+}
+
+bool PortalBitsAndTestNew (byte *dest, const byte *a, const byte *b, const byte *seen)
+{
+	int		i;
+	__m128i	d0, d1, more;
+
+	more = _mm_setzero_si128 ();
+	for (i=0 ; i<portalbytes ; i+=PORTALBITS_ALIGN)
+	{
+		d0 = _mm_and_si128 (_mm_loadu_si128 ((__m128i *)(a + i)), _mm_loadu_si128 ((__m128i *)(b + i)));
+		d1 = _mm_and_si128 (_mm_loadu_si128 ((__m128i *)(a + i + 16)), _mm_loadu_si128 ((__m128i *)(b + i + 16)));
+		_mm_storeu_si128 ((__m128i *)(dest + i), d0);
+		_mm_storeu_si128 ((__m128i *)(dest + i + 16), d1);
+
+		// andnot takes the complement of its first operand
+		more = _mm_or_si128 (more, _mm_andnot_si128 (_mm_loadu_si128 ((__m128i *)(seen + i)), d0));
+		more = _mm_or_si128 (more, _mm_andnot_si128 (_mm_loadu_si128 ((__m128i *)(seen + i + 16)), d1));
+	}
+
+	return _mm_movemask_epi8 (_mm_cmpeq_epi8 (more, _mm_setzero_si128 ())) != 0xffff;
+}
+
 int		c_fullskip;
 int		c_portalskip, c_leafskip;
 int		c_vistest, c_mighttest;
@@ -481,8 +551,8 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 	portal_t	*p;
 	plane_t		backplane;
 	leaf_t 		*leaf;
-	int			i, j;
-	long		*test, *might, *vis, more;
+	int			i;
+	byte		*test;
 	int			pnum;
 
 	// Early-out if we're a VMPI worker that's told to exit. If we don't do this here, then the
@@ -505,9 +575,7 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 	stack.next = NULL;
 	stack.leaf = leaf;
 	stack.portal = NULL;
-
-	might = (long *)stack.mightsee;
-	vis = (long *)thread->base->portalvis;
+	stack.mightsee = (byte *)stackalloc (portalbytes);
 	
 	// check all portals for flowing into other leafs	
 	for (i=0 ; i<leaf->portals.Count() ; i++)
@@ -524,21 +592,15 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		// if the portal can't see anything we haven't allready seen, skip it
 		if (p->status == stat_done)
 		{
-			test = (long *)p->portalvis;
+			test = p->portalvis;
 		}
 		else
 		{
-			test = (long *)p->portalflood;
+			test = p->portalflood;
 		}
 
-		more = 0;
-		for (j=0 ; j<portallongs ; j++)
-		{
-			might[j] = ((long *)prevstack->mightsee)[j] & test[j];
-			more |= (might[j] & ~vis[j]);
-		}
-		
-		if ( !more && CheckBit( thread->base->portalvis, pnum ) )
+		if ( !PortalBitsAndTestNew (stack.mightsee, prevstack->mightsee, test, thread->base->portalvis)
+			&& CheckBit( thread->base->portalvis, pnum ) )
 		{	// can't see anything new
 			continue;
 		}
@@ -642,8 +704,8 @@ void PortalFlow (int iThread, int portalnum)
 	data.pstack_head.portal = p;
 	data.pstack_head.source = p->winding;
 	data.pstack_head.portalplane = p->plane;
-	for (i=0 ; i<portallongs ; i++)
-		((long *)data.pstack_head.mightsee)[i] = ((long *)p->portalflood)[i];
+	data.pstack_head.mightsee = (byte *)stackalloc (portalbytes);
+	PortalBitsCopy (data.pstack_head.mightsee, p->portalflood);
 
 	RecursiveLeafFlow (p->leaf, &data, &data.pstack_head);
 
@@ -800,6 +862,41 @@ void BasePortalVis (int iThread, int portalnum)
 }
 
 
+/*
+==================
+PortalFlowCost
+
+Estimates how much work PortalFlow will do for a portal. Every portal it
+might see is a recursion that in turn tests that portal's own might-see
+set, so sum those instead of just counting them. Needs nummightsee for
+all portals first.
+==================
+*/
+void PortalFlowCost (int iThread, int portalnum)
+{
+	portal_t	*p;
+	int			i, j;
+	int64		cost;
+
+	p = &portals[portalnum];
+
+	cost = 0;
+	for (i=0 ; i<portalbytes ; i++)
+	{
+		if (!p->portalflood[i])
+			continue;
+
+		for (j=0 ; j<8 ; j++)
+		{
+			if (p->portalflood[i] & (1<<j))
+				cost += portals[(i<<3) + j].nummightsee;
+		}
+	}
+
+	p->flowcost = cost;
+}
+
+
 
 
 
@@ -825,12 +922,12 @@ void RecursiveLeafBitFlow (int leafnum, byte *mightsee, byte *cansee)
 {
 	portal_t	*p;
 	leaf_t 		*leaf;
-	int			i, j;
-	long		more;
+	int			i;
 	int			pnum;
-	byte		newmight[MAX_PORTALS/8];
+	byte		*newmight;
 
 	leaf = &leafs[leafnum];
+	newmight = (byte *)stackalloc (portalbytes);
 	
 // check all portals for flowing into other leafs	
 	for (i=0 ; i<leaf->portals.Count(); i++)
@@ -843,15 +940,7 @@ void RecursiveLeafBitFlow (int leafnum, byte *mightsee, byte *cansee)
 			continue;
 
 		// if this portal can see some portals we mightsee, recurse
-		more = 0;
-		for (j=0 ; j<portallongs ; j++)
-		{
-			((long *)newmight)[j] = ((long *)mightsee)[j] 
-				& ((long *)p->portalflood)[j];
-			more |= ((long *)newmight)[j] & ~((long *)cansee)[j];
-		}
-
-		if (!more)
+		if ( !PortalBitsAndTestNew (newmight, mightsee, p->portalflood, cansee) )
 			continue;	// can't see anything new
 
 		SetBit( cansee, pnum );
@@ -55,7 +55,8 @@ struct portal_t
 	byte		*portalflood;	// [portals], intermediate
 	byte		*portalvis;		// [portals], final
 
-	int			nummightsee;	// bit count on portalflood for sort
+	int			nummightsee;	// bit count on portalflood
+	int64		flowcost;		// estimated PortalFlow work, for sort
 };
 
 struct leaf_t
@@ -66,7 +67,7 @@ struct leaf_t
 	
 struct pstack_t
 {
-	byte		mightsee[MAX_PORTALS/8];		// bit string
+	byte		*mightsee;		// bit string, portalbytes long on the stack of the recursion level
 	pstack_t	*next;
 	leaf_t		*leaf;
 	portal_t	*portal;	// portal exiting
@@ -111,15 +112,29 @@ void LeafFlow (int leafnum);
 
 
 void BasePortalVis (int iThread, int portalnum);
+void PortalFlowCost (int iThread, int portalnum);
 void BetterPortalVis (int portalnum);
 void PortalFlow (int iThread, int portalnum);
 void WritePortalTrace( const char *source );
 
 extern	portal_t	*sorted_portals[MAX_MAP_PORTALS*2];
+extern	bool		g_bVisCache;
+
+// viscache.cpp
+int  ApplyVisCache (const char *pFilename);
+void SaveVisCache (const char *pFilename);
 extern int g_TraceClusterStart, g_TraceClusterStop;
 
 int CountBits (byte *bits, int numbits);
 
+// Portal bit strings are portalbytes long, which is padded to a multiple of
+// PORTALBITS_ALIGN bytes so these can work 256 bits at a time.
+#define PORTALBITS_ALIGN	32
+
+void PortalBitsCopy (byte *dest, const byte *src);
+void PortalBitsOr (byte *dest, const byte *src);
+bool PortalBitsAndTestNew (byte *dest, const byte *a, const byte *b, const byte *seen);	// dest = a & b, true if dest has any bits not in seen
+
 #define CheckBit( bitstring, bitNumber )	( (bitstring)[ ((bitNumber) >> 3) ] & ( 1 << ( (bitNumber) & 7 ) ) )
 #define SetBit( bitstring, bitNumber )	( (bitstring)[ ((bitNumber) >> 3) ] |= ( 1 << ( (bitNumber) & 7 ) ) )
 #define ClearBit( bitstring, bitNumber )	( (bitstring)[ ((bitNumber) >> 3) ] &= ~( 1 << ( (bitNumber) & 7 ) ) )
@@ -0,0 +1,408 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: On-disk cache of PortalFlow results, so recompiling a map after
+//			a local edit only re-flows the portals the edit can affect.
+//
+//=============================================================================//
+#include "vis.h"
+#include "threads.h"
+#include "filesystem.h"
+#include "utlbuffer.h"
+#include "utlmap.h"
+#include "tier1/generichash.h"
+
+/*
+
+  PortalFlow only ever looks at the portals in the source portal's
+  portalflood, the leafs they lead into and the portals of those leafs.
+  A portal's result is keyed by a hash of its own winding plus all of that,
+  so an edit to anything the flow clips against changes the key.
+
+  Portal numbers are not stable between compiles, so a result is stored as
+  one bit per portal in portalflood, ordered by each portal's geometry hash.
+  A key hit means the flood set is the same geometry, so the same ordering
+  maps the bits back onto this compile's portal numbers.
+
+*/
+
+#define VISCACHE_ID			(('C'<<24)+('S'<<16)+('I'<<8)+'V')
+#define VISCACHE_VERSION	1
+
+struct viscacheheader_t
+{
+	int		id;
+	int		version;
+	uint64	settings;
+	int		numrecords;
+};
+
+static CUtlVector<uint64>	s_GeomHash;		// [portals] winding and plane
+static CUtlVector<uint64>	s_LeafHash;		// [portals] geometry of the leaf the portal leads into
+static CUtlVector<byte>		s_Ambiguous;	// [portals] another portal has the same geometry hash
+static CUtlVector<uint64>	s_Key;			// [portals] 0 if the result can't be cached
+static CUtlVector< CUtlVector<byte> >	s_Records;	// [portals] encoded results for SaveVisCache
+
+static CUtlBuffer			s_CacheFile;
+static CUtlMap<uint64, int, int>	s_CacheIndex( DefLessFunc( uint64 ) );	// key -> offset of the record in s_CacheFile
+
+/*
+==================
+VisCacheSettings
+
+Anything that changes the flow for every portal
+==================
+*/
+static uint64 VisCacheSettings (void)
+{
+	struct
+	{
+		int		version;
+		int		useradius;
+		double	radius;
+	} settings;
+
+	memset (&settings, 0, sizeof(settings));
+	settings.version = VISCACHE_VERSION;
+	settings.useradius = g_bUseRadius;
+	settings.radius = g_bUseRadius ? g_VisRadius : 0;
+
+	return MurmurHash64 (&settings, sizeof(settings), 0);
+}
+
+/*
+==================
+VisCacheKey
+==================
+*/
+static void VisCacheKey (int iThread, int portalnum)
+{
+	portal_t	*p;
+	int			i, j, pnum;
+	struct
+	{
+		uint64	geom;
+		uint64	flood;
+		int		nummightsee;
+	} key;
+
+	p = &portals[portalnum];
+
+	memset (&key, 0, sizeof(key));
+	key.geom = s_GeomHash[portalnum];
+	key.nummightsee = p->nummightsee;
+
+	if (s_Ambiguous[portalnum])
+	{
+		s_Key[portalnum] = 0;
+		return;
+	}
+
+	for (i=0 ; i<portalbytes ; i++)
+	{
+		if (!p->portalflood[i])
+			continue;
+
+		for (j=0 ; j<8 ; j++)
+		{
+			if (!(p->portalflood[i] & (1<<j)))
+				continue;
+
+			pnum = (i<<3) + j;
+			if (s_Ambiguous[pnum])
+			{
+				s_Key[portalnum] = 0;
+				return;
+			}
+
+			// order independent, the leaf hashes are already well mixed
+			key.flood += s_LeafHash[pnum];
+		}
+	}
+
+	s_Key[portalnum] = MurmurHash64 (&key, sizeof(key), 0) | 1;
+}
+
+/*
+==================
+BuildVisCacheKeys
+==================
+*/
+static int GeomHashComp (const void *a, const void *b)
+{
+	uint64	ha = s_GeomHash[*(int *)a];
+	uint64	hb = s_GeomHash[*(int *)b];
+
+	if (ha != hb)
+		return (ha < hb) ? -1 : 1;
+	return 0;
+}
+
+static void BuildVisCacheKeys (void)
+{
+	int			i, j;
+	portal_t	*p;
+	leaf_t		*leaf;
+	winding_t	*w;
+	uint64		leafgeom;
+	uint64		mix[2];
+	CUtlVector<int>	order;
+
+	s_GeomHash.SetCount (g_numportals*2);
+	s_LeafHash.SetCount (g_numportals*2);
+	s_Ambiguous.SetCount (g_numportals*2);
+	s_Key.SetCount (g_numportals*2);
+
+	for (i=0, p=portals ; i<g_numportals*2 ; i++, p++)
+	{
+		w = p->winding;
+		s_GeomHash[i] = MurmurHash64 (w->points, w->numpoints * sizeof(w->points[0]),
+			(uint32)MurmurHash64 (&p->plane, sizeof(p->plane), w->numpoints));
+	}
+
+	// two portals with the same hash can't be told apart when mapping
+	// results back, so leave anything that touches them out
+	order.SetCount (g_numportals*2);
+	for (i=0 ; i<g_numportals*2 ; i++)
+	{
+		order[i] = i;
+		s_Ambiguous[i] = 0;
+	}
+	qsort (order.Base(), order.Count(), sizeof(int), GeomHashComp);
+	for (i=1 ; i<order.Count() ; i++)
+	{
+		if (s_GeomHash[order[i]] == s_GeomHash[order[i-1]])
+		{
+			s_Ambiguous[order[i]] = 1;
+			s_Ambiguous[order[i-1]] = 1;
+		}
+	}
+
+	for (i=0, p=portals ; i<g_numportals*2 ; i++, p++)
+	{
+		leaf = &leafs[p->leaf];
+		leafgeom = 0;
+		for (j=0 ; j<leaf->portals.Count() ; j++)
+			leafgeom += s_GeomHash[leaf->portals[j] - portals];
+
+		mix[0] = s_GeomHash[i];
+		mix[1] = leafgeom;
+		s_LeafHash[i] = MurmurHash64 (mix, sizeof(mix), 0);
+	}
+
+	RunThreadsOnIndividual (g_numportals*2, false, VisCacheKey);
+}
+
+/*
+==================
+FloodOrder
+
+The portals in portalflood, in geometry hash order
+==================
+*/
+static void FloodOrder (portal_t *p, CUtlVector<int> &order)
+{
+	int		i, j;
+
+	order.RemoveAll ();
+	order.EnsureCapacity (p->nummightsee);
+	for (i=0 ; i<portalbytes ; i++)
+	{
+		if (!p->portalflood[i])
+			continue;
+
+		for (j=0 ; j<8 ; j++)
+		{
+			if (p->portalflood[i] & (1<<j))
+				order.AddToTail ((i<<3) + j);
+		}
+	}
+
+	qsort (order.Base(), order.Count(), sizeof(int), GeomHashComp);
+}
+
+/*
+==================
+ApplyVisCacheRecord
+==================
+*/
+static void ApplyVisCacheRecord (int iThread, int portalnum)
+{
+	portal_t	*p;
+	int			i;
+	int			numflood;
+	const byte	*bits;
+	CUtlVector<int>	order;
+
+	p = &portals[portalnum];
+	if (!s_Key[portalnum])
+		return;
+
+	int index = s_CacheIndex.Find (s_Key[portalnum]);
+	if (index == s_CacheIndex.InvalidIndex())
+		return;
+
+	bits = (const byte *)s_CacheFile.Base() + s_CacheIndex[index];
+	memcpy (&numflood, bits, sizeof(numflood));
+	bits += sizeof(numflood);
+
+	if (numflood != p->nummightsee)
+		return;		// hash collision
+
+	FloodOrder (p, order);
+	for (i=0 ; i<numflood ; i++)
+	{
+		if ( CheckBit( bits, i ) )
+			SetBit( p->portalvis, order[i] );
+	}
+
+	p->status = stat_done;
+}
+
+/*
+==================
+ApplyVisCache
+
+Marks every portal with a cached result as done. Returns how many, and
+moves them to the end of sorted_portals so the rest can be flowed first.
+==================
+*/
+int ApplyVisCache (const char *pFilename)
+{
+	viscacheheader_t	header;
+	uint64		key;
+	int			numflood;
+	int			i, c;
+	portal_t	**dest;
+
+	BuildVisCacheKeys ();
+
+	s_CacheFile.Purge ();
+	s_CacheIndex.RemoveAll ();
+
+	if (!g_pFileSystem->ReadFile (pFilename, NULL, s_CacheFile))
+	{
+		Msg ("no vis cache %s\n", pFilename);
+		return 0;
+	}
+
+	s_CacheFile.Get (&header, sizeof(header));
+	if (!s_CacheFile.IsValid() || header.id != VISCACHE_ID || header.version != VISCACHE_VERSION || header.settings != VisCacheSettings())
+	{
+		Msg ("ignoring out of date vis cache %s\n", pFilename);
+		s_CacheFile.Purge ();
+		return 0;
+	}
+
+	for (i=0 ; i<header.numrecords ; i++)
+	{
+		s_CacheFile.Get (&key, sizeof(key));
+		int offset = s_CacheFile.TellGet ();
+		s_CacheFile.Get (&numflood, sizeof(numflood));
+		if (!s_CacheFile.IsValid() || numflood < 0 || s_CacheFile.GetBytesRemaining() < (numflood+7)>>3)
+		{
+			Warning ("vis cache %s is truncated\n", pFilename);
+			break;
+		}
+		s_CacheFile.SeekGet (CUtlBuffer::SEEK_CURRENT, (numflood+7)>>3);
+
+		s_CacheIndex.InsertOrReplace (key, offset);
+	}
+
+	RunThreadsOnIndividual (g_numportals*2, false, ApplyVisCacheRecord);
+
+	s_CacheIndex.RemoveAll ();
+	s_CacheFile.Purge ();
+
+	// stable partition, the uncached portals keep their sorted order
+	CUtlVector<portal_t *>	cached;
+	dest = sorted_portals;
+	for (i=0 ; i<g_numportals*2 ; i++)
+	{
+		if (sorted_portals[i]->status == stat_done)
+			cached.AddToTail (sorted_portals[i]);
+		else
+			*dest++ = sorted_portals[i];
+	}
+	c = cached.Count();
+	if (c)
+		memcpy (dest, cached.Base(), c * sizeof(portal_t *));
+
+	Msg ("%i of %i portals from vis cache\n", c, g_numportals*2);
+	return c;
+}
+
+/*
+==================
+SaveVisCache
+==================
+*/
+static void EncodeVisCacheRecord (int iThread, int portalnum)
+{
+	portal_t	*p;
+	int			i;
+	int			numflood;
+	byte		*bits;
+	CUtlVector<int>	order;
+	CUtlVector<byte>	&record = s_Records[portalnum];
+
+	p = &portals[portalnum];
+	record.RemoveAll ();
+	if (!s_Key[portalnum] || p->status != stat_done)
+		return;
+
+	FloodOrder (p, order);
+	numflood = order.Count();
+
+	record.SetCount (sizeof(uint64) + sizeof(int) + ((numflood+7)>>3));
+	memset (record.Base(), 0, record.Count());
+	memcpy (record.Base(), &s_Key[portalnum], sizeof(uint64));
+	memcpy (record.Base() + sizeof(uint64), &numflood, sizeof(int));
+
+	bits = record.Base() + sizeof(uint64) + sizeof(int);
+	for (i=0 ; i<numflood ; i++)
+	{
+		if ( CheckBit( p->portalvis, order[i] ) )
+			SetBit( bits, i );
+	}
+}
+
+void SaveVisCache (const char *pFilename)
+{
+	viscacheheader_t	header;
+	CUtlBuffer	buf;
+	int			i;
+
+	if (s_Key.Count() != g_numportals*2)
+		BuildVisCacheKeys ();
+
+	s_Records.SetCount (g_numportals*2);
+	RunThreadsOnIndividual (g_numportals*2, false, EncodeVisCacheRecord);
+
+	header.id = VISCACHE_ID;
+	header.version = VISCACHE_VERSION;
+	header.settings = VisCacheSettings ();
+	header.numrecords = 0;
+	for (i=0 ; i<s_Records.Count() ; i++)
+	{
+		if (s_Records[i].Count())
+			header.numrecords++;
+	}
+
+	buf.Put (&header, sizeof(header));
+	for (i=0 ; i<s_Records.Count() ; i++)
+	{
+		if (s_Records[i].Count())
+			buf.Put (s_Records[i].Base(), s_Records[i].Count());
+	}
+
+	if (!g_pFileSystem->WriteFile (pFilename, NULL, buf))
+		Warning ("couldn't write vis cache %s\n", pFilename);
+	else
+		Msg ("wrote %i portals to vis cache %s\n", header.numrecords, pFilename);
+
+	s_Records.Purge ();
+	s_GeomHash.Purge ();
+	s_LeafHash.Purge ();
+	s_Ambiguous.Purge ();
+	s_Key.Purge ();
+}
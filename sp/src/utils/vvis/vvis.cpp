@@ -14,6 +14,7 @@
 #include "pacifier.h"
 #include "vmpi.h"
 #include "mpivis.h"
+#include "local_distribute_work.h"
 #include "tier1/strtools.h"
 #include "collisionutils.h"
 #include "tier0/icommandline.h"
@@ -46,6 +47,8 @@ int			portalbytes, portallongs;
 
 bool		fastvis;
 bool		nosort;
+bool		g_bVisCache = true;
+char		viscachefile[1024];		// next to the portal file
 
 int			totalvis;
 
@@ -121,17 +124,22 @@ void prl(leaf_t *l)
 SortPortals
 
 Sorts the portals from the least complex, so the later ones can reuse
-the earlier information.
+the earlier information. Portals that finish first prune the recursion
+of everything that might see them, so the cheap ones go first.
 =============
 */
 int PComp (const void *a, const void *b)
 {
-	if ( (*(portal_t **)a)->nummightsee == (*(portal_t **)b)->nummightsee)
-		return 0;
-	if ( (*(portal_t **)a)->nummightsee < (*(portal_t **)b)->nummightsee)
-		return -1;
+	portal_t	*pa = *(portal_t **)a;
+	portal_t	*pb = *(portal_t **)b;
 
-	return 1;
+	if (pa->flowcost != pb->flowcost)
+		return (pa->flowcost < pb->flowcost) ? -1 : 1;
+	if (pa->nummightsee != pb->nummightsee)
+		return (pa->nummightsee < pb->nummightsee) ? -1 : 1;
+
+	// keep the order the same on every machine for vmpi
+	return (pa < pb) ? -1 : (pa > pb) ? 1 : 0;
 }
 
 void BuildTracePortals( int clusterStart )
@@ -153,6 +161,8 @@ void SortPortals (void)
 
 	if (nosort)
 		return;
+
+	RunThreadsOnIndividual (g_numportals*2, false, PortalFlowCost);
 	qsort (sorted_portals, g_numportals*2, sizeof(sorted_portals[0]), PComp);
 }
 
@@ -196,16 +206,16 @@ Merges the portal visibility for a leaf
 void ClusterMerge (int clusternum)
 {
 	leaf_t		*leaf;
-//	byte		portalvector[MAX_PORTALS/8];
-	byte		portalvector[MAX_PORTALS/4];      // 4 because portal bytes is * 2
+	byte		*portalvector;
 	byte		uncompressed[MAX_MAP_LEAFS/8];
-	int			i, j;
+	int			i;
 	int			numvis;
 	portal_t	*p;
 	int			pnum;
 
 	// OR together all the portalvis bits
 
+	portalvector = (byte *)stackalloc (portalbytes);
 	memset (portalvector, 0, portalbytes);
 	leaf = &leafs[clusternum];
 	for (i=0 ; i < leaf->portals.Count(); i++)
@@ -213,8 +223,7 @@ void ClusterMerge (int clusternum)
 		p = leaf->portals[i];
 		if (p->status != stat_done)
 			Error ("portal not done %d %p %p\n", i, p, portals);
-		for (j=0 ; j<portallongs ; j++)
-			((long *)portalvector)[j] |= ((long *)p->portalvis)[j];
+		PortalBitsOr (portalvector, p->portalvis);
 		pnum = p - portals;
 		SetBit( portalvector, pnum );
 	}
@@ -281,6 +290,64 @@ static int CompressAndCrosscheckClusterVis( int clusternum )
 }
 
 
+//-----------------------------------------------------------------------------
+// -localworkers: the same work units as mpivis, run in forked worker processes
+//-----------------------------------------------------------------------------
+static void LocalProcessBasePortalVis( int iThread, uint64 iPortal, MessageBuffer *pBuf )
+{
+	BasePortalVis( iThread, iPortal );
+
+	portal_t *p = &portals[iPortal];
+	pBuf->write( p->portalfront, portalbytes );
+	pBuf->write( p->portalflood, portalbytes );
+}
+
+static void LocalReceiveBasePortalVis( uint64 iWorkUnit, MessageBuffer *pBuf, int iWorker )
+{
+	if ( pBuf->getLen() - pBuf->getOffset() != portalbytes*2 )
+		Error( "Invalid result in LocalReceiveBasePortalVis." );
+
+	portal_t *p = &portals[iWorkUnit];
+
+	p->portalfront = (byte*)malloc (portalbytes);
+	pBuf->read( p->portalfront, portalbytes );
+
+	p->portalflood = (byte*)malloc (portalbytes);
+	pBuf->read( p->portalflood, portalbytes );
+
+	p->portalvis = (byte*)malloc (portalbytes);
+	memset (p->portalvis, 0, portalbytes);
+
+	p->nummightsee = CountBits( p->portalflood, g_numportals*2 );
+}
+
+static void LocalProcessPortalFlow( int iThread, uint64 iPortal, MessageBuffer *pBuf )
+{
+	PortalFlow( iThread, iPortal );
+
+	pBuf->write( sorted_portals[iPortal]->portalvis, portalbytes );
+}
+
+static void LocalReceivePortalFlow( uint64 iWorkUnit, MessageBuffer *pBuf, int iWorker )
+{
+	if ( pBuf->getLen() - pBuf->getOffset() != portalbytes )
+		Error( "Invalid result in LocalReceivePortalFlow." );
+
+	portal_t *p = sorted_portals[iWorkUnit];
+	pBuf->read( p->portalvis, portalbytes );
+	p->status = stat_done;
+}
+
+static void RunLocalWork( const char *pName, int nWorkUnits, ProcessWorkUnitFn processFn, ReceiveWorkUnitFn receiveFn )
+{
+	Msg( "%-20s ", pName );
+	StartPacifier( "" );
+	double elapsed = LocalDistributeWork( nWorkUnits, processFn, receiveFn );
+	EndPacifier( false );
+	Msg( " (%d)\n", (int)elapsed );
+}
+
+
 /*
 ==================
 CalcPortalVis
@@ -308,7 +375,25 @@ void CalcPortalVis (void)
 	}
 	else 
 	{
-		RunThreadsOnIndividual (g_numportals*2, true, PortalFlow);
+		int		numflow;
+
+		numflow = g_numportals*2;
+
+		// portals found in the cache are already done, and are moved
+		// to the end of sorted_portals
+		if (g_bVisCache)
+			numflow -= ApplyVisCache (viscachefile);
+
+		if (numflow)
+		{
+			if ( LocalWork_GetNumWorkers() )
+				RunLocalWork( "PortalFlow:", numflow, LocalProcessPortalFlow, LocalReceivePortalFlow );
+			else
+				RunThreadsOnIndividual (numflow, true, PortalFlow);
+		}
+
+		if (g_bVisCache)
+			SaveVisCache (viscachefile);
 	}
 }
 
@@ -335,6 +420,10 @@ void CalcVis (void)
 	{
 		RunMPIBasePortalVis();
 	}
+	else if ( LocalWork_GetNumWorkers() )
+	{
+		RunLocalWork( "BasePortalVis:", g_numportals*2, LocalProcessBasePortalVis, LocalReceiveBasePortalVis );
+	}
 	else 
 	{
 	    RunThreadsOnIndividual (g_numportals*2, true, BasePortalVis);
@@ -472,7 +561,7 @@ void LoadPortals (char *name)
 	leafbytes = ((portalclusters+63)&~63)>>3;
 	leaflongs = leafbytes/sizeof(long);
 	
-	portalbytes = ((g_numportals*2+63)&~63)>>3;
+	portalbytes = ((g_numportals*2+PORTALBITS_ALIGN*8-1)&~(PORTALBITS_ALIGN*8-1))>>3;
 	portallongs = portalbytes/sizeof(long);
 
 // each file portal is split into two memory portals
@@ -947,6 +1036,29 @@ int ParseCommandLine( int argc, char **argv )
 			Msg ("nosort = true\n");
 			nosort = true;
 		}
+		else if (!Q_stricmp (argv[i],"-nocache"))
+		{
+			Msg ("nocache = true\n");
+			g_bVisCache = false;
+		}
+		else if ( !Q_stricmp( argv[i], "-localworkers" ) )
+		{
+			if ( ++i < argc && atoi( argv[i] ) > 0 )
+			{
+				LocalWork_SetNumWorkers( atoi( argv[i] ) );
+				Msg( "localworkers = %d\n", LocalWork_GetNumWorkers() );
+			}
+			else
+			{
+				Warning( "Error: expected a worker count after '-localworkers'\n\n" );
+				i = 100000;	// force it to print the usage
+				break;
+			}
+		}
+		else if ( !Q_stricmp( argv[i], "-pinworkers" ) )
+		{
+			LocalWork_SetPinWorkers( true );
+		}
 		else if (!Q_stricmp (argv[i],"-tmpin"))
 			strcpy (inbase, "/tmp");
 		else if( !Q_stricmp( argv[i], "-low" ) )
@@ -1030,6 +1142,11 @@ void PrintUsage( int argc, char **argv )
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
 		"  -nosort         : Don't sort portals (sorting is an optimization).\n"
+		"  -nocache        : Don't read or write the <mapname>.viscache portal flow\n"
+		"                    cache, which lets small edits skip unchanged portals.\n"
+		"  -localworkers # : Split the vis work between # worker processes on this\n"
+		"                    machine instead of threads (not on Windows, use -mpi).\n"
+		"  -pinworkers     : Pin each -localworkers process to its own CPU.\n"
 		"  -tmpin          : Make portals come from \\tmp\\<mapname>.\n"
 		"  -tmpout         : Make portals come from \\tmp\\<mapname>.\n"
 		"  -trace <start cluster> <end cluster> : Writes a linefile that traces the vis from one cluster to another for debugging map vis.\n"
@@ -1150,6 +1267,7 @@ int RunVVis( int argc, char **argv )
 		sprintf ( portalfile, "%s%s", inbase, argv[i] );
 		Q_StripExtension( portalfile, portalfile, sizeof( portalfile ) );
 	}
+	Q_snprintf (viscachefile, sizeof(viscachefile), "%s.viscache", portalfile);
 	strcat (portalfile, ".prt");
 	
 	Msg ("reading %s\n", portalfile);